@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+/*
+ * x86_64 version of os_cpu_in_cksum_mbuf(), following the 64-bit version
+ * in arm64/cpu_in_cksum.s, with the 64-byte inner loop accumulating 32-bit
+ * words into 64-bit lanes of SSE2 registers the same way as
+ * cpu_copy_in_cksum.s does.  AVX2 is not used: the kernel only saves and
+ * restores the xmm registers it touches here.
+ */
+
+#ifdef KERNEL
+#define	CKSUM_ERR _kprintf
+#else
+#ifndef LIBSYSCALL_INTERFACE
+#error "LIBSYSCALL_INTERFACE not defined"
+#endif /* !LIBSYSCALL_INTERFACE */
+#define	CKSUM_ERR _fprintf_stderr
+#endif /* !KERNEL */
+
+/*
+ * This routine expects "mbuf-like" argument, and it does not expect the
+ * mbuf to be authentic; it only cares about 3 fields.  See the _CASSERTs
+ * in os_cpu_in_cksum().
+ */
+#define	M_NEXT	0
+#define	M_DATA	16	// 8-byte address, would be aligned to 8-byte boundary
+#define	M_LEN	24
+
+	.const
+	.align	4
+
+/*
+ * a vector v0 = w3 : w2 : w1 : w0 will be using the following mask to
+ * extract 0 : w2 : 0 : w0
+ * then shift right quadword 32-bit to get 0 : w3 : 0 : w1
+ * these two vectors are then accumulated to 4 quadword lanes in 2 vectors
+ */
+L_mask:
+	.quad	0x00000000ffffffff
+	.quad	0x00000000ffffffff
+
+#define Lmask	L_mask(%rip)
+
+	.globl	_os_cpu_in_cksum_mbuf
+	.text
+	.align	4
+_os_cpu_in_cksum_mbuf:
+
+/*
+ * This function returns the partial 16-bit checksum accumulated in
+ * a 32-bit variable (without 1's complement); caller is responsible
+ * for folding the 32-bit sum into 16-bit and performing the 1's
+ * complement if applicable
+ */
+
+/*
+ * uint32_t
+ * os_cpu_in_cksum_mbuf(struct mbuf *m, int len, int off, uint32_t initial_sum)
+ * {
+ * 	int mlen;
+ * 	uint64_t sum, partial;
+ * 	unsigned int final_acc;
+ * 	uint8_t *data;
+ * 	boolean_t needs_swap, started_on_odd;
+ *
+ * 	VERIFY(len >= 0);
+ * 	VERIFY(off >= 0);
+ *
+ * 	needs_swap = FALSE;
+ * 	started_on_odd = FALSE;
+ * 	sum = initial_sum;
+ */
+
+#define	m		%rdi
+#define	len		%rsi
+#define	off		%rdx
+#define	sum		%rcx
+#define	needs_swap	%r8
+#define	started_on_odd	%r9
+#define	mlen		%r10
+#define	data		%r11
+#define	partial		%rax
+#define	partiald	%eax
+/* off is no longer needed once the initial offset is skipped */
+#define	t		%rdx
+#define	td		%edx
+
+/*
+ * renaming vector registers
+ */
+#define v0		%xmm0
+#define v1		%xmm1
+#define v2		%xmm2
+#define v3		%xmm3
+#define v4		%xmm4
+#define v5		%xmm5
+#define v6		%xmm6
+#define v7		%xmm7
+#define v8		%xmm8
+#define v9		%xmm9
+#define v10		%xmm10
+#define v11		%xmm11
+
+	/* push callee-saved registers and set up base pointer */
+	push	%rbp
+	movq	%rsp, %rbp
+
+	movslq	%esi, len
+	movslq	%edx, off
+	mov	%ecx, %ecx		// sum = initial_sum (clear higher half)
+	xor	needs_swap, needs_swap	// needs_swap = FALSE;
+	xor	started_on_odd, started_on_odd	// started_on_odd = FALSE;
+
+/*
+ *	for (;;) {
+ *		if (PREDICT_FALSE(m == NULL)) {
+ *			CKSUM_ERR("%s: out of data\n", __func__);
+ *			return (-1);
+ *		}
+ *		mlen = m->m_len;
+ *		if (mlen > off) {
+ *			mlen -= off;
+ *			data = mtod(m, uint8_t *) + off;
+ *			goto post_initial_offset;
+ *		}
+ *		off -= mlen;
+ *		if (len == 0)
+ *			break;
+ *		m = m->m_next;
+ *	}
+ */
+
+0:
+	test	m, m
+	jz	Lin_cksum_whoops	// if (m == NULL) return -1;
+	movslq	M_LEN(m), mlen		// mlen = m->m_len;
+	cmp	off, mlen
+	jle	1f
+	mov	M_DATA(m), data		// mtod(m, uint8_t *)
+	sub	off, mlen		// mlen -= off;
+	add	off, data		// data = mtod(m, uint8_t *) + off;
+	jmp	L_post_initial_offset
+1:
+	sub	mlen, off		// off -= mlen;
+	test	len, len
+	jz	L_done
+	mov	M_NEXT(m), m		// m = m->m_next;
+	jmp	0b
+
+L_loop:	// for (; len > 0; m = m->m_next) {
+/*
+ *		if (PREDICT_FALSE(m == NULL)) {
+ *			CKSUM_ERR("%s: out of data\n", __func__);
+ *			return (-1);
+ *		}
+ *		mlen = m->m_len;
+ *		data = mtod(m, uint8_t *);
+ */
+	test	m, m
+	jz	Lin_cksum_whoops	// if (m == NULL) return -1;
+	movslq	M_LEN(m), mlen		// mlen = m->m_len;
+	mov	M_DATA(m), data		// mtod(m, uint8_t *)
+
+L_post_initial_offset:
+/*
+ *		if (mlen == 0) continue;
+ *		if (mlen > len) mlen = len;
+ *		len -= mlen;
+ */
+	cmp	len, mlen
+	cmovg	len, mlen
+	test	mlen, mlen		// also covers a zero len at the offset
+	jz	L_continue
+	sub	mlen, len
+
+/*
+ *		partial = 0;
+ *		if ((uintptr_t)data & 1) {
+ *			started_on_odd = !started_on_odd;
+ *			partial = *data << 8;
+ *			++data;
+ *			--mlen;
+ *		}
+ *		needs_swap = started_on_odd;
+ */
+	xor	partial, partial
+	test	$1, data
+	jz	1f
+	movzbl	(data), partiald
+	shl	$8, partial
+	xor	$1, started_on_odd
+	add	$1, data
+	sub	$1, mlen
+1:
+	mov	started_on_odd, needs_swap
+
+/*
+ *		if ((uintptr_t)data & 2) {
+ *			if (mlen < 2)
+ *				goto trailing_bytes;
+ *			partial += *(uint16_t *)(void *)data;
+ *			data += 2;
+ *			mlen -= 2;
+ *		}
+ */
+	test	$2, data
+	jz	1f
+	cmp	$2, mlen
+	jl	L_trailing_bytes
+	movzwl	(data), td
+	add	t, partial
+	add	$2, data
+	sub	$2, mlen
+1:
+
+/*
+ *		while (mlen >= 64) {
+ *			partial += *(uint32_t *)(void *)data;
+ *			...
+ *			partial += *(uint32_t *)(void *)(data + 60);
+ *			data += 64;
+ *			mlen -= 64;
+ *		}
+ *
+ * The 64-bit lanes cannot overflow for any length an int can hold, so
+ * the partial reduction of the C version is not needed in this loop.
+ */
+	cmp	$4*16, mlen
+	jl	L4_bytes
+
+#ifdef KERNEL
+	/* allocate stack space and save xmm0-xmm11 */
+	sub	$12*16, %rsp
+	movdqa	v0, 0*16(%rsp)
+	movdqa	v1, 1*16(%rsp)
+	movdqa	v2, 2*16(%rsp)
+	movdqa	v3, 3*16(%rsp)
+	movdqa	v4, 4*16(%rsp)
+	movdqa	v5, 5*16(%rsp)
+	movdqa	v6, 6*16(%rsp)
+	movdqa	v7, 7*16(%rsp)
+	movdqa	v8, 8*16(%rsp)
+	movdqa	v9, 9*16(%rsp)
+	movdqa	v10, 10*16(%rsp)
+	movdqa	v11, 11*16(%rsp)
+#endif
+
+	/* spread partial into 8 8-byte lanes in v0-v3 */
+	movq	partial, v0
+	pxor	v1, v1
+	pxor	v2, v2
+	pxor	v3, v3
+
+L64_loop:
+	/* load 64 bytes (16 32-bit words) to v4-v7, copy them to v8-v11 */
+	movups	0*16(data), v4
+	movups	1*16(data), v5
+	movups	2*16(data), v6
+	movups	3*16(data), v7
+	add	$4*16, data
+	sub	$4*16, mlen
+
+	movdqa	v4, v8
+	psrlq	$32, v4
+	movdqa	v5, v9
+	psrlq	$32, v5
+	movdqa	v6, v10
+	psrlq	$32, v6
+	movdqa	v7, v11
+	psrlq	$32, v7
+
+	/* accumulate w3:w1 in v4-v7 and w2:w0 in v8-v11 to v0-v3 */
+	pand	Lmask, v8
+	paddq	v4, v0
+	pand	Lmask, v9
+	paddq	v5, v1
+	pand	Lmask, v10
+	paddq	v6, v2
+	pand	Lmask, v11
+	paddq	v7, v3
+
+	paddq	v8, v0
+	paddq	v9, v1
+	paddq	v10, v2
+	paddq	v11, v3
+
+	cmp	$4*16, mlen
+	jge	L64_loop
+
+	/* partial = sum of the 8 lanes in v0-v3 */
+	paddq	v1, v0
+	paddq	v3, v2
+	paddq	v2, v0
+	movq	v0, partial
+	psrldq	$8, v0
+	movq	v0, t
+	add	t, partial
+
+#ifdef KERNEL
+	// restore xmm0-xmm11 and deallocate stack space
+	movdqa	0*16(%rsp), v0
+	movdqa	1*16(%rsp), v1
+	movdqa	2*16(%rsp), v2
+	movdqa	3*16(%rsp), v3
+	movdqa	4*16(%rsp), v4
+	movdqa	5*16(%rsp), v5
+	movdqa	6*16(%rsp), v6
+	movdqa	7*16(%rsp), v7
+	movdqa	8*16(%rsp), v8
+	movdqa	9*16(%rsp), v9
+	movdqa	10*16(%rsp), v10
+	movdqa	11*16(%rsp), v11
+	add	$12*16, %rsp
+#endif
+
+/*
+ *		while (mlen >= 4) {
+ *			partial += *(uint32_t *)(void *)data;
+ *			data += 4;
+ *			mlen -= 4;
+ *		}
+ */
+L4_bytes:
+	sub	$4, mlen
+	jl	L2_bytes
+0:
+	movl	(data), td
+	add	t, partial
+	add	$4, data
+	sub	$4, mlen
+	jge	0b
+
+/*
+ * mlen is not updated below as the remaining tests
+ * are using bit masks, which are not affected.
+ *
+ *		if (mlen & 2) {
+ *			partial += *(uint16_t *)(void *)data;
+ *			data += 2;
+ *		}
+ */
+L2_bytes:
+	test	$2, mlen
+	jz	L_trailing_bytes
+	movzwl	(data), td
+	add	t, partial
+	add	$2, data
+
+/*
+ *	trailing_bytes:
+ *		if (mlen & 1) {
+ *			partial += *data;
+ *			started_on_odd = !started_on_odd;
+ *		}
+ */
+L_trailing_bytes:
+	test	$1, mlen
+	jz	L0_bytes
+	movzbl	(data), td
+	add	t, partial
+	xor	$1, started_on_odd
+
+L0_bytes:
+/*
+ *		if (needs_swap)
+ *			partial = (partial << 8) + (partial >> 56);
+ */
+	test	needs_swap, needs_swap
+	jz	1f
+	rol	$8, partial
+1:
+/*
+ *		sum += (partial >> 32) + (partial & 0xffffffff);
+ *		sum = (sum >> 32) + (sum & 0xffffffff);
+ *	}
+ */
+	mov	partiald, td
+	shr	$32, partial
+	add	partial, sum
+	add	t, sum
+	mov	%ecx, td
+	shr	$32, sum
+	add	t, sum
+
+L_continue:
+	test	len, len
+	jle	L_done
+	mov	M_NEXT(m), m		// m = m->m_next
+	jmp	L_loop
+
+L_done:
+/*
+ *	final_acc = (sum >> 48) + ((sum >> 32) & 0xffff) +
+ *	    ((sum >> 16) & 0xffff) + (sum & 0xffff);
+ *	final_acc = (final_acc >> 16) + (final_acc & 0xffff);
+ *	final_acc = (final_acc >> 16) + (final_acc & 0xffff);
+ *	return (final_acc & 0xffff);
+ * }
+ */
+	mov	sum, %rax
+	shr	$48, %rax
+	movzwl	%cx, %edx
+	add	%edx, %eax
+	mov	sum, %rdx
+	shr	$16, %rdx
+	movzwl	%dx, %edx
+	add	%edx, %eax
+	shr	$32, sum
+	movzwl	%cx, %edx
+	add	%edx, %eax
+
+	movzwl	%ax, %edx
+	shr	$16, %eax
+	add	%edx, %eax
+	movzwl	%ax, %edx
+	shr	$16, %eax
+	add	%edx, %eax
+	/*
+	 * If we were to 1's complement it (XOR with 0xffff):
+	 *
+	 * not      %eax
+	 */
+	movzwl	%ax, %eax
+
+	/* restore callee-saved registers */
+	pop	%rbp
+	ret
+
+Lin_cksum_whoops:
+	leaq	Lin_cksum_whoops_str(%rip), %rdi
+	xor	%eax, %eax
+	call	CKSUM_ERR
+	mov	$-1, %eax
+	pop	%rbp
+	ret
+
+Lin_cksum_whoops_str:
+	.asciz	"os_cpu_in_cksum_mbuf: out of data\n"
+	.align	5
@@ -732,6 +732,7 @@ fdt_init(proc_t p)
 	struct filedesc *fdp = &p->p_fd;
 
 	lck_mtx_init(&fdp->fd_kqhashlock, &proc_kqhashlock_grp, &proc_lck_attr);
+	smr_hash_init_empty(&fdp->fd_kqhash);
 	lck_mtx_init(&fdp->fd_knhashlock, &proc_knhashlock_grp, &proc_lck_attr);
 	lck_mtx_init(&fdp->fd_lock, &proc_fdmlock_grp, &proc_lck_attr);
 	lck_rw_init(&fdp->fd_dirs_lock, &proc_dirslock_grp, &proc_lck_attr);
@@ -742,6 +743,7 @@ fdt_destroy(proc_t p)
 {
 	struct filedesc *fdp = &p->p_fd;
 
+	smr_hash_destroy(&fdp->fd_kqhash);
 	lck_mtx_destroy(&fdp->fd_kqhashlock, &proc_kqhashlock_grp);
 	lck_mtx_destroy(&fdp->fd_knhashlock, &proc_knhashlock_grp);
 	lck_mtx_destroy(&fdp->fd_lock, &proc_fdmlock_grp);
@@ -1019,8 +1021,7 @@ fdt_invalidate(proc_t p)
 	char *ofileflags;
 	struct kqworkq *kqwq = NULL;
 	vnode_t vn1 = NULL, vn2 = NULL;
-	struct kqwllist *kqhash = NULL;
-	u_long kqhashmask = 0;
+	struct smr_hash kqhash;
 	int n_files = 0;
 
 	/*
@@ -1075,10 +1076,7 @@ fdt_invalidate(proc_t p)
 	lck_mtx_lock(&fdp->fd_kqhashlock);
 
 	kqhash = fdp->fd_kqhash;
-	kqhashmask = fdp->fd_kqhashmask;
-
-	fdp->fd_kqhash = 0;
-	fdp->fd_kqhashmask = 0;
+	smr_hash_init_empty(&fdp->fd_kqhash);
 
 	lck_mtx_unlock(&fdp->fd_kqhashlock);
 
@@ -1094,11 +1092,11 @@ fdt_invalidate(proc_t p)
 	if (vn2) {
 		vnode_rele(vn2);
 	}
-	if (kqhash) {
-		for (uint32_t i = 0; i <= kqhashmask; i++) {
-			assert(LIST_EMPTY(&kqhash[i]));
-		}
-		hashdestroy(kqhash, M_KQUEUE, kqhashmask);
+	if (!smr_hash_is_empty_initialized(&kqhash)) {
+		assert(smr_hash_serialized_count(&kqhash) == 0);
+		/* lockless lookups (e.g. proc_info) might still walk the table */
+		smr_proc_task_synchronize();
+		smr_hash_destroy(&kqhash);
 	}
 }
 
@@ -95,10 +95,12 @@
 #include <kern/cpu_data.h>
 #include <kern/policy_internal.h>
 #include <kern/thread_call.h>
+#include <kern/priority_queue.h>
 #include <kern/sched_prim.h>
 #include <kern/waitq.h>
 #include <kern/zalloc.h>
 #include <kern/kalloc.h>
+#include <kern/smr_hash.h>
 #include <kern/assert.h>
 #include <kern/ast.h>
 #include <kern/thread.h>
@@ -122,8 +124,13 @@ extern bool net_check_compatible_alf(void);
 #endif /* SKYWALK && XNU_TARGET_OS_OSX */
 
 #include <mach/task.h>
+#include <mach/mach_vm.h>
 #include <libkern/section_keywords.h>
 
+#include <vm/vm_kern_xnu.h>
+#include <vm/vm_map_xnu.h>
+#include <vm/vm_memory_entry_xnu.h>
+
 #if CONFIG_MEMORYSTATUS
 #include <sys/kern_memorystatus.h>
 #endif
@@ -143,6 +150,13 @@ SYSCTL_INT(_kern_kern_event, OID_AUTO, thread_bound_kqwl_support_enabled,
     &bootarg_thread_bound_kqwl_support_enabled, 0,
     "Whether thread bound kqwl support is enabled");
 
+/* Bytes of wired memory the kqueue shared rings of a process can use. */
+static TUNABLE(uint32_t, kevent_ring_max_bytes, "kevent_ring_max_bytes",
+    8 << 20);
+SYSCTL_UINT(_kern_kern_event, OID_AUTO, ring_max_bytes,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &kevent_ring_max_bytes, 0,
+    "Maximum size of the kqueue shared rings of a process");
+
 static LCK_GRP_DECLARE(kq_lck_grp, "kqueue");
 SECURITY_READ_ONLY_EARLY(vm_packing_params_t) kn_kq_packing_params =
     VM_PACKING_PARAMS(KNOTE_KQ_PACKED);
@@ -176,6 +190,7 @@ static void kevent_register_wait_block(struct turnstile *ts, thread_t handoff_th
     thread_continue_t cont, struct _kevent_register *cont_args) __dead2;
 static void kevent_register_wait_return(struct _kevent_register *cont_args) __dead2;
 static void kevent_register_wait_cleanup(struct knote *kn);
+static void kevent_ring_free(struct kevent_ring *kring);
 
 static struct kqtailq *kqueue_get_suppressed_queue(kqueue_t kq, struct knote *kn);
 static void kqueue_threadreq_initiate(struct kqueue *kq, workq_threadreq_t, kq_index_t qos, int flags);
@@ -247,7 +262,7 @@ static void knote_dequeue(kqueue_t kqu, struct knote *kn);
 
 static void knote_apply_touch(kqueue_t kqu, struct knote *kn,
     struct kevent_qos_s *kev, int result);
-static void knote_suppress(kqueue_t kqu, struct knote *kn);
+static void knote_suppress(kqueue_t kqu, struct knote *kn, kq_index_t slot);
 static void knote_unsuppress(kqueue_t kqu, struct knote *kn);
 static void knote_drop(kqueue_t kqu, struct knote *kn, struct knote_lock_ctx *knlc);
 
@@ -265,6 +280,18 @@ static ZONE_DEFINE(kqworkq_zone, "kqueue workq zone",
 static ZONE_DEFINE(kqworkloop_zone, "kqueue workloop zone",
     sizeof(struct kqworkloop), ZC_CACHING | ZC_ZFREE_CLEARMEM);
 
+/*
+ * Workloops are looked up without locks in the per-process
+ * fd_kqhash SMR hash table, and must be freed through SMR.
+ */
+__startup_func
+static void
+kqworkloop_zone_init(void)
+{
+	zone_enable_smr(kqworkloop_zone, &smr_proc_task, bzero);
+}
+STARTUP(ZALLOC, STARTUP_RANK_LAST, kqworkloop_zone_init);
+
 #define KN_HASH(val, mask)      (((val) ^ (val >> 8)) & (mask))
 
 static int filt_no_attach(struct knote *kn, struct kevent_qos_s *kev);
@@ -1339,7 +1366,7 @@ struct filt_timer_params {
 /*
  * Values stored in the knote at rest (using Mach absolute time units)
  *
- * kn->kn_thcall        where the thread_call object is stored
+ * kn->kn_timer         entry of the knote in the timer queues of its kqueue
  * kn->kn_ext[0]        next deadline or 0 if immediate expiration
  * kn->kn_ext[1]        leeway value
  * kn->kn_sdata         interval timer: the interval
@@ -1368,6 +1395,43 @@ struct filt_timer_params {
 #define TIMER_STATE_MASK 0x3
 #define TIMER_GEN_INC    0x4
 
+/*
+ * Per kqueue timer queues
+ *
+ * Rather than a thread call per knote, the armed timers of a kqueue are kept
+ * in deadline ordered queues, one per clock, each driven by a single thread
+ * call armed for its earliest deadline. When that thread call fires, every
+ * timer whose deadline has passed is delivered, so that timers falling within
+ * the leeway of the earliest one share a single wakeup.
+ *
+ * kqt_lock protects the queues and the kqtimer entries linked into them,
+ * and nests inside the kqueue lock.
+ */
+#define KQTIMER_ABSOLUTE   0
+#define KQTIMER_CONTINUOUS 1
+#define KQTIMER_NCLOCKS    2
+
+struct kqtimer {
+	struct priority_queue_entry_deadline kt_link;
+	struct knote            *kt_kn;
+	struct kqtimer_queue    *kt_queue;      /* queue linked into, or NULL */
+	uint64_t                 kt_leeway;
+	uint32_t                 kt_state;      /* kn_hook32 when armed */
+	uint32_t                 kt_flags;      /* THREAD_CALL_DELAY_* flags */
+};
+
+struct kqtimer_queue {
+	struct priority_queue_deadline_min ktq_heap;
+	thread_call_t            ktq_call;
+	uint64_t                 ktq_armed;     /* deadline of ktq_call, or 0 */
+};
+
+struct kqtimers {
+	lck_spin_t               kqt_lock;
+	struct kqueue           *kqt_kq;
+	struct kqtimer_queue     kqt_queues[KQTIMER_NCLOCKS];
+};
+
 static void
 filt_timer_set_params(struct knote *kn, struct filt_timer_params *params)
 {
@@ -1578,28 +1642,185 @@ filt_timervalidate(const struct kevent_qos_s *kev,
 }
 
 /*
- * filt_timerexpire - the timer callout routine
+ * Arm the thread call of a timer queue for its earliest deadline.
+ *
+ * Called with the kqt_lock held.
  */
 static void
-filt_timerexpire(void *knx, void *state_on_arm)
+kqtimer_queue_arm(struct kqtimers *kqt, int clock)
 {
-	struct knote *kn = knx;
+	struct kqtimer_queue *ktq = &kqt->kqt_queues[clock];
+	struct kqtimer *kt;
+	uint32_t flags;
 
-	uint32_t state = (uint32_t)(uintptr_t)state_on_arm;
-	uint32_t fired_state = state ^ TIMER_ARMED ^ TIMER_FIRED;
+	kt = priority_queue_min(&ktq->ktq_heap, struct kqtimer, kt_link);
+	if (kt == NULL) {
+		/* a late firing of ktq_call will find the queue empty */
+		ktq->ktq_armed = 0;
+		return;
+	}
 
-	if (os_atomic_cmpxchg(&kn->kn_hook32, state, fired_state, relaxed)) {
-		// our f_event always would say FILTER_ACTIVE,
-		// so be leaner and just do it.
-		struct kqueue *kq = knote_get_kq(kn);
-		kqlock(kq);
-		knote_activate(kq, kn, FILTER_ACTIVE);
-		kqunlock(kq);
+	if (ktq->ktq_armed == kt->kt_link.deadline) {
+		return;
+	}
+
+	flags = kt->kt_flags;
+	if (clock == KQTIMER_CONTINUOUS) {
+		flags |= THREAD_CALL_CONTINUOUS;
+	}
+	ktq->ktq_armed = kt->kt_link.deadline;
+	thread_call_enter_delayed_with_leeway(ktq->ktq_call,
+	    (void *)(uintptr_t)clock, kt->kt_link.deadline, kt->kt_leeway, flags);
+}
+
+/*
+ * filt_timerexpire - the timer callout routine
+ *
+ * Fires every timer of the queue whose deadline has passed,
+ * then rearms the queue for the next one.
+ */
+static void
+filt_timerexpire(void *kqtx, void *clockx)
+{
+	struct kqtimers *kqt = kqtx;
+	int clock = (int)(uintptr_t)clockx;
+	struct kqtimer_queue *ktq = &kqt->kqt_queues[clock];
+	struct kqueue *kq = kqt->kqt_kq;
+	struct kqtimer *kt;
+	uint64_t now;
+
+	if (clock == KQTIMER_CONTINUOUS) {
+		now = mach_continuous_time();
 	} else {
+		now = mach_absolute_time();
+	}
+
+	kqlock(kq);
+	lck_spin_lock(&kqt->kqt_lock);
+
+	ktq->ktq_armed = 0;
+	while ((kt = priority_queue_min(&ktq->ktq_heap,
+	    struct kqtimer, kt_link)) != NULL) {
+		struct knote *kn = kt->kt_kn;
+		uint32_t fired_state = kt->kt_state ^ TIMER_ARMED ^ TIMER_FIRED;
+
+		if (kt->kt_link.deadline > now) {
+			break;
+		}
+
+		priority_queue_remove_min(&ktq->ktq_heap, struct kqtimer, kt_link);
+		kt->kt_queue = NULL;
+
+		if (os_atomic_cmpxchg(&kn->kn_hook32, kt->kt_state, fired_state,
+		    relaxed)) {
+			// our f_event always would say FILTER_ACTIVE,
+			// so be leaner and just do it.
+			knote_activate(kq, kn, FILTER_ACTIVE);
+		} else {
+			/*
+			 * The timer has been reprogrammed or canceled since it
+			 * was armed, and this is a late firing for the timer,
+			 * just ignore it.
+			 */
+		}
+	}
+
+	kqtimer_queue_arm(kqt, clock);
+
+	lck_spin_unlock(&kqt->kqt_lock);
+	kqunlock(kq);
+}
+
+/*
+ * Remove a timer from its queue if it is linked into one.
+ *
+ * The thread call of the queue is left armed, and will find nothing to fire
+ * if the timer was the earliest one.
+ */
+static void
+kqtimer_dequeue(struct knote *kn)
+{
+	struct kqtimers *kqt = knote_get_kq(kn)->kq_timers;
+	struct kqtimer *kt = kn->kn_timer;
+
+	lck_spin_lock(&kqt->kqt_lock);
+	if (kt->kt_queue) {
+		priority_queue_remove(&kt->kt_queue->ktq_heap, &kt->kt_link);
+		kt->kt_queue = NULL;
+	}
+	lck_spin_unlock(&kqt->kqt_lock);
+}
+
+static void
+kqtimers_destroy(struct kqtimers *kqt)
+{
+	for (int clock = 0; clock < KQTIMER_NCLOCKS; clock++) {
+		struct kqtimer_queue *ktq = &kqt->kqt_queues[clock];
+		__assert_only boolean_t freed;
+
+		if (ktq->ktq_call == NULL) {
+			continue;
+		}
+		assert(priority_queue_empty(&ktq->ktq_heap));
 		/*
-		 * The timer has been reprogrammed or canceled since it was armed,
-		 * and this is a late firing for the timer, just ignore it.
+		 * Unconditionally cancel to make sure there can't be any
+		 * filt_timerexpire() running anymore.
 		 */
+		thread_call_cancel_wait(ktq->ktq_call);
+		freed = thread_call_free(ktq->ktq_call);
+		assert(freed);
+	}
+	lck_spin_destroy(&kqt->kqt_lock, &kq_lck_grp);
+	kfree_type(struct kqtimers, kqt);
+}
+
+/*
+ * Returns the timer queues of a kqueue, allocating them on first use.
+ */
+static struct kqtimers *
+kqueue_timers_get(struct kqueue *kq)
+{
+	struct kqtimers *kqt, *tmp = NULL;
+
+	kqt = os_atomic_load(&kq->kq_timers, acquire);
+	if (kqt) {
+		return kqt;
+	}
+
+	kqt = kalloc_type(struct kqtimers, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	lck_spin_init(&kqt->kqt_lock, &kq_lck_grp, LCK_ATTR_NULL);
+	kqt->kqt_kq = kq;
+	for (int clock = 0; clock < KQTIMER_NCLOCKS; clock++) {
+		struct kqtimer_queue *ktq = &kqt->kqt_queues[clock];
+
+		priority_queue_init(&ktq->ktq_heap);
+		ktq->ktq_call = thread_call_allocate_with_options(filt_timerexpire,
+		    (thread_call_param_t)kqt, THREAD_CALL_PRIORITY_HIGH,
+		    THREAD_CALL_OPTIONS_ONCE);
+		if (ktq->ktq_call == NULL) {
+			kqtimers_destroy(kqt);
+			return NULL;
+		}
+	}
+
+	if (!os_atomic_cmpxchgv(&kq->kq_timers, NULL, kqt, &tmp, release)) {
+		/* lost the race with another attach */
+		kqtimers_destroy(kqt);
+		kqt = tmp;
+	}
+	return kqt;
+}
+
+/*
+ * Free the timer queues of a kqueue being destroyed, once all its knotes
+ * have been detached.
+ */
+static void
+kqueue_timers_free(struct kqueue *kq)
+{
+	if (kq->kq_timers) {
+		kqtimers_destroy(kq->kq_timers);
+		kq->kq_timers = NULL;
 	}
 }
 
@@ -1626,15 +1847,20 @@ filt_timer_is_ready(struct knote *kn)
 /*
  * Arm a timer
  *
- * It is the responsibility of the caller to make sure the timer call
- * has completed or been cancelled properly prior to arming it.
+ * Links the timer into the queue of its clock, moving it there if it was
+ * already armed, and brings the thread call of the queue forward if this
+ * is its new earliest deadline.
  */
 static void
 filt_timerarm(struct knote *kn)
 {
+	struct kqtimers *kqt = knote_get_kq(kn)->kq_timers;
+	struct kqtimer *kt = kn->kn_timer;
+	struct kqtimer_queue *ktq;
 	uint64_t deadline = kn->kn_ext[0];
 	uint64_t leeway   = kn->kn_ext[1];
 	uint32_t state;
+	int clock = KQTIMER_ABSOLUTE;
 
 	int filter_flags = kn->kn_sfflags;
 	unsigned int timer_flags = 0;
@@ -1652,13 +1878,14 @@ filt_timerarm(struct knote *kn)
 	}
 
 	if (filter_flags & NOTE_MACH_CONTINUOUS_TIME) {
-		timer_flags |= THREAD_CALL_CONTINUOUS;
+		clock = KQTIMER_CONTINUOUS;
 	}
+	ktq = &kqt->kqt_queues[clock];
 
 	/*
 	 * Move to ARMED.
 	 *
-	 * We increase the gencount, and setup the thread call with this expected
+	 * We increase the gencount, and queue the timer with this expected
 	 * state. It means that if there was a previous generation of the timer in
 	 * flight that needs to be ignored, then 3 things are possible:
 	 *
@@ -1670,8 +1897,8 @@ filt_timerarm(struct knote *kn)
 	 * - this code runs first, but filt_timerexpire() comes second. Because it
 	 *   knows an old gencount, it will debounce and not activate the knote.
 	 *
-	 * - filt_timerexpire() wasn't in flight yet, and thread_call_enter below
-	 *   will just cancel it properly.
+	 * - filt_timerexpire() wasn't in flight yet, and requeuing the timer
+	 *   below will just move it to its new deadline.
 	 *
 	 * This is important as userspace expects to never be woken up for past
 	 * timers after filt_timertouch ran.
@@ -1681,17 +1908,28 @@ filt_timerarm(struct knote *kn)
 	state += TIMER_GEN_INC + TIMER_ARMED;
 	os_atomic_store(&kn->kn_hook32, state, relaxed);
 
-	thread_call_enter_delayed_with_leeway(kn->kn_thcall,
-	    (void *)(uintptr_t)state, deadline, leeway, timer_flags);
+	lck_spin_lock(&kqt->kqt_lock);
+	if (kt->kt_queue) {
+		priority_queue_remove(&kt->kt_queue->ktq_heap, &kt->kt_link);
+	}
+	kt->kt_link.deadline = deadline;
+	kt->kt_leeway = leeway;
+	kt->kt_state = state;
+	kt->kt_flags = timer_flags;
+	kt->kt_queue = ktq;
+	priority_queue_insert(&ktq->ktq_heap, &kt->kt_link);
+	if (ktq->ktq_armed == 0 || deadline < ktq->ktq_armed) {
+		kqtimer_queue_arm(kqt, clock);
+	}
+	lck_spin_unlock(&kqt->kqt_lock);
 }
 
 /*
  * Mark a timer as "already fired" when it is being reprogrammed
  *
- * If there is a timer in flight, this will do a best effort at canceling it,
- * but will not wait. If the thread call was in flight, having set the
- * TIMER_IMMEDIATE bit will debounce a filt_timerexpire() racing with this
- * cancelation.
+ * If the timer is armed, this removes it from its queue. If the thread call
+ * of the queue was in flight, having set the TIMER_IMMEDIATE bit will
+ * debounce a filt_timerexpire() racing with this cancelation.
  */
 static void
 filt_timerfire_immediate(struct knote *kn)
@@ -1703,18 +1941,18 @@ filt_timerfire_immediate(struct knote *kn)
 	state = os_atomic_or_orig(&kn->kn_hook32, TIMER_IMMEDIATE, relaxed);
 
 	if ((state & TIMER_STATE_MASK) == TIMER_ARMED) {
-		thread_call_cancel(kn->kn_thcall);
+		kqtimer_dequeue(kn);
 	}
 }
 
 /*
- * Allocate a thread call for the knote's lifetime, and kick off the timer.
+ * Allocate a queue entry for the knote's lifetime, and kick off the timer.
  */
 static int
 filt_timerattach(struct knote *kn, struct kevent_qos_s *kev)
 {
-	thread_call_t callout;
 	struct filt_timer_params params;
+	struct kqtimer *kt;
 	int error;
 
 	if ((error = filt_timervalidate(kev, &params)) != 0) {
@@ -1722,17 +1960,17 @@ filt_timerattach(struct knote *kn, struct kevent_qos_s *kev)
 		return 0;
 	}
 
-	callout = thread_call_allocate_with_options(filt_timerexpire,
-	    (thread_call_param_t)kn, THREAD_CALL_PRIORITY_HIGH,
-	    THREAD_CALL_OPTIONS_ONCE);
-
-	if (NULL == callout) {
+	if (kqueue_timers_get(knote_get_kq(kn)) == NULL) {
 		knote_set_error(kn, ENOMEM);
 		return 0;
 	}
 
+	kt = kalloc_type(struct kqtimer, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	priority_queue_entry_init(&kt->kt_link);
+	kt->kt_kn = kn;
+
 	filt_timer_set_params(kn, &params);
-	kn->kn_thcall = callout;
+	kn->kn_timer = kt;
 	kn->kn_flags |= EV_CLEAR;
 	os_atomic_store(&kn->kn_hook32, TIMER_IDLE, relaxed);
 
@@ -1751,20 +1989,16 @@ filt_timerattach(struct knote *kn, struct kevent_qos_s *kev)
 }
 
 /*
- * Shut down the timer if it's running, and free the callout.
+ * Shut down the timer if it's running, and free its queue entry.
+ *
+ * filt_timerexpire() only looks at timers linked into a queue, with the
+ * kqt_lock held, so once dequeued, the entry can't be used anymore.
  */
 static void
 filt_timerdetach(struct knote *kn)
 {
-	__assert_only boolean_t freed;
-
-	/*
-	 * Unconditionally cancel to make sure there can't be any filt_timerexpire()
-	 * running anymore.
-	 */
-	thread_call_cancel_wait(kn->kn_thcall);
-	freed = thread_call_free(kn->kn_thcall);
-	assert(freed);
+	kqtimer_dequeue(kn);
+	kfree_type(struct kqtimer, kn->kn_timer);
 }
 
 /*
@@ -1910,7 +2144,7 @@ filt_timerprocess(struct knote *kn, struct kevent_qos_s *kev)
 			kn->kn_ext[0] = new_deadline;
 
 			/*
-			 * This can't shortcut setting up the thread call, because
+			 * This can't shortcut queuing the timer, because
 			 * knote_process deactivates EV_CLEAR knotes unconditionnally.
 			 */
 			filt_timerarm(kn);
@@ -2923,6 +3157,7 @@ OS_NOINLINE
 static void
 kqueue_destroy(kqueue_t kqu, zone_t zone)
 {
+	kqueue_timers_free(kqu.kq);
 	lck_spin_destroy(&kqu.kq->kq_lock, &kq_lck_grp);
 
 	zfree(zone, kqu.kq);
@@ -3014,6 +3249,10 @@ kqueue_dealloc(struct kqueue *kq)
 	}
 	knhash_unlock(fdp);
 
+	if (((struct kqfile *)kq)->kqf_ring) {
+		kevent_ring_free(((struct kqfile *)kq)->kqf_ring);
+	}
+
 	kqueue_destroy(kq, kqfile_zone);
 }
 
@@ -3036,7 +3275,9 @@ kqueue_alloc(struct proc *p)
 	kqf = zalloc_flags(kqfile_zone, Z_WAITOK | Z_ZERO);
 	kqf->kqf_p = p;
 	TAILQ_INIT_AFTER_BZERO(&kqf->kqf_queue);
-	TAILQ_INIT_AFTER_BZERO(&kqf->kqf_suppressed);
+	for (int i = 0; i < KQFILE_NPROCESSORS; i++) {
+		TAILQ_INIT_AFTER_BZERO(&kqf->kqf_suppressed[i]);
+	}
 
 	return kqueue_init(kqf).kq;
 }
@@ -3174,9 +3415,23 @@ kqworkq_alloc(struct proc *p, unsigned int flags)
 
 #pragma mark kqworkloop allocation and deallocation
 
-#define KQ_HASH(val, mask)  (((val) ^ (val >> 8)) & (mask))
 #define CONFIG_KQ_HASHSIZE  CONFIG_KN_HASHSIZE
 
+static bool
+kqworkloop_hash_obj_try_get(void *kqwl)
+{
+	return kqworkloop_try_retain((struct kqworkloop *)kqwl);
+}
+
+/*
+ * Dynamic workloops are found in the fd_kqhash SMR hash table:
+ * lookups are lock free, and mutations are serialized by the kqhash lock.
+ */
+SMRH_TRAITS_DEFINE_SCALAR(kqworkloop_hash_traits, struct kqworkloop,
+    kqwl_dynamicid, kqwl_hashlink,
+    .domain      = &smr_proc_task,
+    .obj_try_get = kqworkloop_hash_obj_try_get);
+
 OS_ALWAYS_INLINE
 static inline void
 kqhash_lock(struct filedesc *fdp)
@@ -3193,64 +3448,62 @@ kqhash_unlock(struct filedesc *fdp)
 
 OS_ALWAYS_INLINE
 static inline void
-kqworkloop_hash_insert_locked(struct filedesc *fdp, kqueue_id_t id,
-    struct kqworkloop *kqwl)
+kqworkloop_hash_insert_locked(struct filedesc *fdp, struct kqworkloop *kqwl)
 {
-	struct kqwllist *list = &fdp->fd_kqhash[KQ_HASH(id, fdp->fd_kqhashmask)];
-	LIST_INSERT_HEAD(list, kqwl, kqwl_hashlink);
+	smr_hash_serialized_insert(&fdp->fd_kqhash, &kqwl->kqwl_hashlink,
+	    &kqworkloop_hash_traits);
 }
 
 OS_ALWAYS_INLINE
 static inline struct kqworkloop *
 kqworkloop_hash_lookup_locked(struct filedesc *fdp, kqueue_id_t id)
 {
-	struct kqwllist *list = &fdp->fd_kqhash[KQ_HASH(id, fdp->fd_kqhashmask)];
-	struct kqworkloop *kqwl;
+	return smr_hash_serialized_find(&fdp->fd_kqhash, SMRH_SCALAR_KEY(id),
+	           &kqworkloop_hash_traits);
+}
 
-	LIST_FOREACH(kqwl, list, kqwl_hashlink) {
-		if (kqwl->kqwl_dynamicid == id) {
-			return kqwl;
-		}
+/*
+ * Called with the kqhash lock held, drops it if the hash table needs
+ * to grow, and returns with it unlocked.
+ */
+OS_ALWAYS_INLINE
+static inline void
+kqworkloop_hash_unlock_and_grow(struct filedesc *fdp)
+{
+	if (smr_hash_serialized_should_grow(&fdp->fd_kqhash, 1, 4)) {
+		/* grow if more than 4 workloops per bucket */
+		smr_hash_grow_and_unlock(&fdp->fd_kqhash,
+		    &fdp->fd_kqhashlock, &kqworkloop_hash_traits);
+	} else {
+		kqhash_unlock(fdp);
 	}
-	return NULL;
 }
 
 static struct kqworkloop *
 kqworkloop_hash_lookup_and_retain(struct filedesc *fdp, kqueue_id_t kq_id)
 {
-	struct kqworkloop *kqwl = NULL;
-
-	kqhash_lock(fdp);
-	if (__probable(fdp->fd_kqhash)) {
-		kqwl = kqworkloop_hash_lookup_locked(fdp, kq_id);
-		if (kqwl && !kqworkloop_try_retain(kqwl)) {
-			kqwl = NULL;
-		}
-	}
-	kqhash_unlock(fdp);
-	return kqwl;
+	return smr_hash_get(&fdp->fd_kqhash, SMRH_SCALAR_KEY(kq_id),
+	           &kqworkloop_hash_traits);
 }
 
 OS_NOINLINE
 static void
 kqworkloop_hash_init(struct filedesc *fdp)
 {
-	struct kqwllist *alloc_hash;
-	u_long alloc_mask;
-
+	/*
+	 * smr_hash_init() allocates and publishes the table to lockless
+	 * readers, hold the kqhash lock as a full mutex around it.
+	 */
 	kqhash_unlock(fdp);
-	alloc_hash = hashinit(CONFIG_KQ_HASHSIZE, M_KQUEUE, &alloc_mask);
-	kqhash_lock(fdp);
+	lck_mtx_lock(&fdp->fd_kqhashlock);
 
 	/* See if we won the race */
-	if (__probable(fdp->fd_kqhashmask == 0)) {
-		fdp->fd_kqhash = alloc_hash;
-		fdp->fd_kqhashmask = alloc_mask;
-	} else {
-		kqhash_unlock(fdp);
-		hashdestroy(alloc_hash, M_KQUEUE, alloc_mask);
-		kqhash_lock(fdp);
+	if (__probable(smr_hash_is_empty_initialized(&fdp->fd_kqhash))) {
+		smr_hash_init(&fdp->fd_kqhash, CONFIG_KQ_HASHSIZE);
 	}
+
+	lck_mtx_unlock(&fdp->fd_kqhashlock);
+	kqhash_lock(fdp);
 }
 
 /*
@@ -3418,7 +3671,8 @@ kqworkloop_dealloc(struct kqworkloop *kqwl, bool hash_remove)
 		struct filedesc *fdp = &kqwl->kqwl_p->p_fd;
 
 		kqhash_lock(fdp);
-		LIST_REMOVE(kqwl, kqwl_hashlink);
+		smr_hash_serialized_remove(&fdp->fd_kqhash, &kqwl->kqwl_hashlink,
+		    &kqworkloop_hash_traits);
 #if CONFIG_PROC_RESOURCE_LIMITS
 		fdp->num_kqwls--;
 #endif
@@ -3441,8 +3695,11 @@ kqworkloop_dealloc(struct kqworkloop *kqwl, bool hash_remove)
 	assert(kqwl->kqwl_owner == THREAD_NULL);
 	assert(kqwl->kqwl_turnstile == TURNSTILE_NULL);
 
+	kqueue_timers_free(&kqwl->kqwl_kqueue);
 	lck_spin_destroy(&kqwl->kqwl_statelock, &kq_lck_grp);
-	kqueue_destroy(kqwl, kqworkloop_zone);
+	lck_spin_destroy(&kqwl->kqwl_lock, &kq_lck_grp);
+	/* lockless fd_kqhash lookups might still be looking at this workloop */
+	zfree_smr(kqworkloop_zone, kqwl);
 }
 
 /*!
@@ -3566,9 +3823,21 @@ kqworkloop_get_or_create(struct proc *p, kqueue_id_t id,
 		return EINVAL;
 	}
 
+	if (__probable(!(flags & KEVENT_FLAG_DYNAMIC_KQ_MUST_NOT_EXIST))) {
+		/*
+		 * Fast path: the workloop exists already,
+		 * which doesn't need the kqhash lock.
+		 */
+		kqwl = kqworkloop_hash_lookup_and_retain(fdp, id);
+		if (kqwl) {
+			*kqwlp = kqwl;
+			return 0;
+		}
+	}
+
 	for (;;) {
 		kqhash_lock(fdp);
-		if (__improbable(fdp->fd_kqhash == NULL)) {
+		if (__improbable(smr_hash_is_empty_initialized(&fdp->fd_kqhash))) {
 			kqworkloop_hash_init(fdp);
 		}
 
@@ -3609,7 +3878,7 @@ kqworkloop_get_or_create(struct proc *p, kqueue_id_t id,
 		 * then try to allocate one without blocking.
 		 */
 		if (__probable(alloc_kqwl == NULL)) {
-			alloc_kqwl = zalloc_flags(kqworkloop_zone, Z_NOWAIT | Z_ZERO);
+			alloc_kqwl = zalloc_smr(kqworkloop_zone, Z_NOWAIT | Z_ZERO);
 		}
 		if (__probable(alloc_kqwl)) {
 #if CONFIG_PROC_RESOURCE_LIMITS
@@ -3620,7 +3889,7 @@ kqworkloop_get_or_create(struct proc *p, kqueue_id_t id,
 			/*
 			 * The newly allocated and initialized kqwl has a retain count of 1.
 			 */
-			kqworkloop_hash_insert_locked(fdp, id, alloc_kqwl);
+			kqworkloop_hash_insert_locked(fdp, alloc_kqwl);
 			if (trp && (trp->trp_flags & TRP_BOUND_THREAD)) {
 				/*
 				 * If this kqworkloop is configured to be permanently bound to
@@ -3638,7 +3907,7 @@ kqworkloop_get_or_create(struct proc *p, kqueue_id_t id,
 				 */
 				kqworkloop_retain(alloc_kqwl);
 			}
-			kqhash_unlock(fdp);
+			kqworkloop_hash_unlock_and_grow(fdp);
 			/*
 			 * We do not want to keep holding kqhash lock when workq is
 			 * busy creating and initializing a new thread to bind to this
@@ -3705,13 +3974,13 @@ kqworkloop_get_or_create(struct proc *p, kqueue_id_t id,
 		 */
 		kqhash_unlock(fdp);
 
-		alloc_kqwl = zalloc_flags(kqworkloop_zone, Z_WAITOK | Z_ZERO);
+		alloc_kqwl = zalloc_smr(kqworkloop_zone, Z_WAITOK | Z_ZERO);
 	}
 
 	kqhash_unlock(fdp);
 
 	if (__improbable(alloc_kqwl)) {
-		zfree(kqworkloop_zone, alloc_kqwl);
+		zfree_smr(kqworkloop_zone, alloc_kqwl);
 	}
 
 	return error;
@@ -3822,55 +4091,73 @@ void
 kqworkloops_dealloc(proc_t p)
 {
 	struct filedesc *fdp = &p->p_fd;
-	struct kqworkloop *kqwl, *kqwln;
-	struct kqwllist tofree;
+	struct kqworkloop *kqwl, **tofree;
+	struct smr_hash_iterator it;
+	size_t count, n = 0;
 
 	if (!fdt_flag_test(fdp, FD_WORKLOOP)) {
 		return;
 	}
 
+	/*
+	 * No workloop can be created anymore, so the count can only go down
+	 * between now and when we take the kqhash lock again.
+	 */
 	kqhash_lock(fdp);
+	count = smr_hash_serialized_count(&fdp->fd_kqhash);
+	kqhash_unlock(fdp);
 
-	if (fdp->fd_kqhashmask == 0) {
-		kqhash_unlock(fdp);
+	if (count == 0) {
 		return;
 	}
 
-	LIST_INIT(&tofree);
+	tofree = kalloc_type(struct kqworkloop *, count, Z_WAITOK | Z_NOFAIL);
 
-	for (size_t i = 0; i <= fdp->fd_kqhashmask; i++) {
-		LIST_FOREACH_SAFE(kqwl, &fdp->fd_kqhash[i], kqwl_hashlink, kqwln) {
+	kqhash_lock(fdp);
+
+	it = smr_hash_iter_begin(&fdp->fd_kqhash);
+	while (n < count &&
+	    (kqwl = smr_hash_iter_get(it, &kqworkloop_hash_traits))) {
 #if CONFIG_PREADOPT_TG
-			/*
-			 * kqworkloops that have scheduling parameters have an
-			 * implicit retain from kqueue_workloop_ctl that needs
-			 * to be balanced on process exit.
-			 */
-			__assert_only thread_group_qos_t preadopt_tg;
-			preadopt_tg = os_atomic_load(&kqwl->kqwl_preadopt_tg, relaxed);
+		/*
+		 * kqworkloops that have scheduling parameters have an
+		 * implicit retain from kqueue_workloop_ctl that needs
+		 * to be balanced on process exit.
+		 */
+		__assert_only thread_group_qos_t preadopt_tg;
+		preadopt_tg = os_atomic_load(&kqwl->kqwl_preadopt_tg, relaxed);
 #endif
-			assert(kqwl->kqwl_params
+		assert(kqwl->kqwl_params
 #if CONFIG_PREADOPT_TG
-			    || KQWL_HAS_PERMANENT_PREADOPTED_TG(preadopt_tg)
+		    || KQWL_HAS_PERMANENT_PREADOPTED_TG(preadopt_tg)
 #endif
-			    );
+		    );
 
-			LIST_REMOVE(kqwl, kqwl_hashlink);
-			LIST_INSERT_HEAD(&tofree, kqwl, kqwl_hashlink);
-		}
+		tofree[n++] = kqwl;
+		smr_hash_iter_serialized_erase(&it);
 	}
 #if CONFIG_PROC_RESOURCE_LIMITS
 	fdp->num_kqwls = 0;
 #endif
 	kqhash_unlock(fdp);
 
-	LIST_FOREACH_SAFE(kqwl, &tofree, kqwl_hashlink, kqwln) {
+	/*
+	 * Wait for lockless lookups that might have found these workloops
+	 * before they were removed, so that their refcount is stable.
+	 */
+	smr_proc_task_synchronize();
+
+	for (size_t i = 0; i < n; i++) {
+		kqwl = tofree[i];
+
 		uint32_t ref = os_ref_get_count_raw(&kqwl->kqwl_retains);
 		if (ref != 1) {
 			panic("kq(%p) invalid refcount %d", kqwl, ref);
 		}
 		kqworkloop_dealloc(kqwl, false);
 	}
+
+	kfree_type(struct kqworkloop *, count, tofree);
 }
 
 static int
@@ -4365,7 +4652,7 @@ knote_process(struct knote *kn, kevent_ctx_t kectx,
 	 * suppress knotes to avoid returning the same event multiple times in
 	 * a single call.
 	 */
-	knote_suppress(kq, kn);
+	knote_suppress(kq, kn, kectx->kec_process_slot);
 
 	if (kn->kn_status & (KN_DEFERDELETE | KN_VANISHED)) {
 		uint16_t kev_flags = EV_DISPATCH2 | EV_ONESHOT;
@@ -4671,25 +4958,46 @@ done:
  * -1 if there is nothing to process.
  * EBADF if the kqueue is draining
  *
+ * Unless KEVENT_FLAG_SHARED_PROCESSING is passed, the caller becomes
+ * the exclusive processing thread. Shared processing threads can process
+ * the kqueue at the same time, each suppressing the knotes it delivers
+ * on its own queue, whose index is returned in *slotp. New shared threads
+ * wait behind exclusive threads that are waiting.
+ *
  * Called with kqueue locked and returns the same way,
  * but may drop lock temporarily.
  * May block.
  */
 static int
-kqfile_begin_processing(struct kqfile *kq)
+kqfile_begin_processing(struct kqfile *kq, int flags, kq_index_t *slotp)
 {
+	bool shared = (flags & KEVENT_FLAG_SHARED_PROCESSING);
+
 	kqlock_held(kq);
 
 	assert((kq->kqf_state & (KQ_WORKQ | KQ_WORKLOOP)) == 0);
 	KDBG_DEBUG(KEV_EVTID(BSD_KEVENT_KQ_PROCESS_BEGIN) | DBG_FUNC_START,
 	    VM_KERNEL_UNSLIDE_OR_PERM(kq), 0);
 
-	/* wait to become the exclusive processing thread */
-	while ((kq->kqf_state & (KQ_PROCESSING | KQ_DRAIN)) == KQ_PROCESSING) {
+	/*
+	 * Wait to become a processing thread.
+	 *
+	 * Exclusive threads waiting keep new shared threads out, otherwise
+	 * shared threads overlapping each other would starve them forever.
+	 */
+	if (!shared) {
+		kq->kqf_exclwait++;
+	}
+	while ((kq->kqf_state & KQ_DRAIN) == 0 &&
+	    (shared ? (kq->kqf_processing == KQFILE_PROCESSING_FULL ||
+	    kq->kqf_exclwait != 0) : kq->kqf_processing != 0)) {
 		kq->kqf_state |= KQ_PROCWAIT;
 		lck_spin_sleep(&kq->kqf_lock, LCK_SLEEP_DEFAULT,
 		    &kq->kqf_suppressed, THREAD_UNINT | THREAD_WAIT_NOREPORT);
 	}
+	if (!shared) {
+		kq->kqf_exclwait--;
+	}
 
 	if (kq->kqf_state & KQ_DRAIN) {
 		KDBG_DEBUG(KEV_EVTID(BSD_KEVENT_KQ_PROCESS_BEGIN) | DBG_FUNC_END,
@@ -4697,16 +5005,35 @@ kqfile_begin_processing(struct kqfile *kq)
 		return EBADF;
 	}
 
-	/* Nobody else processing */
+	/*
+	 * A suppression queue is free, and if exclusive, no other thread
+	 * is processing.
+	 */
 
 	/* anything left to process? */
 	if (kq->kqf_count == 0) {
+		/*
+		 * Shared threads held off by this one won't be woken up
+		 * by kqfile_end_processing() if nobody is processing.
+		 */
+		if (!shared && kq->kqf_exclwait == 0 &&
+		    (kq->kqf_state & KQ_PROCWAIT)) {
+			kq->kqf_state &= ~KQ_PROCWAIT;
+			thread_wakeup(&kq->kqf_suppressed);
+		}
 		KDBG_DEBUG(KEV_EVTID(BSD_KEVENT_KQ_PROCESS_BEGIN) | DBG_FUNC_END,
 		    VM_KERNEL_UNSLIDE_OR_PERM(kq), 1);
 		return -1;
 	}
 
 	/* convert to processing mode */
+	if (shared) {
+		*slotp = (kq_index_t)(ffs(~(unsigned int)kq->kqf_processing) - 1);
+		kq->kqf_processing |= (uint8_t)(1u << *slotp);
+	} else {
+		*slotp = 0;
+		kq->kqf_processing = KQFILE_PROCESSING_FULL;
+	}
 	kq->kqf_state |= KQ_PROCESSING;
 
 	KDBG_DEBUG(KEV_EVTID(BSD_KEVENT_KQ_PROCESS_BEGIN) | DBG_FUNC_END,
@@ -4818,7 +5145,7 @@ kqworkloop_end_processing(struct kqworkloop *kqwl, int flags, int kevent_flags)
  * EBADF: kqueue is in draining mode
  */
 static int
-kqfile_end_processing(struct kqfile *kq)
+kqfile_end_processing(struct kqfile *kq, int flags, kq_index_t slot)
 {
 	struct knote *kn;
 	int procwait;
@@ -4831,14 +5158,23 @@ kqfile_end_processing(struct kqfile *kq)
 	    VM_KERNEL_UNSLIDE_OR_PERM(kq), 0);
 
 	/*
-	 * Return suppressed knotes to their original state.
+	 * Return the knotes we suppressed to their original state.
 	 */
-	while ((kn = TAILQ_FIRST(&kq->kqf_suppressed)) != NULL) {
+	while ((kn = TAILQ_FIRST(&kq->kqf_suppressed[slot])) != NULL) {
 		knote_unsuppress(kq, kn);
 	}
 
+	if (flags & KEVENT_FLAG_SHARED_PROCESSING) {
+		kq->kqf_processing &= (uint8_t)~(1u << slot);
+	} else {
+		kq->kqf_processing = 0;
+	}
+
 	procwait = (kq->kqf_state & KQ_PROCWAIT);
-	kq->kqf_state &= ~(KQ_PROCESSING | KQ_PROCWAIT);
+	kq->kqf_state &= ~KQ_PROCWAIT;
+	if (kq->kqf_processing == 0) {
+		kq->kqf_state &= ~KQ_PROCESSING;
+	}
 
 	if (procwait) {
 		/* first wake up any thread already waiting to process */
@@ -5083,10 +5419,12 @@ kqueue_select(struct fileproc *fp, int which, void *wql, __unused vfs_context_t
 	assert((kq->kqf_state & (KQ_WORKLOOP | KQ_WORKQ)) == 0);
 
 	if (which == FREAD) {
+		kq_index_t slot;
+
 		kqlock(kq);
-		if (kqfile_begin_processing(kq) == 0) {
+		if (kqfile_begin_processing(kq, 0, &slot) == 0) {
 			retnum = kq->kqf_count;
-			kqfile_end_processing(kq);
+			kqfile_end_processing(kq, 0, slot);
 		} else if ((kq->kqf_state & KQ_DRAIN) == 0) {
 			selrecord(kq->kqf_p, &kq->kqf_sel, wql);
 		}
@@ -6091,7 +6429,7 @@ kqueue_get_suppressed_queue(kqueue_t kq, struct knote *kn)
 	} else if (kq.kq->kq_state & KQ_WORKQ) {
 		return &kq.kqwq->kqwq_suppressed[kn->kn_qos_index - 1];
 	} else {
-		return &kq.kqf->kqf_suppressed;
+		return &kq.kqf->kqf_suppressed[kn->kn_qos_index];
 	}
 }
 
@@ -7100,9 +7438,14 @@ knote_dequeue(kqueue_t kqu, struct knote *kn)
 	}
 }
 
-/* called with kqueue lock held */
+/*
+ * called with kqueue lock held
+ *
+ * slot is the suppression queue of the processing thread for kqfiles
+ * (see kqfile_begin_processing), and is ignored for other kqueues.
+ */
 static void
-knote_suppress(kqueue_t kqu, struct knote *kn)
+knote_suppress(kqueue_t kqu, struct knote *kn, kq_index_t slot)
 {
 	struct kqtailq *suppressq;
 
@@ -7115,6 +7458,10 @@ knote_suppress(kqueue_t kqu, struct knote *kn)
 	/* deactivate - so new activations indicate a wakeup */
 	kn->kn_status &= ~KN_ACTIVE;
 	kn->kn_status |= KN_SUPPRESSED;
+	if ((kqu.kq->kq_state & (KQ_WORKQ | KQ_WORKLOOP)) == 0) {
+		/* reset by knote_unsuppress_noqueue() */
+		kn->kn_qos_index = slot;
+	}
 	suppressq = kqueue_get_suppressed_queue(kqu, kn);
 	TAILQ_INSERT_TAIL(suppressq, kn, kn_tqe);
 }
@@ -7822,7 +8169,7 @@ kqueue_process(kqueue_t kqu, int flags, kevent_ctx_t kectx,
 		rc = kqworkloop_begin_processing(kqu.kqwl, flags);
 	} else {
 kqfile_retry:
-		rc = kqfile_begin_processing(kqu.kqf);
+		rc = kqfile_begin_processing(kqu.kqf, flags, &kectx->kec_process_slot);
 		if (rc == EBADF) {
 			return EBADF;
 		}
@@ -7891,7 +8238,7 @@ stop_processing:
 	} else if (kq_type & KQ_WORKLOOP) {
 		rc = kqworkloop_end_processing(kqu.kqwl, KQ_PROCESSING, flags);
 	} else {
-		rc = kqfile_end_processing(kqu.kqf);
+		rc = kqfile_end_processing(kqu.kqf, flags, kectx->kec_process_slot);
 	}
 
 	if (__probable(error)) {
@@ -7934,8 +8281,8 @@ kqwl_bound_thread_park:
  * @discussion
  * Assumes we inherit a use/ref count on the kq or its fileglob.
  *
- * This is called by kqueue_scan if neither KEVENT_FLAG_POLL nor
- * KEVENT_FLAG_KERNEL was set, and the caller had to wait.
+ * This is called by kqueue_scan if none of KEVENT_FLAG_POLL,
+ * KEVENT_FLAG_KERNEL or KEVENT_FLAG_RING was set, and the caller had to wait.
  */
 OS_NORETURN OS_NOINLINE
 static void
@@ -7950,7 +8297,8 @@ kqueue_scan_continue(void *data, wait_result_t wait_result)
 	 * only kevent variants call in here, so we know the callback is
 	 * kevent_legacy_callback or kevent_modern_callback.
 	 */
-	assert((flags & (KEVENT_FLAG_POLL | KEVENT_FLAG_KERNEL)) == 0);
+	assert((flags & (KEVENT_FLAG_POLL | KEVENT_FLAG_KERNEL |
+	    KEVENT_FLAG_RING)) == 0);
 
 	switch (wait_result) {
 	case THREAD_AWAKENED:
@@ -7992,11 +8340,12 @@ kqueue_scan_continue(void *data, wait_result_t wait_result)
  * - unless KEVENT_FLAG_IMMEDIATE is set in kectx->kec_process_flags
  * - possibly until kectx->kec_deadline expires
  *
- * When it waits, and that neither KEVENT_FLAG_POLL nor KEVENT_FLAG_KERNEL
- * are set, then it will wait in the kqueue_scan_continue continuation.
+ * When it waits, and that none of KEVENT_FLAG_POLL, KEVENT_FLAG_KERNEL or
+ * KEVENT_FLAG_RING are set, then it will wait in the kqueue_scan_continue
+ * continuation.
  *
- * poll() will block in place, and KEVENT_FLAG_KERNEL calls
- * all pass KEVENT_FLAG_IMMEDIATE and will not wait.
+ * poll() and KEVENT_FLAG_RING callers will block in place, and
+ * KEVENT_FLAG_KERNEL calls all pass KEVENT_FLAG_IMMEDIATE and will not wait.
  *
  * @param kqu
  * The kqueue being scanned.
@@ -8039,7 +8388,8 @@ kqueue_scan(kqueue_t kqu, int flags, kevent_ctx_t kectx,
 		    kectx->kec_deadline);
 		kqunlock(kqu);
 
-		if (__probable((flags & (KEVENT_FLAG_POLL | KEVENT_FLAG_KERNEL)) == 0)) {
+		if (__probable((flags & (KEVENT_FLAG_POLL | KEVENT_FLAG_KERNEL |
+		    KEVENT_FLAG_RING)) == 0)) {
 			thread_block_parameter(kqueue_scan_continue, kqu.kqf);
 			__builtin_unreachable();
 		}
@@ -8237,6 +8587,378 @@ out:
 	return kevent_cleanup(kqu.kq, flags, error, kectx);
 }
 
+#pragma mark kevent shared ring
+
+/*
+ * Kernel state of a kqfile shared ring (KEVENT_FLAG_RING).
+ *
+ * Userspace can write anything in the shared mapping at any time,
+ * so the kernel keeps its own copy of the geometry and of the indexes
+ * it produces, and only publishes them to the ring.
+ *
+ * The submission queue is drained under kevr_sq_lock. The completion
+ * queue is only written by the thread owning kevr_harvesting.
+ */
+struct kevent_ring {
+	struct kevent_ring_s   *kevr_ring;          /* kernel mapping of the ring */
+	vm_size_t               kevr_size;          /* size of the mapping */
+	struct proc            *kevr_proc;          /* process charged for it */
+	uint32_t                kevr_entries;       /* entries in each queue */
+	uint32_t                kevr_sq_head;       /* protected by kevr_sq_lock */
+	uint32_t                kevr_cq_tail;       /* owned by the harvester */
+	uint32_t                kevr_harvesting;    /* a thread is harvesting */
+	lck_mtx_t               kevr_sq_lock;
+};
+
+static inline struct kevent_qos_s *
+kevent_ring_sq(struct kevent_ring *kring)
+{
+	return (struct kevent_qos_s *)(kring->kevr_ring + 1);
+}
+
+static inline struct kevent_qos_s *
+kevent_ring_cq(struct kevent_ring *kring)
+{
+	return kevent_ring_sq(kring) + kring->kevr_entries;
+}
+
+/*!
+ * @function kevent_ring_charge
+ *
+ * @brief
+ * Charges the wired memory of a ring to the process, within
+ * kevent_ring_max_bytes.
+ */
+static bool
+kevent_ring_charge(struct proc *p, vm_size_t size)
+{
+	struct filedesc *fdp = &p->p_fd;
+	uint32_t pages = (uint32_t)atop(size);
+	uint32_t limit = (uint32_t)atop(kevent_ring_max_bytes);
+
+	return os_atomic_rmw_loop(&fdp->fd_kqring_pages, ov, nv, relaxed, {
+		if (pages > limit - MIN(ov, limit)) {
+		        os_atomic_rmw_loop_give_up(return false);
+		}
+		nv = ov + pages;
+	});
+}
+
+static void
+kevent_ring_uncharge(struct proc *p, vm_size_t size)
+{
+	os_atomic_sub(&p->p_fd.fd_kqring_pages, (uint32_t)atop(size), relaxed);
+}
+
+static void
+kevent_ring_free(struct kevent_ring *kring)
+{
+	lck_mtx_destroy(&kring->kevr_sq_lock, &kq_lck_grp);
+	kmem_free(kernel_map, (vm_offset_t)kring->kevr_ring, kring->kevr_size);
+	kevent_ring_uncharge(kring->kevr_proc, kring->kevr_size);
+	kfree_type(struct kevent_ring, kring);
+}
+
+/*!
+ * @function kevent_ring_create
+ *
+ * @brief
+ * Allocate the shared ring of a kqfile and map it in the current process.
+ *
+ * @discussion
+ * The ring is wired kernel memory shared with the process, so that
+ * completions can be posted without faulting from knote processing.
+ *
+ * Since kqueues are confined to their process, the rings are charged to it
+ * until the kqueue is destroyed, and fail with ENOMEM beyond
+ * kevent_ring_max_bytes (the user mapping outlives the kqueue, but only
+ * holds the pages of a ring until the process deallocates it).
+ */
+static int
+kevent_ring_create(struct kqfile *kqf, int entries, user_addr_t uaddr)
+{
+	vm_map_t user_map = current_map();
+	mach_vm_offset_t user_addr = 0;
+	struct kevent_ring_s *ring;
+	struct kevent_ring *kring;
+	memory_object_size_t mo_size;
+	mach_port_t mem_entry;
+	vm_offset_t addr;
+	vm_size_t size;
+	kern_return_t kr;
+	int error;
+
+	if (entries <= 0 || entries > KEVENT_RING_MAX_ENTRIES ||
+	    (entries & (entries - 1))) {
+		return EINVAL;
+	}
+	if (os_atomic_load(&kqf->kqf_ring, relaxed)) {
+		return EEXIST;
+	}
+
+	size = round_page(sizeof(struct kevent_ring_s) +
+	    2 * (vm_size_t)entries * sizeof(struct kevent_qos_s));
+	if (!kevent_ring_charge(kqf->kqf_p, size)) {
+		return ENOMEM;
+	}
+	kr = kmem_alloc(kernel_map, &addr, size, KMA_DATA | KMA_ZERO,
+	    VM_KERN_MEMORY_BSD);
+	if (kr != KERN_SUCCESS) {
+		kevent_ring_uncharge(kqf->kqf_p, size);
+		return ENOMEM;
+	}
+
+	ring = (struct kevent_ring_s *)addr;
+	ring->kr_entries   = (uint32_t)entries;
+	ring->kr_sq_offset = sizeof(struct kevent_ring_s);
+	ring->kr_cq_offset = (uint32_t)(sizeof(struct kevent_ring_s) +
+	    (size_t)entries * sizeof(struct kevent_qos_s));
+
+	mo_size = size;
+	kr = mach_make_memory_entry_64(kernel_map, &mo_size,
+	    (memory_object_offset_t)addr, VM_PROT_READ | VM_PROT_WRITE,
+	    &mem_entry, MACH_PORT_NULL);
+	if (kr == KERN_SUCCESS) {
+		kr = mach_vm_map_kernel(user_map, &user_addr, size, 0,
+		    VM_MAP_KERNEL_FLAGS_ANYWHERE(), mem_entry, 0, FALSE,
+		    VM_PROT_READ | VM_PROT_WRITE, VM_PROT_READ | VM_PROT_WRITE,
+		    VM_INHERIT_NONE);
+		mach_memory_entry_port_release(mem_entry);
+	}
+	if (kr != KERN_SUCCESS) {
+		kmem_free(kernel_map, addr, size);
+		kevent_ring_uncharge(kqf->kqf_p, size);
+		return mach_to_bsd_errno(kr);
+	}
+
+	kring = kalloc_type(struct kevent_ring, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	kring->kevr_ring    = ring;
+	kring->kevr_size    = size;
+	kring->kevr_proc    = kqf->kqf_p;
+	kring->kevr_entries = (uint32_t)entries;
+	lck_mtx_init(&kring->kevr_sq_lock, &kq_lck_grp, LCK_ATTR_NULL);
+
+	error = copyout(&user_addr, uaddr, vm_map_is_64bit(user_map) ? 8 : 4);
+	if (error == 0) {
+		kqlock(kqf);
+		if (kqf->kqf_ring == NULL) {
+			os_atomic_store(&kqf->kqf_ring, kring, release);
+			kring = NULL;
+		} else {
+			error = EEXIST;
+		}
+		kqunlock(kqf);
+	}
+	if (kring) {
+		mach_vm_deallocate(user_map, user_addr, size);
+		kevent_ring_free(kring);
+	}
+	return error;
+}
+
+/*!
+ * @function kevent_ring_cq_space
+ *
+ * @brief
+ * Returns how many completions can be posted before the ring is full.
+ */
+static uint32_t
+kevent_ring_cq_space(struct kevent_ring *kring)
+{
+	uint32_t head = os_atomic_load(&kring->kevr_ring->kr_cq_head, acquire);
+	uint32_t used = kring->kevr_cq_tail - head;
+
+	/* a head that isn't within the ring makes it look full */
+	return used >= kring->kevr_entries ? 0 : kring->kevr_entries - used;
+}
+
+/*!
+ * @function kevent_ring_post
+ *
+ * @brief
+ * Post a completion to the shared ring, returns false if it was full.
+ *
+ * @discussion
+ * The caller must own kevr_harvesting.
+ */
+static bool
+kevent_ring_post(struct kevent_ring *kring, struct kevent_qos_s *kevp)
+{
+	uint32_t tail = kring->kevr_cq_tail;
+
+	if (kevent_ring_cq_space(kring) == 0) {
+		return false;
+	}
+	kevent_ring_cq(kring)[tail & (kring->kevr_entries - 1)] = *kevp;
+	kring->kevr_cq_tail = tail + 1;
+	os_atomic_store(&kring->kevr_ring->kr_cq_tail, tail + 1, release);
+	return true;
+}
+
+/*!
+ * @function kevent_ring_callback
+ *
+ * @brief
+ * Callback for each event harvested into the shared ring.
+ */
+static int
+kevent_ring_callback(struct kevent_qos_s *kevp, kevent_ctx_t kectx)
+{
+	assert(kectx->kec_process_noutputs < kectx->kec_process_nevents);
+
+	/*
+	 * kec_process_nevents was sized from the free space in the ring,
+	 * this can only fail if userspace moved the head backwards.
+	 */
+	if (!kevent_ring_post(kectx->kec_process_ring, kevp)) {
+		return EWOULDBLOCK;
+	}
+	if (++kectx->kec_process_noutputs == kectx->kec_process_nevents) {
+		return EWOULDBLOCK;
+	}
+	return 0;
+}
+
+/*!
+ * @function kevent_ring_submit
+ *
+ * @brief
+ * Register all the kevents posted to the submission queue.
+ *
+ * @discussion
+ * Receipts and errors are posted to the completion queue when the caller
+ * owns it and there is room, like kevent_internal() does for its event list.
+ * Otherwise the first error is returned.
+ *
+ * An EV_RECEIPT entry always needs a completion, so draining stops right
+ * before it when it can't be posted: EAGAIN is returned when another thread
+ * owns the completion queue, ENOSPC when it is full. The entry stays in the
+ * submission queue and is registered by a later call.
+ */
+static int
+kevent_ring_submit(struct kqueue *kq, struct kevent_ring *kring,
+    bool harvest, int *noutputs)
+{
+	struct kevent_qos_s *sq = kevent_ring_sq(kring);
+	uint32_t mask = kring->kevr_entries - 1;
+	uint32_t head, tail;
+	int error = 0;
+
+	lck_mtx_lock(&kring->kevr_sq_lock);
+
+	head = kring->kevr_sq_head;
+	tail = os_atomic_load(&kring->kevr_ring->kr_sq_tail, acquire);
+	if (tail - head > kring->kevr_entries) {
+		error = EINVAL;
+	}
+
+	while (error == 0 && head != tail) {
+		/* snapshot the kevent, userspace can still write to the slot */
+		struct kevent_qos_s kev = sq[head & mask];
+		struct knote *kn = NULL;
+		__assert_only int register_rc;
+
+		if (kev.flags & EV_RECEIPT) {
+			if (!harvest) {
+				error = EAGAIN;
+				break;
+			}
+			if (kevent_ring_cq_space(kring) == 0) {
+				error = ENOSPC;
+				break;
+			}
+		}
+		head++;
+
+		/* Make sure user doesn't pass in any system flags */
+		kev.flags &= ~EV_SYSFLAGS;
+
+		register_rc = kevent_register(kq, &kev, &kn);
+		assert((register_rc & FILTER_REGISTER_WAIT) == 0);
+
+		if (kev.flags & (EV_ERROR | EV_RECEIPT)) {
+			if ((kev.flags & EV_ERROR) == 0) {
+				kev.flags |= EV_ERROR;
+				kev.data = 0;
+			}
+			if (harvest && kevent_ring_post(kring, &kev)) {
+				(*noutputs)++;
+			} else {
+				error = (int)kev.data;
+			}
+		}
+	}
+
+	kring->kevr_sq_head = head;
+	os_atomic_store(&kring->kevr_ring->kr_sq_head, head, release);
+
+	lck_mtx_unlock(&kring->kevr_sq_lock);
+	return error;
+}
+
+/*!
+ * @function kevent_ring_internal
+ *
+ * @brief
+ * The KEVENT_FLAG_RING variant of kevent_qos().
+ *
+ * @discussion
+ * Creates the ring if an event list is passed, otherwise drains the
+ * submission queue and harvests triggered events into the completion queue.
+ *
+ * Only one thread at a time harvests into the completion queue. Other
+ * callers only drain the submission queue and return right away: the
+ * events they would have harvested will be posted by the thread already
+ * doing so.
+ *
+ * The caller is giving kevent_ring_internal a usecount on the fileglob
+ * of the kqfile that needs to be cleaned up by kevent_cleanup().
+ */
+OS_NOINLINE
+static int
+kevent_ring_internal(struct kqueue *kq, user_addr_t ueventlist, int nevents,
+    int flags, kevent_ctx_t kectx, int32_t *retval)
+{
+	struct kqfile *kqf = (struct kqfile *)kq;
+	struct kevent_ring *kring;
+	int error = 0, noutputs = 0;
+	bool harvest;
+
+	if (ueventlist != USER_ADDR_NULL) {
+		error = kevent_ring_create(kqf, nevents, ueventlist);
+		goto out;
+	}
+
+	kring = os_atomic_load(&kqf->kqf_ring, acquire);
+	if (kring == NULL) {
+		error = EINVAL;
+		goto out;
+	}
+
+	harvest = os_atomic_cmpxchg(&kring->kevr_harvesting, 0, 1, acquire);
+	error = kevent_ring_submit(kq, kring, harvest, &noutputs);
+
+	if (harvest) {
+		if (error == 0 && noutputs == 0) {
+			kectx->kec_process_flags = flags;
+			kectx->kec_process_nevents = (int)kevent_ring_cq_space(kring);
+			kectx->kec_process_noutputs = 0;
+			kectx->kec_process_ring = kring;
+
+			/* a full ring must be consumed before harvesting more */
+			if (kectx->kec_process_nevents) {
+				error = kqueue_scan(kq, flags, kectx, kevent_ring_callback);
+			}
+			noutputs = kectx->kec_process_noutputs;
+		}
+		os_atomic_store(&kring->kevr_harvesting, 0, release);
+	}
+
+	*retval = noutputs;
+out:
+	return kevent_cleanup(kq, flags, error, kectx);
+}
+
 #pragma mark modern syscalls: kevent_qos, kevent_id, kevent_workq_internal
 
 /*!
@@ -8277,8 +8999,8 @@ kevent_id(struct proc *p, struct kevent_id_args *uap, int32_t *retval)
 	flags = kevent_adjust_flags_for_proc(p, flags);
 	flags |= KEVENT_FLAG_DYNAMIC_KQUEUE;
 
-	if (__improbable((flags & (KEVENT_FLAG_WORKQ | KEVENT_FLAG_WORKLOOP)) !=
-	    KEVENT_FLAG_WORKLOOP)) {
+	if (__improbable((flags & (KEVENT_FLAG_WORKQ | KEVENT_FLAG_WORKLOOP |
+	    KEVENT_FLAG_RING)) != KEVENT_FLAG_WORKLOOP)) {
 		return EINVAL;
 	}
 
@@ -8413,6 +9135,13 @@ kevent_qos(struct proc *p, struct kevent_qos_args *uap, int32_t *retval)
 		return EINVAL;
 	}
 
+	/* the ring replaces the change and event lists, and only exists on kqfiles */
+	if (__improbable(flags & KEVENT_FLAG_RING) &&
+	    ((flags & KEVENT_FLAG_WORKQ) || uap->nchanges ||
+	    uap->data_out != USER_ADDR_NULL)) {
+		return EINVAL;
+	}
+
 	flags = kevent_adjust_flags_for_proc(p, flags);
 
 	error = kevent_get_data_size(flags, uap->data_available, uap->data_out, kectx);
@@ -8435,6 +9164,11 @@ kevent_qos(struct proc *p, struct kevent_qos_args *uap, int32_t *retval)
 		return error;
 	}
 
+	if (__improbable(flags & KEVENT_FLAG_RING)) {
+		return kevent_ring_internal(kq, uap->eventlist, uap->nevents,
+		           flags, kectx, retval);
+	}
+
 	return kevent_modern_internal(kq, uap->changelist, uap->nchanges,
 	           uap->eventlist, uap->nevents, flags, kectx, retval);
 }
@@ -8570,6 +9304,10 @@ int
 kevent64(struct proc *p, struct kevent64_args *uap, int32_t *retval)
 {
 	int flags = (uap->flags & KEVENT_FLAG_USER) | KEVENT_FLAG_LEGACY64;
+
+	if (__improbable(flags & KEVENT_FLAG_RING)) {
+		return EINVAL;
+	}
 	return kevent_legacy_internal(p, uap, retval, flags);
 }
 
@@ -9337,6 +10075,7 @@ kevent_copyout_proc_dynkqids(void *proc, user_addr_t ubuf, uint32_t ubufsize,
 {
 	proc_t p = (proc_t)proc;
 	struct filedesc *fdp = &p->p_fd;
+	struct kqworkloop *kqwl;
 	unsigned int nkqueues = 0;
 	unsigned long ubuflen = ubufsize / sizeof(kqueue_id_t);
 	size_t buflen, bufsize;
@@ -9364,38 +10103,20 @@ kevent_copyout_proc_dynkqids(void *proc, user_addr_t ubuf, uint32_t ubufsize,
 		}
 	}
 
-	kqhash_lock(fdp);
-
-	u_long kqhashmask = fdp->fd_kqhashmask;
-	if (kqhashmask > 0) {
-		for (uint32_t i = 0; i < kqhashmask + 1; i++) {
-			struct kqworkloop *kqwl;
-
-			LIST_FOREACH(kqwl, &fdp->fd_kqhash[i], kqwl_hashlink) {
-				/* report the number of kqueues, even if they don't all fit */
-				if (nkqueues < buflen) {
-					kq_ids[nkqueues] = kqwl->kqwl_dynamicid;
-				}
-				nkqueues++;
-			}
-
-			/*
-			 * Drop the kqhash lock and take it again to give some breathing room
-			 */
-			kqhash_unlock(fdp);
-			kqhash_lock(fdp);
-
-			/*
-			 * Reevaluate to see if we have raced with someone who changed this -
-			 * if we have, we should bail out with the set of info captured so far
-			 */
-			if (fdp->fd_kqhashmask != kqhashmask) {
-				break;
-			}
+	/*
+	 * Enumerate without the kqhash lock: this might observe workloops
+	 * being destroyed, or twice if the table is being resized,
+	 * which is fine for a snapshot.
+	 */
+	smr_proc_task_enter();
+	smr_hash_foreach(kqwl, &fdp->fd_kqhash, &kqworkloop_hash_traits) {
+		/* report the number of kqueues, even if they don't all fit */
+		if (nkqueues < buflen) {
+			kq_ids[nkqueues] = kqwl->kqwl_dynamicid;
 		}
+		nkqueues++;
 	}
-
-	kqhash_unlock(fdp);
+	smr_proc_task_leave();
 
 	if (kq_ids) {
 		size_t copysize;
@@ -9637,26 +10358,15 @@ kevent_proc_copy_uptrs(void *proc, uint64_t *buf, uint32_t bufsize)
 	}
 	knhash_unlock(fdp);
 
-	kqhash_lock(fdp);
-	size = fdp->fd_kqhashmask;
-
-	if (size != 0) {
-		for (size_t i = 0; i < size + 1; i++) {
-			LIST_FOREACH(kqwl, &fdp->fd_kqhash[i], kqwl_hashlink) {
-				if (nuptrs < buflen) {
-					buf[nuptrs] = kqwl->kqwl_dynamicid;
-				}
-				nuptrs++;
-			}
-
-			kqhash_unlock(fdp);
-			kqhash_lock(fdp);
-			if (size != fdp->fd_kqhashmask) {
-				break;
-			}
+	/* see kevent_copyout_proc_dynkqids() */
+	smr_proc_task_enter();
+	smr_hash_foreach(kqwl, &fdp->fd_kqhash, &kqworkloop_hash_traits) {
+		if (nuptrs < buflen) {
+			buf[nuptrs] = kqwl->kqwl_dynamicid;
 		}
+		nuptrs++;
 	}
-	kqhash_unlock(fdp);
+	smr_proc_task_leave();
 
 	return (int)nuptrs;
 }
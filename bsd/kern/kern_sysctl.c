@@ -122,6 +122,8 @@
 #include <mach/vm_param.h>
 #include <kern/debug.h>
 #include <kern/mach_param.h>
+#include <kern/ledger.h>
+#include <kern/lock_stat.h>
 #include <kern/task.h>
 #include <kern/thread.h>
 #include <kern/thread_group.h>
@@ -4437,6 +4439,14 @@ SYSCTL_PROC(_vm, OID_AUTO, task_no_footprint_for_debug,
     CTLTYPE_INT | CTLFLAG_RW | CTLFLAG_LOCKED | CTLFLAG_ANYBODY,
     0, 0, &sysctl_rw_task_no_footprint_for_debug, "I", "Allow debug memory to be excluded from this task's memory footprint (debug only)");
 
+/* How often updates of per-CPU sharded ledger entries avoid the entry. */
+SYSCTL_SCALABLE_COUNTER(_debug, ledger_shard_staged, ledger_shard_staged,
+    "Updates of sharded ledger entries kept in a per-CPU shard");
+SYSCTL_SCALABLE_COUNTER(_debug, ledger_shard_folded, ledger_shard_folded,
+    "Updates of sharded ledger entries folding a full shard");
+SYSCTL_SCALABLE_COUNTER(_debug, ledger_shard_bypassed, ledger_shard_bypassed,
+    "Updates of sharded ledger entries applied directly near a limit");
+
 #endif /* DEVELOPMENT || DEBUG */
 
 
@@ -4999,6 +5009,30 @@ SYSCTL_SCALABLE_COUNTER(_debug, oslog_e_trace_mode_error_count, oslog_e_trace_mo
     "Number of failed exclaves trace mode updates");
 #endif // CONFIG_EXCLAVES
 
+SYSCTL_SCALABLE_COUNTER(_debug, lck_rw_adaptive_spin_extended, lck_rw_adaptive_spin_extended,
+    "Number of rw lock spins extended because the owner was on core");
+SYSCTL_SCALABLE_COUNTER(_debug, lck_rw_adaptive_spin_off_core, lck_rw_adaptive_spin_off_core,
+    "Number of rw lock spins cut short because the owner was off core");
+SYSCTL_SCALABLE_COUNTER(_debug, lck_rw_br_read_fast, lck_rw_br_read_fast,
+    "Number of big reader lock shared acquisitions on the per-cpu fast path");
+SYSCTL_SCALABLE_COUNTER(_debug, lck_rw_br_read_slow, lck_rw_br_read_slow,
+    "Number of big reader lock shared acquisitions that raced with a writer");
+SYSCTL_SCALABLE_COUNTER(_debug, lck_rw_br_write_drain_block, lck_rw_br_write_drain_block,
+    "Number of big reader lock writers that blocked waiting for readers");
+
+SCALABLE_COUNTER_DECLARE(sched_ipi_batch_coalesced);
+
+SYSCTL_SCALABLE_COUNTER(_debug, sched_ipi_batch_coalesced, sched_ipi_batch_coalesced,
+    "Number of scheduler IPIs saved by batched wakeups");
+
+SCALABLE_COUNTER_DECLARE(ipc_kmsg_cache_hits);
+SCALABLE_COUNTER_DECLARE(ipc_kmsg_cache_misses);
+
+SYSCTL_SCALABLE_COUNTER(_debug, ipc_kmsg_cache_hits, ipc_kmsg_cache_hits,
+    "Number of kmsg allocations served from the per-cpu kmsg cache");
+SYSCTL_SCALABLE_COUNTER(_debug, ipc_kmsg_cache_misses, ipc_kmsg_cache_misses,
+    "Number of cacheable kmsg allocations that found the per-cpu kmsg cache empty");
+
 #endif /* DEVELOPMENT || DEBUG */
 
 /*
@@ -58,6 +58,7 @@
 #include <kern/turnstile.h>
 #include <kern/zalloc.h>
 #include <kern/debug.h>
+#include <kern/smr_hash.h>
 
 #include <vm/vm_map_xnu.h>
 
@@ -90,6 +91,25 @@
  * ownership/priority boost to the new thread.  Instead, it selects the
  * waiting thread with the highest base priority to be woken next, and
  * relies on that thread to carry the torch for the other waiting threads.
+ *
+ * How UL_RW_LOCK promotion works:
+ *
+ * Readers and writers block on two different turnstiles of the same ull,
+ * which both push on the same thread, tracked in ull_owner: the writer named
+ * in the lock word when it is held exclusive, or one of the readers holding
+ * it otherwise.
+ *
+ * Since a turnstile only has one inheritor, readers are boosted one at a
+ * time: the kernel remembers up to ULL_RW_READERS_MAX readers it knows hold
+ * the lock (the ones it woke up, and the ones waiters found named in the lock
+ * word), and pushes on one of them. Readers that drop the lock while waiters
+ * are pending call into ulock_wake(), which moves the push to another reader
+ * still holding the lock.
+ *
+ * When the lock is released, a waiting writer is preferred: the highest
+ * priority writer is woken and inherits the push of all the remaining
+ * waiters, like for UL_UNFAIR_LOCK. Readers are only woken, all at once,
+ * when no writer is waiting.
  */
 
 static LCK_GRP_DECLARE(ull_lck_grp, "ulocks");
@@ -119,6 +139,17 @@ typedef lck_spin_t ull_lock_t;
 #define ULOCK_TO_EVENT(ull)   ((event_t)ull)
 #define EVENT_TO_ULOCK(event) ((ull_t *)event)
 
+/*
+ * UL_RW_LOCK writers wait on their own turnstile, which needs a proprietor
+ * distinct from the readers' one. The event is the same for both.
+ */
+#define ULOCK_TO_PROPRIETOR(ull, flags) \
+	((uintptr_t)(ull) + (((flags) & ULF_WAIT_RW_WRITER) ? 1 : 0))
+#define ULOCK_TO_TURNSTILE_FIELD(ull, flags) \
+	(((flags) & ULF_WAIT_RW_WRITER) ? &(ull)->ull_rw_wturnstile : &(ull)->ull_turnstile)
+
+#define ULL_RW_READERS_MAX      4
+
 typedef enum {
 	ULK_INVALID = 0,
 	ULK_UADDR,
@@ -172,12 +203,21 @@ typedef struct ull {
 	thread_t        ull_owner; /* holds +1 thread reference */
 	ulk_t           ull_key;
 	ull_lock_t      ull_lock;
-	uint            ull_bucket_index;
 	int32_t         ull_nwaiters;
 	int32_t         ull_refcount;
 	uint8_t         ull_opcode;
+	bool            ull_unhashed; /* no longer found by lookups */
+	uint8_t         ull_rw_nreaders;  /* UL_RW_LOCK: valid ull_rw_readers */
+	int32_t         ull_rw_nwriters;  /* UL_RW_LOCK: waiters that are writers */
 	struct turnstile *ull_turnstile;
-	queue_chain_t   ull_hash_link;
+	struct turnstile *ull_rw_wturnstile; /* UL_RW_LOCK: writers turnstile */
+	/* UL_RW_LOCK: readers known to hold the lock, each holds a +1 reference */
+	thread_t        ull_rw_readers[ULL_RW_READERS_MAX];
+	struct smrq_slink ull_hash_link;
+	struct smr_node ull_smr_node;
+#if DEVELOPMENT || DEBUG
+	queue_chain_t   ull_debug_link;
+#endif /* DEVELOPMENT || DEBUG */
 } ull_t;
 
 #define ULL_MUST_EXIST  0x0001
@@ -215,66 +255,129 @@ ull_dump(ull_t *ull)
 	kprintf("ull_opcode\t%d\n\n", ull->ull_opcode);
 	kprintf("ull_owner\t0x%llx\n\n", thread_tid(ull->ull_owner));
 	kprintf("ull_turnstile\t%p\n\n", ull->ull_turnstile);
+	if (ull->ull_opcode == UL_RW_LOCK) {
+		kprintf("ull_rw_wturnstile\t%p\n", ull->ull_rw_wturnstile);
+		kprintf("ull_rw_nwriters\t%d\n", ull->ull_rw_nwriters);
+		kprintf("ull_rw_nreaders\t%d\n\n", ull->ull_rw_nreaders);
+	}
 }
 #endif
 
-typedef struct ull_bucket {
-	queue_head_t ulb_head;
-#if ULL_TICKET_LOCK
-	lck_ticket_t ulb_lock;
-#else
-	lck_spin_t   ulb_lock;
-#endif /* ULL_TICKET_LOCK */
-} ull_bucket_t;
-
-static SECURITY_READ_ONLY_LATE(int) ull_hash_buckets;
-static SECURITY_READ_ONLY_LATE(ull_bucket_t *) ull_bucket;
+/*
+ * ulocks are kept in a scalable SMR hash table: lookups are lock free,
+ * insertions and removals only take the per-bucket lock, and the table
+ * grows (or reseeds) in the background as the number of ulocks in use
+ * changes.
+ *
+ * A ull is "hashed" from its creation until its last waiter leaves,
+ * at which point ull_unhashed is set under the ull lock, and lookups
+ * stop returning it. It is removed from the table in ull_put() once
+ * the last reference is dropped, and freed after an SMR grace period.
+ */
+static struct smr_shash ull_hash;
 static uint32_t ull_nzalloc = 0;
 static KALLOC_TYPE_DEFINE(ull_zone, ull_t, KT_DEFAULT);
 
-#if ULL_TICKET_LOCK
-#define ull_bucket_lock(i)       lck_ticket_lock(&ull_bucket[i].ulb_lock, &ull_lck_grp)
-#define ull_bucket_unlock(i)     lck_ticket_unlock(&ull_bucket[i].ulb_lock)
-#else
-#define ull_bucket_lock(i)       lck_spin_lock_grp(&ull_bucket[i].ulb_lock, &ull_lck_grp)
-#define ull_bucket_unlock(i)     lck_spin_unlock(&ull_bucket[i].ulb_lock)
-#endif /* ULL_TICKET_LOCK */
-static __inline__ uint32_t
-ull_hash_index(const void *key, size_t length)
+static uint32_t ull_hash_key_hash(smrh_key_t key, uint32_t seed);
+static bool     ull_hash_key_equ(smrh_key_t k1, smrh_key_t k2);
+static uint32_t ull_hash_obj_hash(const struct smrq_slink *link, uint32_t seed);
+static bool     ull_hash_obj_equ(const struct smrq_slink *link, smrh_key_t key);
+static bool     ull_hash_obj_try_get(void *ull);
+
+SMRH_TRAITS_DEFINE(ull_hash_traits, ull_t, ull_hash_link,
+    .domain      = &smr_proc_task,
+    .key_hash    = ull_hash_key_hash,
+    .key_equ     = ull_hash_key_equ,
+    .obj_hash    = ull_hash_obj_hash,
+    .obj_equ     = ull_hash_obj_equ,
+    .obj_try_get = ull_hash_obj_try_get);
+
+#if DEVELOPMENT || DEBUG
+/*
+ * The SMR hash table can't be enumerated,
+ * keep all ulocks on a list for ull_hash_dump().
+ */
+static LCK_SPIN_DECLARE(ull_debug_lock, &ull_lck_grp);
+static queue_head_t ull_debug_queue = QUEUE_HEAD_INITIALIZER(ull_debug_queue);
+#endif /* DEVELOPMENT || DEBUG */
+
+static inline smrh_key_t
+ull_hash_key(const ulk_t *key)
 {
-	uint32_t hash = os_hash_jenkins(key, length);
+	return (smrh_key_t){
+		       .smrk_opaque = key,
+		       .smrk_len    = key->ulk_key_type == ULK_UADDR ?
+		   ULK_UADDR_LEN : ULK_XPROC_LEN,
+	};
+}
 
-	hash &= (ull_hash_buckets - 1);
+static uint32_t
+ull_hash_key_hash(smrh_key_t key, uint32_t seed)
+{
+	return os_hash_jenkins(key.smrk_opaque, key.smrk_len, seed);
+}
 
-	return hash;
+static bool
+ull_hash_key_equ(smrh_key_t k1, smrh_key_t k2)
+{
+	return ull_key_match(__DECONST(ulk_t *, k1.smrk_opaque),
+	           __DECONST(ulk_t *, k2.smrk_opaque));
 }
 
-#define ULL_INDEX(keyp) ull_hash_index(keyp, keyp->ulk_key_type == ULK_UADDR ? ULK_UADDR_LEN : ULK_XPROC_LEN)
+static uint32_t
+ull_hash_obj_hash(const struct smrq_slink *link, uint32_t seed)
+{
+	const ull_t *ull = __container_of(link, ull_t, ull_hash_link);
 
-static void
-ulock_initialize(void)
+	/* ull_key never changes while the ull is in the table */
+	return ull_hash_key_hash(ull_hash_key(&ull->ull_key), seed);
+}
+
+static bool
+ull_hash_obj_equ(const struct smrq_slink *link, smrh_key_t key)
 {
-	assert(thread_max > 16);
-	/* Size ull_hash_buckets based on thread_max.
-	 * Round up to nearest power of 2, then divide by 4
-	 */
-	ull_hash_buckets = (1 << (bit_ceiling(thread_max) - 2));
+	const ull_t *ull = __container_of(link, ull_t, ull_hash_link);
 
-	kprintf("%s>thread_max=%d, ull_hash_buckets=%d\n", __FUNCTION__, thread_max, ull_hash_buckets);
-	assert(ull_hash_buckets >= thread_max / 4);
+	/*
+	 * Skip ulocks on their way out, so that lookups find the ull
+	 * that replaced them for the same key. ull_hash_obj_try_get()
+	 * checks again under the ull lock.
+	 */
+	if (os_atomic_load(&ull->ull_unhashed, relaxed)) {
+		return false;
+	}
+	return ull_hash_key_equ(ull_hash_key(&ull->ull_key), key);
+}
 
-	ull_bucket = zalloc_permanent(sizeof(ull_bucket_t) * ull_hash_buckets,
-	    ZALIGN_PTR);
-	assert(ull_bucket != NULL);
+/*
+ * Takes a reference on a ull found in the hash table.
+ *
+ * On success, the ull is returned locked.
+ */
+static bool
+ull_hash_obj_try_get(void *obj)
+{
+	ull_t *ull = obj;
 
-	for (int i = 0; i < ull_hash_buckets; i++) {
-		queue_init(&ull_bucket[i].ulb_head);
-#if ULL_TICKET_LOCK
-		lck_ticket_init(&ull_bucket[i].ulb_lock, &ull_lck_grp);
-#else
-		lck_spin_init(&ull_bucket[i].ulb_lock, &ull_lck_grp, NULL);
-#endif /* ULL_TICKET_LOCK */
+	ull_lock(ull);
+	if (ull->ull_unhashed) {
+		ull_unlock(ull);
+		return false;
 	}
+	ull->ull_refcount++;
+	return true;
+}
+
+static void
+ulock_initialize(void)
+{
+	assert(thread_max > 16);
+	/*
+	 * Size the hash table based on thread_max, divided by 4,
+	 * it grows on demand from there.
+	 */
+	kprintf("%s>thread_max=%d\n", __FUNCTION__, thread_max);
+	smr_shash_init(&ull_hash, SMRSH_BALANCED_NOSHRINK, thread_max / 4);
 }
 STARTUP(EARLY_BOOT, STARTUP_RANK_FIRST, ulock_initialize);
 
@@ -286,27 +389,24 @@ static int
 ull_hash_dump(task_t task)
 {
 	int count = 0;
+	ull_t *elem;
+
 	if (task == TASK_NULL) {
 		kprintf("%s>total number of ull_t allocated %d\n", __FUNCTION__, ull_nzalloc);
 		kprintf("%s>BEGIN\n", __FUNCTION__);
 	}
-	for (int i = 0; i < ull_hash_buckets; i++) {
-		ull_bucket_lock(i);
-		if (!queue_empty(&ull_bucket[i].ulb_head)) {
-			ull_t *elem;
-			if (task == TASK_NULL) {
-				kprintf("%s>index %d:\n", __FUNCTION__, i);
-			}
-			qe_foreach_element(elem, &ull_bucket[i].ulb_head, ull_hash_link) {
-				if ((task == TASK_NULL) || ((elem->ull_key.ulk_key_type == ULK_UADDR)
-				    && (task == elem->ull_key.ulk_task))) {
-					ull_dump(elem);
-					count++;
-				}
-			}
+	lck_spin_lock_grp(&ull_debug_lock, &ull_lck_grp);
+	qe_foreach_element(elem, &ull_debug_queue, ull_debug_link) {
+		if (os_atomic_load(&elem->ull_unhashed, relaxed)) {
+			continue;
+		}
+		if ((task == TASK_NULL) || ((elem->ull_key.ulk_key_type == ULK_UADDR)
+		    && (task == elem->ull_key.ulk_task))) {
+			ull_dump(elem);
+			count++;
 		}
-		ull_bucket_unlock(i);
 	}
+	lck_spin_unlock(&ull_debug_lock);
 	if (task == TASK_NULL) {
 		kprintf("%s>END\n", __FUNCTION__);
 		ull_nzalloc = 0;
@@ -323,13 +423,17 @@ ull_alloc(ulk_t *key)
 
 	ull->ull_refcount = 1;
 	ull->ull_key = *key;
-	ull->ull_bucket_index = ULL_INDEX(key);
+	ull->ull_unhashed = false;
 	ull->ull_nwaiters = 0;
 	ull->ull_opcode = 0;
 
 	ull->ull_owner = THREAD_NULL;
 	ull->ull_turnstile = TURNSTILE_NULL;
 
+	ull->ull_rw_nreaders = 0;
+	ull->ull_rw_nwriters = 0;
+	ull->ull_rw_wturnstile = TURNSTILE_NULL;
+
 	ull_lock_init(ull);
 
 	ull_nzalloc++;
@@ -341,6 +445,8 @@ ull_free(ull_t *ull)
 {
 	assert(ull->ull_owner == THREAD_NULL);
 	assert(ull->ull_turnstile == TURNSTILE_NULL);
+	assert(ull->ull_rw_wturnstile == TURNSTILE_NULL);
+	assert(ull->ull_rw_nreaders == 0);
 
 	ull_assert_notwned(ull);
 
@@ -349,6 +455,12 @@ ull_free(ull_t *ull)
 	zfree(ull_zone, ull);
 }
 
+static void
+ull_free_smr(struct smr_node *node)
+{
+	ull_free(__container_of(node, ull_t, ull_smr_node));
+}
+
 /* Finds an existing ulock structure (ull_t), or creates a new one.
  * If MUST_EXIST flag is set, returns NULL instead of creating a new one.
  * The ulock structure is returned with ull_lock locked
@@ -356,51 +468,47 @@ ull_free(ull_t *ull)
 static ull_t *
 ull_get(ulk_t *key, uint32_t flags, ull_t **unused_ull)
 {
-	ull_t *ull = NULL;
-	uint i = ULL_INDEX(key);
-	ull_t *new_ull = (flags & ULL_MUST_EXIST) ? NULL : ull_alloc(key);
-	ull_t *elem;
-
-	ull_bucket_lock(i);
-	qe_foreach_element(elem, &ull_bucket[i].ulb_head, ull_hash_link) {
-		ull_lock(elem);
-		if (ull_key_match(&elem->ull_key, key)) {
-			ull = elem;
-			break;
-		} else {
-			ull_unlock(elem);
-		}
+	smrh_key_t hkey = ull_hash_key(key);
+	ull_t *new_ull;
+	ull_t *ull;
+
+	ull = smr_shash_get(&ull_hash, hkey, &ull_hash_traits);
+	if (ull != NULL || (flags & ULL_MUST_EXIST)) {
+		/* if ULL_MUST_EXIST is set (called from wake), ull may be NULL */
+		return ull; /* still locked */
 	}
-	if (ull == NULL) {
-		if (flags & ULL_MUST_EXIST) {
-			/* Must already exist (called from wake) */
-			ull_bucket_unlock(i);
-			assert(new_ull == NULL);
-			assert(unused_ull == NULL);
-			return NULL;
-		}
 
-		if (new_ull == NULL) {
-			/* Alloc above failed */
-			ull_bucket_unlock(i);
-			return NULL;
-		}
+	new_ull = ull_alloc(key);
+	if (new_ull == NULL) {
+		return NULL;
+	}
 
-		ull = new_ull;
-		ull_lock(ull);
-		enqueue(&ull_bucket[i].ulb_head, &ull->ull_hash_link);
-	} else if (!(flags & ULL_MUST_EXIST)) {
-		assert(new_ull);
+	/*
+	 * The new ull is locked and holds the reference for the caller
+	 * before it is published, lookups only see it once we unlock it.
+	 */
+	ull_lock(new_ull);
+	new_ull->ull_refcount++;
+
+	ull = smr_shash_get_or_insert(&ull_hash, hkey,
+	    &new_ull->ull_hash_link, &ull_hash_traits);
+	if (ull != NULL) {
+		/* Lost the race with another thread inserting the same key */
+		ull_unlock(new_ull);
+		new_ull->ull_refcount = 1;
 		assert(unused_ull);
 		assert(*unused_ull == NULL);
 		*unused_ull = new_ull;
+		return ull; /* still locked */
 	}
 
-	ull->ull_refcount++;
-
-	ull_bucket_unlock(i);
+#if DEVELOPMENT || DEBUG
+	lck_spin_lock_grp(&ull_debug_lock, &ull_lck_grp);
+	enqueue(&ull_debug_queue, &new_ull->ull_debug_link);
+	lck_spin_unlock(&ull_debug_lock);
+#endif /* DEVELOPMENT || DEBUG */
 
-	return ull; /* still locked */
+	return new_ull; /* still locked */
 }
 
 /*
@@ -411,18 +519,22 @@ ull_put(ull_t *ull)
 {
 	ull_assert_owned(ull);
 	int refcount = --ull->ull_refcount;
-	assert(refcount == 0 ? (ull->ull_key.ulk_key_type == ULK_INVALID) : 1);
+	assert(refcount == 0 ? ull->ull_unhashed : 1);
 	ull_unlock(ull);
 
 	if (refcount > 0) {
 		return;
 	}
 
-	ull_bucket_lock(ull->ull_bucket_index);
-	remqueue(&ull->ull_hash_link);
-	ull_bucket_unlock(ull->ull_bucket_index);
+	smr_shash_remove(&ull_hash, &ull->ull_hash_link, &ull_hash_traits);
+
+#if DEVELOPMENT || DEBUG
+	lck_spin_lock_grp(&ull_debug_lock, &ull_lck_grp);
+	remqueue(&ull->ull_debug_link);
+	lck_spin_unlock(&ull_debug_lock);
+#endif /* DEVELOPMENT || DEBUG */
 
-	ull_free(ull);
+	smr_proc_task_call(&ull->ull_smr_node, sizeof(ull_t), ull_free_smr);
 }
 
 
@@ -450,7 +562,7 @@ uaddr_findobj(user_addr_t uaddr, uint64_t *objectp, uint64_t *offsetp)
 }
 
 static void ulock_wait_continue(void *, wait_result_t);
-static void ulock_wait_cleanup(ull_t *, thread_t, thread_t, int32_t *);
+static void ulock_wait_cleanup(ull_t *, thread_t, thread_t, uint, int32_t *);
 
 inline static int
 wait_result_to_return_code(wait_result_t wr)
@@ -491,6 +603,326 @@ ulock_resolve_owner(uint32_t value, thread_t *owner)
 	return 0;
 }
 
+#pragma mark UL_RW_LOCK
+
+static inline uint32_t
+ulock_rw_readers(uint64_t value)
+{
+	return (uint32_t)((value & ULRW_READERS_MASK) >> ULRW_READERS_SHIFT);
+}
+
+static inline bool
+ulock_rw_held(uint64_t value)
+{
+	return (value & ULRW_WRITE_LOCKED) || ulock_rw_readers(value) != 0;
+}
+
+/*
+ * Returns the waiting bits of the lock word that are still
+ * relevant, shifted down so that they fit in the syscall return value.
+ *
+ * Must be called with ull_lock held
+ */
+static int32_t
+ulock_rw_waiters(ull_t *ull)
+{
+	uint64_t bits = 0;
+
+	if (ull->ull_rw_nwriters > 0) {
+		bits |= ULRW_WRITERS_WAITING;
+	}
+	if (ull->ull_nwaiters > ull->ull_rw_nwriters) {
+		bits |= ULRW_READERS_WAITING;
+	}
+	return (int32_t)(bits >> ULRW_WAITERS_SHIFT);
+}
+
+/*
+ * Remembers that a thread holds the lock shared,
+ * consumes a reference on the thread.
+ *
+ * Must be called with ull_lock held
+ */
+static void
+ulock_rw_reader_add(ull_t *ull, thread_t thread)
+{
+	for (uint i = 0; i < ull->ull_rw_nreaders; i++) {
+		if (ull->ull_rw_readers[i] == thread) {
+			thread_deallocate_safe(thread);
+			return;
+		}
+	}
+	if (ull->ull_rw_nreaders == ULL_RW_READERS_MAX) {
+		thread_deallocate_safe(thread);
+		return;
+	}
+	ull->ull_rw_readers[ull->ull_rw_nreaders++] = thread;
+}
+
+/*
+ * Must be called with ull_lock held
+ */
+static bool
+ulock_rw_reader_known(ull_t *ull, thread_t thread)
+{
+	for (uint i = 0; i < ull->ull_rw_nreaders; i++) {
+		if (ull->ull_rw_readers[i] == thread) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Must be called with ull_lock held
+ */
+static void
+ulock_rw_reader_remove(ull_t *ull, thread_t thread)
+{
+	for (uint i = 0; i < ull->ull_rw_nreaders; i++) {
+		if (ull->ull_rw_readers[i] == thread) {
+			ull->ull_rw_nreaders--;
+			ull->ull_rw_readers[i] = ull->ull_rw_readers[ull->ull_rw_nreaders];
+			ull->ull_rw_readers[ull->ull_rw_nreaders] = THREAD_NULL;
+			thread_deallocate_safe(thread);
+			return;
+		}
+	}
+}
+
+/*
+ * Must be called with ull_lock held
+ */
+static void
+ulock_rw_readers_clear(ull_t *ull)
+{
+	while (ull->ull_rw_nreaders > 0) {
+		thread_t thread;
+
+		ull->ull_rw_nreaders--;
+		thread = ull->ull_rw_readers[ull->ull_rw_nreaders];
+		ull->ull_rw_readers[ull->ull_rw_nreaders] = THREAD_NULL;
+		thread_deallocate_safe(thread);
+	}
+}
+
+/*
+ * Figures out which thread the waiters of a UL_RW_LOCK should push on,
+ * given the current value of the lock word.
+ *
+ * On success, *owner holds a +1 reference, or is THREAD_NULL if the
+ * lock is held shared by readers the kernel doesn't know about.
+ *
+ * Returns ESTALE if the lock isn't held, as nobody would wake the waiter up,
+ * and EOWNERDEAD if the writer named in the lock word isn't a thread.
+ *
+ * Must be called with ull_lock held
+ */
+static int
+ulock_rw_resolve_owner(ull_t *ull, uint64_t value, thread_t *owner)
+{
+	uint32_t owner_value = (uint32_t)(value & ULRW_OWNER_MASK);
+	thread_t reader = THREAD_NULL;
+	int ret;
+
+	*owner = THREAD_NULL;
+
+	if (value & ULRW_WRITE_LOCKED) {
+		/* whoever was known to hold the lock shared dropped it */
+		ulock_rw_readers_clear(ull);
+
+		ret = ulock_resolve_owner(owner_value, owner);
+		/* same as UL_UNFAIR_LOCK: tolerate MACH_PORT_DEAD */
+		return ret == EOWNERDEAD ? ret : 0;
+	}
+
+	if (ulock_rw_readers(value) == 0) {
+		return ESTALE;
+	}
+
+	if (owner_value != 0 && ulock_resolve_owner(owner_value, &reader) == 0) {
+		thread_reference(reader);
+		ulock_rw_reader_add(ull, reader);
+	}
+
+	if (ull->ull_owner != THREAD_NULL &&
+	    ulock_rw_reader_known(ull, ull->ull_owner)) {
+		/* keep pushing on the same reader */
+		thread_reference(ull->ull_owner);
+		*owner = ull->ull_owner;
+		if (reader != THREAD_NULL) {
+			thread_deallocate_safe(reader);
+		}
+	} else if (reader != THREAD_NULL) {
+		*owner = reader;
+	} else if (ull->ull_rw_nreaders > 0) {
+		thread_reference(ull->ull_rw_readers[0]);
+		*owner = ull->ull_rw_readers[0];
+	}
+	return 0;
+}
+
+/*
+ * Makes waiters on a UL_RW_LOCK turnstile push on a new thread.
+ *
+ * Must be called with ull_lock held
+ */
+static void
+ulock_rw_update_inheritor(struct turnstile *ts, thread_t owner)
+{
+	if (ts == TURNSTILE_NULL) {
+		return;
+	}
+
+	turnstile_update_inheritor(ts, owner,
+	    (TURNSTILE_IMMEDIATE_UPDATE | TURNSTILE_INHERITOR_THREAD));
+	turnstile_update_inheritor_complete(ts, TURNSTILE_INTERLOCK_HELD);
+}
+
+/*
+ * Wakes up every waiter of one class of a UL_RW_LOCK.
+ *
+ * Must be called with ull_lock held
+ */
+static void
+ulock_rw_wakeup_all(ull_t *ull, uint flags)
+{
+	struct turnstile *ts;
+
+	ts = turnstile_prepare(ULOCK_TO_PROPRIETOR(ull, flags),
+	    ULOCK_TO_TURNSTILE_FIELD(ull, flags), TURNSTILE_NULL, TURNSTILE_ULOCK);
+
+	waitq_wakeup64_all(&ts->ts_waitq, CAST_EVENT64_T(ULOCK_TO_EVENT(ull)),
+	    THREAD_AWAKENED, WAITQ_UPDATE_INHERITOR);
+	turnstile_update_inheritor_complete(ts, TURNSTILE_INTERLOCK_HELD);
+
+	turnstile_complete(ULOCK_TO_PROPRIETOR(ull, flags),
+	    ULOCK_TO_TURNSTILE_FIELD(ull, flags), NULL, TURNSTILE_ULOCK);
+}
+
+/*
+ * Called when a thread dropped a UL_RW_LOCK with waiters pending.
+ *
+ * If the lock is still held, a reader dropped it while others still hold it
+ * and the push moves to another reader. Otherwise a waiting writer is woken
+ * up and becomes the new push target, or if there are none, all the readers
+ * are woken up.
+ *
+ * Returns the previous push target in *cleanup_thread, with a reference
+ * to drop once the interlock is dropped.
+ *
+ * Must be called with ull_lock held, which is dropped and retaken when the
+ * lock word needs to be faulted in.
+ */
+static int
+ulock_rw_wake(ull_t *ull, user_addr_t addr, uint flags, thread_t *cleanup_thread)
+{
+	thread_t self = current_thread();
+	thread_t new_owner = THREAD_NULL;
+	struct turnstile *ts;
+	uint64_t value;
+	int ret;
+
+	/*
+	 * Holding the ull spinlock makes copyin fail rather than fault
+	 * (see sys_ulock_wait2()).  Unlike a waiter, the waker can't just
+	 * return and let user space fault the page in: the waiters would
+	 * never be woken up.  Fault it in without the lock and try again.
+	 *
+	 * Our reference keeps the ull alive, but its last waiter may have
+	 * left meanwhile, in which case a new ull may already stand for
+	 * the same lock: like ull_get() failing, there's no one to wake.
+	 */
+	while ((ret = copyin_atomic64(addr, &value)) == EFAULT) {
+		ull_unlock(ull);
+		ret = copyin(addr, &value, sizeof(value));
+		ull_lock(ull);
+		if (ret != 0) {
+			return ret;
+		}
+		if (ull->ull_unhashed || ull->ull_nwaiters == 0) {
+			return ENOENT;
+		}
+	}
+	if (ret != 0) {
+		return ret;
+	}
+
+	ulock_rw_reader_remove(ull, self);
+
+	if (flags & ULF_WAKE_ALL) {
+		ulock_rw_readers_clear(ull);
+		ulock_rw_wakeup_all(ull, ULF_WAIT_RW_WRITER);
+		ulock_rw_wakeup_all(ull, 0);
+	} else if (ulock_rw_held(value)) {
+		if (ull->ull_owner != THREAD_NULL && ull->ull_owner != self) {
+			/* the waiters still push on a thread that holds the lock */
+			return 0;
+		}
+
+		ret = ulock_rw_resolve_owner(ull, value, &new_owner);
+		if (ret != 0) {
+			new_owner = THREAD_NULL;
+			ret = 0;
+		}
+
+		ulock_rw_update_inheritor(ull->ull_turnstile, new_owner);
+		ulock_rw_update_inheritor(ull->ull_rw_wturnstile, new_owner);
+	} else {
+		ulock_rw_readers_clear(ull);
+
+		if (ull->ull_rw_nwriters > 0) {
+			/*
+			 * Writers are preferred: the turnstile waitq is priority
+			 * ordered, wake up the highest priority writer and make it
+			 * the inheritor of both the writers and the readers.
+			 */
+			ts = turnstile_prepare(ULOCK_TO_PROPRIETOR(ull, ULF_WAIT_RW_WRITER),
+			    &ull->ull_rw_wturnstile, TURNSTILE_NULL, TURNSTILE_ULOCK);
+			new_owner = waitq_wakeup64_identify(&ts->ts_waitq,
+			    CAST_EVENT64_T(ULOCK_TO_EVENT(ull)),
+			    THREAD_AWAKENED, WAITQ_UPDATE_INHERITOR);
+			turnstile_update_inheritor_complete(ts, TURNSTILE_INTERLOCK_HELD);
+			turnstile_complete(ULOCK_TO_PROPRIETOR(ull, ULF_WAIT_RW_WRITER),
+			    &ull->ull_rw_wturnstile, NULL, TURNSTILE_ULOCK);
+		}
+
+		if (new_owner != THREAD_NULL) {
+			ulock_rw_update_inheritor(ull->ull_turnstile, new_owner);
+			goto out;
+		}
+
+		/*
+		 * No writer is blocked: wake up all the readers, and remember
+		 * the highest priority ones for when a writer shows up.
+		 */
+		ts = turnstile_prepare((uintptr_t)ull, &ull->ull_turnstile,
+		    TURNSTILE_NULL, TURNSTILE_ULOCK);
+		while (ull->ull_rw_nreaders < ULL_RW_READERS_MAX) {
+			thread_t reader = waitq_wakeup64_identify(&ts->ts_waitq,
+			    CAST_EVENT64_T(ULOCK_TO_EVENT(ull)),
+			    THREAD_AWAKENED, WAITQ_WAKEUP_DEFAULT);
+			if (reader == THREAD_NULL) {
+				break;
+			}
+			ull->ull_rw_readers[ull->ull_rw_nreaders++] = reader;
+		}
+		waitq_wakeup64_all(&ts->ts_waitq, CAST_EVENT64_T(ULOCK_TO_EVENT(ull)),
+		    THREAD_AWAKENED, WAITQ_UPDATE_INHERITOR);
+		turnstile_update_inheritor_complete(ts, TURNSTILE_INTERLOCK_HELD);
+		turnstile_complete((uintptr_t)ull, &ull->ull_turnstile,
+		    NULL, TURNSTILE_ULOCK);
+	}
+
+out:
+	*cleanup_thread = ull->ull_owner;
+	ull->ull_owner = new_owner;
+
+	return ret;
+}
+
+#pragma mark syscalls
+
 int
 sys_ulock_wait(struct proc *p, struct ulock_wait_args *args, int32_t *retval)
 {
@@ -531,6 +963,7 @@ sys_ulock_wait2(struct proc *p, struct ulock_wait2_args *args, int32_t *retval)
 	}
 
 	bool set_owner = false;
+	bool rwlock = false;
 	bool xproc = false;
 	size_t lock_size = sizeof(uint32_t);
 	int copy_ret;
@@ -539,6 +972,11 @@ sys_ulock_wait2(struct proc *p, struct ulock_wait2_args *args, int32_t *retval)
 	case UL_UNFAIR_LOCK:
 		set_owner = true;
 		break;
+	case UL_RW_LOCK:
+		set_owner = true;
+		rwlock = true;
+		lock_size = sizeof(uint64_t);
+		break;
 	case UL_COMPARE_AND_WAIT:
 		break;
 	case UL_COMPARE_AND_WAIT64:
@@ -556,6 +994,11 @@ sys_ulock_wait2(struct proc *p, struct ulock_wait2_args *args, int32_t *retval)
 		goto munge_retval;
 	}
 
+	if ((flags & ULF_WAIT_RW_WRITER) && !rwlock) {
+		ret = EINVAL;
+		goto munge_retval;
+	}
+
 	uint64_t value = 0;
 
 	if ((args->addr == 0) || (args->addr & (lock_size - 1))) {
@@ -581,7 +1024,7 @@ sys_ulock_wait2(struct proc *p, struct ulock_wait2_args *args, int32_t *retval)
 		key.ulk_addr = args->addr;
 	}
 
-	if ((flags & ULF_WAIT_ADAPTIVE_SPIN) && set_owner) {
+	if ((flags & ULF_WAIT_ADAPTIVE_SPIN) && set_owner && !rwlock) {
 		/*
 		 * Attempt the copyin outside of the lock once,
 		 *
@@ -629,6 +1072,9 @@ sys_ulock_wait2(struct proc *p, struct ulock_wait2_args *args, int32_t *retval)
 	/* ull is locked */
 
 	ull->ull_nwaiters++;
+	if (flags & ULF_WAIT_RW_WRITER) {
+		ull->ull_rw_nwriters++;
+	}
 
 	if (ull->ull_opcode == 0) {
 		ull->ull_opcode = opcode;
@@ -678,7 +1124,13 @@ sys_ulock_wait2(struct proc *p, struct ulock_wait2_args *args, int32_t *retval)
 		goto out_locked;
 	}
 
-	if (set_owner) {
+	if (rwlock) {
+		assert(owner_thread == THREAD_NULL);
+		ret = ulock_rw_resolve_owner(ull, value, &owner_thread);
+		if (ret != 0) {
+			goto out_locked;
+		}
+	} else if (set_owner) {
 		if (owner_thread == THREAD_NULL) {
 			ret = ulock_resolve_owner((uint32_t)args->value, &owner_thread);
 			if (ret == EOWNERDEAD) {
@@ -691,6 +1143,9 @@ sys_ulock_wait2(struct proc *p, struct ulock_wait2_args *args, int32_t *retval)
 			/* HACK: don't bail on MACH_PORT_DEAD, to avoid blowing up the no-tsd pthread lock */
 			ret = 0;
 		}
+	}
+
+	if (set_owner) {
 		/* owner_thread has a +1 reference */
 
 		/*
@@ -715,6 +1170,12 @@ sys_ulock_wait2(struct proc *p, struct ulock_wait2_args *args, int32_t *retval)
 			thread_reference(owner_thread);
 			ull->ull_owner = owner_thread;
 		}
+
+		if (rwlock && old_owner != owner_thread) {
+			/* waiters of the other kind must push on the same thread */
+			ulock_rw_update_inheritor(*ULOCK_TO_TURNSTILE_FIELD(ull,
+			    flags ^ ULF_WAIT_RW_WRITER), owner_thread);
+		}
 	}
 
 	wait_result_t wr;
@@ -723,8 +1184,8 @@ sys_ulock_wait2(struct proc *p, struct ulock_wait2_args *args, int32_t *retval)
 	wait_interrupt_t interruptible = THREAD_ABORTSAFE;
 	struct turnstile *ts;
 
-	ts = turnstile_prepare((uintptr_t)ull, &ull->ull_turnstile,
-	    TURNSTILE_NULL, TURNSTILE_ULOCK);
+	ts = turnstile_prepare(ULOCK_TO_PROPRIETOR(ull, flags),
+	    ULOCK_TO_TURNSTILE_FIELD(ull, flags), TURNSTILE_NULL, TURNSTILE_ULOCK);
 	thread_set_pending_block_hint(self, kThreadWaitUserLock);
 
 	if (flags & ULF_WAIT_WORKQ_DATA_CONTENTION) {
@@ -776,10 +1237,11 @@ sys_ulock_wait2(struct proc *p, struct ulock_wait2_args *args, int32_t *retval)
 	ret = wait_result_to_return_code(wr);
 
 	ull_lock(ull);
-	turnstile_complete((uintptr_t)ull, &ull->ull_turnstile, NULL, TURNSTILE_ULOCK);
+	turnstile_complete(ULOCK_TO_PROPRIETOR(ull, flags),
+	    ULOCK_TO_TURNSTILE_FIELD(ull, flags), NULL, TURNSTILE_ULOCK);
 
 out_locked:
-	ulock_wait_cleanup(ull, owner_thread, old_owner, retval);
+	ulock_wait_cleanup(ull, owner_thread, old_owner, flags, retval);
 	owner_thread = NULL;
 
 	if (unused_ull) {
@@ -807,13 +1269,19 @@ munge_retval:
  * Must be called with ull_lock held
  */
 static void
-ulock_wait_cleanup(ull_t *ull, thread_t owner_thread, thread_t old_owner, int32_t *retval)
+ulock_wait_cleanup(ull_t *ull, thread_t owner_thread, thread_t old_owner, uint flags, int32_t *retval)
 {
 	ull_assert_owned(ull);
 
 	thread_t old_lingering_owner = THREAD_NULL;
 
 	*retval = --ull->ull_nwaiters;
+	if (flags & ULF_WAIT_RW_WRITER) {
+		ull->ull_rw_nwriters--;
+	}
+	if (ull->ull_opcode == UL_RW_LOCK) {
+		*retval = ulock_rw_waiters(ull);
+	}
 	if (ull->ull_nwaiters == 0) {
 		/*
 		 * If the wait was canceled early, we might need to
@@ -822,8 +1290,10 @@ ulock_wait_cleanup(ull_t *ull, thread_t owner_thread, thread_t old_owner, int32_
 		 */
 		old_lingering_owner = ull->ull_owner;
 		ull->ull_owner = THREAD_NULL;
+		ulock_rw_readers_clear(ull);
 
-		memset(&ull->ull_key, 0, sizeof ull->ull_key);
+		/* ull_key must stay stable, the ull is still hashed */
+		os_atomic_store(&ull->ull_unhashed, true, relaxed);
 		ull->ull_refcount--;
 		assert(ull->ull_refcount > 0);
 	}
@@ -863,9 +1333,10 @@ ulock_wait_continue(__unused void * parameter, wait_result_t wr)
 	ret = wait_result_to_return_code(wr);
 
 	ull_lock(ull);
-	turnstile_complete((uintptr_t)ull, &ull->ull_turnstile, NULL, TURNSTILE_ULOCK);
+	turnstile_complete(ULOCK_TO_PROPRIETOR(ull, flags),
+	    ULOCK_TO_TURNSTILE_FIELD(ull, flags), NULL, TURNSTILE_ULOCK);
 
-	ulock_wait_cleanup(ull, owner_thread, old_owner, retval);
+	ulock_wait_cleanup(ull, owner_thread, old_owner, flags, retval);
 
 	if ((flags & ULF_NO_ERRNO) && (ret != 0)) {
 		*retval = -ret;
@@ -916,12 +1387,16 @@ ulock_wake(task_t task, uint32_t operation, user_addr_t addr, uint64_t wake_valu
 
 	bool set_owner = false;
 	bool allow_non_owner = false;
+	bool rwlock = false;
 	bool xproc = false;
 
 	switch (opcode) {
 	case UL_UNFAIR_LOCK:
 		set_owner = true;
 		break;
+	case UL_RW_LOCK:
+		rwlock = true;
+		break;
 	case UL_COMPARE_AND_WAIT:
 	case UL_COMPARE_AND_WAIT64:
 		break;
@@ -939,7 +1414,7 @@ ulock_wake(task_t task, uint32_t operation, user_addr_t addr, uint64_t wake_valu
 		goto munge_retval;
 	}
 
-	if ((flags & ULF_WAKE_THREAD) && ((flags & ULF_WAKE_ALL) || set_owner)) {
+	if ((flags & ULF_WAKE_THREAD) && ((flags & ULF_WAKE_ALL) || set_owner || rwlock)) {
 		ret = EINVAL;
 		goto munge_retval;
 	}
@@ -1003,6 +1478,11 @@ ulock_wake(task_t task, uint32_t operation, user_addr_t addr, uint64_t wake_valu
 		goto out_ull_put;
 	}
 
+	if (rwlock) {
+		ret = ulock_rw_wake(ull, addr, flags, &cleanup_thread);
+		goto out_ull_put;
+	}
+
 	if (set_owner) {
 		if ((ull->ull_owner != current_thread()) && !allow_non_owner) {
 			/*
@@ -1060,7 +1540,7 @@ ulock_wake(task_t task, uint32_t operation, user_addr_t addr, uint64_t wake_valu
 out_ull_put:
 	ull_put(ull);
 
-	if (ts != TURNSTILE_NULL) {
+	if (ts != TURNSTILE_NULL || rwlock) {
 		/* Need to be called after dropping the interlock */
 		turnstile_cleanup();
 	}
@@ -1087,6 +1567,7 @@ kdp_ulock_find_owner(__unused struct waitq * waitq, event64_t event, thread_wait
 	switch (ull->ull_opcode) {
 	case UL_UNFAIR_LOCK:
 	case UL_UNFAIR_LOCK64_SHARED:
+	case UL_RW_LOCK:
 		waitinfo->owner   = thread_tid(ull->ull_owner);
 		waitinfo->context = ull->ull_key.ulk_addr;
 		break;
@@ -113,6 +113,7 @@
 #include <netinet/flow_divert.h>
 #include <kern/zalloc.h>
 #include <kern/locks.h>
+#include <kern/smr.h>
 #include <machine/limits.h>
 #include <libkern/OSAtomic.h>
 #include <pexpert/pexpert.h>
@@ -351,7 +352,7 @@ vm_size_t       so_cache_zone_element_size;
 static int sodelayed_copy(struct socket *, struct uio *, struct mbuf **,
     user_ssize_t *);
 static void cached_sock_alloc(struct socket **, zalloc_flags_t);
-static void cached_sock_free(struct socket *);
+static void cached_sock_free(smr_node_t);
 
 /*
  * Maximum of extended background idle sockets per process
@@ -494,8 +495,11 @@ cached_sock_alloc(struct socket **so, zalloc_flags_t how)
 }
 
 static void
-cached_sock_free(struct socket *so)
+cached_sock_free(smr_node_t node)
 {
+	struct socket *so = __container_of(node, struct socket,
+	    so_cache_smr_node);
+
 	lck_mtx_lock(&so_cache_mtx);
 
 	so_cache_time = net_uptime();
@@ -959,8 +963,15 @@ sodealloc(struct socket *so)
 
 	so->so_gencnt = OSIncrementAtomic64((SInt64 *)&so_gencnt);
 
+	so_zerocopy_free(so);
+
 	if (so->so_flags1 & SOF1_CACHED_IN_SOCK_LAYER) {
-		cached_sock_free(so);
+		/*
+		 * The inpcb comes back with the socket when it is reused,
+		 * and lockless pcb lookups may still be walking through it.
+		 */
+		smr_inpcb_call(&so->so_cache_smr_node,
+		    so_cache_zone_element_size, cached_sock_free);
 	} else {
 		zfree(socket_zone, so);
 	}
@@ -2178,6 +2189,7 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 	uint16_t headroom = 0;
 	ssize_t mlen;
 	boolean_t en_tracing = FALSE;
+	struct so_zerocopy *zc = NULL;
 
 	if (uio != NULL) {
 		resid = uio_resid(uio);
@@ -2260,6 +2272,10 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 		headroom = so->so_pktheadroom;
 	}
 
+	if (uio != NULL && (so->so_flags1 & SOF1_ZEROCOPY)) {
+		zc = so_zerocopy_alloc(so);
+	}
+
 	do {
 		error = sosendcheck(so, addr, resid, clen, atomic, flags,
 		    &sblocked);
@@ -2324,6 +2340,39 @@ sosend(struct socket *so, struct sockaddr *addr, struct uio *uio,
 					int num_needed;
 					int hdrs_needed = (top == NULL) ? 1 : 0;
 
+					/*
+					 * With SO_ZEROCOPY, large runs of the
+					 * user buffer are referenced in place
+					 * rather than copied; fall back to
+					 * copying if the pages can't be wired.
+					 */
+					if (zc != NULL && freelist == NULL) {
+						mbuf_ref_t last = NULL;
+						int zlen = 0;
+
+						m = so_zerocopy_uiomove(zc, uio,
+						    bytes_to_copy, hdrs_needed,
+						    &last, &zlen);
+						if (m != NULL) {
+							chainlength += zlen;
+							space -= zlen;
+							resid = uio_resid(uio);
+							*mp = m;
+							top->m_pkthdr.len += zlen;
+							mp = &last->m_next;
+							if (resid <= 0) {
+								if (flags & MSG_EOR) {
+									top->m_flags |= M_EOR;
+								}
+								break;
+							}
+							bytes_to_copy = imin((int)resid,
+							    (int)space);
+							bytes_to_alloc = bytes_to_copy;
+							continue;
+						}
+					}
+
 					/*
 					 * try to maintain a local cache of mbuf
 					 * clusters needed to complete this
@@ -2600,6 +2649,10 @@ out_locked:
 		}
 	}
 
+	if (zc != NULL) {
+		so_zerocopy_done(zc, uio_resid(uio) != orig_resid);
+	}
+
 	if (sblocked) {
 		sbunlock(&so->so_snd, FALSE);   /* will unlock socket */
 	} else {
@@ -3542,6 +3595,14 @@ restart:
 			}
 			goto release;
 		}
+		if (so->so_rcv.sb_flags & SB_RECORDHELD) {
+			/* the protocol must be asked for the held record */
+			if (m != NULL) {
+				goto dontblock;
+			}
+			error = ENOMSG;
+			goto release;
+		}
 		if (so->so_state & SS_CANTRCVMORE) {
 #if CONTENT_FILTER
 			/*
@@ -3889,7 +3950,9 @@ dontblock:
 		while (flags & (MSG_WAITALL | MSG_WAITSTREAM) && m == NULL &&
 		    (uio_resid(uio) - delayed_copy_len) > 0 &&
 		    !sosendallatonce(so) && !nextrecord) {
-			if (so->so_error || ((so->so_state & SS_CANTRCVMORE)
+			if (so->so_error ||
+			    (so->so_rcv.sb_flags & SB_RECORDHELD) ||
+			    ((so->so_state & SS_CANTRCVMORE)
 #if CONTENT_FILTER
 			    && cfil_sock_data_pending(&so->so_rcv) == 0
 #endif /* CONTENT_FILTER */
@@ -5811,6 +5874,15 @@ sosetoptlock(struct socket *so, struct sockopt *sopt, int dolock)
 			}
 			break;
 
+		case SO_ZEROCOPY:
+			error = sooptcopyin(sopt, &optval, sizeof(optval),
+			    sizeof(optval));
+			if (error != 0) {
+				goto out;
+			}
+			error = so_zerocopy_setopt(so, optval);
+			break;
+
 		default:
 			error = ENOPROTOOPT;
 			break;
@@ -6326,6 +6398,16 @@ integer:
 			optval = ((so->so_flags1 & SOF1_DOMAIN_INFO_SILENT) > 0)
 			    ? 1 : 0;
 			goto integer;
+		case SO_ZEROCOPY:
+			optval = ((so->so_flags1 & SOF1_ZEROCOPY) > 0) ? 1 : 0;
+			goto integer;
+		case SO_ZEROCOPY_COMPLETE: {
+			struct so_zerocopy_complete zcc;
+
+			so_zerocopy_getcomplete(so, &zcc);
+			error = sooptcopyout(sopt, &zcc, sizeof(zcc));
+			break;
+		}
 		default:
 			error = ENOPROTOOPT;
 			break;
@@ -6634,6 +6716,11 @@ filt_soread_common(struct knote *kn, struct kevent_qos_s *kev, struct socket *so
 		goto out;
 	}
 
+	if (so->so_rcv.sb_flags & SB_RECORDHELD) {
+		retval = 1;
+		goto out;
+	}
+
 	int64_t lowwat = so->so_rcv.sb_lowat;
 	/*
 	 * Ensure that when NOTE_LOWAT is used, the derived
@@ -7014,6 +7101,10 @@ filt_sockev_common(struct knote *kn, struct kevent_qos_s *kev,
 	if (ev_hint & SO_FILT_HINT_WAKE_PKT) {
 		kn->kn_fflags |= NOTE_WAKE_PKT;
 	}
+	if ((ev_hint & SO_FILT_HINT_ZEROCOPY) ||
+	    so_zerocopy_active(so)) {
+		kn->kn_fflags |= NOTE_ZEROCOPY;
+	}
 
 	if ((so->so_state & SS_CANTRCVMORE)
 #if CONTENT_FILTER
@@ -1449,6 +1449,34 @@ sbappendaddr(struct sockbuf *sb, struct sockaddr *asa, struct mbuf *m0,
 	return result;
 }
 
+/*
+ * Append the data of a datagram to the last record of a socket buffer,
+ * for protocols that coalesce consecutive datagrams of a flow into one
+ * record.  Unlike sbappendaddr(), socket filters are not run: the
+ * caller only coalesces when none is attached to the socket.
+ *
+ * Returns:	0			No space, m0 is left to the caller
+ *		1			Success
+ */
+int
+sbappend_lastrecord(struct sockbuf *sb, struct mbuf *m0)
+{
+	int space = m0->m_pkthdr.len;
+
+	if (sb->sb_lastrecord == NULL || (sb->sb_flags & SB_DROP)) {
+		return 0;
+	}
+	if (space > sbspace(sb)) {
+		sb_update_no_space_stats(sb, space);
+		return 0;
+	}
+
+	SBLASTRECORDCHK(sb, __func__);
+	sbcompress(sb, m0, sb->sb_mbtail);
+	SBLASTRECORDCHK(sb, __func__);
+	return 1;
+}
+
 inline boolean_t
 is_cmsg_valid(struct mbuf *control, struct cmsghdr *cmsg)
 {
@@ -2362,7 +2390,8 @@ soreadable(struct socket *so)
 	       && cfil_sock_data_pending(&so->so_rcv) == 0
 #endif /* CONTENT_FILTER */
 	       ) ||
-	       so->so_comp.tqh_first || so->so_error;
+	       so->so_comp.tqh_first || so->so_error ||
+	       (so->so_rcv.sb_flags & SB_RECORDHELD);
 }
 
 /* can we write something to so? */
@@ -0,0 +1,519 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/mbuf.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/socketvar.h>
+#include <sys/sysctl.h>
+#include <sys/ubc.h>
+#include <sys/uio_internal.h>
+
+#include <kern/locks.h>
+#include <kern/thread_call.h>
+#include <kern/zalloc.h>
+
+#include <mach/memory_object_types.h>
+#include <vm/vm_upl.h>
+
+/*
+ * Zero-copy sends (SO_ZEROCOPY).
+ *
+ * sosend() hands large runs of the user buffer to so_zerocopy_uiomove(),
+ * which wires the pages in a UPL, maps them in the kernel and attaches
+ * each page to an external mbuf instead of copying it into a cluster.
+ * The pages are released when the last mbuf referencing them is freed,
+ * i.e. once the data has been acknowledged and any copy made for a
+ * retransmission is gone.  Since mbufs may be freed from contexts that
+ * can neither block nor unmap memory, released UPLs are queued under a
+ * spin lock and torn down from a thread call, which also posts the
+ * completion of a write when its last UPL goes away.
+ *
+ * Each mbuf covers exactly the bytes it carries, with no leading or
+ * trailing space, so that the stack never writes into the user pages
+ * (e.g. when sbcompress() appends a small write to the last mbuf).
+ *
+ * The wired pages are charged against a per-socket and a global limit;
+ * beyond either, writes are copied as usual.
+ */
+
+static unsigned int sosend_zerocopy_min = 16384;
+SYSCTL_DECL(_kern_ipc);
+SYSCTL_UINT(_kern_ipc, OID_AUTO, sosend_zerocopy_min,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &sosend_zerocopy_min, 0,
+    "smallest write sent from the user pages on SO_ZEROCOPY sockets");
+
+static unsigned int sosend_zerocopy_sock_max = 4 * 1024 * 1024;
+SYSCTL_UINT(_kern_ipc, OID_AUTO, sosend_zerocopy_sock_max,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &sosend_zerocopy_sock_max, 0,
+    "most bytes of user pages wired by one SO_ZEROCOPY socket");
+
+static uint64_t sosend_zerocopy_wired_max = 64 * 1024 * 1024;
+SYSCTL_QUAD(_kern_ipc, OID_AUTO, sosend_zerocopy_wired_max,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &sosend_zerocopy_wired_max,
+    "most bytes of user pages wired by all SO_ZEROCOPY sockets");
+
+static uint64_t sosend_zerocopy_wired;
+SYSCTL_QUAD(_kern_ipc, OID_AUTO, sosend_zerocopy_wired,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &sosend_zerocopy_wired,
+    "bytes of user pages wired by SO_ZEROCOPY sockets");
+
+/* Largest run of the user buffer wired at once */
+#define SO_ZEROCOPY_MAX_UPL     (64 * PAGE_SIZE)
+
+/* Beyond this many queued ranges, contiguous ones are merged regardless */
+#define SO_ZEROCOPY_MAX_QUEUED  256
+
+/* Completed ids not yet retrieved by the application */
+struct so_zerocopy_entry {
+	TAILQ_ENTRY(so_zerocopy_entry) ze_link;
+	struct so_zerocopy_range ze_range;
+};
+
+struct so_zerocopy_state {
+	u_int32_t       zs_next;        /* id of the next write */
+	u_int32_t       zs_pending;     /* writes not complete */
+	u_int32_t       zs_queued;      /* entries in zs_complete */
+	u_int32_t       zs_wired;       /* bytes of user pages wired */
+	TAILQ_HEAD(so_zerocopy_entry_head, so_zerocopy_entry) zs_complete;
+};
+
+/* One write; referenced by sosend() and by each of its UPLs */
+struct so_zerocopy {
+	struct socket   *zc_so;
+	u_int32_t       zc_id;
+	u_int32_t       zc_refcnt;
+	bool            zc_copied;      /* no page was sent in place */
+	bool            zc_discard;     /* no data was queued */
+};
+
+/* One run of wired user pages; referenced by each of its mbufs */
+struct so_zerocopy_upl {
+	struct so_zerocopy *zu_zc;
+	upl_t           zu_upl;
+	vm_offset_t     zu_kaddr;
+	u_int32_t       zu_size;        /* bytes wired */
+	u_int32_t       zu_refcnt;
+	STAILQ_ENTRY(so_zerocopy_upl) zu_link;
+};
+
+static LCK_GRP_DECLARE(so_zerocopy_lck_grp, "so_zerocopy");
+static LCK_SPIN_DECLARE(so_zerocopy_lock, &so_zerocopy_lck_grp);
+static STAILQ_HEAD(, so_zerocopy_upl) so_zerocopy_done_head =
+    STAILQ_HEAD_INITIALIZER(so_zerocopy_done_head);
+static thread_call_t so_zerocopy_tcall;
+
+static void so_zerocopy_reap(thread_call_param_t, thread_call_param_t);
+
+__startup_func
+static void
+so_zerocopy_setup(void)
+{
+	so_zerocopy_tcall = thread_call_allocate_with_options(so_zerocopy_reap,
+	    NULL, THREAD_CALL_PRIORITY_KERNEL, THREAD_CALL_OPTIONS_ONCE);
+}
+STARTUP(THREAD_CALL, STARTUP_RANK_MIDDLE, so_zerocopy_setup);
+
+/*
+ * Record that write `id' is complete; merges with the last range
+ * when possible so that in-order completions take a single entry.
+ */
+static void
+so_zerocopy_post(struct socket *so, u_int32_t id, bool copied)
+{
+	struct so_zerocopy_state *zs = so->so_zerocopy;
+	struct so_zerocopy_entry *ze;
+
+	socket_lock_assert_owned(so);
+	VERIFY(zs != NULL && zs->zs_pending > 0);
+
+	zs->zs_pending--;
+	ze = TAILQ_LAST(&zs->zs_complete, so_zerocopy_entry_head);
+	if (ze != NULL && ze->ze_range.zr_last + 1 == id &&
+	    (!!ze->ze_range.zr_copied == copied ||
+	    zs->zs_queued >= SO_ZEROCOPY_MAX_QUEUED)) {
+		ze->ze_range.zr_last = id;
+		if (!copied) {
+			ze->ze_range.zr_copied = 0;
+		}
+	} else {
+		ze = kalloc_type(struct so_zerocopy_entry, Z_WAITOK | Z_NOFAIL);
+		ze->ze_range.zr_first = id;
+		ze->ze_range.zr_last = id;
+		ze->ze_range.zr_copied = copied ? 1 : 0;
+		TAILQ_INSERT_TAIL(&zs->zs_complete, ze, ze_link);
+		zs->zs_queued++;
+	}
+	soevent(so, SO_FILT_HINT_LOCKED | SO_FILT_HINT_ZEROCOPY);
+}
+
+/*
+ * Drop a reference on a write.  The last one posts its completion and
+ * releases the socket reference taken by so_zerocopy_alloc().
+ */
+static void
+so_zerocopy_release(struct so_zerocopy *zc, bool locked)
+{
+	struct socket *so = zc->zc_so;
+
+	if (os_atomic_dec(&zc->zc_refcnt, acq_rel) != 0) {
+		return;
+	}
+	if (!locked) {
+		socket_lock(so, 0);
+	}
+	if (!zc->zc_discard) {
+		so_zerocopy_post(so, zc->zc_id, zc->zc_copied);
+	}
+	if (locked) {
+		/* sosend() holds its own use count */
+		VERIFY(so->so_usecount > 1);
+		so->so_usecount--;
+	} else {
+		socket_unlock(so, 1);
+	}
+	kfree_type(struct so_zerocopy, zc);
+}
+
+static void
+so_zerocopy_upl_release(struct so_zerocopy_upl *zu)
+{
+	if (os_atomic_dec(&zu->zu_refcnt, relaxed) != 0) {
+		return;
+	}
+	lck_spin_lock(&so_zerocopy_lock);
+	STAILQ_INSERT_TAIL(&so_zerocopy_done_head, zu, zu_link);
+	lck_spin_unlock(&so_zerocopy_lock);
+	thread_call_enter(so_zerocopy_tcall);
+}
+
+/*
+ * Reserve `size' bytes of wired pages for `so'; fails if that would
+ * exceed the per-socket or the global limit.  The socket state can't
+ * go away while a write holds a use count on the socket.
+ */
+static bool
+so_zerocopy_wire(struct socket *so, u_int32_t size)
+{
+	struct so_zerocopy_state *zs = so->so_zerocopy;
+
+	if (os_atomic_add(&zs->zs_wired, size, relaxed) >
+	    sosend_zerocopy_sock_max) {
+		os_atomic_sub(&zs->zs_wired, size, relaxed);
+		return false;
+	}
+	if (os_atomic_add(&sosend_zerocopy_wired, (uint64_t)size, relaxed) >
+	    sosend_zerocopy_wired_max) {
+		os_atomic_sub(&sosend_zerocopy_wired, (uint64_t)size, relaxed);
+		os_atomic_sub(&zs->zs_wired, size, relaxed);
+		return false;
+	}
+	return true;
+}
+
+static void
+so_zerocopy_unwire(struct socket *so, u_int32_t size)
+{
+	os_atomic_sub(&so->so_zerocopy->zs_wired, size, relaxed);
+	os_atomic_sub(&sosend_zerocopy_wired, (uint64_t)size, relaxed);
+}
+
+static void
+so_zerocopy_extfree(caddr_t buf, u_int size, caddr_t arg)
+{
+#pragma unused(buf, size)
+	so_zerocopy_upl_release((struct so_zerocopy_upl *)(void *)arg);
+}
+
+static void
+so_zerocopy_reap(thread_call_param_t arg0, thread_call_param_t arg1)
+{
+#pragma unused(arg0, arg1)
+	STAILQ_HEAD(, so_zerocopy_upl) head = STAILQ_HEAD_INITIALIZER(head);
+	struct so_zerocopy_upl *zu;
+	struct so_zerocopy *zc;
+
+	lck_spin_lock(&so_zerocopy_lock);
+	STAILQ_CONCAT(&head, &so_zerocopy_done_head);
+	lck_spin_unlock(&so_zerocopy_lock);
+
+	while ((zu = STAILQ_FIRST(&head)) != NULL) {
+		STAILQ_REMOVE_HEAD(&head, zu_link);
+		zc = zu->zu_zc;
+		(void) ubc_upl_unmap(zu->zu_upl);
+		(void) ubc_upl_abort(zu->zu_upl, 0);
+		so_zerocopy_unwire(zc->zc_so, zu->zu_size);
+		kfree_type(struct so_zerocopy_upl, zu);
+		so_zerocopy_release(zc, false);
+	}
+}
+
+/*
+ * Called by sosend() with the socket locked when SO_ZEROCOPY is set;
+ * the write holds a use count on the socket until it completes.
+ */
+struct so_zerocopy *
+so_zerocopy_alloc(struct socket *so)
+{
+	struct so_zerocopy *zc;
+
+	socket_lock_assert_owned(so);
+	if (so->so_zerocopy == NULL) {
+		return NULL;
+	}
+	zc = kalloc_type(struct so_zerocopy, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	zc->zc_so = so;
+	zc->zc_refcnt = 1;
+	zc->zc_copied = true;
+	so->so_usecount++;
+
+	return zc;
+}
+
+/*
+ * Called by sosend() with the socket locked once the write is done;
+ * `moved' tells whether any of its data was queued, in which case it
+ * consumes the next id.
+ */
+void
+so_zerocopy_done(struct so_zerocopy *zc, boolean_t moved)
+{
+	struct socket *so = zc->zc_so;
+
+	socket_lock_assert_owned(so);
+	if (moved) {
+		zc->zc_id = so->so_zerocopy->zs_next++;
+		so->so_zerocopy->zs_pending++;
+	} else {
+		zc->zc_discard = true;
+	}
+	so_zerocopy_release(zc, true);
+}
+
+/*
+ * Build an mbuf chain referencing up to `len' bytes of the current
+ * iovec in place, and advance the uio past them.  Called by sosend()
+ * with the socket unlocked.  Returns NULL if the user buffer can't be
+ * sent in place, in which case the caller copies it as usual.
+ */
+struct mbuf *
+so_zerocopy_uiomove(struct so_zerocopy *zc, struct uio *uio, int len,
+    int pkthdr, struct mbuf **lastp, int *lenp)
+{
+	struct so_zerocopy_upl *zu;
+	struct mbuf *top = NULL, *m, **mp = &top;
+	upl_page_info_t *pl;
+	upl_t upl = NULL;
+	upl_size_t upl_size, upl_needed_size;
+	upl_control_flags_t upl_flags;
+	unsigned int pages_in_pl = 0;
+	vm_offset_t upl_offset, kaddr;
+	user_addr_t iov_base;
+	kern_return_t kret;
+	int i, off, resid;
+
+	if (!uio_isuserspace(uio)) {
+		return NULL;
+	}
+	iov_base = uio_curriovbase(uio);
+	len = (int)MIN((user_size_t)len, uio_curriovlen(uio));
+	len = MIN(len, (int)SO_ZEROCOPY_MAX_UPL);
+	if (len < (int)sosend_zerocopy_min) {
+		return NULL;
+	}
+
+	upl_offset = (vm_offset_t)(iov_base & PAGE_MASK);
+	upl_needed_size = (upl_size_t)round_page(upl_offset + len);
+	upl_size = upl_needed_size;
+	if (!so_zerocopy_wire(zc->zc_so, upl_needed_size)) {
+		return NULL;
+	}
+	upl_flags = UPL_FILE_IO | UPL_COPYOUT_FROM | UPL_NO_SYNC |
+	    UPL_CLEAN_IN_PLACE | UPL_SET_INTERNAL | UPL_SET_LITE | UPL_SET_IO_WIRE;
+
+	kret = vm_map_get_upl(current_map(),
+	    vm_map_trunc_page(iov_base, vm_map_page_mask(current_map())),
+	    &upl_size, &upl, NULL, &pages_in_pl, &upl_flags,
+	    VM_KERN_MEMORY_MBUF, 0);
+	if (kret != KERN_SUCCESS) {
+		goto unwire;
+	}
+	if (upl_size < upl_needed_size) {
+		goto abort;
+	}
+	pl = UPL_GET_INTERNAL_PAGE_LIST(upl);
+	pages_in_pl = upl_size / PAGE_SIZE;
+	for (i = 0; i < (int)pages_in_pl; i++) {
+		if (!upl_valid_page(pl, i)) {
+			goto abort;
+		}
+	}
+	if (ubc_upl_map(upl, &kaddr) != KERN_SUCCESS) {
+		goto abort;
+	}
+
+	/* the build reference keeps the UPL until the chain is complete */
+	zu = kalloc_type(struct so_zerocopy_upl, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	zu->zu_zc = zc;
+	zu->zu_upl = upl;
+	zu->zu_kaddr = kaddr;
+	zu->zu_size = upl_needed_size;
+	zu->zu_refcnt = 1;
+	os_atomic_inc(&zc->zc_refcnt, relaxed);
+
+	off = (int)upl_offset;
+	resid = len;
+	for (i = 0; resid > 0; i++) {
+		int mlen = MIN(resid, (int)PAGE_SIZE - off);
+
+		if (pkthdr && top == NULL) {
+			MGETHDR(m, M_WAIT, MT_DATA);
+		} else {
+			MGET(m, M_WAIT, MT_DATA);
+		}
+		if (m == NULL) {
+			break;
+		}
+		os_atomic_inc(&zu->zu_refcnt, relaxed);
+		/* no room around the data: the stack must not write here */
+		m = m_clattach(m, MT_DATA,
+		    __unsafe_forge_bidi_indexable(caddr_t,
+		    kaddr + ptoa(i) + off, mlen),
+		    so_zerocopy_extfree, mlen, (caddr_t)zu, M_WAIT, 0);
+		if (m == NULL) {
+			os_atomic_dec(&zu->zu_refcnt, relaxed);
+			break;
+		}
+		VERIFY(M_LEADINGSPACE(m) == 0);
+		m->m_len = mlen;
+		VERIFY(M_TRAILINGSPACE(m) == 0);
+		resid -= mlen;
+		off = 0;
+		*mp = m;
+		mp = &m->m_next;
+		*lastp = m;
+	}
+	if (resid > 0) {
+		/* the pages go back once the partial chain is freed */
+		m_freem(top);
+		top = NULL;
+	} else {
+		zc->zc_copied = false;
+		uio_update(uio, len);
+		*lenp = len;
+	}
+	so_zerocopy_upl_release(zu);
+
+	return top;
+
+abort:
+	(void) ubc_upl_abort(upl, 0);
+unwire:
+	so_zerocopy_unwire(zc->zc_so, upl_needed_size);
+	return NULL;
+}
+
+int
+so_zerocopy_setopt(struct socket *so, int optval)
+{
+	struct so_zerocopy_state *zs;
+
+	socket_lock_assert_owned(so);
+	if ((SOCK_DOM(so) != PF_INET && SOCK_DOM(so) != PF_INET6) ||
+	    SOCK_TYPE(so) != SOCK_STREAM || SOCK_PROTO(so) != IPPROTO_TCP) {
+		return EOPNOTSUPP;
+	}
+	if (optval == 0) {
+		so->so_flags1 &= ~SOF1_ZEROCOPY;
+		return 0;
+	}
+	if (so->so_zerocopy == NULL) {
+		zs = kalloc_type(struct so_zerocopy_state,
+		    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+		TAILQ_INIT(&zs->zs_complete);
+		so->so_zerocopy = zs;
+	}
+	so->so_flags1 |= SOF1_ZEROCOPY;
+	return 0;
+}
+
+/*
+ * Hand the oldest completed ranges to the application and forget them.
+ */
+void
+so_zerocopy_getcomplete(struct socket *so, struct so_zerocopy_complete *zcc)
+{
+	struct so_zerocopy_state *zs = so->so_zerocopy;
+	struct so_zerocopy_entry *ze;
+
+	socket_lock_assert_owned(so);
+	bzero(zcc, sizeof(*zcc));
+	if (zs == NULL) {
+		return;
+	}
+	while (zcc->zc_count < SO_ZEROCOPY_MAX_RANGES &&
+	    (ze = TAILQ_FIRST(&zs->zs_complete)) != NULL) {
+		TAILQ_REMOVE(&zs->zs_complete, ze, ze_link);
+		zs->zs_queued--;
+		zcc->zc_ranges[zcc->zc_count++] = ze->ze_range;
+		kfree_type(struct so_zerocopy_entry, ze);
+	}
+	zcc->zc_pending = zs->zs_pending;
+}
+
+boolean_t
+so_zerocopy_active(struct socket *so)
+{
+	return so->so_zerocopy != NULL &&
+	       !TAILQ_EMPTY(&so->so_zerocopy->zs_complete);
+}
+
+/*
+ * Called from sodealloc(); every write holds a use count on the socket,
+ * so only completions never retrieved can be left.
+ */
+void
+so_zerocopy_free(struct socket *so)
+{
+	struct so_zerocopy_state *zs = so->so_zerocopy;
+	struct so_zerocopy_entry *ze;
+
+	if (zs == NULL) {
+		return;
+	}
+	VERIFY(zs->zs_pending == 0);
+	while ((ze = TAILQ_FIRST(&zs->zs_complete)) != NULL) {
+		TAILQ_REMOVE(&zs->zs_complete, ze, ze_link);
+		kfree_type(struct so_zerocopy_entry, ze);
+	}
+	kfree_type(struct so_zerocopy_state, zs);
+	so->so_zerocopy = NULL;
+}
@@ -30,6 +30,7 @@
 #include <net/dlil_var_private.h>
 #include <net/dlil.h>
 #include <net/dlil_sysctl.h>
+#include <netinet6/ip6_var.h>
 
 
 #define DLIL_EWMA(old, new, decay) do {                                 \
@@ -736,6 +737,328 @@ dlil_input_cksum_dbg(struct ifnet *ifp, struct mbuf *m, char *frame_header,
 	}
 }
 
+/*
+ * Software receive offload for the legacy input path.
+ *
+ * In-order TCP segments of a flow that arrive in the same input batch
+ * are merged into the first one before the list is passed up, so that
+ * ip_input and tcp_input run once per merged packet; rx_seg_cnt tells
+ * TCP how many segments it stands for, as with the packets aggregated
+ * by the flowswitch.  Only segments whose checksums were verified by
+ * the hardware are merged: the TCP checksum of the merged packet is not
+ * refreshed, only the checksum flags of its first segment are trusted.
+ */
+#define DLIL_GRO_FLOWS          8       /* flows merged at once */
+#define DLIL_GRO_MAX_SEGS       UINT8_MAX
+
+struct dlil_gro_seg {
+	uint16_t                gs_iphlen;      /* IP header length */
+	uint16_t                gs_hlen;        /* IP and TCP header length */
+	uint16_t                gs_len;         /* TCP payload length */
+};
+
+struct dlil_gro_flow {
+	mbuf_t                  gf_head;        /* segments are merged here */
+	mbuf_t                  gf_tail;        /* last mbuf of gf_head */
+	protocol_family_t       gf_pf;
+	uint32_t                gf_seq;         /* next expected sequence */
+	uint16_t                gf_iphlen;      /* IP header length */
+	uint16_t                gf_hlen;        /* IP and TCP header length */
+	uint16_t                gf_mss;         /* payload of first segment */
+	boolean_t               gf_closed;      /* no more merging */
+};
+
+struct dlil_gro {
+	uint32_t                g_nflows;
+	uint32_t                g_evict;        /* next flow to replace */
+	uint32_t                g_segs;         /* segments considered */
+	uint32_t                g_merged;       /* segments merged */
+	struct dlil_gro_flow    g_flows[DLIL_GRO_FLOWS];
+};
+
+static inline struct tcphdr *
+dlil_gro_tcphdr(mbuf_t m, uint16_t iphlen)
+{
+	return (struct tcphdr *)(void *)(mtod(m, uint8_t *) + iphlen);
+}
+
+/*
+ * Measure the headers of a TCP packet whose IP and TCP headers are in
+ * its first mbuf; returns FALSE if the packet is not such a packet.
+ * `eligible' tells whether the packet may be merged or start a merge.
+ */
+static boolean_t
+dlil_gro_parse(mbuf_t m, protocol_family_t pf, struct dlil_gro_seg *s,
+    boolean_t *eligible)
+{
+	uint32_t csum_ok = CSUM_DATA_VALID | CSUM_PSEUDO_HDR;
+	uint32_t mlen = (uint32_t)m->m_len;
+	uint32_t iphlen, thlen, iplen;
+	boolean_t ipopts = FALSE;
+	struct tcphdr *th;
+
+	if (!IP_HDR_ALIGNED_P(mtod(m, caddr_t))) {
+		return FALSE;
+	}
+	if (pf == PF_INET) {
+		struct ip *ip = mtod(m, struct ip *);
+
+		if (mlen < sizeof(*ip) || ip->ip_v != IPVERSION ||
+		    ip->ip_p != IPPROTO_TCP ||
+		    (ntohs(ip->ip_off) & (IP_MF | IP_OFFMASK)) != 0) {
+			return FALSE;
+		}
+		iphlen = ip->ip_hl << 2;
+		iplen = ntohs(ip->ip_len);
+		ipopts = (iphlen != sizeof(*ip));
+		csum_ok |= CSUM_IP_CHECKED | CSUM_IP_VALID;
+	} else {
+		struct ip6_hdr *ip6 = mtod(m, struct ip6_hdr *);
+
+		if (mlen < sizeof(*ip6) ||
+		    (ip6->ip6_vfc & IPV6_VERSION_MASK) != IPV6_VERSION ||
+		    ip6->ip6_nxt != IPPROTO_TCP) {
+			return FALSE;
+		}
+		iphlen = sizeof(*ip6);
+		iplen = sizeof(*ip6) + ntohs(ip6->ip6_plen);
+	}
+	if (mlen < iphlen + sizeof(*th)) {
+		return FALSE;
+	}
+	th = dlil_gro_tcphdr(m, (uint16_t)iphlen);
+	thlen = th->th_off << 2;
+	if (thlen < sizeof(*th) || mlen < iphlen + thlen ||
+	    iplen < iphlen + thlen) {
+		return FALSE;
+	}
+
+	s->gs_iphlen = (uint16_t)iphlen;
+	s->gs_hlen = (uint16_t)(iphlen + thlen);
+	s->gs_len = (uint16_t)(iplen - s->gs_hlen);
+	*eligible = (!ipopts && s->gs_len > 0 &&
+	    iplen == (uint32_t)m->m_pkthdr.len &&
+	    (th->th_flags & ~TH_PUSH) == TH_ACK &&
+	    (m->m_pkthdr.csum_flags & (csum_ok | CSUM_PARTIAL)) == csum_ok &&
+	    m->m_pkthdr.csum_rx_val == 0xffff &&
+	    (m->m_pkthdr.pkt_flags & PKTF_WAKE_PKT) == 0 &&
+	    (m->m_flags & (M_BCAST | M_MCAST)) == 0 &&
+	    m_tag_first(m) == NULL);
+	return TRUE;
+}
+
+static boolean_t
+dlil_gro_same_flow(struct dlil_gro_flow *f, mbuf_t m, protocol_family_t pf,
+    struct dlil_gro_seg *s)
+{
+	mbuf_t head = f->gf_head;
+	struct tcphdr *th, *nth;
+
+	if (f->gf_pf != pf || head->m_pkthdr.rcvif != m->m_pkthdr.rcvif) {
+		return FALSE;
+	}
+	th = dlil_gro_tcphdr(head, f->gf_iphlen);
+	nth = dlil_gro_tcphdr(m, s->gs_iphlen);
+	if (th->th_sport != nth->th_sport || th->th_dport != nth->th_dport) {
+		return FALSE;
+	}
+	if (pf == PF_INET) {
+		struct ip *ip = mtod(head, struct ip *);
+		struct ip *nip = mtod(m, struct ip *);
+
+		return ip->ip_src.s_addr == nip->ip_src.s_addr &&
+		       ip->ip_dst.s_addr == nip->ip_dst.s_addr;
+	} else {
+		struct ip6_hdr *ip6 = mtod(head, struct ip6_hdr *);
+		struct ip6_hdr *nip6 = mtod(m, struct ip6_hdr *);
+
+		return IN6_ARE_ADDR_EQUAL(&ip6->ip6_src, &nip6->ip6_src) &&
+		       IN6_ARE_ADDR_EQUAL(&ip6->ip6_dst, &nip6->ip6_dst);
+	}
+}
+
+/*
+ * A segment is merged if it is the next one in sequence, no larger than
+ * the first, and its IP and TCP headers only differ from the first one's
+ * by their lengths, PSH and the timestamp option; in particular the ECN
+ * codepoints must match so that CE marks are not lost.
+ */
+static boolean_t
+dlil_gro_can_merge(struct dlil_gro_flow *f, mbuf_t m, struct dlil_gro_seg *s)
+{
+	mbuf_t head = f->gf_head;
+	struct tcphdr *th = dlil_gro_tcphdr(head, f->gf_iphlen);
+	struct tcphdr *nth = dlil_gro_tcphdr(m, s->gs_iphlen);
+	uint8_t *opt, *nopt;
+	uint32_t optlen;
+
+	if (f->gf_closed || ntohl(nth->th_seq) != f->gf_seq ||
+	    s->gs_hlen != f->gf_hlen || s->gs_len > f->gf_mss ||
+	    th->th_ack != nth->th_ack || th->th_win != nth->th_win ||
+	    head->m_pkthdr.rx_seg_cnt >= DLIL_GRO_MAX_SEGS ||
+	    head->m_pkthdr.len + s->gs_len > IP_MAXPACKET) {
+		return FALSE;
+	}
+	if (f->gf_pf == PF_INET) {
+		struct ip *ip = mtod(head, struct ip *);
+		struct ip *nip = mtod(m, struct ip *);
+
+		if (ip->ip_tos != nip->ip_tos || ip->ip_ttl != nip->ip_ttl ||
+		    (ip->ip_off & htons(IP_DF)) != (nip->ip_off & htons(IP_DF))) {
+			return FALSE;
+		}
+	} else {
+		struct ip6_hdr *ip6 = mtod(head, struct ip6_hdr *);
+		struct ip6_hdr *nip6 = mtod(m, struct ip6_hdr *);
+
+		if (ip6->ip6_flow != nip6->ip6_flow ||
+		    ip6->ip6_hlim != nip6->ip6_hlim) {
+			return FALSE;
+		}
+	}
+
+	opt = mtod(head, uint8_t *) + f->gf_iphlen + sizeof(struct tcphdr);
+	nopt = mtod(m, uint8_t *) + s->gs_iphlen + sizeof(struct tcphdr);
+	optlen = f->gf_hlen - f->gf_iphlen - sizeof(struct tcphdr);
+	if (bcmp(opt, nopt, optlen) == 0) {
+		return TRUE;
+	}
+	/* only the timestamp option laid out as in RFC 7323 may differ */
+	if (optlen == TCPOLEN_TSTAMP_APPA) {
+		uint32_t ts_hdr = htonl(TCPOPT_TSTAMP_HDR);
+
+		return bcmp(opt, &ts_hdr, sizeof(ts_hdr)) == 0 &&
+		       bcmp(nopt, &ts_hdr, sizeof(ts_hdr)) == 0;
+	}
+	return FALSE;
+}
+
+static void
+dlil_gro_merge(struct dlil_gro_flow *f, mbuf_t m, struct dlil_gro_seg *s)
+{
+	mbuf_t head = f->gf_head;
+	struct tcphdr *th = dlil_gro_tcphdr(head, f->gf_iphlen);
+	struct tcphdr *nth = dlil_gro_tcphdr(m, s->gs_iphlen);
+	uint32_t optlen = f->gf_hlen - f->gf_iphlen - sizeof(struct tcphdr);
+
+	/* the merged packet carries the newest timestamp and PSH */
+	if (optlen == TCPOLEN_TSTAMP_APPA) {
+		bcopy(mtod(m, uint8_t *) + s->gs_iphlen + sizeof(struct tcphdr),
+		    mtod(head, uint8_t *) + f->gf_iphlen + sizeof(struct tcphdr),
+		    TCPOLEN_TSTAMP_APPA);
+	}
+	th->th_flags |= (nth->th_flags & TH_PUSH);
+
+	if (f->gf_pf == PF_INET) {
+		struct ip *ip = mtod(head, struct ip *);
+		uint16_t len = htons(ntohs(ip->ip_len) + s->gs_len);
+
+		ip->ip_sum = nat464_cksum_fixup(ip->ip_sum, ip->ip_len, len, 0);
+		ip->ip_len = len;
+	} else {
+		struct ip6_hdr *ip6 = mtod(head, struct ip6_hdr *);
+
+		ip6->ip6_plen = htons(ntohs(ip6->ip6_plen) + s->gs_len);
+	}
+
+	m_adj(m, s->gs_hlen);
+	m->m_flags &= ~M_PKTHDR;
+	f->gf_tail->m_next = m;
+	f->gf_tail = m_last(m);
+	head->m_pkthdr.len += s->gs_len;
+	if (head->m_pkthdr.rx_seg_cnt == 0) {
+		head->m_pkthdr.rx_seg_cnt = 1;
+	}
+	head->m_pkthdr.rx_seg_cnt++;
+	f->gf_seq += s->gs_len;
+
+	/* a push or a short segment ends the merge */
+	if ((th->th_flags & TH_PUSH) != 0 || s->gs_len < f->gf_mss) {
+		f->gf_closed = TRUE;
+	}
+}
+
+static void
+dlil_gro_open(struct dlil_gro_flow *f, mbuf_t m, protocol_family_t pf,
+    struct dlil_gro_seg *s)
+{
+	struct tcphdr *th = dlil_gro_tcphdr(m, s->gs_iphlen);
+
+	f->gf_head = m;
+	f->gf_tail = m_last(m);
+	f->gf_pf = pf;
+	f->gf_seq = ntohl(th->th_seq) + s->gs_len;
+	f->gf_iphlen = s->gs_iphlen;
+	f->gf_hlen = s->gs_hlen;
+	f->gf_mss = s->gs_len;
+	f->gf_closed = (th->th_flags & TH_PUSH) != 0;
+}
+
+/*
+ * Returns TRUE if the packet was merged into an earlier one of the list,
+ * in which case the caller must not touch it again.  A segment of a flow
+ * that can't be merged replaces the flow's earlier packet, as nothing may
+ * be merged past it without reordering the flow.
+ */
+static boolean_t
+dlil_gro_input(struct dlil_gro *gro, mbuf_t m, protocol_family_t pf)
+{
+	struct dlil_gro_flow *f = NULL;
+	struct dlil_gro_seg s;
+	boolean_t eligible;
+	uint32_t i;
+
+	if (!dlil_gro_parse(m, pf, &s, &eligible)) {
+		return FALSE;
+	}
+	if (eligible) {
+		gro->g_segs++;
+	}
+	for (i = 0; i < gro->g_nflows; i++) {
+		if (dlil_gro_same_flow(&gro->g_flows[i], m, pf, &s)) {
+			f = &gro->g_flows[i];
+			break;
+		}
+	}
+	if (f != NULL && eligible && dlil_gro_can_merge(f, m, &s)) {
+		dlil_gro_merge(f, m, &s);
+		gro->g_merged++;
+		return TRUE;
+	}
+	if (f == NULL && eligible) {
+		if (gro->g_nflows < DLIL_GRO_FLOWS) {
+			f = &gro->g_flows[gro->g_nflows++];
+		} else {
+			f = &gro->g_flows[gro->g_evict++ % DLIL_GRO_FLOWS];
+		}
+	}
+	if (f != NULL) {
+		if (eligible) {
+			dlil_gro_open(f, m, pf, &s);
+		} else {
+			f->gf_closed = TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*
+ * Called before the list the merged packets belong to is passed up.
+ */
+static void
+dlil_gro_flush(struct dlil_gro *gro)
+{
+	if (gro->g_segs != 0) {
+		os_atomic_add(&rx_gro_segs_in, gro->g_segs, relaxed);
+		os_atomic_add(&rx_gro_pkts_out, gro->g_segs - gro->g_merged,
+		    relaxed);
+	}
+	gro->g_nflows = 0;
+	gro->g_evict = 0;
+	gro->g_segs = 0;
+	gro->g_merged = 0;
+}
+
 static void
 dlil_input_packet_list_common(struct ifnet *ifp_param, mbuf_ref_t m,
     u_int32_t cnt, ifnet_model_t mode, boolean_t ext)
@@ -751,9 +1074,15 @@ dlil_input_packet_list_common(struct ifnet *ifp_param, mbuf_ref_t m,
 	u_int32_t poll_thresh = 0, poll_ival = 0;
 	int iorefcnt = 0;
 	boolean_t skip_bridge_filter = FALSE;
+	struct dlil_gro gro;
+	boolean_t gro_enabled;
 
 	KERNEL_DEBUG(DBG_FNC_DLIL_INPUT | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
+	/* merged packets may not be forwarded, they exceed the MTU */
+	gro_enabled = (rx_gro != 0 && ipforwarding == 0 && ip6_forwarding == 0);
+	gro.g_nflows = gro.g_evict = gro.g_segs = gro.g_merged = 0;
+
 	if (ext && mode == IFNET_MODEL_INPUT_POLL_ON && cnt > 1 &&
 	    (poll_ival = if_rxpoll_interval_pkts) > 0) {
 		poll_thresh = cnt;
@@ -1053,6 +1382,7 @@ skip_clat:
 		if (ifproto != last_ifproto) {
 			if (last_ifproto != NULL) {
 				/* pass up the list for the previous protocol */
+				dlil_gro_flush(&gro);
 				dlil_ifproto_input(last_ifproto, pkt_first);
 				pkt_first = NULL;
 				if_proto_free(last_ifproto);
@@ -1060,8 +1390,14 @@ skip_clat:
 			last_ifproto = ifproto;
 			if_proto_ref(ifproto);
 		}
-		/* extend the list */
+		/* extend the list, unless the packet is merged into another */
 		m->m_pkthdr.pkt_hdr = frame_header;
+		if (gro_enabled && (protocol_family == PF_INET ||
+		    protocol_family == PF_INET6) &&
+		    !(ifp->if_flags & IFF_LOOPBACK) &&
+		    dlil_gro_input(&gro, m, protocol_family)) {
+			goto next;
+		}
 		if (pkt_first == NULL) {
 			pkt_first = m;
 		} else {
@@ -1072,6 +1408,7 @@ skip_clat:
 next:
 		if (next_packet == NULL && last_ifproto != NULL) {
 			/* pass up the last list of packets */
+			dlil_gro_flush(&gro);
 			dlil_ifproto_input(last_ifproto, pkt_first);
 			if_proto_free(last_ifproto);
 			last_ifproto = NULL;
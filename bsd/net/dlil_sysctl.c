@@ -312,6 +312,27 @@ SYSCTL_QUAD(_net_link_generic_system, OID_AUTO,
     &hwcksum_dbg_finalized_data, "finalized payloads");
 
 
+
+/******************************************************************************
+* Section: software receive offload.                                         *
+******************************************************************************/
+
+uint32_t rx_gro = 0;
+SYSCTL_UINT(_net_link_generic_system, OID_AUTO, rx_gro,
+    CTLFLAG_RW | CTLFLAG_LOCKED, &rx_gro, 0,
+    "merge in-order TCP segments received in the same batch (off by default)");
+
+uint64_t rx_gro_segs_in = 0;
+SYSCTL_QUAD(_net_link_generic_system, OID_AUTO,
+    rx_gro_segs_in, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &rx_gro_segs_in, "TCP segments considered for receive offload");
+
+uint64_t rx_gro_pkts_out = 0;
+SYSCTL_QUAD(_net_link_generic_system, OID_AUTO,
+    rx_gro_pkts_out, CTLFLAG_RD | CTLFLAG_LOCKED,
+    &rx_gro_pkts_out, "TCP packets passed up after receive offload");
+
+
 /******************************************************************************
 * Section: DLIL debugging, notifications and sanity checks                   *
 ******************************************************************************/
@@ -122,6 +122,15 @@ extern uint64_t hwcksum_dbg_finalized_hdr;          /* Finalized headers. */
 extern uint64_t hwcksum_dbg_finalized_data;         /* Finalized payloads. */
 
 
+/******************************************************************************
+* Section: software receive offload.                                         *
+******************************************************************************/
+
+extern uint32_t rx_gro;                      /* enable/disable */
+extern uint64_t rx_gro_segs_in;              /* TCP segments considered for merging. */
+extern uint64_t rx_gro_pkts_out;             /* TCP packets passed up after merging. */
+
+
 /******************************************************************************
 * Section: DLIL debugging, notifications and sanity checks                   *
 ******************************************************************************/
@@ -1677,6 +1677,44 @@ nstat_inp_bluetooth_counts(struct inpcb *inp, nstat_interface_counts *buf, size_
 	return sizeof(nstat_interface_counts);
 }
 
+static size_t
+nstat_tcp_cc_model_info(struct inpcb *inp, nstat_tcp_cc_model *buf, size_t len)
+{
+	// Note, the caller has guaranteed that the buffer has been zeroed, there is no need to clear it again
+	struct tcpcb *tp = intotcpcb(inp);
+	struct tcp_cc_model model;
+
+	if (tp == NULL || CC_ALGO(tp)->get_model == NULL) {
+		// Only connections using a model-based congestion control have one to report
+		return 0;
+	}
+
+	if (buf == NULL) {
+		return sizeof(nstat_tcp_cc_model);
+	}
+
+	if (len < sizeof(nstat_tcp_cc_model)) {
+		return 0;
+	}
+
+	// if the pcb is in the dead state, we should stop using it
+	if (inp->inp_state == INPCB_STATE_DEAD || !tcp_cc_get_model(tp, &model)) {
+		return 0;
+	}
+	buf->nstat_cc_bw = model.ccm_bw;
+	buf->nstat_cc_pacing_rate = model.ccm_pacing_rate;
+	buf->nstat_cc_delivery_rate = model.ccm_delivery_rate;
+	buf->nstat_cc_min_rtt = model.ccm_min_rtt;
+	buf->nstat_cc_inflight_hi = model.ccm_inflight_hi;
+	buf->nstat_cc_inflight_lo = model.ccm_inflight_lo;
+	buf->nstat_cc_cwnd = model.ccm_cwnd;
+	buf->nstat_cc_pacing_gain = model.ccm_pacing_gain;
+	buf->nstat_cc_cwnd_gain = model.ccm_cwnd_gain;
+	buf->nstat_cc_state = model.ccm_state;
+	buf->nstat_cc_phase = model.ccm_phase;
+	return sizeof(nstat_tcp_cc_model);
+}
+
 static nstat_provider   nstat_tcp_provider;
 
 static errno_t
@@ -2225,6 +2263,9 @@ nstat_tcp_extensions(nstat_provider_cookie_t cookie, u_int32_t extension_id, voi
 	case NSTAT_EXTENDED_UPDATE_TYPE_BLUETOOTH_COUNTS:
 		return nstat_inp_bluetooth_counts(inp, (nstat_interface_counts *)buf, len);
 
+	case NSTAT_EXTENDED_UPDATE_TYPE_TCP_CC_MODEL:
+		return nstat_tcp_cc_model_info(inp, (nstat_tcp_cc_model *)buf, len);
+
 	case NSTAT_EXTENDED_UPDATE_TYPE_NECP_TLV:
 	default:
 		break;
@@ -419,6 +419,22 @@ typedef struct nstat_interface_counts {
 	u_int64_t       nstat_txbytes;
 } nstat_interface_counts;
 
+/* Path model of a TCP connection using a model-based congestion control (BBR) */
+typedef struct nstat_tcp_cc_model {
+	u_int64_t       nstat_cc_bw;                /* bottleneck bandwidth estimate, bytes per second */
+	u_int64_t       nstat_cc_pacing_rate;       /* bytes per second */
+	u_int64_t       nstat_cc_delivery_rate;     /* latest delivery rate sample, bytes per second */
+	u_int32_t       nstat_cc_min_rtt;           /* microseconds */
+	u_int32_t       nstat_cc_inflight_hi;       /* long-term bound on bytes in flight, 0 if unset */
+	u_int32_t       nstat_cc_inflight_lo;       /* short-term bound on bytes in flight, 0 if unset */
+	u_int32_t       nstat_cc_cwnd;
+	u_int16_t       nstat_cc_pacing_gain;       /* in units of 1/256 */
+	u_int16_t       nstat_cc_cwnd_gain;         /* in units of 1/256 */
+	u_int8_t        nstat_cc_state;             /* TCP_CC_BBR_STARTUP... */
+	u_int8_t        nstat_cc_phase;             /* TCP_CC_BBR_PHASE_DOWN... */
+	u_int8_t        nstat_cc_reserved[2];
+} nstat_tcp_cc_model;
+
 #define NSTAT_MAX_DOMAIN_NAME_LENGTH           256 /* As per RFC 2181 for full domain name */
 #define NSTAT_MAX_DOMAIN_OWNER_LENGTH          256
 #define NSTAT_MAX_DOMAIN_TRACKER_CONTEXT       256
@@ -812,10 +828,11 @@ enum{
 	, NSTAT_EXTENDED_UPDATE_TYPE_ORIGINAL_DOMAIN    = 4
 	, NSTAT_EXTENDED_UPDATE_TYPE_FUUID              = 5
 	, NSTAT_EXTENDED_UPDATE_TYPE_BLUETOOTH_COUNTS   = 6
+	, NSTAT_EXTENDED_UPDATE_TYPE_TCP_CC_MODEL       = 7
 };
 
 #define NSTAT_EXTENDED_UPDATE_TYPE_MIN  NSTAT_EXTENDED_UPDATE_TYPE_DOMAIN
-#define NSTAT_EXTENDED_UPDATE_TYPE_MAX  NSTAT_EXTENDED_UPDATE_TYPE_BLUETOOTH_COUNTS
+#define NSTAT_EXTENDED_UPDATE_TYPE_MAX  NSTAT_EXTENDED_UPDATE_TYPE_TCP_CC_MODEL
 
 
 #define NSTAT_EXTENDED_UPDATE_FLAG_MASK    0x00ffffffull    /* Maximum of 24 extension types allowed due to restrictions on specifying via filter flags */
@@ -892,6 +909,7 @@ enum{
 #define NSTAT_EXTENSION_FILTER_ORIGINAL_NECP_TLV        (1ull << (NSTAT_EXTENDED_UPDATE_TYPE_ORIGINAL_NECP_TLV + NSTAT_FILTER_ALLOWED_EXTENSIONS_SHIFT))
 #define NSTAT_EXTENSION_FILTER_ORIGINAL_DOMAIN_INFO     (1ull << (NSTAT_EXTENDED_UPDATE_TYPE_ORIGINAL_DOMAIN + NSTAT_FILTER_ALLOWED_EXTENSIONS_SHIFT))
 #define NSTAT_EXTENSION_FILTER_BLUETOOTH_COUNTS         (1ull << (NSTAT_EXTENDED_UPDATE_TYPE_BLUETOOTH_COUNTS + NSTAT_FILTER_ALLOWED_EXTENSIONS_SHIFT))
+#define NSTAT_EXTENSION_FILTER_TCP_CC_MODEL             (1ull << (NSTAT_EXTENDED_UPDATE_TYPE_TCP_CC_MODEL + NSTAT_FILTER_ALLOWED_EXTENSIONS_SHIFT))
 #define NSTAT_EXTENSION_FILTER_MASK                     (NSTAT_EXTENDED_UPDATE_FLAG_MASK << NSTAT_FILTER_ALLOWED_EXTENSIONS_SHIFT)
 
 // Version one is constrained to use only the following
@@ -193,7 +193,7 @@ os_cpu_in_cksum(const void *__sized_by(len) data, uint32_t len, uint32_t initial
 	return os_cpu_in_cksum_mbuf(&m, len, 0, initial_sum);
 }
 
-#if defined(__i386__) || defined(__x86_64__)
+#if defined(__i386__)
 
 /*
  * Checksum routine for Internet Protocol family headers (Portable Version).
@@ -204,19 +204,16 @@ os_cpu_in_cksum(const void *__sized_by(len) data, uint32_t len, uint32_t initial
  * A discussion of different implementation techniques can be found in
  * RFC 1071.
  *
- * The default implementation for 32-bit architectures is using
- * a 32-bit accumulator and operating on 16-bit operands.
+ * This implementation is using a 32-bit accumulator and operating
+ * on 16-bit operands; the 64-bit architectures have their own in
+ * assembly (dev/arm64/cpu_in_cksum.s, dev/i386/cpu_in_cksum.s), using
+ * 64-bit accumulators and operating on 32-bit operands.
  *
- * The default implementation for 64-bit architectures is using
- * a 64-bit accumulator and operating on 32-bit operands.
- *
- * Both versions are unrolled to handle 32 Byte / 64 Byte fragments as core
- * of the inner loop. After each iteration of the inner loop, a partial
- * reduction is done to avoid carry in long packets.
+ * The inner loop is unrolled to handle 32 Byte fragments as its core.
+ * After each iteration of the inner loop, a partial reduction is done
+ * to avoid carry in long packets.
  */
 
-#if !defined(__LP64__)
-/* 32-bit version */
 uint32_t
 os_cpu_in_cksum_mbuf(struct _mbuf *m, int len, int off, uint32_t initial_sum)
 {
@@ -366,171 +363,4 @@ post_initial_offset:
 	return final_acc & 0xffff;
 }
 
-#else /* __LP64__ */
-/* 64-bit version */
-uint32_t
-os_cpu_in_cksum_mbuf(struct _mbuf *m, int len, int off, uint32_t initial_sum)
-{
-	int mlen;
-	uint64_t sum, partial;
-	unsigned int final_acc;
-	uint8_t *data;
-	boolean_t needs_swap, started_on_odd;
-
-	VERIFY(len >= 0);
-	VERIFY(off >= 0);
-
-	needs_swap = FALSE;
-	started_on_odd = FALSE;
-	sum = initial_sum;
-
-	for (;;) {
-		if (PREDICT_FALSE(m == NULL)) {
-			CKSUM_ERR("%s: out of data\n", __func__);
-			return (uint32_t)-1;
-		}
-		mlen = m->_m_len;
-		if (mlen > off) {
-			mlen -= off;
-			data = m->_m_data + off;
-			goto post_initial_offset;
-		}
-		off -= mlen;
-		if (len == 0) {
-			break;
-		}
-		m = m->_m_next;
-	}
-
-	for (; len > 0; m = m->_m_next) {
-		if (PREDICT_FALSE(m == NULL)) {
-			CKSUM_ERR("%s: out of data\n", __func__);
-			return (uint32_t)-1;
-		}
-		mlen = m->_m_len;
-		data = m->_m_data;
-post_initial_offset:
-		if (mlen == 0) {
-			continue;
-		}
-		if (mlen > len) {
-			mlen = len;
-		}
-		len -= mlen;
-
-		partial = 0;
-		if ((uintptr_t)data & 1) {
-			/* Align on word boundary */
-			started_on_odd = !started_on_odd;
-#if BYTE_ORDER == LITTLE_ENDIAN
-			partial = *data << 8;
-#else
-			partial = *data;
-#endif
-			++data;
-			--mlen;
-		}
-		needs_swap = started_on_odd;
-		if ((uintptr_t)data & 2) {
-			if (mlen < 2) {
-				goto trailing_bytes;
-			}
-			partial += *(uint16_t *)(void *)data;
-			data += 2;
-			mlen -= 2;
-		}
-		while (mlen >= 64) {
-			__builtin_prefetch(data + 32);
-			__builtin_prefetch(data + 64);
-			partial += *(uint32_t *)(void *)data;
-			partial += *(uint32_t *)(void *)(data + 4);
-			partial += *(uint32_t *)(void *)(data + 8);
-			partial += *(uint32_t *)(void *)(data + 12);
-			partial += *(uint32_t *)(void *)(data + 16);
-			partial += *(uint32_t *)(void *)(data + 20);
-			partial += *(uint32_t *)(void *)(data + 24);
-			partial += *(uint32_t *)(void *)(data + 28);
-			partial += *(uint32_t *)(void *)(data + 32);
-			partial += *(uint32_t *)(void *)(data + 36);
-			partial += *(uint32_t *)(void *)(data + 40);
-			partial += *(uint32_t *)(void *)(data + 44);
-			partial += *(uint32_t *)(void *)(data + 48);
-			partial += *(uint32_t *)(void *)(data + 52);
-			partial += *(uint32_t *)(void *)(data + 56);
-			partial += *(uint32_t *)(void *)(data + 60);
-			data += 64;
-			mlen -= 64;
-			if (PREDICT_FALSE(partial & (3ULL << 62))) {
-				if (needs_swap) {
-					partial = (partial << 8) +
-					    (partial >> 56);
-				}
-				sum += (partial >> 32);
-				sum += (partial & 0xffffffff);
-				partial = 0;
-			}
-		}
-		/*
-		 * mlen is not updated below as the remaining tests
-		 * are using bit masks, which are not affected.
-		 */
-		if (mlen & 32) {
-			partial += *(uint32_t *)(void *)data;
-			partial += *(uint32_t *)(void *)(data + 4);
-			partial += *(uint32_t *)(void *)(data + 8);
-			partial += *(uint32_t *)(void *)(data + 12);
-			partial += *(uint32_t *)(void *)(data + 16);
-			partial += *(uint32_t *)(void *)(data + 20);
-			partial += *(uint32_t *)(void *)(data + 24);
-			partial += *(uint32_t *)(void *)(data + 28);
-			data += 32;
-		}
-		if (mlen & 16) {
-			partial += *(uint32_t *)(void *)data;
-			partial += *(uint32_t *)(void *)(data + 4);
-			partial += *(uint32_t *)(void *)(data + 8);
-			partial += *(uint32_t *)(void *)(data + 12);
-			data += 16;
-		}
-		if (mlen & 8) {
-			partial += *(uint32_t *)(void *)data;
-			partial += *(uint32_t *)(void *)(data + 4);
-			data += 8;
-		}
-		if (mlen & 4) {
-			partial += *(uint32_t *)(void *)data;
-			data += 4;
-		}
-		if (mlen & 2) {
-			partial += *(uint16_t *)(void *)data;
-			data += 2;
-		}
-trailing_bytes:
-		if (mlen & 1) {
-#if BYTE_ORDER == LITTLE_ENDIAN
-			partial += *data;
-#else
-			partial += *data << 8;
-#endif
-			started_on_odd = !started_on_odd;
-		}
-
-		if (needs_swap) {
-			partial = (partial << 8) + (partial >> 56);
-		}
-		sum += (partial >> 32) + (partial & 0xffffffff);
-		/*
-		 * Reduce sum to allow potential byte swap
-		 * in the next iteration without carry.
-		 */
-		sum = (sum >> 32) + (sum & 0xffffffff);
-	}
-	final_acc = (sum >> 48) + ((sum >> 32) & 0xffff) +
-	    ((sum >> 16) & 0xffff) + (sum & 0xffff);
-	final_acc = (final_acc >> 16) + (final_acc & 0xffff);
-	final_acc = (final_acc >> 16) + (final_acc & 0xffff);
-	return final_acc & 0xffff;
-}
-#endif /* __LP64 */
-
-#endif /* __i386__ || __x86_64__ */
+#endif /* __i386__ */
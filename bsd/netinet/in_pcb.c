@@ -83,6 +83,7 @@
 
 #include <libkern/OSAtomic.h>
 #include <kern/locks.h>
+#include <kern/smr.h>
 
 #include <machine/limits.h>
 
@@ -106,6 +107,7 @@
 
 #include <netinet/ip6.h>
 #include <netinet6/ip6_var.h>
+#include <netinet6/scope6_var.h>
 
 #include <sys/kdebug.h>
 #include <sys/random.h>
@@ -303,6 +305,40 @@ struct inp_flowhash_key {
 static u_int32_t inp_hash_seed = 0;
 #endif /* !SKYWALK */
 
+/*
+ * SO_REUSEPORT load balancing groups
+ *
+ * Unconnected UDP sockets and TCP listeners that share a { laddr, lport }
+ * with SO_REUSEPORT are gathered in a group hanging off the port head.
+ * Incoming flows are spread over the members by hashing their 4-tuple
+ * into a table of slots, each owned by a member. When a member joins,
+ * it takes its share of slots from the members that have the most; when
+ * it leaves, its slots are handed to the members that have the fewest.
+ * Flows owned by the other members are never moved.
+ */
+#define INPCB_LBGROUP_SLOTS     256
+#define INPCB_LBGROUP_MAX       INPCB_LBGROUP_SLOTS
+
+struct inpcblbgroup {
+	LIST_ENTRY(inpcblbgroup) il_link;
+	struct inp_flowhash_key_addr il_laddr;
+	uint32_t        il_lifscope;
+	int             il_af;
+	uint16_t        il_count;       /* number of members */
+	uint8_t         il_slots[INPCB_LBGROUP_SLOTS];  /* member of each slot */
+	uint16_t        il_nslots[INPCB_LBGROUP_MAX];   /* slots of each member */
+	struct inpcb    *il_members[INPCB_LBGROUP_MAX];
+};
+
+struct inpcblbgroup_key {
+	struct inp_flowhash_key_addr ilk_laddr;
+	struct inp_flowhash_key_addr ilk_faddr;
+	u_int32_t       ilk_lport;
+	u_int32_t       ilk_fport;
+};
+
+static u_int32_t inp_lbgroup_seed;
+
 static int infc_cmp(const struct inpcb *, const struct inpcb *);
 
 /* Flags used by inp_fc_getinp */
@@ -338,6 +374,8 @@ in_pcbinit(void)
 	VERIFY(!inpcb_initialized);
 	inpcb_initialized = 1;
 
+	inp_lbgroup_seed = RandomULong();
+
 	logging_config = atm_get_diagnostic_config();
 	if (logging_config & 0x80000000) {
 		inp_log_privacy = 1;
@@ -2106,6 +2144,14 @@ in_pcbdetach(struct inpcb *inp)
 }
 
 
+static void
+in_pcbfree_smr(smr_node_t node)
+{
+	struct inpcb *inp = __container_of(node, struct inpcb, inp_smr_node);
+
+	zfree(inp->inp_pcbinfo->ipi_zone, inp);
+}
+
 void
 in_pcbdispose(struct inpcb *inp)
 {
@@ -2177,8 +2223,13 @@ in_pcbdispose(struct inpcb *inp)
 		 * we deallocate the structure.
 		 */
 		ROUTE_RELEASE(&inp->inp_route);
+		/*
+		 * Lockless lookups may still be walking through the pcb;
+		 * one cached with its socket is deferred by sodealloc().
+		 */
 		if ((so->so_flags1 & SOF1_CACHED_IN_SOCK_LAYER) == 0) {
-			zfree(ipi->ipi_zone, inp);
+			smr_inpcb_call(&inp->inp_smr_node, sizeof(*inp),
+			    in_pcbfree_smr);
 		}
 		sodealloc(so);
 	}
@@ -2381,14 +2432,14 @@ in_pcblookup_local(struct inpcbinfo *pcbinfo, struct in_addr laddr,
 	KERNEL_DEBUG(DBG_FNC_PCB_LOOKUP | DBG_FUNC_START, 0, 0, 0, 0, 0);
 
 	if (!wild_okay) {
-		struct inpcbhead *head;
+		struct smrq_list_head *head;
 		/*
 		 * Look for an unconnected (wildcard foreign addr) PCB that
 		 * matches the local address and port we're looking for.
 		 */
 		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
 		    pcbinfo->ipi_hashmask)];
-		LIST_FOREACH(inp, head, inp_hash) {
+		smrq_serialized_foreach(inp, head, inp_hash) {
 			if (!(inp->inp_vflag & INP_IPV4)) {
 				continue;
 			}
@@ -2471,7 +2522,7 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
     u_int fport_arg, struct in_addr laddr, u_int lport_arg, int wildcard,
     uid_t *uid, gid_t *gid, struct ifnet *ifp)
 {
-	struct inpcbhead *head;
+	struct smrq_list_head *head;
 	struct inpcb *inp;
 	u_short fport = (u_short)fport_arg, lport = (u_short)lport_arg;
 	int found = 0;
@@ -2492,7 +2543,7 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 	 */
 	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr.s_addr, lport, fport,
 	    pcbinfo->ipi_hashmask)];
-	LIST_FOREACH(inp, head, inp_hash) {
+	smrq_serialized_foreach(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV4)) {
 			continue;
 		}
@@ -2534,7 +2585,7 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 
 	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
 	    pcbinfo->ipi_hashmask)];
-	LIST_FOREACH(inp, head, inp_hash) {
+	smrq_serialized_foreach(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV4)) {
 			continue;
 		}
@@ -2593,6 +2644,94 @@ in_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 	return found;
 }
 
+/*
+ * Take a want count on a pcb found in an smr_inpcb read section, whose
+ * generation count was gencnt when it matched.
+ *
+ * Freed inpcbs, including those cached in the socket layer with their
+ * socket, are only returned to their zone or reused after a grace
+ * period, so the pcb stays valid memory until the section is left.
+ * A different generation count means it was disposed of meanwhile;
+ * it is checked before touching the want count, and again once the
+ * count is held, in which case nothing else can have used it yet.
+ */
+struct inpcb *
+in_pcb_smr_acquire(struct inpcb *inp, inp_gen_t gencnt)
+{
+	assert(smr_inpcb_entered());
+
+	if (os_atomic_load(&inp->inp_gencnt, acquire) != gencnt ||
+	    in_pcb_checkstate(inp, WNT_ACQUIRE, 0) == WNT_STOPUSING) {
+		return NULL;
+	}
+	if (os_atomic_load(&inp->inp_gencnt, relaxed) != gencnt) {
+		os_atomic_dec(&inp->inp_wantcnt, relaxed);
+		return NULL;
+	}
+	return inp;
+}
+
+/*
+ * Finish a lockless lookup once the read section is left.  The receive
+ * restrictions may block, so they are checked now that the pcb is held.
+ *
+ * Returns NULL if the pcb can't be used, in which case the caller
+ * falls back to the locked lookup.
+ */
+struct inpcb *
+in_pcblookup_smr_validate(struct inpcb *inp, struct ifnet *ifp)
+{
+	if (inp == NULL) {
+		return NULL;
+	}
+
+	if (inp_restricted_recv(inp, ifp)) {
+		goto release;
+	}
+#if NECP
+	if (!necp_socket_is_allowed_to_recv_on_interface(inp, ifp)) {
+		goto release;
+	}
+#endif /* NECP */
+	return inp;
+
+release:
+	in_pcb_checkstate(inp, WNT_RELEASE, 0);
+	return NULL;
+}
+
+/*
+ * Lockless lookup of a connected PCB, which is what most inbound
+ * segments and datagrams are for.
+ */
+static struct inpcb *
+in_pcblookup_hash_smr(struct inpcbinfo *pcbinfo, struct in_addr faddr,
+    u_short fport, struct in_addr laddr, u_short lport, struct ifnet *ifp)
+{
+	struct smrq_list_head *head;
+	struct inpcb *inp;
+	inp_gen_t gencnt = 0;
+
+	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr.s_addr, lport, fport,
+	    pcbinfo->ipi_hashmask)];
+
+	smr_inpcb_enter();
+	smrq_entered_foreach(inp, head, inp_hash) {
+		gencnt = os_atomic_load(&inp->inp_gencnt, acquire);
+		if ((inp->inp_vflag & INP_IPV4) &&
+		    inp->inp_faddr.s_addr == faddr.s_addr &&
+		    inp->inp_laddr.s_addr == laddr.s_addr &&
+		    inp->inp_fport == fport &&
+		    inp->inp_lport == lport) {
+			inp = in_pcb_smr_acquire(inp, gencnt);
+			break;
+		}
+	}
+	smr_inpcb_leave();
+
+	return in_pcblookup_smr_validate(inp, ifp);
+}
+
 /*
  * Lookup PCB in hash list.
  */
@@ -2601,7 +2740,7 @@ in_pcblookup_hash_locked(struct inpcbinfo *pcbinfo, struct in_addr faddr,
     u_int fport_arg, struct in_addr laddr, u_int lport_arg, int wildcard,
     struct ifnet *ifp)
 {
-	struct inpcbhead *head;
+	struct smrq_list_head *head;
 	struct inpcb *inp;
 	u_short fport = (u_short)fport_arg, lport = (u_short)lport_arg;
 	struct inpcb *local_wild = NULL;
@@ -2612,7 +2751,7 @@ in_pcblookup_hash_locked(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 	 */
 	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr.s_addr, lport, fport,
 	    pcbinfo->ipi_hashmask)];
-	LIST_FOREACH(inp, head, inp_hash) {
+	smrq_serialized_foreach(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV4)) {
 			continue;
 		}
@@ -2650,9 +2789,15 @@ in_pcblookup_hash_locked(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 		return NULL;
 	}
 
+	inp = in_pcblbgroup_lookup(pcbinfo, AF_INET, &laddr, 0, lport,
+	    &faddr, fport, ifp, 0);
+	if (inp != NULL) {
+		return inp;
+	}
+
 	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
 	    pcbinfo->ipi_hashmask)];
-	LIST_FOREACH(inp, head, inp_hash) {
+	smrq_serialized_foreach(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV4)) {
 			continue;
 		}
@@ -2685,6 +2830,14 @@ in_pcblookup_hash_locked(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 			}
 		}
 	}
+
+	/* nothing is bound to laddr, balance over the wildcard group */
+	inp = in_pcblbgroup_lookup(pcbinfo, AF_INET, &laddr, 0, lport,
+	    &faddr, fport, ifp, 1);
+	if (inp != NULL) {
+		return inp;
+	}
+
 	if (local_wild == NULL) {
 		if (local_wild_mapped != NULL) {
 			if (in_pcb_checkstate(local_wild_mapped,
@@ -2713,6 +2866,12 @@ in_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 {
 	struct inpcb *inp;
 
+	inp = in_pcblookup_hash_smr(pcbinfo, faddr, (u_short)fport_arg, laddr,
+	    (u_short)lport_arg, ifp);
+	if (inp != NULL) {
+		return inp;
+	}
+
 	lck_rw_lock_shared(&pcbinfo->ipi_lock);
 
 	inp = in_pcblookup_hash_locked(pcbinfo, faddr, fport_arg, laddr,
@@ -2756,7 +2915,7 @@ in_pcblookup_hash_try(struct inpcbinfo *pcbinfo, struct in_addr faddr,
 int
 in_pcbinshash(struct inpcb *inp, struct sockaddr *remote, int locked)
 {
-	struct inpcbhead *pcbhash;
+	struct smrq_list_head *pcbhash;
 	struct inpcbporthead *pcbporthash;
 	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
 	struct inpcbport *phd;
@@ -2818,6 +2977,7 @@ in_pcbinshash(struct inpcb *inp, struct sockaddr *remote, int locked)
 		phd = kalloc_type(struct inpcbport, Z_WAITOK | Z_NOFAIL);
 		phd->phd_port = inp->inp_lport;
 		LIST_INIT(&phd->phd_pcblist);
+		LIST_INIT(&phd->phd_lbgroups);
 		LIST_INSERT_HEAD(pcbporthash, phd, phd_hash);
 	}
 
@@ -2850,9 +3010,14 @@ in_pcbinshash(struct inpcb *inp, struct sockaddr *remote, int locked)
 
 	inp->inp_phd = phd;
 	LIST_INSERT_HEAD(&phd->phd_pcblist, inp, inp_portlist);
-	LIST_INSERT_HEAD(pcbhash, inp, inp_hash);
+	smrq_serialized_insert_head(pcbhash, &inp->inp_hash);
 	inp->inp_flags2 |= INP2_INHASHLIST;
 
+	/* TCP sockets join their group when they start listening */
+	if (inp->inp_socket->so_type == SOCK_DGRAM) {
+		in_pcblbgroup_insert(inp, 1);
+	}
+
 	if (!locked) {
 		lck_rw_done(&pcbinfo->ipi_lock);
 	}
@@ -2874,7 +3039,7 @@ in_pcbinshash(struct inpcb *inp, struct sockaddr *remote, int locked)
 void
 in_pcbrehash(struct inpcb *inp)
 {
-	struct inpcbhead *head;
+	struct smrq_list_head *head;
 	u_int32_t hashkey_faddr;
 
 #if SKYWALK
@@ -2914,6 +3079,12 @@ in_pcbrehash(struct inpcb *inp)
 		inp_update_netns_flags(so);
 	}
 #endif /* SKYWALK */
+	if (inp->inp_flags2 & INP2_INHASHLIST) {
+		head = &inp->inp_pcbinfo->ipi_hashbase[inp->inp_hash_element];
+		smrq_serialized_remove(head, &inp->inp_hash);
+		inp->inp_flags2 &= ~INP2_INHASHLIST;
+	}
+
 	if (inp->inp_vflag & INP_IPV6) {
 		hashkey_faddr = inp->in6p_faddr.s6_addr32[3] /* XXX */;
 	} else {
@@ -2924,15 +3095,17 @@ in_pcbrehash(struct inpcb *inp)
 	    inp->inp_fport, inp->inp_pcbinfo->ipi_hashmask);
 	head = &inp->inp_pcbinfo->ipi_hashbase[inp->inp_hash_element];
 
-	if (inp->inp_flags2 & INP2_INHASHLIST) {
-		LIST_REMOVE(inp, inp_hash);
-		inp->inp_flags2 &= ~INP2_INHASHLIST;
-	}
-
 	VERIFY(!(inp->inp_flags2 & INP2_INHASHLIST));
-	LIST_INSERT_HEAD(head, inp, inp_hash);
+	smrq_serialized_insert_head(head, &inp->inp_hash);
 	inp->inp_flags2 |= INP2_INHASHLIST;
 
+	/*
+	 * Connected sockets don't take flows from their group, and don't
+	 * join it back on disconnect as their laddr may be reset without
+	 * a rehash.
+	 */
+	in_pcblbgroup_remove(inp);
+
 #if NECP
 	// This call catches updates to the remote addresses
 	inp_update_necp_policy(inp, NULL, NULL, 0);
@@ -2958,9 +3131,15 @@ in_pcbremlists(struct inpcb *inp)
 
 		VERIFY(phd != NULL && inp->inp_lport > 0);
 
-		LIST_REMOVE(inp, inp_hash);
-		inp->inp_hash.le_next = NULL;
-		inp->inp_hash.le_prev = NULL;
+		in_pcblbgroup_remove(inp);
+
+		/*
+		 * SMR readers may still be walking through the pcb,
+		 * leave its next pointer alone.
+		 */
+		smrq_serialized_remove(
+			&inp->inp_pcbinfo->ipi_hashbase[inp->inp_hash_element],
+			&inp->inp_hash);
 
 		LIST_REMOVE(inp, inp_portlist);
 		inp->inp_portlist.le_next = NULL;
@@ -2998,6 +3177,288 @@ in_pcbremlists(struct inpcb *inp)
 	inp->inp_pcbinfo->ipi_count--;
 }
 
+static bool
+in_pcblbgroup_addr_matches(struct inpcblbgroup *grp, int af,
+    const void *laddr, uint32_t lifscope)
+{
+	if (af == AF_INET) {
+		return grp->il_laddr.infha.v4.s_addr ==
+		       ((const struct in_addr *)laddr)->s_addr;
+	}
+	return in6_are_addr_equal_scoped(&grp->il_laddr.infha.v6,
+	           (const struct in6_addr *)laddr, grp->il_lifscope, lifscope);
+}
+
+static bool
+in_pcblbgroup_addr_is_any(struct inpcblbgroup *grp)
+{
+	if (grp->il_af == AF_INET) {
+		return grp->il_laddr.infha.v4.s_addr == INADDR_ANY;
+	}
+	return IN6_IS_ADDR_UNSPECIFIED(&grp->il_laddr.infha.v6);
+}
+
+static struct inpcbport *
+in_pcblbgroup_port(struct inpcbinfo *pcbinfo, u_short lport)
+{
+	struct inpcbporthead *porthash;
+	struct inpcbport *phd;
+
+	porthash = &pcbinfo->ipi_porthashbase[INP_PCBPORTHASH(lport,
+	    pcbinfo->ipi_porthashmask)];
+	LIST_FOREACH(phd, porthash, phd_hash) {
+		if (phd->phd_port == lport) {
+			return phd;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a bound, unconnected SO_REUSEPORT pcb to the group of its
+ * { laddr, lport }, creating the group if needed.
+ *
+ * @param	locked	Implies if ipi_lock is already held exclusively.
+ */
+void
+in_pcblbgroup_insert(struct inpcb *inp, int locked)
+{
+	struct inpcbinfo *pcbinfo = inp->inp_pcbinfo;
+	struct socket *so = inp->inp_socket;
+	struct inpcbport *phd;
+	struct inpcblbgroup *grp;
+	const void *laddr;
+	uint32_t lifscope = 0;
+	uint16_t idx, target;
+	int af = SOCK_DOM(so);
+
+	if (!(so->so_options & SO_REUSEPORT) ||
+	    (inp->inp_flags2 & INP2_INLBGROUP)) {
+		return;
+	}
+
+	if (!locked) {
+		if (!lck_rw_try_lock_exclusive(&pcbinfo->ipi_lock)) {
+			socket_unlock(so, 0);
+			lck_rw_lock_exclusive(&pcbinfo->ipi_lock);
+			socket_lock(so, 0);
+		}
+	}
+	LCK_RW_ASSERT(&pcbinfo->ipi_lock, LCK_RW_ASSERT_EXCLUSIVE);
+
+	phd = inp->inp_phd;
+	if (inp->inp_state == INPCB_STATE_DEAD ||
+	    (inp->inp_flags2 & (INP2_INHASHLIST | INP2_INLBGROUP)) !=
+	    INP2_INHASHLIST) {
+		goto done;
+	}
+
+	if (af == AF_INET6) {
+		if (!IN6_IS_ADDR_UNSPECIFIED(&inp->in6p_faddr)) {
+			goto done;
+		}
+		laddr = &inp->in6p_laddr;
+		lifscope = inp->inp_lifscope;
+	} else {
+		if (inp->inp_faddr.s_addr != INADDR_ANY) {
+			goto done;
+		}
+		laddr = &inp->inp_laddr;
+	}
+
+	LIST_FOREACH(grp, &phd->phd_lbgroups, il_link) {
+		if (grp->il_af == af &&
+		    in_pcblbgroup_addr_matches(grp, af, laddr, lifscope)) {
+			break;
+		}
+	}
+
+	if (grp == NULL) {
+		grp = kalloc_type(struct inpcblbgroup, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+		grp->il_af = af;
+		grp->il_lifscope = lifscope;
+		if (af == AF_INET6) {
+			grp->il_laddr.infha.v6 = inp->in6p_laddr;
+		} else {
+			grp->il_laddr.infha.v4 = inp->inp_laddr;
+		}
+		LIST_INSERT_HEAD(&phd->phd_lbgroups, grp, il_link);
+	} else if (grp->il_count == INPCB_LBGROUP_MAX) {
+		/* the pcb is still found by the regular lookup */
+		goto done;
+	}
+
+	idx = grp->il_count++;
+	grp->il_members[idx] = inp;
+	grp->il_nslots[idx] = 0;
+	inp->inp_flags2 |= INP2_INLBGROUP;
+
+	if (idx == 0) {
+		grp->il_nslots[0] = INPCB_LBGROUP_SLOTS;
+		goto done;
+	}
+
+	/* take a fair share of slots from the members having more */
+	target = INPCB_LBGROUP_SLOTS / grp->il_count;
+	for (int s = 0; s < INPCB_LBGROUP_SLOTS &&
+	    grp->il_nslots[idx] < target; s++) {
+		uint8_t owner = grp->il_slots[s];
+
+		if (grp->il_nslots[owner] > target) {
+			grp->il_nslots[owner]--;
+			grp->il_slots[s] = (uint8_t)idx;
+			grp->il_nslots[idx]++;
+		}
+	}
+
+done:
+	if (!locked) {
+		lck_rw_done(&pcbinfo->ipi_lock);
+	}
+}
+
+/*
+ * Remove a pcb from its SO_REUSEPORT group, handing its slots to the
+ * members having the fewest, and free the group when it becomes empty.
+ *
+ * Must be called with the pcbinfo lock held in exclusive mode.
+ */
+void
+in_pcblbgroup_remove(struct inpcb *inp)
+{
+	struct inpcbport *phd = inp->inp_phd;
+	struct inpcblbgroup *grp;
+	uint16_t idx = 0, last;
+
+	if (!(inp->inp_flags2 & INP2_INLBGROUP)) {
+		return;
+	}
+	LCK_RW_ASSERT(&inp->inp_pcbinfo->ipi_lock, LCK_RW_ASSERT_EXCLUSIVE);
+
+	LIST_FOREACH(grp, &phd->phd_lbgroups, il_link) {
+		for (idx = 0; idx < grp->il_count; idx++) {
+			if (grp->il_members[idx] == inp) {
+				goto found;
+			}
+		}
+	}
+	panic("%s: inp %p not found in its group", __func__, inp);
+
+found:
+	inp->inp_flags2 &= ~INP2_INLBGROUP;
+	last = --grp->il_count;
+	if (last == 0) {
+		LIST_REMOVE(grp, il_link);
+		kfree_type(struct inpcblbgroup, grp);
+		return;
+	}
+
+	/* hand the slots of the pcb to the least loaded members */
+	for (int s = 0; s < INPCB_LBGROUP_SLOTS; s++) {
+		uint16_t least = idx == 0 ? 1 : 0;
+
+		if (grp->il_slots[s] != idx) {
+			continue;
+		}
+		for (uint16_t m = 0; m <= last; m++) {
+			if (m != idx && grp->il_nslots[m] < grp->il_nslots[least]) {
+				least = m;
+			}
+		}
+		grp->il_slots[s] = (uint8_t)least;
+		grp->il_nslots[least]++;
+	}
+
+	/* move the last member in the freed index */
+	if (idx != last) {
+		grp->il_members[idx] = grp->il_members[last];
+		grp->il_nslots[idx] = grp->il_nslots[last];
+		for (int s = 0; s < INPCB_LBGROUP_SLOTS; s++) {
+			if (grp->il_slots[s] == last) {
+				grp->il_slots[s] = (uint8_t)idx;
+			}
+		}
+	}
+	grp->il_members[last] = NULL;
+	grp->il_nslots[last] = 0;
+}
+
+/*
+ * Pick the member of an SO_REUSEPORT group on lport that owns the flow:
+ * the group bound to laddr, or with wildcard set, the one bound to the
+ * unspecified address.  The caller looks up the wildcard group only once
+ * no pcb is bound to laddr, so that such a pcb keeps taking precedence
+ * over the wildcard sockets whether they are in a group or not.
+ *
+ * Returns the pcb with a want count held, or NULL if there is no group
+ * or no member can receive the flow, in which case the caller falls back
+ * to the regular wildcard lookup.
+ *
+ * Must be called with the pcbinfo lock held.
+ */
+struct inpcb *
+in_pcblbgroup_lookup(struct inpcbinfo *pcbinfo, int af, const void *laddr,
+    uint32_t lifscope, u_short lport, const void *faddr, u_short fport,
+    struct ifnet *ifp, int wildcard)
+{
+	struct inpcblbgroup_key key __attribute__((aligned(8)));
+	struct inpcblbgroup *grp;
+	struct inpcbport *phd;
+	uint32_t hash;
+
+	phd = in_pcblbgroup_port(pcbinfo, lport);
+	if (phd == NULL || LIST_EMPTY(&phd->phd_lbgroups)) {
+		return NULL;
+	}
+
+	LIST_FOREACH(grp, &phd->phd_lbgroups, il_link) {
+		if (grp->il_af != af) {
+			continue;
+		}
+		if (wildcard ? in_pcblbgroup_addr_is_any(grp) :
+		    in_pcblbgroup_addr_matches(grp, af, laddr, lifscope)) {
+			break;
+		}
+	}
+	if (grp == NULL) {
+		return NULL;
+	}
+
+	bzero(&key, sizeof(key));
+	if (af == AF_INET6) {
+		key.ilk_laddr.infha.v6 = *(const struct in6_addr *)laddr;
+		key.ilk_faddr.infha.v6 = *(const struct in6_addr *)faddr;
+	} else {
+		key.ilk_laddr.infha.v4 = *(const struct in_addr *)laddr;
+		key.ilk_faddr.infha.v4 = *(const struct in_addr *)faddr;
+	}
+	key.ilk_lport = lport;
+	key.ilk_fport = fport;
+	hash = net_flowhash(&key, sizeof(key), inp_lbgroup_seed);
+
+	/*
+	 * If the owner of the slot can't take the flow, probe the next
+	 * slots, which are likely owned by other members.
+	 */
+	for (int i = 0; i < INPCB_LBGROUP_SLOTS; i++) {
+		uint8_t slot = (uint8_t)(hash + i);
+		struct inpcb *inp = grp->il_members[grp->il_slots[slot]];
+
+		if (inp_restricted_recv(inp, ifp)) {
+			continue;
+		}
+#if NECP
+		if (!necp_socket_is_allowed_to_recv_on_interface(inp, ifp)) {
+			continue;
+		}
+#endif /* NECP */
+		if (in_pcb_checkstate(inp, WNT_ACQUIRE, 0) != WNT_STOPUSING) {
+			return inp;
+		}
+	}
+	return NULL;
+}
+
 /*
  * Mechanism used to defer the memory release of PCBs
  * The pcb list will contain the pcb until the reaper can clean it up if
@@ -79,6 +79,7 @@
 #include <sys/bitstring.h>
 #include <sys/tree.h>
 #include <kern/locks.h>
+#include <kern/smr_types.h>
 #include <kern/zalloc.h>
 #include <netinet/in_stat.h>
 #include <net/if_ports_used.h>
@@ -163,7 +164,7 @@ struct inp_necp_attributes {
  */
 struct inpcb {
 	decl_lck_mtx_data(, inpcb_mtx); /* inpcb per-socket mutex */
-	LIST_ENTRY(inpcb) inp_hash;     /* hash list */
+	struct smrq_link inp_hash;      /* hash list, SMR protected */
 	LIST_ENTRY(inpcb) inp_list;     /* list for all PCBs of this proto */
 	void    *inp_ppcb;              /* pointer to per-protocol pcb */
 	struct inpcbinfo *inp_pcbinfo;  /* PCB list info */
@@ -264,6 +265,7 @@ struct inpcb {
 	uint8_t inp_keepalive_datalen; /* keepalive data length */
 	uint8_t inp_keepalive_type;    /* type of application */
 	uint16_t inp_keepalive_interval; /* keepalive interval */
+	uint16_t inp_udp_segsize;      /* UDP_SEGMENT send segment size */
 	uint32_t inp_nstat_refcnt __attribute__((aligned(4)));
 	struct inp_stat *inp_stat;
 	struct inp_stat *inp_cstat;     /* cellular data */
@@ -281,6 +283,8 @@ struct inpcb {
 
 	char inp_last_proc_name[MAXCOMLEN + 1];
 	char inp_e_proc_name[MAXCOMLEN + 1];
+
+	struct smr_node inp_smr_node;   /* deferred free after hash removal */
 };
 
 #define IFNET_COUNT_TYPE(_ifp)                                      \
@@ -579,6 +583,7 @@ struct  xinpgen {
 struct inpcbport {
 	LIST_ENTRY(inpcbport) phd_hash;
 	struct inpcbhead phd_pcblist;
+	LIST_HEAD(, inpcblbgroup) phd_lbgroups; /* SO_REUSEPORT groups */
 	u_short phd_port;
 };
 
@@ -649,9 +654,11 @@ struct inpcbinfo {
 
 	/*
 	 * Per-protocol hash of pcbs, hashed by local and foreign
-	 * addresses and port numbers.
+	 * addresses and port numbers.  Modified with ipi_lock held
+	 * exclusively, and walked either with ipi_lock held or in
+	 * an smr_inpcb read section.
 	 */
-	struct inpcbhead        *__counted_by(ipi_hashbase_count) ipi_hashbase;
+	struct smrq_list_head   *__counted_by(ipi_hashbase_count) ipi_hashbase;
 	size_t                  ipi_hashbase_count;
 	u_long                  ipi_hashmask;
 
@@ -797,6 +804,8 @@ struct inpcbinfo {
 #define INP2_LAST_ROUTE_LOCAL   0x00080000 /* Last used route was local */
 #define INP2_ULTRA_CONSTRAINED_ALLOWED 0x00100000 /* Allow communication over ultra-constrained interfaces */
 #define INP2_ULTRA_CONSTRAINED_CHECKED 0x00200000 /* Checked entitlements for ultra-constrained interfaces */
+#define INP2_INLBGROUP          0x00400000 /* pcb is in a SO_REUSEPORT group */
+#define INP2_UDP_GRO            0x00800000 /* coalesce received UDP datagrams */
 
 /*
  * Flags passed to in_pcblookup*() functions.
@@ -875,6 +884,14 @@ extern int in_getsockaddr(struct socket *, struct sockaddr **);
 extern int in_getsockaddr_s(struct socket *, struct sockaddr_in *);
 extern int in_pcb_checkstate(struct inpcb *, int, int);
 extern void in_pcbremlists(struct inpcb *);
+extern void in_pcblbgroup_insert(struct inpcb *, int);
+extern void in_pcblbgroup_remove(struct inpcb *);
+extern struct inpcb *in_pcblbgroup_lookup(struct inpcbinfo *, int,
+    const void *, uint32_t, u_short, const void *, u_short, struct ifnet *,
+    int);
+extern struct inpcb *in_pcb_smr_acquire(struct inpcb *, inp_gen_t);
+extern struct inpcb *in_pcblookup_smr_validate(struct inpcb *,
+    struct ifnet *);
 extern void inpcb_to_compat(struct inpcb *, struct inpcb_compat *);
 #if XNU_TARGET_OS_OSX
 extern void inpcb_to_xinpcb64(struct inpcb *, struct xinpcb64 *);
@@ -0,0 +1,890 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include "tcp_includes.h"
+
+/*
+ * BBR congestion control, following draft-ietf-ccwg-bbr.
+ *
+ * BBR builds a model of the path from the delivery rate samples of
+ * incoming ACKs: the bottleneck bandwidth is the windowed max of the
+ * delivery rate and the propagation delay is the windowed min RTT.
+ * The connection is paced at a gain of the bandwidth estimate and
+ * cwnd is only a cap on the data in flight, at a gain of the BDP.
+ * Loss doesn't reduce the sending rate directly, it bounds the model
+ * through inflight_hi (long-term) and bw_lo/inflight_lo (short-term).
+ */
+
+static int tcp_bbr_init(struct tcpcb *tp);
+static int tcp_bbr_cleanup(struct tcpcb *tp);
+static void tcp_bbr_cwnd_init_or_reset(struct tcpcb *tp);
+static void tcp_bbr_pre_fr(struct tcpcb *tp);
+static void tcp_bbr_post_fr(struct tcpcb *tp, struct tcphdr *th);
+static void tcp_bbr_after_idle(struct tcpcb *tp);
+static void tcp_bbr_after_timeout(struct tcpcb *tp);
+static int tcp_bbr_delay_ack(struct tcpcb *tp, struct tcphdr *th);
+static void tcp_bbr_switch_cc(struct tcpcb *tp);
+static void tcp_bbr_rate_sample(struct tcpcb *tp, struct tcphdr *th);
+static void tcp_bbr_get_model(struct tcpcb *tp, struct tcp_cc_model *model);
+
+struct tcp_cc_algo tcp_cc_bbr = {
+	.name = "bbr",
+	.init = tcp_bbr_init,
+	.cleanup = tcp_bbr_cleanup,
+	.cwnd_init = tcp_bbr_cwnd_init_or_reset,
+	.pre_fr = tcp_bbr_pre_fr,
+	.post_fr = tcp_bbr_post_fr,
+	.after_idle = tcp_bbr_after_idle,
+	.after_timeout = tcp_bbr_after_timeout,
+	.delay_ack = tcp_bbr_delay_ack,
+	.switch_to = tcp_bbr_switch_cc,
+	.rate_sample = tcp_bbr_rate_sample,
+	.get_model = tcp_bbr_get_model
+};
+
+/*
+ * Gains are fixed point with BBR_SCALE fractional bits
+ */
+#define BBR_SCALE                   (8)
+#define BBR_UNIT                    (1 << BBR_SCALE)
+
+#define BBR_STARTUP_PACING_GAIN     (709)  /* 2.77 = 4 * ln(2) */
+#define BBR_STARTUP_CWND_GAIN       (512)  /* 2 */
+#define BBR_DRAIN_PACING_GAIN       (89)   /* 0.35 */
+#define BBR_PROBE_UP_PACING_GAIN    (320)  /* 1.25 */
+#define BBR_PROBE_DOWN_PACING_GAIN  (230)  /* 0.9 */
+#define BBR_PROBE_UP_CWND_GAIN      (576)  /* 2.25 */
+#define BBR_CWND_GAIN               (512)  /* 2 */
+#define BBR_PROBE_RTT_CWND_GAIN     (128)  /* 0.5 */
+
+#define BBR_BETA                    (179)  /* 0.7, multiplicative decrease of the short-term model */
+#define BBR_HEADROOM                (38)   /* 0.15, share of inflight_hi left to other flows */
+#define BBR_LOSS_THRESH             (5)    /* 2%, loss rate that bounds inflight_hi */
+#define BBR_FULL_BW_THRESH          (320)  /* 1.25, bw growth expected per round in STARTUP */
+#define BBR_FULL_BW_CNT             (3)    /* rounds without growth to leave STARTUP */
+
+#define BBR_MIN_RTT_WIN             (10 * USEC_PER_SEC)  /* min_rtt filter window */
+#define BBR_PROBE_RTT_DURATION      (200 * 1000)         /* 200 ms */
+#define BBR_PROBE_WAIT_BASE         (2 * USEC_PER_SEC)   /* time between bw probes ... */
+#define BBR_PROBE_WAIT_RAND         (USEC_PER_SEC)       /* ... plus up to one second */
+#define BBR_MAX_ROUNDS_TO_PROBE     (63)   /* upper bound for Reno coexistence */
+
+#define BBR_PACING_MARGIN           (1)    /* percent below the bw estimate */
+#define BBR_MIN_CWND_SEGS           (4)
+#define BBR_BURST_SHIFT             (12)   /* 1/(2^12) = 0.000244s, as for Prague */
+
+#define BBR_UNKNOWN_RTT             UINT32_MAX
+#define BBR_INFINITE_BW             UINT64_MAX
+#define BBR_INFINITE_INFLIGHT       UINT32_MAX
+
+#define PACING_INITIAL_RTT          (1000) /* 1ms, Only used without an RTT sample */
+
+static inline uint32_t
+bbr_min_cwnd(struct tcpcb *tp)
+{
+	return BBR_MIN_CWND_SEGS * tp->t_maxseg;
+}
+
+static inline uint64_t
+bbr_max_bw(struct tcpcb *tp)
+{
+	return MAX(tp->t_ccstate->bbr_bw_hi[0], tp->t_ccstate->bbr_bw_hi[1]);
+}
+
+/*
+ * Bandwidth used for pacing, bounded by the short-term model after loss
+ */
+static inline uint64_t
+bbr_bw(struct tcpcb *tp)
+{
+	return MIN(tp->t_ccstate->bbr_bw, tp->t_ccstate->bbr_bw_lo);
+}
+
+/*
+ * Bytes in flight at a gain of the estimated bandwidth-delay product
+ */
+static uint32_t
+bbr_bdp(struct tcpcb *tp, uint64_t bw, uint16_t gain)
+{
+	uint64_t bdp;
+
+	if (tp->t_ccstate->bbr_min_rtt == BBR_UNKNOWN_RTT || bw == 0) {
+		return tcp_initial_cwnd(tp);
+	}
+	bdp = bw * tp->t_ccstate->bbr_min_rtt / USEC_PER_SEC;
+	bdp = (bdp * gain) >> BBR_SCALE;
+
+	return (uint32_t)MIN(bdp, TCP_MAXWIN << TCP_MAX_WINSHIFT);
+}
+
+static uint32_t
+bbr_inflight_with_headroom(struct tcpcb *tp)
+{
+	uint32_t inflight_hi = tp->t_ccstate->bbr_inflight_hi;
+	uint32_t headroom;
+
+	if (inflight_hi == BBR_INFINITE_INFLIGHT) {
+		return inflight_hi;
+	}
+	headroom = (uint32_t)(((uint64_t)inflight_hi * BBR_HEADROOM) >> BBR_SCALE);
+	headroom = max(headroom, tp->t_maxseg);
+
+	return max(inflight_hi > headroom ? inflight_hi - headroom : 0,
+	    bbr_min_cwnd(tp));
+}
+
+static inline bool
+bbr_is_probing_bw(struct tcpcb *tp)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	return bbr->bbr_state == TCP_CC_BBR_STARTUP ||
+	       (bbr->bbr_state == TCP_CC_BBR_PROBE_BW &&
+	       (bbr->bbr_phase == TCP_CC_BBR_PHASE_REFILL ||
+	       bbr->bbr_phase == TCP_CC_BBR_PHASE_UP));
+}
+
+static void
+bbr_reset_lower_bounds(struct tcpcb *tp)
+{
+	tp->t_ccstate->bbr_bw_lo = BBR_INFINITE_BW;
+	tp->t_ccstate->bbr_inflight_lo = BBR_INFINITE_INFLIGHT;
+}
+
+static void
+bbr_reset_congestion_signals(struct tcpcb *tp)
+{
+	tp->t_ccstate->bbr_loss_in_cycle = 0;
+	tp->t_ccstate->bbr_lost_in_round = 0;
+	tp->t_ccstate->bbr_delivered_in_round = 0;
+	tp->t_ccstate->bbr_bw_latest = 0;
+	tp->t_ccstate->bbr_inflight_latest = 0;
+}
+
+static void
+bbr_set_state(struct tcpcb *tp, uint8_t state, uint8_t phase)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	bbr->bbr_state = state;
+	bbr->bbr_phase = phase;
+
+	switch (state) {
+	case TCP_CC_BBR_STARTUP:
+		bbr->bbr_pacing_gain = BBR_STARTUP_PACING_GAIN;
+		bbr->bbr_cwnd_gain = BBR_STARTUP_CWND_GAIN;
+		break;
+	case TCP_CC_BBR_DRAIN:
+		bbr->bbr_pacing_gain = BBR_DRAIN_PACING_GAIN;
+		bbr->bbr_cwnd_gain = BBR_STARTUP_CWND_GAIN;
+		break;
+	case TCP_CC_BBR_PROBE_BW:
+		bbr->bbr_cwnd_gain = BBR_CWND_GAIN;
+		if (phase == TCP_CC_BBR_PHASE_DOWN) {
+			bbr->bbr_pacing_gain = BBR_PROBE_DOWN_PACING_GAIN;
+		} else if (phase == TCP_CC_BBR_PHASE_UP) {
+			bbr->bbr_pacing_gain = BBR_PROBE_UP_PACING_GAIN;
+			bbr->bbr_cwnd_gain = BBR_PROBE_UP_CWND_GAIN;
+		} else {
+			bbr->bbr_pacing_gain = BBR_UNIT;
+		}
+		break;
+	case TCP_CC_BBR_PROBE_RTT:
+		bbr->bbr_pacing_gain = BBR_UNIT;
+		bbr->bbr_cwnd_gain = BBR_PROBE_RTT_CWND_GAIN;
+		break;
+	}
+	TCP_LOG_CC_MODEL(tp, "state");
+}
+
+static void
+bbr_clear_state(struct tcpcb *tp)
+{
+	bzero(&tp->t_ccstate->_bbr_state_, sizeof(tp->t_ccstate->_bbr_state_));
+
+	tp->t_ccstate->bbr_min_rtt = BBR_UNKNOWN_RTT;
+	tp->t_ccstate->bbr_inflight_hi = BBR_INFINITE_INFLIGHT;
+	tp->t_ccstate->bbr_last_delivered = tp->t_rate.delivered;
+	tp->t_ccstate->bbr_next_round_delivered = tp->t_rate.delivered;
+	bbr_reset_lower_bounds(tp);
+	bbr_set_state(tp, TCP_CC_BBR_STARTUP, 0);
+}
+
+/*
+ * A round trip ends when a segment sent after the start of the
+ * round has been delivered
+ */
+static void
+bbr_update_round(struct tcpcb *tp)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	struct tcp_rate *rate = &tp->t_rate;
+
+	bbr->bbr_round_start = 0;
+	if (rate->rs_tx_ts != 0 &&
+	    rate->rs_prior_delivered >= bbr->bbr_next_round_delivered) {
+		bbr->bbr_next_round_delivered = rate->delivered;
+		bbr->bbr_round_count++;
+		bbr->bbr_rounds_since_probe++;
+		bbr->bbr_round_start = 1;
+	}
+}
+
+/*
+ * Returns true when the min_rtt filter has expired and PROBE_RTT is due
+ */
+static bool
+bbr_update_min_rtt(struct tcpcb *tp, uint64_t now)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	struct tcp_rate *rate = &tp->t_rate;
+	uint32_t rtt = rate->rs_rtt;
+	bool expired;
+
+	/* Without tracked segments fall back to the smoothed RTT */
+	if (rtt == 0 && !TCP_RACK_ENABLED(tp) && tp->t_rttcur != 0) {
+		rtt = tp->t_rttcur * 1000;
+	}
+	expired = bbr->bbr_min_rtt != BBR_UNKNOWN_RTT &&
+	    now > bbr->bbr_min_rtt_stamp + BBR_MIN_RTT_WIN;
+
+	if (rtt != 0 && (rtt <= bbr->bbr_min_rtt || expired)) {
+		bbr->bbr_min_rtt = rtt;
+		bbr->bbr_min_rtt_stamp = now;
+	}
+	if (rate->rs_delivered > 0) {
+		bbr->bbr_idle_restart = 0;
+	}
+
+	return expired;
+}
+
+static void
+bbr_update_bw(struct tcpcb *tp)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	struct tcp_rate *rate = &tp->t_rate;
+	uint64_t bw;
+
+	if (!rate->rs_valid) {
+		return;
+	}
+	/* An interval shorter than min_rtt over-estimates the rate */
+	if (bbr->bbr_min_rtt != BBR_UNKNOWN_RTT &&
+	    rate->rs_interval < bbr->bbr_min_rtt) {
+		return;
+	}
+	bw = (uint64_t)rate->rs_delivered * USEC_PER_SEC / rate->rs_interval;
+	bbr->bbr_delivery_rate = bw;
+
+	bbr->bbr_bw_latest = MAX(bbr->bbr_bw_latest, bw);
+	bbr->bbr_inflight_latest = max(bbr->bbr_inflight_latest, rate->rs_delivered);
+
+	/* App-limited samples only count when they raise the estimate */
+	if (bw >= bbr->bbr_bw || !rate->rs_is_app_limited) {
+		bbr->bbr_bw_hi[0] = MAX(bbr->bbr_bw_hi[0], bw);
+		bbr->bbr_bw = bbr_max_bw(tp);
+	}
+}
+
+/*
+ * Cut the short-term model once per round in which loss was seen,
+ * except while probing for bandwidth where loss bounds inflight_hi
+ */
+static void
+bbr_adapt_lower_bounds(struct tcpcb *tp)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	if (bbr_is_probing_bw(tp) || bbr->bbr_lost_in_round == 0) {
+		return;
+	}
+	if (bbr->bbr_bw_lo == BBR_INFINITE_BW) {
+		bbr->bbr_bw_lo = bbr->bbr_bw;
+	}
+	if (bbr->bbr_inflight_lo == BBR_INFINITE_INFLIGHT) {
+		bbr->bbr_inflight_lo = tp->snd_cwnd;
+	}
+	bbr->bbr_bw_lo = MAX(bbr->bbr_bw_latest,
+	    (bbr->bbr_bw_lo * BBR_BETA) >> BBR_SCALE);
+	bbr->bbr_inflight_lo = max(bbr->bbr_inflight_latest,
+	    (uint32_t)(((uint64_t)bbr->bbr_inflight_lo * BBR_BETA) >> BBR_SCALE));
+}
+
+static bool
+bbr_is_loss_too_high(struct tcpcb *tp)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	uint64_t lost = bbr->bbr_lost_in_round;
+
+	if (lost == 0) {
+		return false;
+	}
+	return lost * BBR_UNIT >
+	       (lost + bbr->bbr_delivered_in_round) * BBR_LOSS_THRESH;
+}
+
+static void
+bbr_start_probe_down(struct tcpcb *tp, uint64_t now)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	/* Advance the max filter so that it spans two probe cycles */
+	bbr->bbr_bw_hi[1] = bbr->bbr_bw_hi[0];
+	bbr->bbr_bw_hi[0] = 0;
+
+	bbr_reset_congestion_signals(tp);
+	bbr->bbr_rounds_since_probe = 0;
+	bbr->bbr_probe_wait = BBR_PROBE_WAIT_BASE +
+	    (uint32_t)(random() % BBR_PROBE_WAIT_RAND);
+	bbr->bbr_cycle_stamp = now;
+	bbr_set_state(tp, TCP_CC_BBR_PROBE_BW, TCP_CC_BBR_PHASE_DOWN);
+}
+
+static void
+bbr_start_probe_refill(struct tcpcb *tp, uint64_t now)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	bbr_reset_lower_bounds(tp);
+	bbr->bbr_probe_up_rounds = 0;
+	bbr->bbr_probe_up_acked = 0;
+	bbr->bbr_cycle_stamp = now;
+	/* Wait for a round of data sent at the refilled rate */
+	bbr->bbr_next_round_delivered = tp->t_rate.delivered;
+	bbr_set_state(tp, TCP_CC_BBR_PROBE_BW, TCP_CC_BBR_PHASE_REFILL);
+}
+
+/*
+ * Grow inflight_hi exponentially per round while probing for bandwidth
+ */
+static void
+bbr_raise_inflight_hi_slope(struct tcpcb *tp)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	uint32_t cnt;
+
+	cnt = tp->snd_cwnd >> bbr->bbr_probe_up_rounds;
+	bbr->bbr_probe_up_cnt = max(cnt, tp->t_maxseg);
+	bbr->bbr_probe_up_rounds = min(bbr->bbr_probe_up_rounds + 1, 30);
+}
+
+static void
+bbr_start_probe_up(struct tcpcb *tp, uint64_t now)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	bbr_reset_congestion_signals(tp);
+	bbr->bbr_probe_up_rounds = 0;
+	bbr->bbr_probe_up_acked = 0;
+	bbr->bbr_cycle_stamp = now;
+	bbr_set_state(tp, TCP_CC_BBR_PROBE_BW, TCP_CC_BBR_PHASE_UP);
+	bbr_raise_inflight_hi_slope(tp);
+}
+
+static void
+bbr_probe_inflight_hi_upward(struct tcpcb *tp, uint32_t inflight)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	uint32_t delta;
+
+	if (bbr->bbr_inflight_hi == BBR_INFINITE_INFLIGHT ||
+	    inflight + tp->t_maxseg < bbr->bbr_inflight_hi) {
+		/* Not limited by inflight_hi, nothing to learn */
+		return;
+	}
+	bbr->bbr_probe_up_acked += tp->t_rate.rs_delivered;
+	if (bbr->bbr_probe_up_acked >= bbr->bbr_probe_up_cnt) {
+		delta = bbr->bbr_probe_up_acked / bbr->bbr_probe_up_cnt;
+		bbr->bbr_probe_up_acked -= delta * bbr->bbr_probe_up_cnt;
+		bbr->bbr_inflight_hi = min(bbr->bbr_inflight_hi + delta * tp->t_maxseg,
+		    TCP_MAXWIN << TCP_MAX_WINSHIFT);
+	}
+	if (bbr->bbr_round_start) {
+		bbr_raise_inflight_hi_slope(tp);
+	}
+}
+
+/*
+ * Loss above BBR_LOSS_THRESH while probing means that the probe went
+ * past what the path can hold, remember it in inflight_hi
+ */
+static void
+bbr_handle_loss_while_probing(struct tcpcb *tp, uint32_t inflight, uint64_t now)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	uint32_t target;
+
+	if (!bbr_is_loss_too_high(tp)) {
+		return;
+	}
+	target = (uint32_t)(((uint64_t)bbr_bdp(tp, bbr->bbr_bw, BBR_UNIT) *
+	    BBR_BETA) >> BBR_SCALE);
+	bbr->bbr_inflight_hi = max(max(inflight, target), bbr_min_cwnd(tp));
+	bbr->bbr_loss_in_cycle = 1;
+
+	if (bbr->bbr_state == TCP_CC_BBR_STARTUP) {
+		bbr->bbr_full_bw_reached = 1;
+	} else if (bbr->bbr_phase == TCP_CC_BBR_PHASE_UP ||
+	    bbr->bbr_phase == TCP_CC_BBR_PHASE_REFILL) {
+		bbr_start_probe_down(tp, now);
+	}
+	TCP_LOG_CC_MODEL(tp, "loss");
+}
+
+static void
+bbr_check_full_bw_reached(struct tcpcb *tp)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	if (bbr->bbr_full_bw_reached || !bbr->bbr_round_start ||
+	    tp->t_rate.rs_is_app_limited) {
+		return;
+	}
+	if (bbr->bbr_bw >= (bbr->bbr_full_bw * BBR_FULL_BW_THRESH) >> BBR_SCALE) {
+		bbr->bbr_full_bw = bbr->bbr_bw;
+		bbr->bbr_full_bw_cnt = 0;
+		return;
+	}
+	if (++bbr->bbr_full_bw_cnt >= BBR_FULL_BW_CNT) {
+		bbr->bbr_full_bw_reached = 1;
+	}
+}
+
+static bool
+bbr_is_time_to_probe(struct tcpcb *tp, uint64_t now)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	uint32_t rounds;
+
+	if (now - bbr->bbr_cycle_stamp > bbr->bbr_probe_wait) {
+		return true;
+	}
+	/* Probe at least as often as Reno would fill the same BDP */
+	rounds = min(bbr_bdp(tp, bbr->bbr_bw, BBR_UNIT) / tp->t_maxseg,
+	    BBR_MAX_ROUNDS_TO_PROBE);
+	return bbr->bbr_rounds_since_probe >= rounds;
+}
+
+static void
+bbr_update_probe_bw_cycle(struct tcpcb *tp, uint32_t inflight, uint64_t now)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	uint32_t bdp = bbr_bdp(tp, bbr->bbr_bw, BBR_UNIT);
+
+	switch (bbr->bbr_phase) {
+	case TCP_CC_BBR_PHASE_DOWN:
+		if (bbr_is_time_to_probe(tp, now)) {
+			bbr_start_probe_refill(tp, now);
+		} else if (inflight <= min(bdp, bbr_inflight_with_headroom(tp))) {
+			bbr->bbr_cycle_stamp = now;
+			bbr_set_state(tp, TCP_CC_BBR_PROBE_BW, TCP_CC_BBR_PHASE_CRUISE);
+		}
+		break;
+	case TCP_CC_BBR_PHASE_CRUISE:
+		if (bbr_is_time_to_probe(tp, now)) {
+			bbr_start_probe_refill(tp, now);
+		}
+		break;
+	case TCP_CC_BBR_PHASE_REFILL:
+		if (bbr->bbr_round_start) {
+			bbr_start_probe_up(tp, now);
+		}
+		break;
+	case TCP_CC_BBR_PHASE_UP:
+		/* The probe has built a queue once it spent a min_rtt above the BDP */
+		if (now - bbr->bbr_cycle_stamp > bbr->bbr_min_rtt &&
+		    inflight > ((uint64_t)bdp * BBR_PROBE_UP_PACING_GAIN) >> BBR_SCALE) {
+			bbr_start_probe_down(tp, now);
+		}
+		break;
+	}
+}
+
+static void
+bbr_exit_probe_rtt(struct tcpcb *tp, uint64_t now)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	bbr_reset_lower_bounds(tp);
+	tp->snd_cwnd = max(tp->snd_cwnd, bbr->bbr_prior_cwnd);
+	if (bbr->bbr_full_bw_reached) {
+		bbr_start_probe_down(tp, now);
+		bbr_set_state(tp, TCP_CC_BBR_PROBE_BW, TCP_CC_BBR_PHASE_CRUISE);
+	} else {
+		bbr_set_state(tp, TCP_CC_BBR_STARTUP, 0);
+	}
+}
+
+/*
+ * Drain the queue for at least BBR_PROBE_RTT_DURATION and a round trip
+ * so that a fresh min_rtt can be measured
+ */
+static void
+bbr_update_probe_rtt(struct tcpcb *tp, bool min_rtt_expired, uint32_t inflight,
+    uint64_t now)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	uint32_t probe_rtt_cwnd;
+
+	if (bbr->bbr_state != TCP_CC_BBR_PROBE_RTT) {
+		if (!min_rtt_expired || bbr->bbr_idle_restart) {
+			return;
+		}
+		bbr->bbr_prior_cwnd = IN_FASTRECOVERY(tp) ?
+		    max(bbr->bbr_prior_cwnd, tp->snd_cwnd) : tp->snd_cwnd;
+		bbr->bbr_probe_rtt_done_stamp = 0;
+		bbr->bbr_probe_rtt_round_done = 0;
+		bbr_set_state(tp, TCP_CC_BBR_PROBE_RTT, 0);
+	}
+
+	probe_rtt_cwnd = max(bbr_bdp(tp, bbr->bbr_bw, BBR_PROBE_RTT_CWND_GAIN),
+	    bbr_min_cwnd(tp));
+	if (bbr->bbr_probe_rtt_done_stamp == 0) {
+		if (inflight <= probe_rtt_cwnd) {
+			bbr->bbr_probe_rtt_done_stamp = now + BBR_PROBE_RTT_DURATION;
+			bbr->bbr_probe_rtt_round_done = 0;
+			bbr->bbr_next_round_delivered = tp->t_rate.delivered;
+		}
+		return;
+	}
+	if (bbr->bbr_round_start) {
+		bbr->bbr_probe_rtt_round_done = 1;
+	}
+	if (bbr->bbr_probe_rtt_round_done && now > bbr->bbr_probe_rtt_done_stamp) {
+		bbr->bbr_min_rtt_stamp = now;
+		bbr_exit_probe_rtt(tp, now);
+	}
+}
+
+static void
+bbr_update_state(struct tcpcb *tp, bool min_rtt_expired, uint32_t inflight,
+    uint64_t now)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	switch (bbr->bbr_state) {
+	case TCP_CC_BBR_STARTUP:
+		bbr_check_full_bw_reached(tp);
+		if (bbr->bbr_full_bw_reached) {
+			bbr_set_state(tp, TCP_CC_BBR_DRAIN, 0);
+		}
+		break;
+	case TCP_CC_BBR_DRAIN:
+		if (inflight <= bbr_bdp(tp, bbr->bbr_bw, BBR_UNIT)) {
+			bbr_start_probe_down(tp, now);
+		}
+		break;
+	case TCP_CC_BBR_PROBE_BW:
+		bbr_update_probe_bw_cycle(tp, inflight, now);
+		break;
+	}
+	bbr_update_probe_rtt(tp, min_rtt_expired, inflight, now);
+}
+
+static void
+bbr_set_pacing_rate(struct tcpcb *tp)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	uint64_t bw = bbr_bw(tp);
+	uint64_t rate;
+
+	if (bw == 0) {
+		/* Keep the initial rate until there is a sample */
+		return;
+	}
+	rate = (bw * bbr->bbr_pacing_gain) >> BBR_SCALE;
+	rate = rate * (100 - BBR_PACING_MARGIN) / 100;
+
+	/* Never slow down in STARTUP, the estimate is still growing */
+	if (bbr->bbr_full_bw_reached || rate > tp->t_pacer.rate) {
+		tp->t_pacer.rate = rate;
+	}
+	tp->t_pacer.tso_burst_size = max(tp->t_maxseg,
+	    (uint32_t)(tp->t_pacer.rate >> BBR_BURST_SHIFT));
+}
+
+static void
+bbr_set_cwnd(struct tcpcb *tp, uint32_t acked)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	uint32_t cwnd = tp->snd_cwnd;
+	uint32_t target, cap;
+
+	/* Packet conservation, don't send more than what left the network */
+	if (bbr->bbr_in_recovery) {
+		cwnd = cwnd > tp->t_rate.rs_lost ? cwnd - tp->t_rate.rs_lost : 0;
+		cwnd = max(cwnd, bbr_min_cwnd(tp));
+	}
+
+	target = bbr_bdp(tp, bbr->bbr_bw, bbr->bbr_cwnd_gain) +
+	    3 * tp->t_pacer.tso_burst_size;
+	if (bbr->bbr_full_bw_reached) {
+		cwnd = min(cwnd + acked, target);
+	} else if (cwnd < target || tp->t_rate.delivered < tcp_initial_cwnd(tp)) {
+		cwnd += acked;
+	}
+
+	if (bbr->bbr_state == TCP_CC_BBR_PROBE_RTT) {
+		cwnd = min(cwnd, bbr_bdp(tp, bbr->bbr_bw, BBR_PROBE_RTT_CWND_GAIN));
+	}
+
+	/* Bound by the long-term model while probing and the short-term one after loss */
+	cap = BBR_INFINITE_INFLIGHT;
+	if (bbr->bbr_state == TCP_CC_BBR_PROBE_BW &&
+	    bbr->bbr_phase != TCP_CC_BBR_PHASE_CRUISE) {
+		cap = bbr->bbr_inflight_hi;
+	} else if (bbr->bbr_state == TCP_CC_BBR_PROBE_RTT ||
+	    bbr->bbr_state == TCP_CC_BBR_PROBE_BW) {
+		cap = bbr_inflight_with_headroom(tp);
+	}
+	cap = min(cap, bbr->bbr_inflight_lo);
+	cwnd = min(cwnd, cap);
+
+	cwnd = max(cwnd, bbr_min_cwnd(tp));
+	tp->snd_cwnd = min(cwnd, TCP_MAXWIN << tp->snd_scale);
+	if (bbr->bbr_in_recovery) {
+		tp->snd_ssthresh = tp->snd_cwnd;
+	}
+}
+
+static void
+tcp_bbr_rate_sample(struct tcpcb *tp, struct tcphdr *th)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+	struct tcp_rate *rate = &tp->t_rate;
+	uint64_t now = tcp_rate_now();
+	uint32_t inflight, acked, cum_acked = 0;
+	bool min_rtt_expired;
+
+	VERIFY(bbr != NULL);
+
+	acked = (uint32_t)(rate->delivered - bbr->bbr_last_delivered);
+	bbr->bbr_last_delivered = rate->delivered;
+
+	/* snd_una is not updated yet */
+	if (SEQ_GT(th->th_ack, tp->snd_una)) {
+		cum_acked = BYTES_ACKED(th, tp);
+	}
+	inflight = tcp_flight_size(tp);
+	inflight = inflight > cum_acked ? inflight - cum_acked : 0;
+
+	bbr_update_round(tp);
+	if (bbr->bbr_round_start) {
+		/* Close the previous round */
+		bbr_adapt_lower_bounds(tp);
+		bbr->bbr_lost_in_round = 0;
+		bbr->bbr_delivered_in_round = 0;
+		bbr->bbr_bw_latest = 0;
+		bbr->bbr_inflight_latest = 0;
+	}
+	bbr->bbr_lost_in_round += rate->rs_lost;
+	bbr->bbr_delivered_in_round += acked;
+
+	min_rtt_expired = bbr_update_min_rtt(tp, now);
+	bbr_update_bw(tp);
+
+	if (bbr_is_probing_bw(tp)) {
+		bbr_handle_loss_while_probing(tp, inflight, now);
+	}
+	if (bbr->bbr_state == TCP_CC_BBR_PROBE_BW &&
+	    bbr->bbr_phase == TCP_CC_BBR_PHASE_UP) {
+		bbr_probe_inflight_hi_upward(tp, inflight);
+	}
+
+	bbr_update_state(tp, min_rtt_expired, inflight, now);
+
+	bbr_set_pacing_rate(tp);
+	bbr_set_cwnd(tp, acked);
+}
+
+static void
+tcp_bbr_get_model(struct tcpcb *tp, struct tcp_cc_model *model)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	model->ccm_bw = bbr->bbr_bw;
+	model->ccm_pacing_rate = tp->t_pacer.rate;
+	model->ccm_delivery_rate = bbr->bbr_delivery_rate;
+	model->ccm_min_rtt = bbr->bbr_min_rtt == BBR_UNKNOWN_RTT ? 0 : bbr->bbr_min_rtt;
+	model->ccm_inflight_hi = bbr->bbr_inflight_hi == BBR_INFINITE_INFLIGHT ?
+	    0 : bbr->bbr_inflight_hi;
+	model->ccm_inflight_lo = bbr->bbr_inflight_lo == BBR_INFINITE_INFLIGHT ?
+	    0 : bbr->bbr_inflight_lo;
+	model->ccm_cwnd = tp->snd_cwnd;
+	model->ccm_pacing_gain = bbr->bbr_pacing_gain;
+	model->ccm_cwnd_gain = bbr->bbr_cwnd_gain;
+	model->ccm_state = bbr->bbr_state;
+	model->ccm_phase = bbr->bbr_phase;
+}
+
+static void
+tcp_bbr_pre_fr(struct tcpcb *tp)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	/* Restored on exit, loss alone doesn't change the model */
+	if (!bbr->bbr_in_recovery) {
+		bbr->bbr_prior_cwnd = tp->snd_cwnd;
+	}
+	bbr->bbr_in_recovery = 1;
+
+	/* Start recovery with the data still in flight */
+	tp->snd_ssthresh = max(tcp_flight_size(tp), bbr_min_cwnd(tp));
+	tcp_cc_resize_sndbuf(tp);
+	TCP_LOG_CC_MODEL(tp, "recovery");
+}
+
+static void
+tcp_bbr_post_fr(struct tcpcb *tp, __unused struct tcphdr *th)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	if (bbr->bbr_in_recovery) {
+		tp->snd_cwnd = max(tp->snd_cwnd, bbr->bbr_prior_cwnd);
+		bbr->bbr_in_recovery = 0;
+	}
+	tp->snd_ssthresh = TCP_MAXWIN << TCP_MAX_WINSHIFT;
+}
+
+static void
+tcp_bbr_after_idle(struct tcpcb *tp)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	bbr->bbr_idle_restart = 1;
+
+	/* Restart at the estimated rate instead of at a high gain */
+	if (bbr->bbr_state == TCP_CC_BBR_PROBE_BW && bbr_bw(tp) != 0) {
+		tp->t_pacer.rate = bbr_bw(tp);
+		tp->t_pacer.tso_burst_size = max(tp->t_maxseg,
+		    (uint32_t)(tp->t_pacer.rate >> BBR_BURST_SHIFT));
+	}
+}
+
+static void
+tcp_bbr_after_timeout(struct tcpcb *tp)
+{
+	struct tcp_ccstate *bbr = tp->t_ccstate;
+
+	VERIFY(bbr != NULL);
+
+	/*
+	 * Avoid adjusting congestion window due to SYN retransmissions.
+	 * If more than one byte (SYN) is outstanding then it is still
+	 * needed to adjust the window.
+	 */
+	if (tp->t_state < TCPS_ESTABLISHED &&
+	    ((int)(tp->snd_max - tp->snd_una) <= 1)) {
+		return;
+	}
+
+	if (!bbr->bbr_in_recovery) {
+		bbr->bbr_prior_cwnd = tp->snd_cwnd;
+	}
+	bbr->bbr_in_recovery = 0;
+	bbr_reset_congestion_signals(tp);
+
+	/*
+	 * Close the congestion window down to one segment, it grows back
+	 * to the model with the data delivered after the timeout.
+	 */
+	tp->snd_cwnd = tp->t_maxseg;
+	tp->snd_ssthresh = TCP_MAXWIN << TCP_MAX_WINSHIFT;
+	TCP_LOG_CC_MODEL(tp, "timeout");
+}
+
+static int
+tcp_bbr_delay_ack(struct tcpcb *tp, struct tcphdr *th)
+{
+	return tcp_cc_delay_ack(tp, th);
+}
+
+int
+tcp_bbr_init(struct tcpcb *tp)
+{
+	os_atomic_inc(&tcp_cc_bbr.num_sockets, relaxed);
+
+	VERIFY(tp->t_ccstate != NULL);
+
+	bbr_clear_state(tp);
+	return 0;
+}
+
+int
+tcp_bbr_cleanup(struct tcpcb *tp)
+{
+#pragma unused(tp)
+	os_atomic_dec(&tcp_cc_bbr.num_sockets, relaxed);
+	return 0;
+}
+
+/*
+ * Initialize the congestion window for a connection
+ */
+void
+tcp_bbr_cwnd_init_or_reset(struct tcpcb *tp)
+{
+	uint32_t srtt;
+
+	VERIFY(tp->t_ccstate != NULL);
+
+	tcp_cc_cwnd_init_or_reset(tp);
+	tp->t_pipeack = 0;
+	tcp_clear_pipeack_state(tp);
+	tp->t_bytes_acked = 0;
+
+	/* BBR doesn't use slow start, cwnd follows the model */
+	tp->snd_ssthresh = TCP_MAXWIN << TCP_MAX_WINSHIFT;
+
+	if (tp->t_ccstate->bbr_bw == 0) {
+		/* Set initial pacer state, at the STARTUP gain of cwnd per RTT */
+		srtt = (tp->t_srtt >> TCP_RTT_SHIFT) * 1000;
+		if (srtt == 0) {
+			srtt = PACING_INITIAL_RTT;
+		}
+		tp->t_pacer.rate = (((uint64_t)tp->snd_cwnd * USEC_PER_SEC / srtt) *
+		    BBR_STARTUP_PACING_GAIN) >> BBR_SCALE;
+		tp->t_pacer.tso_burst_size = tp->t_maxseg;
+	} else {
+		bbr_set_pacing_rate(tp);
+	}
+}
+
+/*
+ * When switching from a different CC start with a fresh model, the
+ * path is probed again from STARTUP.
+ */
+static void
+tcp_bbr_switch_cc(struct tcpcb *tp)
+{
+	bbr_clear_state(tp);
+	tcp_bbr_cwnd_init_or_reset(tp);
+
+	os_atomic_inc(&tcp_cc_bbr.num_sockets, relaxed);
+}
@@ -44,6 +44,7 @@ extern struct tcp_cc_algo tcp_cc_newreno;
 extern struct tcp_cc_algo tcp_cc_ledbat;
 extern struct tcp_cc_algo tcp_cc_cubic;
 extern struct tcp_cc_algo tcp_cc_prague;
+extern struct tcp_cc_algo tcp_cc_bbr;
 
  #define SET_SNDSB_IDEAL_SIZE(sndsb, size) \
 	sndsb->sb_idealsize = min(max(tcp_sendspace, tp->snd_ssthresh), \
@@ -68,6 +69,7 @@ tcp_cc_init(void)
 	tcp_cc_algo_list[TCP_CC_ALGO_BACKGROUND_INDEX] = &tcp_cc_ledbat;
 	tcp_cc_algo_list[TCP_CC_ALGO_CUBIC_INDEX] = &tcp_cc_cubic;
 	tcp_cc_algo_list[TCP_CC_ALGO_PRAGUE_INDEX] = &tcp_cc_prague;
+	tcp_cc_algo_list[TCP_CC_ALGO_BBR_INDEX] = &tcp_cc_bbr;
 
 	tcp_ccdbg_control_register();
 }
@@ -215,6 +217,7 @@ tcp_cc_allocate_state(struct tcpcb *tp)
 {
 	if ((tp->tcp_cc_index == TCP_CC_ALGO_CUBIC_INDEX ||
 	    tp->tcp_cc_index == TCP_CC_ALGO_PRAGUE_INDEX ||
+	    tp->tcp_cc_index == TCP_CC_ALGO_BBR_INDEX ||
 	    tp->tcp_cc_index == TCP_CC_ALGO_BACKGROUND_INDEX) &&
 	    tp->t_ccstate == NULL) {
 		tp->t_ccstate = &tp->_t_ccstate;
@@ -223,6 +226,33 @@ tcp_cc_allocate_state(struct tcpcb *tp)
 	}
 }
 
+/*
+ * Hand the delivery rate sample of an ACK to the algorithms that model the
+ * path. Called after the S/ACKed segments and losses of the ACK have been
+ * processed and before snd_una is updated.
+ */
+void
+tcp_cc_rate_sample(struct tcpcb *tp, struct tcphdr *th)
+{
+	if (CC_ALGO(tp)->rate_sample == NULL) {
+		return;
+	}
+	tcp_rate_gen_sample(tp, th);
+	CC_ALGO(tp)->rate_sample(tp, th);
+	tcp_rate_sample_done(tp);
+}
+
+bool
+tcp_cc_get_model(struct tcpcb *tp, struct tcp_cc_model *model)
+{
+	if (CC_ALGO(tp)->get_model == NULL || tp->t_ccstate == NULL) {
+		return false;
+	}
+	bzero(model, sizeof(*model));
+	CC_ALGO(tp)->get_model(tp, model);
+	return true;
+}
+
 /*
  * If stretch ack was disabled automatically on long standing connections,
  * re-evaluate the situation after 15 minutes to enable it.
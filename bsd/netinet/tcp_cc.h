@@ -110,7 +110,39 @@ struct tcp_cc_debug_state {
 #define TCP_CC_ALGO_BACKGROUND_INDEX    2 /* CC for background transport */
 #define TCP_CC_ALGO_CUBIC_INDEX         3 /* default CC algorithm */
 #define TCP_CC_ALGO_PRAGUE_INDEX        4 /* L4S CC algorithm */
-#define TCP_CC_ALGO_COUNT               5 /* Count of CC algorithms */
+#define TCP_CC_ALGO_BBR_INDEX           5 /* Model-based CC algorithm */
+#define TCP_CC_ALGO_COUNT               6 /* Count of CC algorithms */
+
+/*
+ * Path model of a model-based congestion control algorithm
+ */
+struct tcp_cc_model {
+	uint64_t ccm_bw;                /* bottleneck bandwidth estimate, bytes per second */
+	uint64_t ccm_pacing_rate;       /* bytes per second */
+	uint64_t ccm_delivery_rate;     /* latest delivery rate sample, bytes per second */
+	uint32_t ccm_min_rtt;           /* microseconds */
+	uint32_t ccm_inflight_hi;       /* long-term bound on bytes in flight, 0 if unset */
+	uint32_t ccm_inflight_lo;       /* short-term bound on bytes in flight, 0 if unset */
+	uint32_t ccm_cwnd;
+	uint16_t ccm_pacing_gain;       /* in units of 1/256 */
+	uint16_t ccm_cwnd_gain;         /* in units of 1/256 */
+	uint8_t ccm_state;
+	uint8_t ccm_phase;
+	uint8_t ccm_unused[2];
+};
+
+/*
+ * Values of ccm_state and ccm_phase for BBR
+ */
+#define TCP_CC_BBR_STARTUP              1
+#define TCP_CC_BBR_DRAIN                2
+#define TCP_CC_BBR_PROBE_BW             3
+#define TCP_CC_BBR_PROBE_RTT            4
+
+#define TCP_CC_BBR_PHASE_DOWN           1 /* drain the queue created by probing */
+#define TCP_CC_BBR_PHASE_CRUISE         2 /* leave headroom for other flows */
+#define TCP_CC_BBR_PHASE_REFILL         3 /* refill the pipe before probing */
+#define TCP_CC_BBR_PHASE_UP             4 /* probe for more bandwidth */
 
 /*
  * Values of ccd_event
@@ -223,6 +255,12 @@ struct tcp_cc_algo {
 
 	/* Switch a connection to this CC algorithm after sending some packets */
 	void (*switch_to)(struct tcpcb *tp);
+
+	/* called with the delivery rate sample of an ACK, used by BBR only */
+	void (*rate_sample) (struct tcpcb *tp, struct tcphdr *th);
+
+	/* report the path model of the connection, used by BBR only */
+	void (*get_model) (struct tcpcb *tp, struct tcp_cc_model *model);
 } __attribute__((aligned(4)));
 
 extern struct tcp_cc_algo* tcp_cc_algo_list[TCP_CC_ALGO_COUNT];
@@ -280,6 +318,8 @@ extern uint32_t tcp_cc_is_cwnd_nonvalidated(struct tcpcb *tp);
 extern void tcp_cc_adjust_nonvalidated_cwnd(struct tcpcb *tp);
 extern u_int32_t tcp_get_max_pipeack(struct tcpcb *tp);
 extern void tcp_clear_pipeack_state(struct tcpcb *tp);
+extern void tcp_cc_rate_sample(struct tcpcb *tp, struct tcphdr *th);
+extern bool tcp_cc_get_model(struct tcpcb *tp, struct tcp_cc_model *model);
 
 static inline uint32_t
 tcp_initial_cwnd(struct tcpcb *tp)
@@ -556,6 +556,19 @@ tcp_bwmeas_check(struct tcpcb *tp)
 	}
 }
 
+/*
+ * Append in-order data to the receive buffer, through the kernel TLS
+ * record layer once the application installed its receive keys.
+ */
+static inline int
+tcp_sbappend_rcv(struct tcpcb *tp, struct socket *so, struct mbuf *m)
+{
+	if (tp->t_flagsext & TF_TLS_RX) {
+		return tcp_tls_input(tp, m);
+	}
+	return sbappendstream_rcvdemux(so, m);
+}
+
 static int
 tcp_reass(struct tcpcb *tp, struct tcphdr *th, int *tlenp, struct mbuf *m,
     struct ifnet *ifp, int *dowakeup)
@@ -812,7 +825,7 @@ present:
 				tp->t_flagsext &= ~TF_LAST_IS_PSH;
 			}
 
-			if (sbappendstream_rcvdemux(so, q->tqe_m)) {
+			if (tcp_sbappend_rcv(tp, so, q->tqe_m)) {
 				*dowakeup = 1;
 			}
 		}
@@ -2055,6 +2068,7 @@ tcp_input(struct mbuf *m, int off0)
 	bool findpcb_iterated = false;
 	bool rack_loss_detected = false;
 	bool is_th_swapped = false;
+	bool cc_rate_sampled = false;
 	/*
 	 * The mbuf may be freed after it has been added to the receive socket
 	 * buffer or the reassembly queue, so we reinitialize th to point to a
@@ -3286,6 +3300,9 @@ findpcb:
 					}
 				}
 
+				/* Update the path model of model-based CC */
+				tcp_cc_rate_sample(tp, th);
+
 				/*
 				 * Handle an ack that is in sequence during
 				 * congestion avoidance phase. The
@@ -3442,7 +3459,7 @@ findpcb:
 				tp->t_flagsext &= ~TF_LAST_IS_PSH;
 			}
 
-			if (sbappendstream_rcvdemux(so, m)) {
+			if (tcp_sbappend_rcv(tp, so, m)) {
 				mptcp_handle_input(so);
 				read_wakeup = 1;
 			}
@@ -5063,6 +5080,15 @@ process_dupack:
 				if (TCP_RACK_ENABLED(tp) && tcp_rack_detect_loss_and_arm_timer(tp, tp->t_dupacks)) {
 					rack_loss_detected = true;
 				}
+				/*
+				 * SACKed and lost bytes of this ACK update the path model
+				 * of model-based CC before any recovery decision, unless
+				 * it advanced snd_una and was sampled in process_ACK
+				 */
+				if (!cc_rate_sampled) {
+					tcp_cc_rate_sample(tp, th);
+					cc_rate_sampled = true;
+				}
 				/*
 				 * Below are four different processing of (dup) ACKs,
 				 * 1. Not a valid dup ACK
@@ -5494,6 +5520,10 @@ process_ACK:
 			}
 		}
 
+		/* Update the path model of model-based CC, also during recovery */
+		tcp_cc_rate_sample(tp, th);
+		cc_rate_sampled = true;
+
 		/*
 		 * When new data is acked, open the congestion window.
 		 * The specifics of how this is achieved are up to the
@@ -5858,7 +5888,7 @@ dodata:
 				tp->t_flagsext &= ~TF_LAST_IS_PSH;
 			}
 
-			if (sbappendstream_rcvdemux(so, m)) {
+			if (tcp_sbappend_rcv(tp, so, m)) {
 				read_wakeup = 1;
 			}
 			th = &saved_tcphdr;
@@ -7414,6 +7444,8 @@ tcp_set_foreground_cc(struct socket *so)
 {
 	if (tcp_use_newreno) {
 		tcp_set_new_cc(so, TCP_CC_ALGO_NEWRENO_INDEX);
+	} else if (tcp_use_bbr) {
+		tcp_set_new_cc(so, TCP_CC_ALGO_BBR_INDEX);
 #if (DEVELOPMENT || DEBUG)
 	} else if (tcp_use_ledbat) {
 		/* Only used for testing */
@@ -40,6 +40,7 @@
 #define TCPSTATES
 #include <netinet/tcp_fsm.h>
 
+#include <netinet/tcp_cc.h>
 #include <netinet/tcp_log.h>
 
 SYSCTL_NODE(_net_inet_tcp, OID_AUTO, log, CTLFLAG_RW | CTLFLAG_LOCKED, 0,
@@ -1219,6 +1220,62 @@ tcp_log_output(const char *func_name, int line_no, struct tcpcb *tp, const char
 #undef TCP_LOG_MESSAGE_ARGS
 }
 
+void
+tcp_log_cc_model(const char *func_name, int line_no, struct tcpcb *tp, const char *event)
+{
+	struct inpcb *inp;
+	struct socket *so;
+	struct ifnet *ifp;
+	char laddr_buf[ADDRESS_STR_LEN];
+	char faddr_buf[ADDRESS_STR_LEN];
+	in_port_t local_port;
+	in_port_t foreign_port;
+	struct tcp_cc_model model;
+
+	if (tp == NULL || tp->t_inpcb == NULL || tp->t_inpcb->inp_socket == NULL) {
+		return;
+	}
+	if (!tcp_cc_get_model(tp, &model)) {
+		return;
+	}
+
+	/* Do not log too much */
+	if (tcp_log_is_rate_limited()) {
+		return;
+	}
+
+	inp = tp->t_inpcb;
+	so = inp->inp_socket;
+
+	local_port = inp->inp_lport;
+	foreign_port = inp->inp_fport;
+
+	ifp = inp->inp_last_outifp != NULL ? inp->inp_last_outifp :
+	    inp->inp_boundifp != NULL ? inp->inp_boundifp : NULL;
+
+	tcp_log_inp_addresses(inp, laddr_buf, sizeof(laddr_buf), faddr_buf, sizeof(faddr_buf));
+
+#define TCP_LOG_CC_MODEL_FMT \
+	    "tcp_cc_model (%s:%d) " \
+	    TCP_LOG_COMMON_PCB_FMT \
+	    "%s cc: %s state: %u phase: %u " \
+	    "bw: %llu pacing_rate: %llu delivery_rate: %llu min_rtt: %u us " \
+	    "inflight_hi: %u inflight_lo: %u cwnd: %u pacing_gain: %u cwnd_gain: %u"
+
+#define TCP_LOG_CC_MODEL_ARGS \
+	func_name, line_no, \
+	TCP_LOG_COMMON_PCB_ARGS, \
+	event, CC_ALGO(tp)->name, model.ccm_state, model.ccm_phase, \
+	model.ccm_bw, model.ccm_pacing_rate, model.ccm_delivery_rate, model.ccm_min_rtt, \
+	model.ccm_inflight_hi, model.ccm_inflight_lo, model.ccm_cwnd, \
+	model.ccm_pacing_gain, model.ccm_cwnd_gain
+
+	os_log(OS_LOG_DEFAULT, TCP_LOG_CC_MODEL_FMT,
+	    TCP_LOG_CC_MODEL_ARGS);
+#undef TCP_LOG_CC_MODEL_FMT
+#undef TCP_LOG_CC_MODEL_ARGS
+}
+
 static int
 sysctl_tcp_log_port SYSCTL_HANDLER_ARGS
 {
@@ -50,7 +50,8 @@
 	X(TLEF_STATE,           0x00010000, state)      \
 	X(TLEF_SYN_RXMT,	0x00020000, synrxmt)    \
 	X(TLEF_OUTPUT,	        0x00040000, output)     \
-	X(TLEF_BIND,	        0x00080000, bind)
+	X(TLEF_BIND,	        0x00080000, bind)       \
+	X(TLEF_CC_MODEL,	0x00100000, ccmodel)
 
 /*
  * Flag values for tcp_log_enabled
@@ -106,6 +107,7 @@ extern void tcp_log_fsw_flow(const char *func_name, int line_no, struct tcpcb *t
 extern void tcp_log_state_change(const char *func_name, int line_no, struct tcpcb *tp, int new_state);
 extern void tcp_log_output(const char *func_name, int line_no, struct tcpcb *tp, const char *format, ...) __printflike(4, 5);
 extern void tcp_log_bind(struct inpcb *inp, const char *event, int error);
+extern void tcp_log_cc_model(const char *func_name, int line_no, struct tcpcb *tp, const char *event);
 
 
 #define IN6_IS_ADDR_V4MAPPED_LOOPBACK(a) \
@@ -244,6 +246,9 @@ tcp_log_summary_needed(struct tcpcb *tp)
 #define TCP_LOG_BIND(tp, error) if (tcp_is_log_enabled(tp, TLEF_BIND)) \
     tcp_log_connection((tp), "bind", (error))
 
+#define TCP_LOG_CC_MODEL(tp, event) if (tcp_is_log_enabled(tp, TLEF_CC_MODEL)) \
+    tcp_log_cc_model(__func__, __LINE__, (tp), (event))
+
 #endif /* BSD_KERNEL_PRIVATE */
 
 #endif /* _NETINET_TCP_LOG_H_ */
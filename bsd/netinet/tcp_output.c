@@ -1289,7 +1289,8 @@ after_sack_rexmit:
 		len = tcp_tfo_check(tp, len);
 	}
 
-	if (tp->tcp_cc_index == TCP_CC_ALGO_PRAGUE_INDEX &&
+	if ((tp->tcp_cc_index == TCP_CC_ALGO_PRAGUE_INDEX ||
+	    tp->tcp_cc_index == TCP_CC_ALGO_BBR_INDEX) &&
 	    tp->t_pacer.tso_burst_size != 0 && len > 0 &&
 	    (uint32_t)len > tp->t_pacer.tso_burst_size) {
 		len = tp->t_pacer.tso_burst_size;
@@ -1801,6 +1802,9 @@ just_return:
 	 * If there is no reason to send a segment, just return.
 	 * but if there is some packets left in the packet list, send them now.
 	 */
+	if (TCPS_HAVEESTABLISHED(tp->t_state)) {
+		tcp_rate_check_app_limited(tp);
+	}
 	while (inp->inp_sndinprog_cnt == 0 &&
 	    tp->t_pktlist_head != NULL) {
 		packetlist = tp->t_pktlist_head;
@@ -2686,6 +2690,13 @@ send:
 			    !SEQ_LT(tp->snd_nxt, tp->snd_max) && !rack_sack_rxmit) {
 				ip6->ip6_flow |= htonl(IPTOS_ECN_ECT0 << 20);
 			}
+			/* BBR paces all of its data packets */
+			if (tp->tcp_cc_index == TCP_CC_ALGO_BBR_INDEX && len > 0) {
+				uint64_t tx_time = tcp_pacer_get_packet_tx_time(tp, (uint16_t)len);
+				if (tx_time) {
+					tcp_set_mbuf_tx_time(m, tx_time);
+				}
+			}
 		}
 		svc_flags |= PKT_SCF_IPV6;
 #if PF_ECN
@@ -2713,6 +2724,13 @@ send:
 			    !rack_sack_rxmit && !(flags & TH_SYN)) {
 				ip->ip_tos |= IPTOS_ECN_ECT0;
 			}
+			/* BBR paces all of its data packets */
+			if (tp->tcp_cc_index == TCP_CC_ALGO_BBR_INDEX && len > 0) {
+				uint64_t tx_time = tcp_pacer_get_packet_tx_time(tp, (uint16_t)len);
+				if (tx_time) {
+					tcp_set_mbuf_tx_time(m, tx_time);
+				}
+			}
 		}
 #if PF_ECN
 		m_pftag(m)->pftag_hdr = (void *)ip;
@@ -142,6 +142,62 @@ struct tcp_notify_ack_complete {
 #define MPTCP_EXPECTED_PROGRESS_TARGET  0x219
 #define MPTCP_FORCE_VERSION             0x21a
 #define TCP_ENABLE_L4S                  0x21b   /* Enable or disable L4S */
+#define TCP_TLS_TX                      0x21c   /* Send data as TLS records */
+#define TCP_TLS_RX                      0x21d   /* Decrypt received TLS records */
+#define TCP_TLS_RX_RECORD               0x21e   /* Get a received TLS record that isn't application data */
+#define TCP_TLS_RECORD_TYPE             0x21f   /* cmsg: content type of the TLS records of a send */
+
+/*
+ * Kernel TLS record layer
+ *
+ * Once the handshake is done, the application installs the traffic keys
+ * of a direction with TCP_TLS_TX or TCP_TLS_RX and a tcp_tls_crypto_info
+ * structure.  Keys can't be changed once installed, except by TLS 1.3 key
+ * updates: the send keys can be replaced right after sending a KeyUpdate
+ * message, and decryption stops after a received KeyUpdate message until
+ * the receive keys are replaced.  Both keep the version and cipher.
+ *
+ * Data written to the socket, including with sendfile(2), is then sent as
+ * TLS records of up to TCP_TLS_MAX_PLAINTEXT bytes.  The records are
+ * application data unless the send carries a TCP_TLS_RECORD_TYPE control
+ * message with another content type, e.g. for an alert.
+ *
+ * Received records are authenticated and decrypted into the receive buffer.
+ * Decryption stops after a record that isn't application data, and reading
+ * the socket fails with ENOMSG once the data before it has been read.  That
+ * record is returned by getsockopt(TCP_TLS_RX_RECORD) as a tcp_tls_record
+ * structure, which resumes decryption.  A record that fails authentication
+ * stops decryption for good: the next read fails with EBADMSG and the
+ * socket reads as end of file after that.
+ */
+#define TCP_TLS_VERSION_1_2             0x0303
+#define TCP_TLS_VERSION_1_3             0x0304
+
+#define TCP_TLS_CIPHER_AES_GCM_128      1
+#define TCP_TLS_CIPHER_AES_GCM_256      2
+#define TCP_TLS_CIPHER_CHACHA20_POLY1305 3
+
+#define TCP_TLS_CONTENT_CHANGE_CIPHER_SPEC      20
+#define TCP_TLS_CONTENT_ALERT                   21
+#define TCP_TLS_CONTENT_HANDSHAKE               22
+#define TCP_TLS_CONTENT_APPLICATION_DATA        23
+
+#define TCP_TLS_MAX_PLAINTEXT           16384
+
+struct tcp_tls_crypto_info {
+	u_int16_t       tci_version;    /* TCP_TLS_VERSION_* */
+	u_int16_t       tci_cipher;     /* TCP_TLS_CIPHER_* */
+	u_int8_t        tci_key[32];    /* only the first 16 bytes for AES-GCM-128 */
+	u_int8_t        tci_iv[12];     /* only the 4 byte salt for AES-GCM in TLS 1.2 */
+	u_int8_t        tci_seq[8];     /* sequence number of the next record, big endian */
+};
+
+struct tcp_tls_record {
+	u_int8_t        ttr_type;       /* content type */
+	u_int8_t        ttr_unused;
+	u_int16_t       ttr_len;        /* length of ttr_data */
+	u_int8_t        ttr_data[TCP_TLS_MAX_PLAINTEXT];
+};
 
 /* When adding new socket-options, you need to make sure MPTCP supports these as well! */
 
@@ -416,16 +416,20 @@ tcp_rack_output(struct tcpcb *tp, uint32_t cwin, uint16_t *rack_seg_len)
 
 /*
  * Check if a retransmitted segment was completed covered by received
- * (first) DSACK block
+ * (first) DSACK block. Only the segments ending within the block are
+ * looked at, starting from the first one ending after its start.
  */
 void
 tcp_rack_detect_reordering_dsack(struct tcpcb *tp, tcp_seq start, tcp_seq end)
 {
+	struct tcp_seg_sent segment = { .end_seq = start + 1 };
 	struct tcp_seg_sent *seg = NULL;
 
-	TAILQ_FOREACH(seg, &tp->t_segs_sent, tx_link) {
+	for (seg = RB_NFIND(tcp_seg_sent_tree_head, &tp->t_segs_sent_tree, &segment);
+	    seg != NULL && SEQ_LEQ(seg->end_seq, end);
+	    seg = RB_NEXT(tcp_seg_sent_tree_head, &tp->t_segs_sent_tree, seg)) {
 		if (seg->flags & TCP_SEGMENT_RETRANSMITTED_ATLEAST_ONCE) {
-			if (SEQ_LEQ(start, seg->start_seq) && SEQ_GEQ(end, seg->end_seq)) {
+			if (SEQ_LEQ(start, seg->start_seq)) {
 				tp->t_reordered_pkts++;
 			}
 		}
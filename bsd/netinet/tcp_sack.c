@@ -116,6 +116,18 @@ SYSCTL_INT(_net_inet_tcp, OID_AUTO, sack_globalholes, CTLFLAG_RD | CTLFLAG_LOCKE
 
 static KALLOC_TYPE_DEFINE(sack_hole_zone, struct sackhole, NET_KT_DEFAULT);
 
+/*
+ * The holes of the scoreboard never overlap, so ordering them by their
+ * start also orders them by their end; this stays true as holes shrink.
+ */
+int
+tcp_sackhole_cmp(const struct sackhole *hole1, const struct sackhole *hole2)
+{
+	return (int)(hole1->start - hole2->start);
+}
+
+RB_GENERATE(sackhole_tree_head, sackhole, scbtree, tcp_sackhole_cmp)
+
 #define TCP_VALIDATE_SACK_SEQ_NUMBERS(_tp_, _sb_, _ack_) \
     (SEQ_GT((_sb_)->end, (_sb_)->start) && \
     SEQ_GT((_sb_)->start, (_tp_)->snd_una) && \
@@ -295,6 +307,7 @@ tcp_sackhole_insert(struct tcpcb *tp, tcp_seq start, tcp_seq end,
 	} else {
 		TAILQ_INSERT_TAIL(&tp->snd_holes, hole, scblink);
 	}
+	RB_INSERT(sackhole_tree_head, &tp->snd_holes_tree, hole);
 
 	/* Update SACK hint. */
 	if (tp->sackhint.nexthole == NULL) {
@@ -317,10 +330,28 @@ tcp_sackhole_remove(struct tcpcb *tp, struct sackhole *hole)
 
 	/* Remove this SACK hole. */
 	TAILQ_REMOVE(&tp->snd_holes, hole, scblink);
+	RB_REMOVE(sackhole_tree_head, &tp->snd_holes_tree, hole);
 
 	/* Free this SACK hole. */
 	tcp_sackhole_free(tp, hole);
 }
+
+/*
+ * Return the last SACK hole starting before seq, without walking the
+ * holes in between.
+ */
+static struct sackhole *
+tcp_sackhole_find_before(struct tcpcb *tp, tcp_seq seq)
+{
+	struct sackhole key = { .start = seq };
+	struct sackhole *hole;
+
+	hole = RB_NFIND(sackhole_tree_head, &tp->snd_holes_tree, &key);
+	if (hole == NULL) {
+		return TAILQ_LAST(&tp->snd_holes, sackhole_head);
+	}
+	return TAILQ_PREV(hole, sackhole_head, scblink);
+}
 /*
  * When a new ack with SACK is received, check if it indicates packet
  * reordering. If there is packet reordering, the socket is marked and
@@ -583,9 +614,11 @@ tcp_sack_doack(struct tcpcb *tp, struct tcpopt *to, struct tcphdr *th,
 		if (SEQ_LEQ(sblkp->end, cur->start)) {
 			/*
 			 * SACKs data before the current hole.
-			 * Go to the previous hole.
+			 * Go to the last hole this block may overlap,
+			 * skipping over the ones in between, as there
+			 * can be thousands of them.
 			 */
-			cur = TAILQ_PREV(cur, sackhole_head, scblink);
+			cur = tcp_sackhole_find_before(tp, sblkp->end);
 			continue;
 		}
 		tp->sackhint.sack_bytes_rexmit -= (cur->rxmit - cur->start);
@@ -750,6 +783,7 @@ tcp_sack_partialack(struct tcpcb *tp, struct tcphdr *th)
 	}
 }
 
+#if (DEVELOPMENT || DEBUG)
 /*
  * Debug version of tcp_sack_output() that walks the scoreboard. Used for
  * now to sanity check the hint.
@@ -772,6 +806,7 @@ tcp_sack_output_debug(struct tcpcb *tp, int *sack_bytes_rexmt)
 	}
 	return p;
 }
+#endif /* (DEVELOPMENT || DEBUG) */
 
 /*
  * Returns the next hole to retransmit and the number of retransmitted bytes
@@ -793,10 +828,13 @@ tcp_sack_output_debug(struct tcpcb *tp, int *sack_bytes_rexmt)
 struct sackhole *
 tcp_sack_output(struct tcpcb *tp, int *sack_bytes_rexmt)
 {
-	struct sackhole *hole = NULL, *dbg_hole = NULL;
+	struct sackhole *hole = NULL;
+#if (DEVELOPMENT || DEBUG)
+	struct sackhole *dbg_hole = NULL;
 	int dbg_bytes_rexmt;
 
 	dbg_hole = tcp_sack_output_debug(tp, &dbg_bytes_rexmt);
+#endif /* (DEVELOPMENT || DEBUG) */
 	*sack_bytes_rexmt = tp->sackhint.sack_bytes_rexmit;
 	hole = tp->sackhint.nexthole;
 	if (hole == NULL || SEQ_LT(hole->rxmit, hole->end)) {
@@ -809,6 +847,11 @@ tcp_sack_output(struct tcpcb *tp, int *sack_bytes_rexmt)
 		}
 	}
 out:
+#if (DEVELOPMENT || DEBUG)
+	/*
+	 * The walk of the whole scoreboard is only done on debug kernels,
+	 * as it would otherwise be paid on every output during recovery.
+	 */
 	if (dbg_hole != hole) {
 		printf("%s: Computed sack hole not the same as cached value\n", __func__);
 		hole = dbg_hole;
@@ -819,6 +862,7 @@ out:
 		    __func__, dbg_bytes_rexmt, *sack_bytes_rexmt);
 		*sack_bytes_rexmt = dbg_bytes_rexmt;
 	}
+#endif /* (DEVELOPMENT || DEBUG) */
 	return hole;
 }
 
@@ -150,7 +150,6 @@
 
 static tcp_cc tcp_ccgen;
 
-extern struct tcptimerlist tcp_timer_list;
 extern struct tcptailq tcp_tw_tailq;
 
 extern int tcp_awdl_rtobase;
@@ -607,20 +606,7 @@ tcp_init(struct protosw *pp, struct domain *dp)
 	/* Initialize time wait and timer lists */
 	TAILQ_INIT(&tcp_tw_tailq);
 
-	bzero(&tcp_timer_list, sizeof(tcp_timer_list));
-	LIST_INIT(&tcp_timer_list.lhead);
-	/*
-	 * allocate group and attribute for the tcp timer list
-	 */
-	tcp_timer_list.mtx_grp = lck_grp_alloc_init("tcptimerlist",
-	    LCK_GRP_ATTR_NULL);
-	lck_mtx_init(&tcp_timer_list.mtx, tcp_timer_list.mtx_grp,
-	    LCK_ATTR_NULL);
-
-	tcp_timer_list.call = thread_call_allocate(tcp_run_timerlist, NULL);
-	if (tcp_timer_list.call == NULL) {
-		panic("failed to allocate call entry 1 in tcp_init");
-	}
+	tcp_timer_lists_init();
 
 	/* Initialize TCP Cache */
 	tcp_cache_init();
@@ -1135,6 +1121,7 @@ tcp_newtcpcb(struct inpcb *inp)
 	}
 
 	TAILQ_INIT(&tp->snd_holes);
+	RB_INIT(&tp->snd_holes_tree);
 	SLIST_INIT(&tp->t_rxt_segments);
 	TAILQ_INIT(&tp->t_segs_sent);
 	RB_INIT(&tp->t_segs_sent_tree);
@@ -1156,6 +1143,8 @@ tcp_newtcpcb(struct inpcb *inp)
 	if (tcp_use_newreno) {
 		/* use newreno by default */
 		tp->tcp_cc_index = TCP_CC_ALGO_NEWRENO_INDEX;
+	} else if (tcp_use_bbr) {
+		tp->tcp_cc_index = TCP_CC_ALGO_BBR_INDEX;
 #if (DEVELOPMENT || DEBUG)
 	} else if (tcp_use_ledbat) {
 		/* use ledbat for testing */
@@ -1678,6 +1667,7 @@ no_valid_rt:
 
 	tcp_free_sackholes(tp);
 	tcp_notify_ack_free(tp);
+	tcp_tls_free(tp);
 
 	inp_decr_sndbytes_allunsent(so, tp->snd_una);
 
@@ -3433,6 +3423,10 @@ tcp_sbspace(struct tcpcb *tp)
 	/* Compensate for data being processed by content filters */
 	pending = cfil_sock_data_space(sb);
 #endif /* CONTENT_FILTER */
+	/* And for TLS records not yet decrypted into the receive buffer */
+	if (tp->t_flagsext & TF_TLS_RX) {
+		pending += tcp_tls_rx_pending(tp);
+	}
 	if (pending > space) {
 		space = 0;
 	} else {
@@ -4018,6 +4012,81 @@ tcp_seg_alloc_init(struct tcpcb *tp)
 	return seg;
 }
 
+static inline bool
+tcp_rate_sampling(struct tcpcb *tp)
+{
+	return CC_ALGO(tp)->rate_sample != NULL;
+}
+
+/*
+ * Snapshot the delivery state of the connection in a segment
+ * that is being (re)transmitted
+ */
+static void
+tcp_rate_transmit_seg(struct tcpcb *tp, struct tcp_seg_sent *seg)
+{
+	struct tcp_rate *rate = &tp->t_rate;
+	uint64_t now;
+
+	if (!tcp_rate_sampling(tp)) {
+		return;
+	}
+	now = tcp_rate_now();
+
+	/* Start a new flight when nothing else is outstanding */
+	if (TAILQ_FIRST(&tp->t_segs_sent) == seg &&
+	    TAILQ_LAST(&tp->t_segs_sent, tcp_seg_sent_head) == seg) {
+		rate->first_tx_ts = now;
+		rate->delivered_ts = now;
+	}
+	seg->tx_ts = now;
+	seg->tx_delivered = rate->delivered;
+	seg->tx_delivered_ts = rate->delivered_ts;
+	seg->tx_first_ts = rate->first_tx_ts;
+	if (rate->app_limited != 0) {
+		seg->flags |= TCP_SEGMENT_APP_LIMITED;
+	} else {
+		seg->flags &= ~TCP_SEGMENT_APP_LIMITED;
+	}
+}
+
+static void
+tcp_rate_seg_delivered(struct tcpcb *tp, struct tcp_seg_sent *seg, uint32_t len)
+{
+	struct tcp_rate *rate = &tp->t_rate;
+	uint64_t now;
+
+	if (!tcp_rate_sampling(tp) || len == 0) {
+		return;
+	}
+	now = tcp_rate_now();
+
+	rate->delivered += len;
+	rate->delivered_ts = now;
+
+	/* Sent before sampling started */
+	if (seg->tx_delivered_ts == 0) {
+		return;
+	}
+	/* The sample comes from the most recently sent segment delivered */
+	if (rate->rs_tx_ts != 0 && seg->tx_ts < rate->rs_tx_ts) {
+		return;
+	}
+	rate->rs_prior_delivered = seg->tx_delivered;
+	rate->rs_prior_ts = seg->tx_delivered_ts;
+	rate->rs_is_app_limited = !!(seg->flags & TCP_SEGMENT_APP_LIMITED);
+	rate->rs_send_elapsed = (uint32_t)(seg->tx_ts - seg->tx_first_ts);
+	rate->rs_ack_elapsed = (uint32_t)(now - seg->tx_delivered_ts);
+	rate->rs_tx_ts = seg->tx_ts;
+	/* RTT of a retransmitted segment is ambiguous */
+	if (seg->flags & TCP_SEGMENT_RETRANSMITTED_ATLEAST_ONCE) {
+		rate->rs_rtt = 0;
+	} else {
+		rate->rs_rtt = (uint32_t)(now - seg->tx_ts);
+	}
+	rate->first_tx_ts = seg->tx_ts;
+}
+
 static void
 tcp_update_seg_after_rto(struct tcpcb *tp, struct tcp_seg_sent *found_seg,
     uint32_t xmit_ts, uint8_t flags)
@@ -4030,6 +4099,7 @@ tcp_update_seg_after_rto(struct tcpcb *tp, struct tcp_seg_sent *found_seg,
 		TAILQ_REMOVE(&tp->t_segs_sent, seg, tx_link);
 		TAILQ_INSERT_TAIL(&tp->t_segs_sent, seg, tx_link);
 	}
+	tcp_rate_transmit_seg(tp, found_seg);
 }
 
 static void
@@ -4060,6 +4130,11 @@ tcp_seg_sent_insert_before(struct tcpcb *tp, struct tcp_seg_sent *before, tcp_se
 	struct tcp_seg_sent *seg = tcp_seg_alloc_init(tp);
 	/* segment MUST be allocated, there is no other fail-safe here */
 	tcp_rack_transmit_seg(tp, seg, start, end, xmit_ts, flags);
+	/* Both parts of a split segment were sent at the same time */
+	seg->tx_ts = before->tx_ts;
+	seg->tx_delivered = before->tx_delivered;
+	seg->tx_delivered_ts = before->tx_delivered_ts;
+	seg->tx_first_ts = before->tx_first_ts;
 	struct tcp_seg_sent *not_inserted = RB_INSERT(tcp_seg_sent_tree_head, &tp->t_segs_sent_tree, seg);
 	if (not_inserted) {
 		os_log(OS_LOG_DEFAULT, "segment %p[%u %u) was not inserted in the RB tree", not_inserted,
@@ -4083,6 +4158,7 @@ tcp_seg_rto_insert_end(struct tcpcb *tp, tcp_seq start, tcp_seq end,
 		    not_inserted->start_seq, not_inserted->end_seq);
 	}
 	TAILQ_INSERT_TAIL(&tp->t_segs_sent, seg, tx_link);
+	tcp_rate_transmit_seg(tp, seg);
 
 	return seg;
 }
@@ -4102,6 +4178,7 @@ tcp_seg_sent_insert(struct tcpcb *tp, struct tcp_seg_sent *seg, tcp_seq start, t
 			tcp_rack_transmit_seg(tp, seg, seg->start_seq, seg->end_seq, xmit_ts, seg_flags);
 			TAILQ_REMOVE(&tp->t_segs_sent, seg, tx_link);
 			TAILQ_INSERT_TAIL(&tp->t_segs_sent, seg, tx_link);
+			tcp_rate_transmit_seg(tp, seg);
 		} else {
 			/*
 			 * Original segment is retransmitted partially, update start_seq by len
@@ -4120,6 +4197,7 @@ tcp_seg_sent_insert(struct tcpcb *tp, struct tcp_seg_sent *seg, tcp_seq start, t
 				    not_inserted->start_seq, not_inserted->end_seq);
 			}
 			TAILQ_INSERT_TAIL(&tp->t_segs_sent, partial_seg, tx_link);
+			tcp_rate_transmit_seg(tp, partial_seg);
 		}
 
 		return;
@@ -4139,6 +4217,7 @@ tcp_seg_sent_insert(struct tcpcb *tp, struct tcp_seg_sent *seg, tcp_seq start, t
 			    not_inserted->start_seq, not_inserted->end_seq);
 		}
 		TAILQ_INSERT_TAIL(&tp->t_segs_sent, seg, tx_link);
+		tcp_rate_transmit_seg(tp, seg);
 
 		return;
 	}
@@ -4163,42 +4242,35 @@ tcp_seg_sent_insert(struct tcpcb *tp, struct tcp_seg_sent *seg, tcp_seq start, t
 	}
 	/*
 	 * We come here when we don't find an exact match and end of segment
-	 * retransmitted after RTO lies within a segment.
+	 * retransmitted after RTO lies within a segment, which is then the
+	 * first segment ending after it.
 	 */
-	RB_FOREACH(found_seg, tcp_seg_sent_tree_head, &tp->t_segs_sent_tree) {
-		if (SEQ_LT(end, found_seg->end_seq) && SEQ_GT(end, found_seg->start_seq)) {
-			/*
-			 * This segment is partially retransmitted. We split this segment at the boundary of end
-			 * sequence. First insert the part being retransmitted at the end of time-ordered list.
-			 */
-			tcp_seg_rto_insert_end(tp, found_seg->start_seq, end, xmit_ts,
-			    found_seg->flags | flags);
-
-			if (SEQ_LEQ(found_seg->start_seq, start)) {
-				/*
-				 * We are done with the retransmitted part.
-				 * Move the start of existing segment
-				 */
-				found_seg->start_seq = end;
-			} else {
-				/*
-				 * This retransmitted sequence covers more than one segment
-				 * Look for segments covered by this retransmission below this segment
-				 */
-				segment.end_seq = found_seg->start_seq;
-				rxmt_seg = RB_FIND(tcp_seg_sent_tree_head, &tp->t_segs_sent_tree, &segment);
+	found_seg = RB_NFIND(tcp_seg_sent_tree_head, &tp->t_segs_sent_tree, &segment);
+	if (found_seg == NULL || SEQ_LEQ(end, found_seg->start_seq)) {
+		return;
+	}
+	/*
+	 * This segment is partially retransmitted. We split this segment at the boundary of end
+	 * sequence. First insert the part being retransmitted at the end of time-ordered list.
+	 */
+	tcp_seg_rto_insert_end(tp, found_seg->start_seq, end, xmit_ts,
+	    found_seg->flags | flags);
 
-				if (rxmt_seg != NULL) {
-					/* rxmt_seg is just before the current segment */
-					tcp_process_rxmt_segs_after_rto(tp, rxmt_seg, start, xmit_ts, flags);
-				}
+	if (SEQ_GT(found_seg->start_seq, start)) {
+		/*
+		 * This retransmitted sequence covers more than one segment
+		 * Look for segments covered by this retransmission below this segment
+		 */
+		segment.end_seq = found_seg->start_seq;
+		rxmt_seg = RB_FIND(tcp_seg_sent_tree_head, &tp->t_segs_sent_tree, &segment);
 
-				/* Move the start of existing segment */
-				found_seg->start_seq = end;
-			}
-			return;
+		if (rxmt_seg != NULL) {
+			/* rxmt_seg is just before the current segment */
+			tcp_process_rxmt_segs_after_rto(tp, rxmt_seg, start, xmit_ts, flags);
 		}
 	}
+	/* Move the start of existing segment */
+	found_seg->start_seq = end;
 }
 
 static void
@@ -4272,6 +4344,8 @@ tcp_seg_delete_acked(struct tcpcb *tp, uint32_t acked_xmit_ts, uint32_t tsecr)
 				    "SACKed segment length (%u)", tp->bytes_sacked, seg_len);
 			}
 			tp->bytes_sacked -= seg_len;
+		} else {
+			tcp_rate_seg_delivered(tp, acked_seg, seg_len);
 		}
 		TAILQ_REMOVE(&tp->t_segs_acked, acked_seg, ack_link);
 		TAILQ_REMOVE(&tp->t_segs_sent, acked_seg, tx_link);
@@ -4296,7 +4370,7 @@ tcp_segs_doack(struct tcpcb *tp, tcp_seq th_ack, struct tcpopt *to)
 	}
 
 	struct tcp_seg_sent seg = {};
-	struct tcp_seg_sent *found_seg = NULL, *next = NULL;
+	struct tcp_seg_sent *found_seg = NULL;
 
 	found_seg = TAILQ_LAST(&tp->t_segs_sent, tcp_seg_sent_head);
 
@@ -4309,6 +4383,13 @@ tcp_segs_doack(struct tcpcb *tp, tcp_seq th_ack, struct tcpopt *to)
 			acked_seq = found_seg->end_seq;
 			acked_xmit_ts = found_seg->xmit_ts;
 			was_retransmitted = !!(found_seg->flags & TCP_SEGMENT_RETRANSMITTED_ATLEAST_ONCE);
+			if (tcp_rate_sampling(tp)) {
+				/* Without retransmissions the last sent segment is also the newest */
+				struct tcp_seg_sent *first_seg = RB_MIN(tcp_seg_sent_tree_head,
+				    &tp->t_segs_sent_tree);
+				tcp_rate_seg_delivered(tp, found_seg,
+				    (found_seg->end_seq - first_seg->start_seq) - tp->bytes_sacked);
+			}
 			tcp_segs_sent_clean(tp, false);
 
 			/* Advance RACK state */
@@ -4345,24 +4426,26 @@ tcp_segs_doack(struct tcpcb *tp, tcp_seq th_ack, struct tcpopt *to)
 	}
 	/*
 	 * When TSO is enabled, it is possible that th_ack is less
-	 * than segment->end, hence we search the tree
-	 * until we find the largest (partially) ACKed segment.
+	 * than segment->end, hence we search the tree for the
+	 * first segment ending after th_ack, the largest (partially)
+	 * ACKed segment.
 	 */
-	RB_FOREACH_SAFE(found_seg, tcp_seg_sent_tree_head, &tp->t_segs_sent_tree, next) {
-		if (SEQ_LT(th_ack, found_seg->end_seq) && SEQ_GT(th_ack, found_seg->start_seq)) {
-			acked_seq = th_ack;
-			acked_xmit_ts = found_seg->xmit_ts;
-			was_retransmitted = !!(found_seg->flags & TCP_SEGMENT_RETRANSMITTED_ATLEAST_ONCE);
-
-			/* Remove all segments completely ACKed by this ack */
-			tcp_seg_collect_acked(tp, RB_ROOT(&tp->t_segs_sent_tree), th_ack, acked_xmit_ts, tsecr);
-			tcp_seg_delete_acked(tp, acked_xmit_ts, tsecr);
-			found_seg->start_seq = th_ack;
+	found_seg = RB_NFIND(tcp_seg_sent_tree_head, &tp->t_segs_sent_tree, &seg);
+	if (found_seg != NULL && SEQ_GT(th_ack, found_seg->start_seq)) {
+		acked_seq = th_ack;
+		acked_xmit_ts = found_seg->xmit_ts;
+		was_retransmitted = !!(found_seg->flags & TCP_SEGMENT_RETRANSMITTED_ATLEAST_ONCE);
 
-			/* Advance RACK state */
-			tcp_rack_update_segment_acked(tp, tsecr, acked_xmit_ts, acked_seq, was_retransmitted);
-			break;
+		/* Remove all segments completely ACKed by this ack */
+		tcp_seg_collect_acked(tp, RB_ROOT(&tp->t_segs_sent_tree), th_ack, acked_xmit_ts, tsecr);
+		tcp_seg_delete_acked(tp, acked_xmit_ts, tsecr);
+		if ((found_seg->flags & TCP_SEGMENT_SACKED) == 0) {
+			tcp_rate_seg_delivered(tp, found_seg, th_ack - found_seg->start_seq);
 		}
+		found_seg->start_seq = th_ack;
+
+		/* Advance RACK state */
+		tcp_rack_update_segment_acked(tp, tsecr, acked_xmit_ts, acked_seq, was_retransmitted);
 	}
 }
 
@@ -4408,6 +4491,7 @@ tcp_seg_mark_sacked(struct tcpcb *tp, struct tcp_seg_sent *seg, uint32_t *newbyt
 	*newbytes_sacked += seg_len;
 	seg->flags |= TCP_SEGMENT_SACKED;
 	tp->bytes_sacked += seg_len;
+	tcp_rate_seg_delivered(tp, seg, seg_len);
 
 	return true;
 }
@@ -4503,61 +4587,57 @@ tcp_segs_dosack(struct tcpcb *tp, tcp_seq sblk_start, tcp_seq sblk_end,
 	}
 	/*
 	 * We come here when we don't find an exact match and sblk_end
-	 * lies within a segment. This would happen only when TSO is used.
+	 * lies within a segment, the first one ending after it. This
+	 * would happen only when TSO is used.
 	 */
-	RB_FOREACH(found_seg, tcp_seg_sent_tree_head, &tp->t_segs_sent_tree) {
-		if (SEQ_LT(sblk_end, found_seg->end_seq) && SEQ_GT(sblk_end, found_seg->start_seq)) {
-			/*
-			 * This segment is partially SACKed. We split this segment at the boundary
-			 * of SACK block. First insert the newly SACKed part
-			 */
-			tcp_seq start = SEQ_LEQ(sblk_start, found_seg->start_seq) ? found_seg->start_seq : sblk_start;
-			struct tcp_seg_sent *inserted = tcp_seg_sent_insert_before(tp, found_seg, start,
-			    sblk_end, found_seg->xmit_ts, found_seg->flags);
-			/* Record seg flags before they get erased. */
-			uint8_t seg_flags = inserted->flags;
-			/* Mark the SACKed segment */
-			tcp_seg_mark_sacked(tp, inserted, newbytes_sacked);
-
-			/* Advance RACK state */
-			tcp_rack_update_segment_acked(tp, tsecr, inserted->xmit_ts,
-			    inserted->end_seq, !!(seg_flags & TCP_SEGMENT_RETRANSMITTED_ATLEAST_ONCE));
-
-			if (sblk_start == found_seg->start_seq) {
-				/*
-				 * We are done with this SACK block.
-				 * Move the start of existing segment
-				 */
-				found_seg->start_seq = sblk_end;
-				break;
-			}
-
-			if (SEQ_GT(sblk_start, found_seg->start_seq)) {
-				/* Insert the remaining unSACKed part before the SACKED segment inserted above */
-				tcp_seg_sent_insert_before(tp, inserted, found_seg->start_seq,
-				    sblk_start, found_seg->xmit_ts, found_seg->flags);
-				/* Move the start of existing segment */
-				found_seg->start_seq = sblk_end;
-				break;
-			} else {
-				/*
-				 * This SACK block covers more than one segment
-				 * Look for segments SACKed below this segment
-				 */
-				seg.end_seq = found_seg->start_seq;
-				sacked_seg = RB_FIND(tcp_seg_sent_tree_head, &tp->t_segs_sent_tree, &seg);
+	found_seg = RB_NFIND(tcp_seg_sent_tree_head, &tp->t_segs_sent_tree, &seg);
+	if (found_seg == NULL || SEQ_LEQ(sblk_end, found_seg->start_seq)) {
+		return;
+	}
+	/*
+	 * This segment is partially SACKed. We split this segment at the boundary
+	 * of SACK block. First insert the newly SACKed part
+	 */
+	tcp_seq start = SEQ_LEQ(sblk_start, found_seg->start_seq) ? found_seg->start_seq : sblk_start;
+	struct tcp_seg_sent *inserted = tcp_seg_sent_insert_before(tp, found_seg, start,
+	    sblk_end, found_seg->xmit_ts, found_seg->flags);
+	/* Record seg flags before they get erased. */
+	uint8_t seg_flags = inserted->flags;
+	/* Mark the SACKed segment */
+	tcp_seg_mark_sacked(tp, inserted, newbytes_sacked);
+
+	/* Advance RACK state */
+	tcp_rack_update_segment_acked(tp, tsecr, inserted->xmit_ts,
+	    inserted->end_seq, !!(seg_flags & TCP_SEGMENT_RETRANSMITTED_ATLEAST_ONCE));
+
+	if (sblk_start == found_seg->start_seq) {
+		/*
+		 * We are done with this SACK block.
+		 * Move the start of existing segment
+		 */
+		found_seg->start_seq = sblk_end;
+		return;
+	}
 
-				if (sacked_seg != NULL) {
-					/* We found an exact match for sblk_end */
-					tcp_segs_dosack_matched(tp, sacked_seg, sblk_start, tsecr, newbytes_sacked);
-				}
+	if (SEQ_GT(sblk_start, found_seg->start_seq)) {
+		/* Insert the remaining unSACKed part before the SACKED segment inserted above */
+		tcp_seg_sent_insert_before(tp, inserted, found_seg->start_seq,
+		    sblk_start, found_seg->xmit_ts, found_seg->flags);
+	} else {
+		/*
+		 * This SACK block covers more than one segment
+		 * Look for segments SACKed below this segment
+		 */
+		seg.end_seq = found_seg->start_seq;
+		sacked_seg = RB_FIND(tcp_seg_sent_tree_head, &tp->t_segs_sent_tree, &seg);
 
-				/* Move the start of existing segment */
-				found_seg->start_seq = sblk_end;
-			}
-			break;
+		if (sacked_seg != NULL) {
+			/* We found an exact match for sblk_end */
+			tcp_segs_dosack_matched(tp, sacked_seg, sblk_start, tsecr, newbytes_sacked);
 		}
 	}
+	/* Move the start of existing segment */
+	found_seg->start_seq = sblk_end;
 }
 
 void
@@ -4600,6 +4680,7 @@ tcp_mark_seg_lost(struct tcpcb *tp, struct tcp_seg_sent *seg)
 	} else {
 		seg->flags |= TCP_SEGMENT_LOST;
 		tp->bytes_lost += seg_len;
+		tp->t_rate.lost += seg_len;
 	}
 }
 
@@ -4650,6 +4731,116 @@ tcp_segs_sent_clean(struct tcpcb *tp, bool free_segs)
 	}
 }
 
+uint64_t
+tcp_rate_now(void)
+{
+	return microuptime_ns() / NSEC_PER_USEC;
+}
+
+/*
+ * Mark the connection application-limited when it has nothing left to
+ * send while the congestion window is open, so that the rate samples
+ * taken until this data is delivered don't lower the bandwidth model.
+ */
+void
+tcp_rate_check_app_limited(struct tcpcb *tp)
+{
+	struct socket *so = tp->t_inpcb->inp_socket;
+	struct tcp_rate *rate = &tp->t_rate;
+	uint32_t flight = tp->snd_max - tp->snd_una;
+	uint32_t unsent = 0;
+
+	if (!tcp_rate_sampling(tp)) {
+		return;
+	}
+	if (so->so_snd.sb_cc > tp->snd_nxt - tp->snd_una) {
+		unsent = so->so_snd.sb_cc - (tp->snd_nxt - tp->snd_una);
+	}
+	if (unsent < tp->t_maxseg && flight < tp->snd_cwnd &&
+	    tp->bytes_lost <= tp->bytes_retransmitted) {
+		rate->app_limited = MAX(rate->delivered + flight, 1);
+	}
+}
+
+/*
+ * Without SACK there are no segments to take samples from, use the
+ * bytes cumulatively ACKed since the start of the current window of
+ * data instead.
+ */
+static void
+tcp_rate_window_sample(struct tcpcb *tp, struct tcphdr *th, uint64_t now)
+{
+	struct tcp_rate *rate = &tp->t_rate;
+
+	if (SEQ_LEQ(th->th_ack, tp->snd_una)) {
+		return;
+	}
+	rate->delivered += BYTES_ACKED(th, tp);
+	rate->delivered_ts = now;
+
+	if (rate->win_ts != 0) {
+		rate->rs_prior_delivered = rate->win_delivered;
+		rate->rs_prior_ts = rate->win_ts;
+		rate->rs_tx_ts = rate->win_ts;
+		rate->rs_send_elapsed = 0;
+		rate->rs_ack_elapsed = (uint32_t)(now - rate->win_ts);
+		rate->rs_is_app_limited = rate->app_limited != 0;
+		rate->rs_rtt = 0;
+
+		if (SEQ_LT(th->th_ack, rate->win_end)) {
+			return;
+		}
+	}
+	rate->win_end = tp->snd_max;
+	rate->win_delivered = rate->delivered;
+	rate->win_ts = now;
+}
+
+/*
+ * Generate the rate sample of an ACK once its S/ACKed segments have
+ * been processed. Called before snd_una is updated.
+ */
+void
+tcp_rate_gen_sample(struct tcpcb *tp, struct tcphdr *th)
+{
+	struct tcp_rate *rate = &tp->t_rate;
+
+	if (!TCP_RACK_ENABLED(tp)) {
+		tcp_rate_window_sample(tp, th, tcp_rate_now());
+	}
+	/* The app-limited phase ends once its data has been delivered */
+	if (rate->app_limited != 0 && rate->delivered > rate->app_limited) {
+		rate->app_limited = 0;
+	}
+	rate->rs_lost = (uint32_t)(rate->lost - rate->rs_prior_lost);
+	rate->rs_valid = 0;
+	if (rate->rs_tx_ts == 0) {
+		rate->rs_delivered = 0;
+		rate->rs_interval = 0;
+		return;
+	}
+	rate->rs_delivered = (uint32_t)(rate->delivered - rate->rs_prior_delivered);
+	/*
+	 * Use the longer of the send and ACK phases so that ACK compression
+	 * or a burst of sends doesn't overestimate the rate
+	 */
+	rate->rs_interval = max(rate->rs_send_elapsed, rate->rs_ack_elapsed);
+	rate->rs_valid = rate->rs_delivered > 0 && rate->rs_interval > 0;
+}
+
+void
+tcp_rate_sample_done(struct tcpcb *tp)
+{
+	struct tcp_rate *rate = &tp->t_rate;
+
+	rate->rs_prior_delivered = 0;
+	rate->rs_prior_ts = 0;
+	rate->rs_tx_ts = 0;
+	rate->rs_prior_lost = rate->lost;
+	rate->rs_rtt = 0;
+	rate->rs_valid = 0;
+}
+
 void
 tcp_get_connectivity_status(struct tcpcb *tp,
     struct tcp_conn_status *connstatus)
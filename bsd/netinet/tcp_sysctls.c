@@ -135,3 +135,12 @@ SYSCTL_INT(_net_inet_tcp, OID_AUTO, cubic_sockets,
 SYSCTL_SKMEM_TCP_INT(OID_AUTO, use_newreno,
     CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_use_newreno, 0,
     "Use TCP NewReno by default");
+
+extern struct tcp_cc_algo tcp_cc_bbr;
+SYSCTL_INT(_net_inet_tcp, OID_AUTO, bbr_sockets,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &tcp_cc_bbr.num_sockets,
+    0, "Number of sockets using BBR");
+
+SYSCTL_SKMEM_TCP_INT(OID_AUTO, use_bbr,
+    CTLFLAG_RW | CTLFLAG_LOCKED, int, tcp_use_bbr, 0,
+    "Use TCP BBR by default");
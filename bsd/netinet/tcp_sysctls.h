@@ -50,5 +50,6 @@ extern int tcp_rledbat;
 extern int tcp_cc_debug;
 extern int tcp_use_ledbat;
 extern int tcp_use_newreno;
+extern int tcp_use_bbr;
 
 #endif /* _NETINET_TCP_SYSCTLS_H_ */
@@ -76,6 +76,8 @@
 #include <sys/queue.h>
 #include <kern/locks.h>
 #include <kern/cpu_number.h>    /* before tcp_seq.h, for tcp_random18() */
+#include <kern/thread_call.h>
+#include <machine/machine_routines.h>
 #include <mach/boolean.h>
 
 #include <net/route.h>
@@ -114,8 +116,18 @@
  */
 #define TCP_SLEEP_TOO_LONG      (10 * 60 * 1000) /* 10 minutes in ms */
 
-/* tcp timer list */
-struct tcptimerlist tcp_timer_list;
+/* tcp timer lists, connections are spread over them by flow hash */
+static struct tcptimerlist *tcp_timer_lists;
+static uint32_t tcp_timer_lists_count;
+
+/*
+ * Number of tcp timer lists, 0 for one per CPU. It is capped to
+ * TCP_TIMERLIST_MAX_COUNT and rounded down to a power of 2.
+ */
+static TUNABLE(uint32_t, tcp_timer_lists_max, "tcp_timer_lists", 0);
+SYSCTL_UINT(_net_inet_tcp, OID_AUTO, timer_lists,
+    CTLFLAG_RD | CTLFLAG_LOCKED, &tcp_timer_lists_count, 0,
+    "Number of timer lists connections are spread over");
 
 /* List of pcbs in timewait state, protected by tcbinfo's ipi_lock */
 struct tcptailq tcp_tw_tailq;
@@ -353,7 +365,7 @@ int     tcp_jack_rxmt = TCP_RETRANSHZ / 2;
 static boolean_t tcp_itimer_done = FALSE;
 
 static void tcp_remove_timer(struct tcpcb *tp);
-static void tcp_sched_timerlist(uint32_t offset);
+static void tcp_sched_timerlist(struct tcptimerlist *listp, uint32_t offset);
 static u_int32_t tcp_run_conn_timer(struct tcpcb *tp, u_int16_t *mode,
     u_int16_t probe_if_index);
 static inline void tcp_set_lotimer_index(struct tcpcb *);
@@ -1903,12 +1915,13 @@ dropit:
 void
 tcp_remove_timer(struct tcpcb *tp)
 {
-	struct tcptimerlist *listp = &tcp_timer_list;
+	struct tcptimerlist *listp;
 
 	socket_lock_assert_owned(tp->t_inpcb->inp_socket);
 	if (!(TIMER_IS_ON_LIST(tp))) {
 		return;
 	}
+	listp = &tcp_timer_lists[tp->tentry.list];
 	lck_mtx_lock(&listp->mtx);
 
 	if (listp->next_te != NULL && listp->next_te == &tp->tentry) {
@@ -1933,9 +1946,9 @@ tcp_remove_timer(struct tcpcb *tp)
  */
 
 static boolean_t
-need_to_resched_timerlist(u_int32_t runtime, u_int16_t mode)
+need_to_resched_timerlist(struct tcptimerlist *listp, u_int32_t runtime,
+    u_int16_t mode)
 {
-	struct tcptimerlist *listp = &tcp_timer_list;
 	int32_t diff;
 
 	/*
@@ -1974,10 +1987,9 @@ need_to_resched_timerlist(u_int32_t runtime, u_int16_t mode)
 }
 
 void
-tcp_sched_timerlist(uint32_t offset)
+tcp_sched_timerlist(struct tcptimerlist *listp, uint32_t offset)
 {
 	uint64_t deadline = 0;
-	struct tcptimerlist *listp = &tcp_timer_list;
 
 	LCK_MTX_ASSERT(&listp->mtx, LCK_MTX_ASSERT_OWNED);
 
@@ -1995,6 +2007,45 @@ tcp_sched_timerlist(uint32_t offset)
 	listp->scheduled = TRUE;
 }
 
+/*
+ * Allocate the tcp timer lists, each run by its own thread call so that
+ * they can be processed in parallel.
+ */
+void
+tcp_timer_lists_init(void)
+{
+	lck_grp_t *grp;
+	uint32_t count;
+
+	count = tcp_timer_lists_max;
+	if (count == 0) {
+		count = ml_wait_max_cpus();
+	}
+	count = MAX(MIN(count, TCP_TIMERLIST_MAX_COUNT), 1);
+	tcp_timer_lists_count = 1U << (fls(count) - 1);
+
+	tcp_timer_lists = kalloc_type(struct tcptimerlist,
+	    tcp_timer_lists_count, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+
+	/*
+	 * allocate group and attribute for the tcp timer lists
+	 */
+	grp = lck_grp_alloc_init("tcptimerlist", LCK_GRP_ATTR_NULL);
+
+	for (uint32_t i = 0; i < tcp_timer_lists_count; i++) {
+		struct tcptimerlist *listp = &tcp_timer_lists[i];
+
+		LIST_INIT(&listp->lhead);
+		listp->mtx_grp = grp;
+		lck_mtx_init(&listp->mtx, grp, LCK_ATTR_NULL);
+
+		listp->call = thread_call_allocate(tcp_run_timerlist, listp);
+		if (listp->call == NULL) {
+			panic("failed to allocate call entry %u in tcp_init", i);
+		}
+	}
+}
+
 /*
  * Function to run the timers for a connection.
  *
@@ -2144,9 +2195,9 @@ done:
 void
 tcp_run_timerlist(void * arg1, void * arg2)
 {
-#pragma unused(arg1, arg2)
+#pragma unused(arg2)
 	struct tcptimerentry *te, *__single next_te;
-	struct tcptimerlist *__single listp = &tcp_timer_list;
+	struct tcptimerlist *__single listp = arg1;
 	struct tcpcb *__single tp;
 	uint32_t next_timer = 0; /* offset of the next timer on the list */
 	u_int16_t te_mode = 0;  /* modes of all active timers in a tcpcb */
@@ -2290,13 +2341,13 @@ tcp_run_timerlist(void * arg1, void * arg2)
 			    TCP_TIMER_500MS_QUANTUM);
 		}
 
-		tcp_sched_timerlist(next_timer);
+		tcp_sched_timerlist(listp, next_timer);
 	} else {
 		/*
 		 * No need to reschedule this timer, but always run
 		 * periodically at a much higher granularity.
 		 */
-		tcp_sched_timerlist(TCP_TIMERLIST_MAX_OFFSET);
+		tcp_sched_timerlist(listp, TCP_TIMERLIST_MAX_OFFSET);
 	}
 
 	listp->running = FALSE;
@@ -2317,7 +2368,7 @@ tcp_sched_timers(struct tcpcb *tp)
 	struct tcptimerentry *te = &tp->tentry;
 	u_int16_t index = te->index;
 	u_int16_t mode = te->mode;
-	struct tcptimerlist *listp = &tcp_timer_list;
+	struct tcptimerlist *listp;
 	int32_t offset = 0;
 	boolean_t list_locked = FALSE;
 
@@ -2345,6 +2396,21 @@ tcp_sched_timers(struct tcpcb *tp)
 		tcp_timer_advanced++;
 	}
 
+	if (!TIMER_IS_ON_LIST(tp)) {
+		/*
+		 * Pick the list of the connection from its flow hash, which
+		 * is only computed at connect time, so fall back to the
+		 * address of the pcb before that.
+		 */
+		uint32_t hash = tp->t_inpcb->inp_flowhash;
+
+		if (hash == 0) {
+			hash = (uint32_t)VM_KERNEL_ADDRHASH(tp);
+		}
+		te->list = (uint16_t)(hash & (tcp_timer_lists_count - 1));
+	}
+	listp = &tcp_timer_lists[te->list];
+
 	if (!TIMER_IS_ON_LIST(tp)) {
 		if (!list_locked) {
 			lck_mtx_lock(&listp->mtx);
@@ -2371,7 +2437,7 @@ tcp_sched_timers(struct tcpcb *tp)
 	 * Timer entry is currently on the list, check if the list needs
 	 * to be rescheduled.
 	 */
-	if (need_to_resched_timerlist(te->runtime, mode)) {
+	if (need_to_resched_timerlist(listp, te->runtime, mode)) {
 		tcp_resched_timerlist++;
 
 		if (!list_locked) {
@@ -2426,7 +2492,7 @@ schedule:
 		listp->idleruns = 0;
 		offset = min(offset, TCP_TIMER_100MS_QUANTUM);
 	}
-	tcp_sched_timerlist(offset);
+	tcp_sched_timerlist(listp, offset);
 
 done:
 	if (list_locked) {
@@ -2738,14 +2804,10 @@ tcp_report_stats(void)
 #undef  stat
 }
 
-void
-tcp_interface_send_probe(u_int16_t probe_if_index)
+static void
+tcp_timerlist_send_probe(struct tcptimerlist *listp, u_int16_t probe_if_index)
 {
 	int32_t offset = 0;
-	struct tcptimerlist *listp = &tcp_timer_list;
-
-	/* Make sure TCP clock is up to date */
-	calculate_tcp_clock();
 
 	lck_mtx_lock(&listp->mtx);
 	if (listp->probe_if_index > 0 && listp->probe_if_index != probe_if_index) {
@@ -2783,13 +2845,24 @@ tcp_interface_send_probe(u_int16_t probe_if_index)
 	listp->mode = TCP_TIMERLIST_10MS_MODE;
 	listp->idleruns = 0;
 
-	tcp_sched_timerlist(offset);
+	tcp_sched_timerlist(listp, offset);
 
 done:
 	lck_mtx_unlock(&listp->mtx);
 	return;
 }
 
+void
+tcp_interface_send_probe(u_int16_t probe_if_index)
+{
+	/* Make sure TCP clock is up to date */
+	calculate_tcp_clock();
+
+	for (uint32_t i = 0; i < tcp_timer_lists_count; i++) {
+		tcp_timerlist_send_probe(&tcp_timer_lists[i], probe_if_index);
+	}
+}
+
 /*
  * Enable read probes on this connection, if:
  * - it is in established state
@@ -2849,14 +2922,44 @@ tcp_disable_read_probe(struct tcpcb *tp)
 }
 
 /*
- * Reschedule the tcp timerlist in the next 10ms to re-enable read/write
+ * Reschedule a tcp timerlist to run within the next 10ms.
+ */
+static void
+tcp_timerlist_expedite(struct tcptimerlist *listp)
+{
+	int32_t offset;
+
+	lck_mtx_lock(&listp->mtx);
+	if (listp->running) {
+		listp->pref_mode |= TCP_TIMERLIST_10MS_MODE;
+		goto done;
+	}
+
+	/* Reschedule within the next 10ms */
+	offset = TCP_TIMER_10MS_QUANTUM;
+	if (listp->scheduled) {
+		int32_t diff;
+		diff = timer_diff(listp->runtime, 0, tcp_now, offset);
+		if (diff <= 0) {
+			/* The timer will fire sooner than what's needed */
+			goto done;
+		}
+	}
+	listp->mode = TCP_TIMERLIST_10MS_MODE;
+	listp->idleruns = 0;
+
+	tcp_sched_timerlist(listp, offset);
+done:
+	lck_mtx_unlock(&listp->mtx);
+}
+
+/*
+ * Reschedule the tcp timerlists in the next 10ms to re-enable read/write
  * probes on connections going over a particular interface.
  */
 void
 tcp_probe_connectivity(struct ifnet *ifp, u_int32_t enable)
 {
-	int32_t offset;
-	struct tcptimerlist *listp = &tcp_timer_list;
 	struct inpcbinfo *pcbinfo = &tcbinfo;
 	struct inpcb *inp, *nxt;
 
@@ -2900,29 +3003,9 @@ tcp_probe_connectivity(struct ifnet *ifp, u_int32_t enable)
 	}
 	lck_rw_done(&pcbinfo->ipi_lock);
 
-	lck_mtx_lock(&listp->mtx);
-	if (listp->running) {
-		listp->pref_mode |= TCP_TIMERLIST_10MS_MODE;
-		goto done;
+	for (uint32_t i = 0; i < tcp_timer_lists_count; i++) {
+		tcp_timerlist_expedite(&tcp_timer_lists[i]);
 	}
-
-	/* Reschedule within the next 10ms */
-	offset = TCP_TIMER_10MS_QUANTUM;
-	if (listp->scheduled) {
-		int32_t diff;
-		diff = timer_diff(listp->runtime, 0, tcp_now, offset);
-		if (diff <= 0) {
-			/* The timer will fire sooner than what's needed */
-			goto done;
-		}
-	}
-	listp->mode = TCP_TIMERLIST_10MS_MODE;
-	listp->idleruns = 0;
-
-	tcp_sched_timerlist(offset);
-done:
-	lck_mtx_unlock(&listp->mtx);
-	return;
 }
 
 inline void
@@ -240,6 +240,7 @@ struct tcptimerentry {
 	uint16_t index;         /* index of lowest timer that needs to run first */
 	uint16_t mode;          /* Bit-wise OR of timers that are active */
 	uint32_t runtime;       /* deadline at which the first timer has to fire */
+	uint16_t list;          /* index of the timer list of the entry */
 };
 
 LIST_HEAD(timerlisthead, tcptimerentry);
@@ -268,6 +269,12 @@ struct tcptimerlist {
 	u_int16_t probe_if_index; /* Interface index that needs to send probes */
 };
 
+/*
+ * Connections are spread over up to one timer list per CPU by flow hash,
+ * so that each list can be run in parallel and has its own lock.
+ */
+#define TCP_TIMERLIST_MAX_COUNT 64
+
 /* number of idle runs allowed for TCP timer list in fast or quick modes */
 #define TCP_FASTMODE_IDLERUN_MAX 10
 
@@ -0,0 +1,933 @@
+/*
+ * Copyright (c) 2024 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#include "tcp_includes.h"
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/mbuf.h>
+#include <sys/socket.h>
+#include <sys/socketvar.h>
+#include <kern/zalloc.h>
+
+#include <corecrypto/cc.h>
+#include <libkern/crypto/aes.h>
+#include <libkern/crypto/chacha20poly1305.h>
+
+/*
+ * Kernel TLS record layer.
+ *
+ * The handshake stays in user space, which installs the traffic keys of
+ * each direction once it is done.  Sent data is then framed and sealed
+ * into TLS records before it is queued in the send buffer, so that
+ * retransmissions and sendfile(2) need no further work.  Received data
+ * is staged until a whole record is in, then authenticated and decrypted
+ * into the receive buffer.
+ *
+ * The records are AEAD protected, as in TLS 1.2 (RFC 5288, RFC 7905) and
+ * TLS 1.3 (RFC 8446).  Decryption is done out of place since the received
+ * clusters may be shared, e.g. over loopback.
+ *
+ * TLS 1.3 key updates are handled by user space as well: it replaces the
+ * send keys after sending a KeyUpdate message, and decryption stops after
+ * a received one until it has replaced the receive keys.
+ */
+
+#define TLS_HEADER_LEN          5
+#define TLS_TAG_LEN             16
+#define TLS_NONCE_LEN           12
+#define TLS_EXPLICIT_NONCE_LEN  8
+#define TLS_SALT_LEN            (TLS_NONCE_LEN - TLS_EXPLICIT_NONCE_LEN)
+#define TLS_AAD_LEN_1_2         13
+#define TLS_HANDSHAKE_KEY_UPDATE 24
+
+/* Maximum length of the protected part of a record */
+#define TLS_MAX_CIPHERTEXT_1_2  (TCP_TLS_MAX_PLAINTEXT + 2048)
+#define TLS_MAX_CIPHERTEXT_1_3  (TCP_TLS_MAX_PLAINTEXT + 256)
+
+struct tcp_tls_dir {
+	uint16_t        version;
+	uint16_t        cipher;
+	bool            encrypt;
+	uint8_t         iv[TLS_NONCE_LEN];
+	uint64_t        seq;            /* sequence number of the next record */
+	size_t          ctx_size;
+	void            *ctx;           /* ccgcm_ctx or chacha20poly1305_ctx */
+};
+
+struct tcp_tls {
+	struct tcp_tls_dir      tx;
+	struct tcp_tls_dir      rx;
+
+	struct mbuf             *rx_m;          /* ciphertext not decrypted yet */
+	uint32_t                rx_cc;          /* bytes in rx_m */
+	int                     rx_error;       /* decryption stopped for good */
+	bool                    rx_held;        /* rx_record waits for the application */
+	bool                    rx_rekey;       /* waits for keys after a KeyUpdate */
+	struct tcp_tls_record   *rx_record;
+};
+
+static inline bool
+tcp_tls_is_gcm(struct tcp_tls_dir *d)
+{
+	return d->cipher == TCP_TLS_CIPHER_AES_GCM_128 ||
+	       d->cipher == TCP_TLS_CIPHER_AES_GCM_256;
+}
+
+/* Only AES-GCM in TLS 1.2 sends part of the nonce in the record */
+static inline int
+tcp_tls_explicit_len(struct tcp_tls_dir *d)
+{
+	if (d->version == TCP_TLS_VERSION_1_2 && tcp_tls_is_gcm(d)) {
+		return TLS_EXPLICIT_NONCE_LEN;
+	}
+	return 0;
+}
+
+static void
+tcp_tls_nonce(struct tcp_tls_dir *d, uint8_t nonce[TLS_NONCE_LEN])
+{
+	uint64_t seq = htonll(d->seq);
+	uint8_t *seqp = (uint8_t *)&seq;
+
+	if (tcp_tls_explicit_len(d) != 0) {
+		memcpy(nonce, d->iv, TLS_SALT_LEN);
+		memcpy(nonce + TLS_SALT_LEN, seqp, TLS_EXPLICIT_NONCE_LEN);
+		return;
+	}
+	memcpy(nonce, d->iv, TLS_NONCE_LEN);
+	for (int i = 0; i < TLS_EXPLICIT_NONCE_LEN; i++) {
+		nonce[TLS_SALT_LEN + i] ^= seqp[i];
+	}
+}
+
+/* Additional data of TLS 1.2, the record header is used for TLS 1.3 */
+static void
+tcp_tls_aad_1_2(struct tcp_tls_dir *d, uint8_t type, int len,
+    uint8_t aad[TLS_AAD_LEN_1_2])
+{
+	uint64_t seq = htonll(d->seq);
+
+	memcpy(aad, &seq, sizeof(seq));
+	aad[8] = type;
+	aad[9] = TCP_TLS_VERSION_1_2 >> 8;
+	aad[10] = TCP_TLS_VERSION_1_2 & 0xff;
+	aad[11] = (uint8_t)(len >> 8);
+	aad[12] = (uint8_t)len;
+}
+
+static int
+tcp_tls_crypt_begin(struct tcp_tls_dir *d, const uint8_t nonce[TLS_NONCE_LEN],
+    const uint8_t *aad, int aad_len)
+{
+	int error;
+
+	if (!tcp_tls_is_gcm(d)) {
+		error = chacha20poly1305_reset(d->ctx);
+		if (error == 0) {
+			error = chacha20poly1305_setnonce(d->ctx, nonce);
+		}
+		if (error == 0) {
+			error = chacha20poly1305_aad(d->ctx, aad_len, aad);
+		}
+	} else if (d->encrypt) {
+		error = aes_encrypt_reset_gcm(d->ctx);
+		if (error == 0) {
+			error = aes_encrypt_set_iv_gcm(nonce, TLS_NONCE_LEN, d->ctx);
+		}
+		if (error == 0) {
+			error = aes_encrypt_aad_gcm(aad, aad_len, d->ctx);
+		}
+	} else {
+		error = aes_decrypt_reset_gcm(d->ctx);
+		if (error == 0) {
+			error = aes_decrypt_set_iv_gcm(nonce, TLS_NONCE_LEN, d->ctx);
+		}
+		if (error == 0) {
+			error = aes_decrypt_aad_gcm(aad, aad_len, d->ctx);
+		}
+	}
+	return error;
+}
+
+static int
+tcp_tls_crypt_update(struct tcp_tls_dir *d, const uint8_t *in, uint8_t *out,
+    int len)
+{
+	if (!tcp_tls_is_gcm(d)) {
+		if (d->encrypt) {
+			return chacha20poly1305_encrypt(d->ctx, len, in, out);
+		}
+		return chacha20poly1305_decrypt(d->ctx, len, in, out);
+	}
+	if (d->encrypt) {
+		return aes_encrypt_gcm(in, len, out, d->ctx);
+	}
+	return aes_decrypt_gcm(in, len, out, d->ctx);
+}
+
+/* Computes the tag of a sealed record, or checks the one of a received record */
+static int
+tcp_tls_crypt_finish(struct tcp_tls_dir *d, uint8_t tag[TLS_TAG_LEN])
+{
+	if (!tcp_tls_is_gcm(d)) {
+		if (d->encrypt) {
+			return chacha20poly1305_finalize(d->ctx, tag);
+		}
+		return chacha20poly1305_verify(d->ctx, tag);
+	}
+	if (d->encrypt) {
+		return aes_encrypt_finalize_gcm(tag, TLS_TAG_LEN, d->ctx);
+	}
+	return aes_decrypt_finalize_gcm(tag, TLS_TAG_LEN, d->ctx);
+}
+
+/* Encrypts or decrypts len bytes of a chain at soff into another at doff */
+static int
+tcp_tls_crypt_chain(struct tcp_tls_dir *d, struct mbuf *src, int soff,
+    struct mbuf *dst, int doff, int len)
+{
+	int error, n;
+
+	while (src != NULL && soff >= src->m_len) {
+		soff -= src->m_len;
+		src = src->m_next;
+	}
+	while (dst != NULL && doff >= dst->m_len) {
+		doff -= dst->m_len;
+		dst = dst->m_next;
+	}
+	while (len > 0) {
+		if (src == NULL || dst == NULL) {
+			return EINVAL;
+		}
+		n = imin(imin(src->m_len - soff, dst->m_len - doff), len);
+		if (n > 0) {
+			error = tcp_tls_crypt_update(d,
+			    mtod(src, uint8_t *) + soff,
+			    mtod(dst, uint8_t *) + doff, n);
+			if (error != 0) {
+				return error;
+			}
+		}
+		len -= n;
+		soff += n;
+		doff += n;
+		if (soff == src->m_len) {
+			src = src->m_next;
+			soff = 0;
+		}
+		if (doff == dst->m_len) {
+			dst = dst->m_next;
+			doff = 0;
+		}
+	}
+	return 0;
+}
+
+static struct mbuf *
+tcp_tls_alloc_chain(int len)
+{
+	unsigned int num_needed = 1;
+	struct mbuf *m, *n;
+	int curlen = 0;
+
+	m = m_allocpacket_internal(&num_needed, len, NULL, M_NOWAIT, 1, 0);
+	if (m == NULL) {
+		return NULL;
+	}
+	for (n = m; n != NULL; n = n->m_next) {
+		n->m_len = (int32_t)imin((int)mbuf_maxlen(n), len - curlen);
+		curlen += n->m_len;
+	}
+	mbuf_pkthdr_setlen(m, curlen);
+	return m;
+}
+
+static int
+tcp_tls_dir_init(struct tcp_tls_dir *d, struct tcp_tls_crypto_info *ci,
+    bool encrypt)
+{
+	int key_len, error;
+
+	if (ci->tci_version != TCP_TLS_VERSION_1_2 &&
+	    ci->tci_version != TCP_TLS_VERSION_1_3) {
+		return EINVAL;
+	}
+	switch (ci->tci_cipher) {
+	case TCP_TLS_CIPHER_AES_GCM_128:
+		key_len = 16;
+		d->ctx_size = encrypt ? aes_encrypt_get_ctx_size_gcm() :
+		    aes_decrypt_get_ctx_size_gcm();
+		break;
+	case TCP_TLS_CIPHER_AES_GCM_256:
+		key_len = 32;
+		d->ctx_size = encrypt ? aes_encrypt_get_ctx_size_gcm() :
+		    aes_decrypt_get_ctx_size_gcm();
+		break;
+	case TCP_TLS_CIPHER_CHACHA20_POLY1305:
+		key_len = 32;
+		d->ctx_size = sizeof(chacha20poly1305_ctx);
+		break;
+	default:
+		return EINVAL;
+	}
+
+	d->version = ci->tci_version;
+	d->cipher = ci->tci_cipher;
+	d->encrypt = encrypt;
+	memcpy(d->iv, ci->tci_iv, sizeof(d->iv));
+	memcpy(&d->seq, ci->tci_seq, sizeof(d->seq));
+	d->seq = ntohll(d->seq);
+	d->ctx = kalloc_data(d->ctx_size, Z_WAITOK | Z_ZERO);
+	if (d->ctx == NULL) {
+		return ENOMEM;
+	}
+
+	if (!tcp_tls_is_gcm(d)) {
+		error = chacha20poly1305_init(d->ctx, ci->tci_key);
+	} else if (encrypt) {
+		error = aes_encrypt_key_gcm(ci->tci_key, key_len, d->ctx);
+		if (error == 0) {
+			error = aes_encrypt_reset_gcm(d->ctx);
+		}
+	} else {
+		error = aes_decrypt_key_gcm(ci->tci_key, key_len, d->ctx);
+	}
+	if (error != 0) {
+		kfree_data(d->ctx, d->ctx_size);
+		d->ctx = NULL;
+		return EINVAL;
+	}
+	return 0;
+}
+
+static void
+tcp_tls_dir_free(struct tcp_tls_dir *d)
+{
+	if (d->ctx != NULL) {
+		cc_clear(d->ctx_size, d->ctx);
+		kfree_data(d->ctx, d->ctx_size);
+		d->ctx = NULL;
+	}
+	cc_clear(sizeof(d->iv), d->iv);
+}
+
+/*
+ * Seals len bytes of plaintext at off into a record of the given type
+ */
+static struct mbuf *
+tcp_tls_seal_record(struct tcp_tls_dir *d, struct mbuf *m, int off, int len,
+    uint8_t type, int *errorp)
+{
+	uint8_t hdr[TLS_HEADER_LEN], nonce[TLS_NONCE_LEN];
+	uint8_t aad[TLS_AAD_LEN_1_2], tag[TLS_TAG_LEN];
+	int explicit_len = tcp_tls_explicit_len(d);
+	bool tls13 = d->version == TCP_TLS_VERSION_1_3;
+	int inner_len = len + (tls13 ? 1 : 0);
+	int clen = explicit_len + inner_len + TLS_TAG_LEN;
+	struct mbuf *rec;
+	int error;
+
+	rec = tcp_tls_alloc_chain(TLS_HEADER_LEN + clen);
+	if (rec == NULL) {
+		*errorp = ENOBUFS;
+		return NULL;
+	}
+
+	/* TLS 1.3 hides the real type inside the record */
+	hdr[0] = tls13 ? TCP_TLS_CONTENT_APPLICATION_DATA : type;
+	hdr[1] = TCP_TLS_VERSION_1_2 >> 8;
+	hdr[2] = TCP_TLS_VERSION_1_2 & 0xff;
+	hdr[3] = (uint8_t)(clen >> 8);
+	hdr[4] = (uint8_t)clen;
+	m_copyback(rec, 0, TLS_HEADER_LEN, hdr);
+
+	tcp_tls_nonce(d, nonce);
+	if (explicit_len != 0) {
+		m_copyback(rec, TLS_HEADER_LEN, explicit_len,
+		    nonce + TLS_SALT_LEN);
+	}
+	if (tls13) {
+		error = tcp_tls_crypt_begin(d, nonce, hdr, TLS_HEADER_LEN);
+	} else {
+		tcp_tls_aad_1_2(d, type, len, aad);
+		error = tcp_tls_crypt_begin(d, nonce, aad, sizeof(aad));
+	}
+	if (error == 0) {
+		error = tcp_tls_crypt_chain(d, m, off, rec,
+		    TLS_HEADER_LEN + explicit_len, len);
+	}
+	if (error == 0 && tls13) {
+		uint8_t inner_type;
+
+		error = tcp_tls_crypt_update(d, &type, &inner_type, 1);
+		m_copyback(rec, TLS_HEADER_LEN + explicit_len + len, 1,
+		    &inner_type);
+	}
+	if (error == 0) {
+		error = tcp_tls_crypt_finish(d, tag);
+	}
+	if (error != 0) {
+		m_freem(rec);
+		*errorp = EINVAL;
+		return NULL;
+	}
+	m_copyback(rec, TLS_HEADER_LEN + clen - TLS_TAG_LEN, TLS_TAG_LEN, tag);
+	d->seq++;
+
+	return rec;
+}
+
+/*
+ * Replaces the plaintext of a send with the TLS records carrying it
+ */
+int
+tcp_tls_seal(struct tcpcb *tp, struct mbuf **mp, uint8_t type)
+{
+	struct tcp_tls_dir *d = &tp->t_tls->tx;
+	struct mbuf *m = *mp, *top = NULL, *last = NULL, *rec;
+	int len, off, plen, error = 0;
+	uint64_t seq = d->seq;
+
+	if (m == NULL) {
+		return 0;
+	}
+	len = m_length(m);
+	if (len == 0 && type == TCP_TLS_CONTENT_APPLICATION_DATA) {
+		return 0;
+	}
+
+	off = 0;
+	do {
+		plen = imin(len - off, TCP_TLS_MAX_PLAINTEXT);
+		rec = tcp_tls_seal_record(d, m, off, plen, type, &error);
+		if (rec == NULL) {
+			break;
+		}
+		if (top == NULL) {
+			top = rec;
+		} else {
+			top->m_pkthdr.len += rec->m_pkthdr.len;
+			last->m_next = rec;
+		}
+		for (last = rec; last->m_next != NULL; last = last->m_next) {
+			;
+		}
+		off += plen;
+	} while (off < len);
+
+	m_freem(m);
+	if (error != 0) {
+		/*
+		 * The records sealed so far can't be sent either, give
+		 * their sequence numbers back to the next records.
+		 */
+		if (top != NULL) {
+			m_freem(top);
+		}
+		d->seq = seq;
+		*mp = NULL;
+		return error;
+	}
+	*mp = top;
+	return 0;
+}
+
+/*
+ * Returns the index of the last non-zero byte of a TLS 1.3 inner
+ * plaintext, which is the real content type, or -1 without one
+ */
+static int
+tcp_tls_inner_type(struct mbuf *m, uint8_t *type)
+{
+	int off = 0, last = -1;
+
+	for (; m != NULL; m = m->m_next) {
+		uint8_t *p = mtod(m, uint8_t *);
+
+		for (int i = 0; i < m->m_len; i++) {
+			if (p[i] != 0) {
+				last = off + i;
+				*type = p[i];
+			}
+		}
+		off += m->m_len;
+	}
+	return last;
+}
+
+/*
+ * Authenticates and decrypts the record at the head of the staged
+ * ciphertext, whose header announced clen protected bytes
+ */
+static int
+tcp_tls_open_record(struct tcp_tls *tls, const uint8_t hdr[TLS_HEADER_LEN],
+    int clen, uint8_t *typep, struct mbuf **mp)
+{
+	struct tcp_tls_dir *d = &tls->rx;
+	uint8_t nonce[TLS_NONCE_LEN], aad[TLS_AAD_LEN_1_2], tag[TLS_TAG_LEN];
+	int explicit_len = tcp_tls_explicit_len(d);
+	bool tls13 = d->version == TCP_TLS_VERSION_1_3;
+	struct mbuf *plain = NULL;
+	int len, error;
+
+	len = clen - explicit_len - TLS_TAG_LEN;
+	if (len < (tls13 ? 1 : 0)) {
+		return EBADMSG;
+	}
+
+	tcp_tls_nonce(d, nonce);
+	if (explicit_len != 0) {
+		m_copydata(tls->rx_m, TLS_HEADER_LEN, explicit_len,
+		    nonce + TLS_SALT_LEN);
+	}
+	if (len > 0) {
+		plain = tcp_tls_alloc_chain(len);
+		if (plain == NULL) {
+			return ENOBUFS;
+		}
+	}
+	if (tls13) {
+		error = tcp_tls_crypt_begin(d, nonce, hdr, TLS_HEADER_LEN);
+	} else {
+		tcp_tls_aad_1_2(d, hdr[0], len, aad);
+		error = tcp_tls_crypt_begin(d, nonce, aad, sizeof(aad));
+	}
+	if (error == 0) {
+		error = tcp_tls_crypt_chain(d, tls->rx_m,
+		    TLS_HEADER_LEN + explicit_len, plain, 0, len);
+	}
+	if (error == 0) {
+		m_copydata(tls->rx_m, TLS_HEADER_LEN + clen - TLS_TAG_LEN,
+		    TLS_TAG_LEN, tag);
+		error = tcp_tls_crypt_finish(d, tag);
+	}
+	if (error != 0) {
+		goto bad;
+	}
+
+	*typep = hdr[0];
+	if (tls13) {
+		int last = tcp_tls_inner_type(plain, typep);
+
+		if (last < 0) {
+			goto bad;
+		}
+		m_adj(plain, -(len - last));
+		len = last;
+	}
+	if (len > TCP_TLS_MAX_PLAINTEXT) {
+		goto bad;
+	}
+	if (len == 0 && plain != NULL) {
+		m_freem(plain);
+		plain = NULL;
+	}
+	d->seq++;
+	*mp = plain;
+	return 0;
+bad:
+	if (plain != NULL) {
+		m_freem(plain);
+	}
+	return EBADMSG;
+}
+
+/* Drops the bytes of a processed record from the staged ciphertext */
+static void
+tcp_tls_rx_drop(struct tcp_tls *tls, int len)
+{
+	tls->rx_cc -= len;
+	if (tls->rx_cc == 0) {
+		m_freem(tls->rx_m);
+		tls->rx_m = NULL;
+		return;
+	}
+	m_adj(tls->rx_m, len);
+	while (tls->rx_m->m_len == 0) {
+		tls->rx_m = m_free(tls->rx_m);
+	}
+}
+
+/*
+ * Whether a TLS 1.3 handshake record ends with a KeyUpdate message,
+ * after which the peer uses new keys
+ */
+static bool
+tcp_tls_key_update(struct tcp_tls_record *rec)
+{
+	uint32_t off = 0;
+	uint8_t type = 0;
+
+	while (off + 4 <= rec->ttr_len) {
+		type = rec->ttr_data[off];
+		off += 4 + ((rec->ttr_data[off + 1] << 16) |
+		    (rec->ttr_data[off + 2] << 8) | rec->ttr_data[off + 3]);
+	}
+	return off == rec->ttr_len && type == TLS_HANDSHAKE_KEY_UPDATE;
+}
+
+/*
+ * Decrypts the complete records staged, until one that isn't
+ * application data.  A record that can't be decrypted for lack of
+ * mbufs stays staged; only bad records break the stream.  Returns 1
+ * when the reader has to be woken up.
+ */
+static int
+tcp_tls_rx_decrypt(struct tcpcb *tp)
+{
+	struct socket *so = tp->t_inpcb->inp_socket;
+	struct tcp_tls *tls = tp->t_tls;
+	struct tcp_tls_dir *d = &tls->rx;
+	uint8_t hdr[TLS_HEADER_LEN], type;
+	struct mbuf *plain;
+	int clen, error, wakeup = 0;
+
+	while (tls->rx_error == 0 && !tls->rx_held && !tls->rx_rekey &&
+	    tls->rx_cc >= TLS_HEADER_LEN) {
+		m_copydata(tls->rx_m, 0, TLS_HEADER_LEN, hdr);
+		clen = (hdr[3] << 8) | hdr[4];
+		if (hdr[1] != (TCP_TLS_VERSION_1_2 >> 8) ||
+		    hdr[2] != (TCP_TLS_VERSION_1_2 & 0xff) ||
+		    (d->version == TCP_TLS_VERSION_1_3 &&
+		    (hdr[0] != TCP_TLS_CONTENT_APPLICATION_DATA ||
+		    clen > TLS_MAX_CIPHERTEXT_1_3)) ||
+		    clen > TLS_MAX_CIPHERTEXT_1_2) {
+			error = EBADMSG;
+			goto fail;
+		}
+		if (tls->rx_cc < TLS_HEADER_LEN + clen) {
+			break;
+		}
+
+		error = tcp_tls_open_record(tls, hdr, clen, &type, &plain);
+		if (error == ENOBUFS) {
+			/* Leave the record staged, for the next input or read */
+			break;
+		}
+		if (error != 0) {
+			goto fail;
+		}
+		tcp_tls_rx_drop(tls, TLS_HEADER_LEN + clen);
+
+		if (type == TCP_TLS_CONTENT_APPLICATION_DATA) {
+			if (plain != NULL &&
+			    sbappendstream_rcvdemux(so, plain)) {
+				wakeup = 1;
+			}
+			continue;
+		}
+
+		/* Hold back the rest until the application took this record */
+		tls->rx_record->ttr_type = type;
+		tls->rx_record->ttr_len = 0;
+		if (plain != NULL) {
+			tls->rx_record->ttr_len = (uint16_t)m_length(plain);
+			m_copydata(plain, 0, tls->rx_record->ttr_len,
+			    tls->rx_record->ttr_data);
+			m_freem(plain);
+		}
+		if (d->version == TCP_TLS_VERSION_1_3 &&
+		    type == TCP_TLS_CONTENT_HANDSHAKE &&
+		    tcp_tls_key_update(tls->rx_record)) {
+			tls->rx_rekey = true;
+		}
+		tls->rx_held = true;
+		so->so_rcv.sb_flags |= SB_RECORDHELD;
+		wakeup = 1;
+	}
+	return wakeup;
+
+fail:
+	/* The stream can't be trusted past a bad record */
+	tls->rx_error = error;
+	if (tls->rx_m != NULL) {
+		m_freem(tls->rx_m);
+		tls->rx_m = NULL;
+	}
+	tls->rx_cc = 0;
+	so->so_error = error;
+	socantrcvmore(so);
+	return 1;
+}
+
+/*
+ * Stages in-order ciphertext received by TCP and decrypts the records
+ * it completes.  Returns 1 when the reader has to be woken up.
+ */
+int
+tcp_tls_input(struct tcpcb *tp, struct mbuf *m)
+{
+	struct tcp_tls *tls = tp->t_tls;
+	int len;
+
+	if (m == NULL) {
+		return 0;
+	}
+	len = m_length(m);
+	if (len == 0 || tls->rx_error != 0) {
+		m_freem(m);
+		return 0;
+	}
+	if (tls->rx_m == NULL) {
+		tls->rx_m = m;
+	} else {
+		m_cat(tls->rx_m, m);
+	}
+	tls->rx_cc += len;
+
+	return tcp_tls_rx_decrypt(tp);
+}
+
+/*
+ * Retries the records that couldn't be decrypted for lack of mbufs once
+ * the application read from the socket
+ */
+void
+tcp_tls_rcvd(struct tcpcb *tp)
+{
+	struct tcp_tls *tls = tp->t_tls;
+
+	if (tls->rx_m == NULL) {
+		return;
+	}
+	if (tcp_tls_rx_decrypt(tp)) {
+		sorwakeup(tp->t_inpcb->inp_socket);
+	}
+}
+
+/*
+ * Ciphertext held back behind a record the application didn't take yet,
+ * or behind a KeyUpdate, counts against the receive window.  A partial
+ * record doesn't, so that a small receive buffer can't stall the
+ * connection.
+ */
+uint32_t
+tcp_tls_rx_pending(struct tcpcb *tp)
+{
+	struct tcp_tls *tls = tp->t_tls;
+
+	if (tls == NULL || (!tls->rx_held && !tls->rx_rekey)) {
+		return 0;
+	}
+	return tls->rx_cc;
+}
+
+int
+tcp_tls_record_type(struct mbuf *control, uint8_t *type)
+{
+	struct cmsghdr *cm;
+
+	for (cm = M_FIRST_CMSGHDR(control); cm;
+	    cm = M_NXT_CMSGHDR(control, cm)) {
+		if (cm->cmsg_len < sizeof(struct cmsghdr) ||
+		    cm->cmsg_len > control->m_len) {
+			return EINVAL;
+		}
+		if (cm->cmsg_level != IPPROTO_TCP ||
+		    cm->cmsg_type != TCP_TLS_RECORD_TYPE) {
+			continue;
+		}
+		if (cm->cmsg_len != CMSG_LEN(sizeof(uint8_t))) {
+			return EINVAL;
+		}
+		*type = *(uint8_t *)(void *)CMSG_DATA(cm);
+		if (*type == 0) {
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Replaces the keys of a direction for a TLS 1.3 key update, which keeps
+ * the version and cipher
+ */
+static int
+tcp_tls_dir_rekey(struct tcp_tls_dir *d, struct tcp_tls_crypto_info *ci)
+{
+	struct tcp_tls_dir nd = {};
+	int error;
+
+	if (ci->tci_version != d->version || ci->tci_cipher != d->cipher) {
+		return EINVAL;
+	}
+	error = tcp_tls_dir_init(&nd, ci, d->encrypt);
+	if (error != 0) {
+		return error;
+	}
+	tcp_tls_dir_free(d);
+	*d = nd;
+	cc_clear(sizeof(nd), &nd);
+	return 0;
+}
+
+int
+tcp_tls_setopt(struct tcpcb *tp, struct sockopt *sopt)
+{
+	struct socket *so = tp->t_inpcb->inp_socket;
+	struct tcp_tls_crypto_info ci;
+	bool tx = sopt->sopt_name == TCP_TLS_TX;
+	struct tcp_tls *tls;
+	struct mbuf *m;
+	int error;
+
+	error = sooptcopyin(sopt, &ci, sizeof(ci), sizeof(ci));
+	if (error != 0) {
+		return error;
+	}
+	if (so->so_flags & SOF_MP_SUBFLOW) {
+		error = EOPNOTSUPP;
+		goto done;
+	}
+	if (!TCPS_HAVEESTABLISHED(tp->t_state) ||
+	    tp->t_state == TCPS_TIME_WAIT) {
+		error = ENOTCONN;
+		goto done;
+	}
+	if (tx && (tp->t_flagsext & TF_TLS_TX)) {
+		/* the KeyUpdate was sealed with the keys it replaces */
+		if (tp->t_tls->tx.version != TCP_TLS_VERSION_1_3) {
+			error = EBUSY;
+			goto done;
+		}
+		error = tcp_tls_dir_rekey(&tp->t_tls->tx, &ci);
+		goto done;
+	}
+	if (!tx && (tp->t_flagsext & TF_TLS_RX)) {
+		tls = tp->t_tls;
+		if (!tls->rx_rekey || tls->rx_held) {
+			error = EBUSY;
+			goto done;
+		}
+		error = tcp_tls_dir_rekey(&tls->rx, &ci);
+		if (error == 0) {
+			tls->rx_rekey = false;
+			if (tcp_tls_rx_decrypt(tp)) {
+				sorwakeup(so);
+			}
+			(void) tcp_output(tp);
+		}
+		goto done;
+	}
+
+	if (tp->t_tls == NULL) {
+		tp->t_tls = kalloc_type(struct tcp_tls, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	}
+	tls = tp->t_tls;
+
+	if (tx) {
+		error = tcp_tls_dir_init(&tls->tx, &ci, true);
+		if (error == 0) {
+			tp->t_flagsext |= TF_TLS_TX;
+		}
+		goto done;
+	}
+
+	error = tcp_tls_dir_init(&tls->rx, &ci, false);
+	if (error != 0) {
+		goto done;
+	}
+	tls->rx_record = kalloc_type(struct tcp_tls_record,
+	    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+
+	/* Records received right after the handshake are still to decrypt */
+	if (so->so_rcv.sb_cc > 0) {
+		m = m_copym(so->so_rcv.sb_mb, 0, so->so_rcv.sb_cc, M_NOWAIT);
+		if (m == NULL) {
+			tcp_tls_dir_free(&tls->rx);
+			kfree_type(struct tcp_tls_record, tls->rx_record);
+			error = ENOBUFS;
+			goto done;
+		}
+		sbdrop(&so->so_rcv, so->so_rcv.sb_cc);
+		tls->rx_m = m;
+		tls->rx_cc = m_length(m);
+	}
+	tp->t_flagsext |= TF_TLS_RX;
+	if (tcp_tls_rx_decrypt(tp)) {
+		sorwakeup(so);
+	}
+done:
+	cc_clear(sizeof(ci), &ci);
+	return error;
+}
+
+int
+tcp_tls_getopt(struct tcpcb *tp, struct sockopt *sopt)
+{
+	struct socket *so = tp->t_inpcb->inp_socket;
+	struct tcp_tls *tls = tp->t_tls;
+	int error;
+
+	if (!(tp->t_flagsext & TF_TLS_RX)) {
+		return EINVAL;
+	}
+	if (!tls->rx_held) {
+		return tls->rx_error != 0 ? tls->rx_error : ENOENT;
+	}
+
+	error = sooptcopyout(sopt, tls->rx_record,
+	    offsetof(struct tcp_tls_record, ttr_data) + tls->rx_record->ttr_len);
+	if (error != 0) {
+		return error;
+	}
+	tls->rx_held = false;
+	so->so_rcv.sb_flags &= ~SB_RECORDHELD;
+
+	/* Resume with the records held back, and reopen the window */
+	if (tcp_tls_rx_decrypt(tp)) {
+		sorwakeup(so);
+	}
+	(void) tcp_output(tp);
+	return 0;
+}
+
+void
+tcp_tls_free(struct tcpcb *tp)
+{
+	struct tcp_tls *tls = tp->t_tls;
+
+	if (tls == NULL) {
+		return;
+	}
+	tcp_tls_dir_free(&tls->tx);
+	tcp_tls_dir_free(&tls->rx);
+	if (tls->rx_m != NULL) {
+		m_freem(tls->rx_m);
+	}
+	if (tls->rx_record != NULL) {
+		cc_clear(sizeof(*tls->rx_record), tls->rx_record);
+		kfree_type(struct tcp_tls_record, tls->rx_record);
+	}
+	kfree_type(struct tcp_tls, tls);
+	tp->t_tls = NULL;
+	tp->t_flagsext &= ~(TF_TLS_TX | TF_TLS_RX);
+	tp->t_inpcb->inp_socket->so_rcv.sb_flags &= ~SB_RECORDHELD;
+}
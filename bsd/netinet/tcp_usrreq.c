@@ -396,6 +396,7 @@ tcp_usr_listen(struct socket *so, struct proc *p)
 	if (error == 0) {
 		TCP_LOG_STATE(tp, TCPS_LISTEN);
 		tp->t_state = TCPS_LISTEN;
+		in_pcblbgroup_insert(inp, 0);
 		if (nstat_collect) {
 			nstat_pcb_event(inp, NSTAT_EVENT_SRC_FLOW_STATE_LISTEN);
 		}
@@ -426,6 +427,7 @@ tcp6_usr_listen(struct socket *so, struct proc *p)
 	if (error == 0) {
 		TCP_LOG_STATE(tp, TCPS_LISTEN);
 		tp->t_state = TCPS_LISTEN;
+		in_pcblbgroup_insert(inp, 0);
 		if (nstat_collect) {
 			nstat_pcb_event(inp, NSTAT_EVENT_SRC_FLOW_STATE_LISTEN);
 		}
@@ -1048,6 +1050,10 @@ tcp_usr_rcvd(struct socket *so, int flags)
 	}
 	tcp_sbrcv_trim(tp, &so->so_rcv);
 
+	if (tp->t_flagsext & TF_TLS_RX) {
+		tcp_tls_rcvd(tp);
+	}
+
 	if ((flags & MSG_WAITALL) && SEQ_LT(tp->last_ack_sent, tp->rcv_nxt)) {
 		tp->t_flags |= TF_ACKNOW;
 	}
@@ -1159,6 +1165,7 @@ tcp_usr_send(struct socket *so, int flags, struct mbuf *m,
 	uint32_t mpkl_len = 0; /* length of mbuf chain */
 	uint32_t mpkl_seq = 0; /* sequence number where new data is added */
 	struct so_mpkl_send_info mpkl_send_info = {};
+	uint8_t tls_type = TCP_TLS_CONTENT_APPLICATION_DATA;
 	bool isipv6;
 
 	bool cant_connect = (inp->inp_flowhash == 0) && (nam == NULL);
@@ -1226,6 +1233,18 @@ tcp_usr_send(struct socket *so, int flags, struct mbuf *m,
 				goto out;
 			}
 		}
+		if (control->m_len > 0 && (tp->t_flagsext & TF_TLS_TX)) {
+			error = tcp_tls_record_type(control, &tls_type);
+			if (error != 0) {
+				m_freem(control);
+				if (m != NULL) {
+					m_freem(m);
+				}
+				control = NULL;
+				m = NULL;
+				goto out;
+			}
+		}
 		/*
 		 * Silently drop unsupported ancillary data messages
 		 */
@@ -1233,6 +1252,21 @@ tcp_usr_send(struct socket *so, int flags, struct mbuf *m,
 		control = NULL;
 	}
 
+	if (tp->t_flagsext & TF_TLS_TX) {
+		/* Urgent data has no place in a TLS record stream */
+		if (flags & PRUS_OOB) {
+			if (m != NULL) {
+				m_freem(m);
+			}
+			error = EOPNOTSUPP;
+			goto out;
+		}
+		error = tcp_tls_seal(tp, &m, tls_type);
+		if (error != 0) {
+			goto out;
+		}
+	}
+
 	/* MPTCP sublow socket buffers must not be compressed */
 	VERIFY(!(so->so_flags & SOF_MP_SUBFLOW) ||
 	    (so->so_snd.sb_flags & SB_NOCOMPRESS));
@@ -2750,6 +2784,10 @@ tcp_ctloutput(struct socket *so, struct sockopt *sopt)
 			}
 			tcp_set_foreground_cc(so);
 			break;
+		case TCP_TLS_TX:
+		case TCP_TLS_RX:
+			error = tcp_tls_setopt(tp, sopt);
+			break;
 		case TCP_NOTIFY_ACKNOWLEDGEMENT:
 			error = sooptcopyin(sopt, &optval,
 			    sizeof(optval), sizeof(optval));
@@ -2876,6 +2914,15 @@ tcp_ctloutput(struct socket *so, struct sockopt *sopt)
 		case TCP_ENABLE_L4S:
 			optval = (tp->t_flagsext & TF_L4S_ENABLED) ? 1 : 0;
 			break;
+		case TCP_TLS_TX:
+			optval = (tp->t_flagsext & TF_TLS_TX) ? 1 : 0;
+			break;
+		case TCP_TLS_RX:
+			optval = (tp->t_flagsext & TF_TLS_RX) ? 1 : 0;
+			break;
+		case TCP_TLS_RX_RECORD:
+			error = tcp_tls_getopt(tp, sopt);
+			goto done;
 		case TCP_CONNECTIONTIMEOUT:
 			optval = tp->t_keepinit / TCP_RETRANSHZ;
 			break;
@@ -3342,6 +3389,10 @@ tcpsockopt_cassert(void)
 	case TCP_DISABLE_BLACKHOLE_DETECTION:
 	case TCP_ECN_MODE:
 	case TCP_KEEPALIVE_OFFLOAD:
+	case TCP_TLS_TX:
+	case TCP_TLS_RX:
+	case TCP_TLS_RX_RECORD:
+	case TCP_TLS_RECORD_TYPE:
 		;
 	}
 }
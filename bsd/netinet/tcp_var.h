@@ -184,8 +184,14 @@ struct sackhole {
 	tcp_seq rxmit;          /* next seq. no in hole to be retransmitted */
 	u_int32_t rxmit_start;  /* timestamp of first retransmission */
 	TAILQ_ENTRY(sackhole) scblink;  /* scoreboard linkage */
+	RB_ENTRY(sackhole) scbtree;     /* scoreboard index by start */
 };
 
+int tcp_sackhole_cmp(const struct sackhole *, const struct sackhole *);
+
+RB_HEAD(sackhole_tree_head, sackhole);
+RB_PROTOTYPE(sackhole_tree_head, sackhole, scbtree, tcp_sackhole_cmp)
+
 struct sackhint {
 	struct sackhole *nexthole;
 	int     sack_bytes_rexmit;
@@ -213,6 +219,13 @@ struct tcp_seg_sent {
 #define TCP_RACK_RETRANSMITTED              0x4
 #define TCP_SEGMENT_RETRANSMITTED_ATLEAST_ONCE      0x8 /* If a segment was retransmitted at least once; used for reordering detection and to avoid spurious inferences for RACK.rtt */
 #define TCP_SEGMENT_RETRANSMITTED           (TCP_RACK_RETRANSMITTED | TCP_SEGMENT_RETRANSMITTED_ATLEAST_ONCE)
+#define TCP_SEGMENT_APP_LIMITED             0x10 /* Sent while the connection was application-limited */
+
+	/* Delivery rate sampling state at the time of (re)transmission */
+	uint64_t tx_ts;                 /* send time in microseconds */
+	uint64_t tx_delivered;          /* t_rate.delivered when sent */
+	uint64_t tx_delivered_ts;       /* t_rate.delivered_ts when sent */
+	uint64_t tx_first_ts;           /* t_rate.first_tx_ts when sent */
 
 	TAILQ_ENTRY(tcp_seg_sent) tx_link; /* Time ordered list of segments */
 	RB_ENTRY(tcp_seg_sent)    seg_link; /* RB tree to keep track of S/ACKed segments */
@@ -336,6 +349,79 @@ struct tcp_ccstate {
 #define ledbat_slowdown_ts __u__._ledbat_state_.slowdown_ts
 #define ledbat_slowdown_begin __u__._ledbat_state_.slowdown_begin
 #define ledbat_md_bytes_acked __u__._ledbat_state_.md_bytes_acked
+		struct tcp_bbr_state {
+			uint64_t bw;              /* bottleneck bandwidth estimate, bytes per second */
+			uint64_t bw_hi[2];        /* max delivery rate of the current and previous probe cycle */
+			uint64_t bw_lo;           /* short-term lower bound of bw after loss */
+			uint64_t bw_latest;       /* max delivery rate of the current round */
+			uint64_t full_bw;         /* bw at the last STARTUP growth check */
+			uint64_t delivery_rate;   /* rate of the last valid sample */
+			uint64_t next_round_delivered; /* delivered count that ends the current round */
+			uint64_t round_count;     /* packet-timed round trips so far */
+			uint64_t last_delivered;  /* t_rate.delivered at the previous sample */
+			uint64_t min_rtt_stamp;   /* time min_rtt was measured, in microseconds */
+			uint64_t cycle_stamp;     /* start of the current PROBE_BW phase, in microseconds */
+			uint64_t probe_rtt_done_stamp; /* end of the current PROBE_RTT, in microseconds */
+			uint32_t min_rtt;         /* windowed min RTT, in microseconds */
+			uint32_t probe_wait;      /* wall clock to wait in PROBE_BW before probing, in microseconds */
+			uint32_t inflight_hi;     /* long-term upper bound of bytes in flight */
+			uint32_t inflight_lo;     /* short-term upper bound of bytes in flight after loss */
+			uint32_t inflight_latest; /* bytes delivered in the current round */
+			uint32_t lost_in_round;   /* bytes lost in the current round */
+			uint32_t delivered_in_round; /* bytes delivered in the current round */
+			uint32_t prior_cwnd;      /* cwnd before loss recovery or PROBE_RTT */
+			uint32_t probe_up_cnt;    /* bytes to deliver per inflight_hi increase */
+			uint32_t probe_up_acked;  /* bytes delivered towards the next increase */
+			uint32_t probe_up_rounds; /* rounds spent raising inflight_hi */
+			uint32_t rounds_since_probe; /* rounds since the last bandwidth probe */
+			uint16_t pacing_gain;     /* in units of 1/256 */
+			uint16_t cwnd_gain;       /* in units of 1/256 */
+			uint8_t state;            /* STARTUP, DRAIN, PROBE_BW or PROBE_RTT */
+			uint8_t phase;            /* phase of the PROBE_BW cycle */
+			uint8_t full_bw_cnt;      /* rounds without significant bw growth */
+			uint8_t round_start:1,    /* this ACK started a new round */
+			    full_bw_reached:1,    /* STARTUP has filled the pipe */
+			    probe_rtt_round_done:1, /* a round elapsed at the PROBE_RTT cwnd */
+			    loss_in_cycle:1,      /* loss was seen while probing for bandwidth */
+			    idle_restart:1,       /* restarting after an idle period */
+			    in_recovery:1,        /* in loss recovery */
+			    unused:2;
+		} _bbr_state_;
+#define bbr_bw __u__._bbr_state_.bw
+#define bbr_bw_hi __u__._bbr_state_.bw_hi
+#define bbr_bw_lo __u__._bbr_state_.bw_lo
+#define bbr_bw_latest __u__._bbr_state_.bw_latest
+#define bbr_full_bw __u__._bbr_state_.full_bw
+#define bbr_delivery_rate __u__._bbr_state_.delivery_rate
+#define bbr_next_round_delivered __u__._bbr_state_.next_round_delivered
+#define bbr_round_count __u__._bbr_state_.round_count
+#define bbr_last_delivered __u__._bbr_state_.last_delivered
+#define bbr_min_rtt_stamp __u__._bbr_state_.min_rtt_stamp
+#define bbr_cycle_stamp __u__._bbr_state_.cycle_stamp
+#define bbr_probe_rtt_done_stamp __u__._bbr_state_.probe_rtt_done_stamp
+#define bbr_min_rtt __u__._bbr_state_.min_rtt
+#define bbr_probe_wait __u__._bbr_state_.probe_wait
+#define bbr_inflight_hi __u__._bbr_state_.inflight_hi
+#define bbr_inflight_lo __u__._bbr_state_.inflight_lo
+#define bbr_inflight_latest __u__._bbr_state_.inflight_latest
+#define bbr_lost_in_round __u__._bbr_state_.lost_in_round
+#define bbr_delivered_in_round __u__._bbr_state_.delivered_in_round
+#define bbr_prior_cwnd __u__._bbr_state_.prior_cwnd
+#define bbr_probe_up_cnt __u__._bbr_state_.probe_up_cnt
+#define bbr_probe_up_acked __u__._bbr_state_.probe_up_acked
+#define bbr_probe_up_rounds __u__._bbr_state_.probe_up_rounds
+#define bbr_rounds_since_probe __u__._bbr_state_.rounds_since_probe
+#define bbr_pacing_gain __u__._bbr_state_.pacing_gain
+#define bbr_cwnd_gain __u__._bbr_state_.cwnd_gain
+#define bbr_state __u__._bbr_state_.state
+#define bbr_phase __u__._bbr_state_.phase
+#define bbr_full_bw_cnt __u__._bbr_state_.full_bw_cnt
+#define bbr_round_start __u__._bbr_state_.round_start
+#define bbr_full_bw_reached __u__._bbr_state_.full_bw_reached
+#define bbr_probe_rtt_round_done __u__._bbr_state_.probe_rtt_round_done
+#define bbr_loss_in_cycle __u__._bbr_state_.loss_in_cycle
+#define bbr_idle_restart __u__._bbr_state_.idle_restart
+#define bbr_in_recovery __u__._bbr_state_.in_recovery
 	} __u__;
 };
 
@@ -376,6 +462,41 @@ struct pacer {
 	uint64_t packet_tx_time;
 };
 
+/*
+ * Delivery rate estimation, following draft-cheng-iccrg-delivery-rate-estimation.
+ * Segments snapshot the connection's delivery state when they are sent and
+ * the sample of an ACK is taken from the most recently sent segment it
+ * delivers. Times are in microseconds.
+ */
+struct tcp_rate {
+	uint64_t delivered;             /* bytes ACKed or SACKed so far */
+	uint64_t delivered_ts;          /* time delivered was last updated */
+	uint64_t first_tx_ts;           /* send time of the first segment of the current flight */
+	uint64_t app_limited;           /* delivered count ending the app-limited phase, 0 if none */
+	uint64_t lost;                  /* bytes marked lost so far */
+
+	/* Rate sample of the ACK being processed */
+	uint64_t rs_prior_delivered;    /* delivered when the newest delivered segment was sent */
+	uint64_t rs_prior_ts;           /* delivered_ts when the newest delivered segment was sent */
+	uint64_t rs_tx_ts;              /* send time of the newest delivered segment, 0 if none */
+	uint64_t rs_prior_lost;         /* lost at the previous sample */
+	uint32_t rs_send_elapsed;       /* send phase of the sample */
+	uint32_t rs_ack_elapsed;        /* ACK phase of the sample */
+	uint32_t rs_interval;           /* max of the send and ACK phases */
+	uint32_t rs_delivered;          /* bytes delivered over the interval */
+	uint32_t rs_lost;               /* bytes newly marked lost */
+	uint32_t rs_rtt;                /* RTT of the newest delivered segment, 0 if ambiguous */
+	uint8_t rs_is_app_limited:1,    /* the sample was taken while app-limited */
+	    rs_valid:1,                 /* the sample can be used */
+	    unused:6;
+	uint8_t pad[3];
+
+	/* Per-window sample used when segments are not tracked (no SACK) */
+	tcp_seq win_end;                /* sequence number ending the current window */
+	uint64_t win_delivered;         /* delivered at the start of the window */
+	uint64_t win_ts;                /* time at the start of the window */
+};
+
 /*
  * Tcp control block, one per tcp; fields:
  * Organized for 16 byte cacheline efficiency.
@@ -419,7 +540,7 @@ struct tcpcb {
 #define TF_CLOSING      0x8000000       /* pending tcp close */
 #define TF_TSO          0x10000000      /* TCP Segment Offloading is enable on this connection */
 #define TF_BLACKHOLE    0x20000000      /* Path MTU Discovery Black Hole detection */
-#define TF_TIMER_ONLIST 0x40000000      /* pcb is on tcp_timer_list */
+#define TF_TIMER_ONLIST 0x40000000      /* pcb is on tcp_timer_lists[tentry.list] */
 #define TF_STRETCHACK   0x80000000      /* receiver is going to delay acks */
 
 	tcp_seq snd_una;                /* send unacknowledged */
@@ -580,6 +701,8 @@ struct tcpcb {
 
 	struct pacer    t_pacer;        /* Pacer state used to pace packets */
 
+	struct tcp_rate t_rate;         /* Delivery rate estimation for model-based CC */
+
 /* state for bad retransmit recovery */
 	u_int32_t       snd_cwnd_prev;  /* cwnd prior to retransmit */
 	u_int32_t       snd_ssthresh_prev; /* ssthresh prior to retransmit */
@@ -595,6 +718,7 @@ struct tcpcb {
 	int16_t snd_numholes;           /* number of holes seen by sender */
 	TAILQ_HEAD(sackhole_head, sackhole) snd_holes;
 	/* SACK scoreboard (sorted) */
+	struct sackhole_tree_head snd_holes_tree; /* index of snd_holes */
 	tcp_seq snd_fack;               /* last seq number(+1) sack'd by rcv'r*/
 	int     rcv_numsacks;           /* # distinct sack blks present */
 	struct sackblk sackblks[MAX_SACK_BLKS]; /* seq nos. of sack blocks */
@@ -644,6 +768,7 @@ struct tcpcb {
 #define TF_DETECT_READSTALL     0x80            /* Used to detect a stall during read operation */
 #define TF_RECV_THROTTLE        0x100           /* Input throttling active */
 #define TF_NOSTRETCHACK         0x200           /* ack every other packet */
+#define TF_TLS_TX               0x400           /* Send data as kernel TLS records */
 #define TF_NOTIMEWAIT           0x800           /* Avoid going into time-wait */
 #define TF_SENT_TLPROBE         0x1000          /* Sent data in PTO */
 #define TF_PKTS_REORDERED       0x2000          /* Detected reordering */
@@ -651,6 +776,7 @@ struct tcpcb {
 #define TF_FORCE                0x8000          /* force 1 byte out */
 #define TF_DISABLE_STRETCHACK   0x10000         /* auto-disable stretch ack */
 #define TF_NOBLACKHOLE_DETECTION 0x20000        /* Disable PMTU blackhole detection */
+#define TF_TLS_RX               0x40000         /* Decrypt received kernel TLS records */
 #define TF_RESCUE_RXT           0x80000         /* SACK rescue retransmit */
 #define TF_CWND_NONVALIDATED    0x100000        /* cwnd non validated */
 #define TF_IF_PROBING           0x200000        /* Trigger interface probe timeout */
@@ -675,6 +801,7 @@ struct tcpcb {
 	uint32_t        std_dev_iaj;            /* Standard deviation */
 #endif /* TRAFFIC_MGT */
 	struct bwmeas   *t_bwmeas;              /* State for bandwidth measurement */
+	struct tcp_tls  *t_tls;                 /* Kernel TLS record layer state */
 	tcp_seq         t_idleat;               /* rcv_nxt at idle time */
 	uint8_t         t_fin_sent;
 	uint8_t         t_fin_rcvd;
@@ -1873,6 +2000,7 @@ void     tcp_setpersist(struct tcpcb *);
 void     tcp_gc(struct inpcbinfo *);
 void     tcp_itimer(struct inpcbinfo *ipi);
 void     tcp_check_timer_state(struct tcpcb *tp);
+void     tcp_timer_lists_init(void);
 void     tcp_run_timerlist(void *arg1, void *arg2);
 void     tcp_sched_timers(struct tcpcb *tp);
 
@@ -1931,6 +2059,11 @@ void tcp_segs_clear_sacked(struct tcpcb *tp);
 void tcp_mark_seg_lost(struct tcpcb *tp, struct tcp_seg_sent *seg);
 void tcp_seg_delete(struct tcpcb *tp, struct tcp_seg_sent *seg);
 void tcp_segs_sent_clean(struct tcpcb *tp, bool free_segs);
+/* Delivery rate sampling */
+uint64_t tcp_rate_now(void);
+void tcp_rate_check_app_limited(struct tcpcb *tp);
+void tcp_rate_gen_sample(struct tcpcb *tp, struct tcphdr *th);
+void tcp_rate_sample_done(struct tcpcb *tp);
 
 extern void tcp_set_background_cc(struct socket *);
 extern void tcp_set_foreground_cc(struct socket *);
@@ -2009,6 +2142,16 @@ extern int get_tcp_inp_list(struct inpcb * __single * __counted_by(n), size_t n,
 extern bool tcp_notify_ack_active(struct socket *so);
 extern void tcp_set_finwait_timeout(struct tcpcb *);
 
+/* Kernel TLS record layer */
+extern int tcp_tls_setopt(struct tcpcb *, struct sockopt *);
+extern int tcp_tls_getopt(struct tcpcb *, struct sockopt *);
+extern int tcp_tls_record_type(struct mbuf *control, uint8_t *type);
+extern int tcp_tls_seal(struct tcpcb *, struct mbuf **, uint8_t type);
+extern int tcp_tls_input(struct tcpcb *, struct mbuf *);
+extern void tcp_tls_rcvd(struct tcpcb *);
+extern uint32_t tcp_tls_rx_pending(struct tcpcb *);
+extern void tcp_tls_free(struct tcpcb *);
+
 #if MPTCP
 extern uint16_t mptcp_output_csum(struct mbuf *m, uint64_t dss_val,
     uint32_t sseq, uint16_t dlen);
@@ -89,6 +89,8 @@ struct udphdr {
 #define UDP_NOCKSUM     0x01    /* don't checksum outbound payloads */
 #ifdef PRIVATE
 #define UDP_KEEPALIVE_OFFLOAD   0x02 /* Send keep-alive at a given interval */
+#define UDP_SEGMENT             0x03 /* send datagrams of this size from one buffer */
+#define UDP_GRO                 0x04 /* coalesce received datagrams of one flow */
 #endif /* PRIVATE */
 
 #ifdef PRIVATE
@@ -118,5 +120,22 @@ struct udp_keepalive_offload {
 #define UDP_KEEPALIVE_OFFLOAD_TYPE_AIRPLAY      0x1
 };
 
+
+/*
+ * Segmentation offload for datagram protocols such as QUIC.
+ *
+ * With UDP_SEGMENT set to a non-zero size, through setsockopt or as an
+ * ancillary uint16_t of a single send, a buffer larger than that size
+ * is sent as a train of datagrams of that size, the last one possibly
+ * shorter, with a single system call.
+ *
+ * With UDP_GRO enabled, consecutive datagrams from the same source are
+ * coalesced into a single record of the receive buffer as long as they
+ * have the same size, the last one possibly shorter.  The size of the
+ * datagrams is returned as an ancillary int of type UDP_GRO, and can
+ * be used to split the received buffer back into datagrams.
+ */
+#define UDP_SEGMENT_MAX_SEGMENTS        64
+
 #endif /* PRIVATE */
 #endif /* _NETINET_UDP_H */
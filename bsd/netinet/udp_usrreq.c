@@ -814,8 +814,7 @@ udp_input(struct mbuf *m, int iphlen)
 	}
 #endif /* CONTENT_FILTER and NECP */
 	so_recv_data_stat(inp->inp_socket, m, 0);
-	if (sbappendaddr(&inp->inp_socket->so_rcv, append_sa,
-	    m, opts, NULL) == 0) {
+	if (udp_sbappend(inp, append_sa, m, opts) == 0) {
 		udpstat.udps_fullsock++;
 	} else {
 		sorwakeup(inp->inp_socket);
@@ -910,8 +909,7 @@ udp_append(struct inpcb *last, struct ip *ip, struct mbuf *n, int off,
 	}
 	so_recv_data_stat(last->inp_socket, n, 0);
 	m_adj(n, off);
-	if (sbappendaddr(&last->inp_socket->so_rcv, append_sa,
-	    n, opts, NULL) == 0) {
+	if (udp_sbappend(last, append_sa, n, opts) == 0) {
 		udpstat.udps_fullsock++;
 		UDP_LOG(last, "sbappendaddr full receive socket buffer");
 	} else {
@@ -923,6 +921,90 @@ error:
 	m_freem(opts);
 }
 
+/*
+ * Append a datagram to the last record of the receive buffer when that
+ * record holds datagrams of the same source, all of the size recorded
+ * in its UDP_GRO control message, and this one is not larger.
+ */
+static boolean_t
+udp_gro_coalesce(struct socket *so, struct sockaddr *from, struct mbuf *m)
+{
+	struct sockbuf *sb = &so->so_rcv;
+	struct mbuf *rec = sb->sb_lastrecord, *control, *data;
+	struct cmsghdr *cm;
+	int len = m->m_pkthdr.len, segsize;
+
+	if (rec == NULL || so->so_filt != NULL) {
+		return FALSE;
+	}
+#if CONTENT_FILTER
+	if (CFIL_DGRAM_FILTERED(so)) {
+		return FALSE;
+	}
+#endif /* CONTENT_FILTER */
+	/* the first record may be copied out with the socket unlocked */
+	if (rec == sb->sb_mb && (sb->sb_flags & SB_LOCK)) {
+		return FALSE;
+	}
+
+	if (rec->m_type != MT_SONAME || rec->m_len != from->sa_len ||
+	    bcmp(mtod(rec, caddr_t), from, from->sa_len) != 0) {
+		return FALSE;
+	}
+	control = rec->m_next;
+	if (control == NULL || control->m_type != MT_CONTROL ||
+	    control->m_len != CMSG_SPACE(sizeof(segsize))) {
+		return FALSE;
+	}
+	cm = mtod(control, struct cmsghdr *);
+	if (cm->cmsg_level != IPPROTO_UDP || cm->cmsg_type != UDP_GRO) {
+		return FALSE;
+	}
+	data = control->m_next;
+	if (data == NULL || (data->m_flags & M_PKTHDR) == 0) {
+		return FALSE;
+	}
+
+	bcopy(CMSG_DATA(cm), &segsize, sizeof(segsize));
+	if (segsize == 0 || len == 0 || len > segsize ||
+	    data->m_pkthdr.len % segsize != 0 ||
+	    data->m_pkthdr.len / segsize >= UDP_SEGMENT_MAX_SEGMENTS ||
+	    data->m_pkthdr.len + len > IP_MAXPACKET) {
+		return FALSE;
+	}
+
+	if (sbappend_lastrecord(sb, m) == 0) {
+		return FALSE;
+	}
+	data->m_pkthdr.len += len;
+	return TRUE;
+}
+
+/*
+ * Queue a received datagram on the socket.  With UDP_GRO, datagrams
+ * that need no other control message are coalesced with the previous
+ * ones of the same source, and the record carries the datagram size.
+ */
+int
+udp_sbappend(struct inpcb *inp, struct sockaddr *from, struct mbuf *m,
+    struct mbuf *opts)
+{
+	struct socket *so = inp->inp_socket;
+	int segsize;
+
+	if (!(inp->inp_flags2 & INP2_UDP_GRO) || opts != NULL) {
+		return sbappendaddr(&so->so_rcv, from, m, opts, NULL);
+	}
+
+	if (udp_gro_coalesce(so, from, m)) {
+		return 1;
+	}
+	segsize = m->m_pkthdr.len;
+	opts = sbcreatecontrol((caddr_t)&segsize, sizeof(segsize), UDP_GRO,
+	    IPPROTO_UDP);
+	return sbappendaddr(&so->so_rcv, from, m, opts, NULL);
+}
+
 /*
  * Notify a udp user of an asynchronous error;
  * just wake up so that he can collect error status.
@@ -1161,6 +1243,32 @@ udp_ctloutput(struct socket *so, struct sockopt *sopt)
 			}
 			break;
 		}
+		case UDP_SEGMENT:
+			if ((error = sooptcopyin(sopt, &optval, sizeof(optval),
+			    sizeof(optval))) != 0) {
+				break;
+			}
+
+			/* 0 turns segmentation off */
+			if (optval < 0 ||
+			    optval > IP_MAXPACKET - (int)sizeof(struct udpiphdr)) {
+				error = EINVAL;
+				break;
+			}
+			inp->inp_udp_segsize = (uint16_t)optval;
+			break;
+		case UDP_GRO:
+			if ((error = sooptcopyin(sopt, &optval, sizeof(optval),
+			    sizeof(optval))) != 0) {
+				break;
+			}
+
+			if (optval != 0) {
+				inp->inp_flags2 |= INP2_UDP_GRO;
+			} else {
+				inp->inp_flags2 &= ~INP2_UDP_GRO;
+			}
+			break;
 		case SO_FLUSH:
 			if ((error = sooptcopyin(sopt, &optval, sizeof(optval),
 			    sizeof(optval))) != 0) {
@@ -1181,6 +1289,12 @@ udp_ctloutput(struct socket *so, struct sockopt *sopt)
 		case UDP_NOCKSUM:
 			optval = inp->inp_flags & INP_UDP_NOCKSUM;
 			break;
+		case UDP_SEGMENT:
+			optval = inp->inp_udp_segsize;
+			break;
+		case UDP_GRO:
+			optval = (inp->inp_flags2 & INP2_UDP_GRO) ? 1 : 0;
+			break;
 
 		default:
 			error = ENOPROTOOPT;
@@ -1554,6 +1668,91 @@ udp_check_pktinfo(struct mbuf *control, struct ifnet **outif,
 	return 0;
 }
 
+/*
+ * Override the UDP_SEGMENT size of the socket with the one passed as
+ * ancillary data of this send, if any.
+ */
+int
+udp_segsize_from_control(struct mbuf *control, uint16_t *segsize)
+{
+	struct cmsghdr *cm = 0;
+
+	if (control->m_next != NULL || control->m_len < CMSG_LEN(0)) {
+		return EINVAL;
+	}
+
+	for (cm = M_FIRST_CMSGHDR(control);
+	    is_cmsg_valid(control, cm);
+	    cm = M_NXT_CMSGHDR(control, cm)) {
+		if (cm->cmsg_level != IPPROTO_UDP ||
+		    cm->cmsg_type != UDP_SEGMENT) {
+			continue;
+		}
+
+		if (cm->cmsg_len != CMSG_LEN(sizeof(*segsize))) {
+			return EINVAL;
+		}
+		bcopy(CMSG_DATA(cm), segsize, sizeof(*segsize));
+	}
+	return 0;
+}
+
+static void
+udp_segment_fixup(struct mbuf *m, int len)
+{
+	struct udpiphdr *ui = mtod(m, struct udpiphdr *);
+
+	ui->ui_ulen = htons((u_short)len + sizeof(struct udphdr));
+	((struct ip *)ui)->ip_len = (uint16_t)(sizeof(struct udpiphdr) + len);
+	if (m->m_pkthdr.csum_flags & CSUM_UDP) {
+		ui->ui_sum = in_pseudo(ui->ui_src.s_addr, ui->ui_dst.s_addr,
+		    htons((u_short)len + sizeof(struct udphdr) + IPPROTO_UDP));
+	}
+	m->m_pkthdr.len = (int)sizeof(struct udpiphdr) + len;
+}
+
+/*
+ * Split a UDP_SEGMENT send of len bytes, whose UDP/IP header is filled
+ * in, into datagrams of segsize bytes linked through m_nextpkt for
+ * ip_output_list().  Every datagram gets a copy of the header and of
+ * the packet header; the payload clusters are shared, not copied.
+ */
+static struct mbuf *
+udp_segment(struct mbuf *m, int len, int segsize)
+{
+	struct mbuf *n, **mnext = &m->m_nextpkt;
+	int off, seglen;
+
+	for (off = segsize; off < len; off += segsize) {
+		seglen = MIN(segsize, len - off);
+
+		if ((n = m_gethdr(M_DONTWAIT, MT_DATA)) == NULL) {
+			goto bad;
+		}
+		*mnext = n;
+		mnext = &n->m_nextpkt;
+		if (m_dup_pkthdr(n, m, M_DONTWAIT) != 0) {
+			goto bad;
+		}
+		MH_ALIGN(n, sizeof(struct udpiphdr));
+		bcopy(mtod(m, caddr_t), mtod(n, caddr_t),
+		    sizeof(struct udpiphdr));
+		n->m_len = sizeof(struct udpiphdr);
+		n->m_next = m_copym(m, (int)sizeof(struct udpiphdr) + off,
+		    seglen, M_DONTWAIT);
+		if (n->m_next == NULL) {
+			goto bad;
+		}
+		udp_segment_fixup(n, seglen);
+	}
+	m_adj(m, segsize - len);
+	udp_segment_fixup(m, segsize);
+	return m;
+bad:
+	m_freem_list(m);
+	return NULL;
+}
+
 int
 udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
     struct mbuf *control, struct proc *p)
@@ -1566,6 +1765,8 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 	int error = 0, udp_dodisconnect = 0, pktinfo = 0;
 	struct socket *so = inp->inp_socket;
 	int soopts = 0;
+	uint16_t segsize = inp->inp_udp_segsize;
+	int nsegs = 1;
 	struct mbuf *inpopts;
 	struct ip_moptions *__single mopts;
 	struct route ro;
@@ -1633,10 +1834,13 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 		sotc = so_tc_from_control(control, &netsvctype);
 		VERIFY(outif == NULL);
 		error = udp_check_pktinfo(control, &outif, &pi_laddr);
+		if (error == 0) {
+			error = udp_segsize_from_control(control, &segsize);
+		}
 		m_freem(control);
 		control = NULL;
 		if (error) {
-			UDP_LOG(inp, "udp_check_pktinfo error %d", error);
+			UDP_LOG(inp, "control error %d", error);
 			goto release;
 		}
 		if (outif != NULL) {
@@ -1659,6 +1863,16 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 		goto release;
 	}
 
+	if (segsize != 0 && len > segsize) {
+		nsegs = howmany(len, segsize);
+		if (nsegs > UDP_SEGMENT_MAX_SEGMENTS) {
+			error = EINVAL;
+			UDP_LOG(inp, "len %d over %d segments error EINVAL", len,
+			    UDP_SEGMENT_MAX_SEGMENTS);
+			goto release;
+		}
+	}
+
 	if (flowadv && INP_WAIT_FOR_IF_FEEDBACK(inp)) {
 		/*
 		 * The socket is flow-controlled, drop the packets
@@ -1952,7 +2166,7 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 	} else {
 		((struct ip *)ui)->ip_tos = inp->inp_ip_tos;    /* XXX */
 	}
-	udpstat.udps_opackets++;
+	udpstat.udps_opackets += nsegs;
 
 	KERNEL_DEBUG(DBG_LAYER_OUT_END, ui->ui_dport, ui->ui_sport,
 	    ui->ui_src.s_addr, ui->ui_dst.s_addr, ui->ui_ulen);
@@ -2089,10 +2303,16 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 		ipoa.ipoa_flags |= IPOAF_BOUND_SRCADDR;
 	}
 
-	socket_unlock(so, 0);
-	error = ip_output(m, inpopts, &ro, soopts, mopts, &ipoa);
-	m = NULL;
-	socket_lock(so, 0);
+	if (nsegs > 1 && (m = udp_segment(m, len, segsize)) == NULL) {
+		error = ENOBUFS;
+		UDP_LOG(inp, "udp_segment error ENOBUFS");
+	} else {
+		socket_unlock(so, 0);
+		error = ip_output_list(m, nsegs > 1 ? nsegs : 0, inpopts, &ro,
+		    soopts, mopts, &ipoa);
+		m = NULL;
+		socket_lock(so, 0);
+	}
 	if (mopts != NULL) {
 		IMO_REMREF(mopts);
 	}
@@ -2113,7 +2333,7 @@ udp_output(struct inpcb *inp, struct mbuf *m, struct sockaddr *addr,
 		if (ro.ro_rt != NULL) {
 			ifnet_count_type = IFNET_COUNT_TYPE(ro.ro_rt->rt_ifp);
 		}
-		INP_ADD_STAT(inp, ifnet_count_type, txpackets, 1);
+		INP_ADD_STAT(inp, ifnet_count_type, txpackets, nsegs);
 		INP_ADD_STAT(inp, ifnet_count_type, txbytes, len);
 		inp_set_activity_bitmap(inp);
 	}
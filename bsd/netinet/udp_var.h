@@ -172,6 +172,9 @@ extern int udp_connectx_common(struct socket *, int, struct sockaddr *,
     struct sockaddr *, struct proc *, uint32_t, sae_associd_t,
     sae_connid_t *, uint32_t, void *, uint32_t, struct uio*, user_ssize_t *);
 extern void udp_notify(struct inpcb *inp, int errno);
+extern int udp_sbappend(struct inpcb *, struct sockaddr *, struct mbuf *,
+    struct mbuf *);
+extern int udp_segsize_from_control(struct mbuf *, uint16_t *);
 extern int udp_shutdown(struct socket *so);
 extern int udp_lock(struct socket *, int, void *);
 extern int udp_unlock(struct socket *, int, void *);
@@ -126,6 +126,7 @@
 #include <net/if_var.h>
 
 #include <kern/kern_types.h>
+#include <kern/smr.h>
 #include <kern/zalloc.h>
 
 #if IPSEC
@@ -1240,14 +1241,14 @@ in6_pcblookup_local(struct inpcbinfo *pcbinfo, struct in6_addr *laddr,
 	struct inpcbport *__single phd;
 
 	if (!wild_okay) {
-		struct inpcbhead *__single head;
+		struct smrq_list_head *__single head;
 		/*
 		 * Look for an unconnected (wildcard foreign addr) PCB that
 		 * matches the local address and port we're looking for.
 		 */
 		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
 		    pcbinfo->ipi_hashmask)];
-		LIST_FOREACH(inp, head, inp_hash) {
+		smrq_serialized_foreach(inp, head, inp_hash) {
 			if (!(inp->inp_vflag & INP_IPV6)) {
 				continue;
 			}
@@ -1373,7 +1374,7 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
     u_int fport_arg, uint32_t fifscope, struct in6_addr *laddr, u_int lport_arg, uint32_t lifscope, int wildcard,
     uid_t *uid, gid_t *gid, struct ifnet *ifp, bool relaxed)
 {
-	struct inpcbhead *__single head;
+	struct smrq_list_head *__single head;
 	struct inpcb *__single inp;
 	uint16_t fport = (uint16_t)fport_arg, lport = (uint16_t)lport_arg;
 	int found;
@@ -1388,7 +1389,7 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 	 */
 	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr->s6_addr32[3] /* XXX */,
 	    lport, fport, pcbinfo->ipi_hashmask)];
-	LIST_FOREACH(inp, head, inp_hash) {
+	smrq_serialized_foreach(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV6)) {
 			continue;
 		}
@@ -1428,7 +1429,7 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 
 		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
 		    pcbinfo->ipi_hashmask)];
-		LIST_FOREACH(inp, head, inp_hash) {
+		smrq_serialized_foreach(inp, head, inp_hash) {
 			if (!(inp->inp_vflag & INP_IPV6)) {
 				continue;
 			}
@@ -1482,6 +1483,38 @@ in6_pcblookup_hash_exists(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 	return 0;
 }
 
+/*
+ * Lockless lookup of a connected PCB, see in_pcblookup_hash_smr().
+ */
+static struct inpcb *
+in6_pcblookup_hash_smr(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
+    uint16_t fport, uint32_t fifscope, struct in6_addr *laddr, uint16_t lport,
+    uint32_t lifscope, struct ifnet *ifp)
+{
+	struct smrq_list_head *__single head;
+	struct inpcb *__single inp;
+	inp_gen_t gencnt = 0;
+
+	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr->s6_addr32[3] /* XXX */,
+	    lport, fport, pcbinfo->ipi_hashmask)];
+
+	smr_inpcb_enter();
+	smrq_entered_foreach(inp, head, inp_hash) {
+		gencnt = os_atomic_load(&inp->inp_gencnt, acquire);
+		if ((inp->inp_vflag & INP_IPV6) &&
+		    in6_are_addr_equal_scoped(&inp->in6p_faddr, faddr, inp->inp_fifscope, fifscope) &&
+		    in6_are_addr_equal_scoped(&inp->in6p_laddr, laddr, inp->inp_lifscope, lifscope) &&
+		    inp->inp_fport == fport &&
+		    inp->inp_lport == lport) {
+			inp = in_pcb_smr_acquire(inp, gencnt);
+			break;
+		}
+	}
+	smr_inpcb_leave();
+
+	return in_pcblookup_smr_validate(inp, ifp);
+}
+
 /*
  * Lookup PCB in hash list.
  */
@@ -1490,7 +1523,7 @@ in6_pcblookup_hash_locked(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
     u_int fport_arg, uint32_t fifscope, struct in6_addr *laddr, u_int lport_arg,
     uint32_t lifscope, int wildcard, struct ifnet *ifp)
 {
-	struct inpcbhead *__single head;
+	struct smrq_list_head *__single head;
 	struct inpcb *__single inp;
 	uint16_t fport = (uint16_t)fport_arg, lport = (uint16_t)lport_arg;
 
@@ -1499,7 +1532,7 @@ in6_pcblookup_hash_locked(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 	 */
 	head = &pcbinfo->ipi_hashbase[INP_PCBHASH(faddr->s6_addr32[3] /* XXX */,
 	    lport, fport, pcbinfo->ipi_hashmask)];
-	LIST_FOREACH(inp, head, inp_hash) {
+	smrq_serialized_foreach(inp, head, inp_hash) {
 		if (!(inp->inp_vflag & INP_IPV6)) {
 			continue;
 		}
@@ -1533,9 +1566,15 @@ in6_pcblookup_hash_locked(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 	if (wildcard) {
 		struct inpcb *__single local_wild = NULL;
 
+		inp = in_pcblbgroup_lookup(pcbinfo, AF_INET6, laddr, lifscope,
+		    lport, faddr, fport, ifp, 0);
+		if (inp != NULL) {
+			return inp;
+		}
+
 		head = &pcbinfo->ipi_hashbase[INP_PCBHASH(INADDR_ANY, lport, 0,
 		    pcbinfo->ipi_hashmask)];
-		LIST_FOREACH(inp, head, inp_hash) {
+		smrq_serialized_foreach(inp, head, inp_hash) {
 			if (!(inp->inp_vflag & INP_IPV6)) {
 				continue;
 			}
@@ -1567,6 +1606,14 @@ in6_pcblookup_hash_locked(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 				}
 			}
 		}
+
+		/* nothing is bound to laddr, balance over the wildcard group */
+		inp = in_pcblbgroup_lookup(pcbinfo, AF_INET6, laddr, lifscope,
+		    lport, faddr, fport, ifp, 1);
+		if (inp != NULL) {
+			return inp;
+		}
+
 		if (local_wild && in_pcb_checkstate(local_wild,
 		    WNT_ACQUIRE, 0) != WNT_STOPUSING) {
 			return local_wild;
@@ -1588,6 +1635,12 @@ in6_pcblookup_hash(struct inpcbinfo *pcbinfo, struct in6_addr *faddr,
 {
 	struct inpcb *inp;
 
+	inp = in6_pcblookup_hash_smr(pcbinfo, faddr, (uint16_t)fport_arg,
+	    fifscope, laddr, (uint16_t)lport_arg, lifscope, ifp);
+	if (inp != NULL) {
+		return inp;
+	}
+
 	lck_rw_lock_shared(&pcbinfo->ipi_lock);
 
 	inp = in6_pcblookup_hash_locked(pcbinfo, faddr, fport_arg, fifscope,
@@ -183,6 +183,7 @@ udp6_output(struct in6pcb *in6p, struct mbuf *m, struct sockaddr *addr6,
 	bool check_qos_marking_again = (so->so_flags1 & SOF1_QOSMARKING_POLICY_OVERRIDE) ? FALSE : TRUE;
 	uint32_t lifscope = IFSCOPE_NONE, fifscope = IFSCOPE_NONE;
 	drop_reason_t drop_reason = DROP_REASON_UNSPECIFIED;
+	uint16_t segsize;
 
 	bzero(&ip6oa, sizeof(ip6oa));
 	ip6oa.ip6oa_boundif = IFSCOPE_NONE;
@@ -198,6 +199,20 @@ udp6_output(struct in6pcb *in6p, struct mbuf *m, struct sockaddr *addr6,
 		goto release;
 	}
 
+	/* UDP_SEGMENT is only supported over IPv4 */
+	segsize = in6p->inp_udp_segsize;
+	if (control != NULL &&
+	    (error = udp_segsize_from_control(control, &segsize)) != 0) {
+		drop_reason = DROP_REASON_IP6_BAD_OPTION;
+		UDP_LOG(in6p, "bad option error %d", error);
+		goto release;
+	}
+	if (segsize != 0 && ulen > segsize) {
+		error = EOPNOTSUPP;
+		UDP_LOG(in6p, "len %u over segment size error EOPNOTSUPP", ulen);
+		goto release;
+	}
+
 	if (in6p->inp_flags & INP_BOUND_IF) {
 		ip6oa.ip6oa_boundif = in6p->inp_boundifp->if_index;
 		ip6oa.ip6oa_flags |= IP6OAF_BOUND_IF;
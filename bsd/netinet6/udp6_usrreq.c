@@ -229,8 +229,7 @@ udp6_append(struct inpcb *last, struct ip6_hdr *ip6,
 		inp_set_activity_bitmap(last);
 	}
 	so_recv_data_stat(last->in6p_socket, n, 0);
-	if (sbappendaddr(&last->in6p_socket->so_rcv,
-	    SA(udp_in6), n, opts, NULL) == 0) {
+	if (udp_sbappend(last, SA(udp_in6), n, opts) == 0) {
 		UDP_LOG(last, "sbappendaddr full receive socket buffer");
 		udpstat.udps_fullsock++;
 	} else {
@@ -656,8 +655,7 @@ udp6_input(struct mbuf **mp, int *offp, int proto)
 		inp_set_activity_bitmap(in6p);
 	}
 	so_recv_data_stat(in6p->in6p_socket, m, 0);
-	if (sbappendaddr(&in6p->in6p_socket->so_rcv,
-	    SA(&udp_in6), m, opts, NULL) == 0) {
+	if (udp_sbappend(in6p, SA(&udp_in6), m, opts) == 0) {
 		UDP_LOG(in6p, "sbappendaddr full receive socket buffer");
 		m = NULL;
 		opts = NULL;
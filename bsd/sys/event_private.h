@@ -153,6 +153,8 @@ typedef uint64_t kqueue_id_t;
 #define KEVENT_FLAG_DYNAMIC_KQ_MUST_EXIST        0x020000   /* kq lookup by id must exist */
 #define KEVENT_FLAG_DYNAMIC_KQ_MUST_NOT_EXIST    0x040000   /* kq lookup by id must not exist */
 #define KEVENT_FLAG_WORKLOOP_NO_WQ_THREAD        0x080000   /* obsolete */
+#define KEVENT_FLAG_RING                         0x100000   /* use the kqueue shared ring */
+#define KEVENT_FLAG_SHARED_PROCESSING            0x200000   /* process a kqueue concurrently with other threads */
 
 #ifdef XNU_KERNEL_PRIVATE
 
@@ -169,7 +171,8 @@ typedef uint64_t kqueue_id_t;
 
 #define KEVENT_FLAG_USER (KEVENT_FLAG_IMMEDIATE | KEVENT_FLAG_ERROR_EVENTS | \
 	        KEVENT_FLAG_STACK_DATA | KEVENT_FLAG_WORKQ | KEVENT_FLAG_WORKLOOP | \
-	        KEVENT_FLAG_DYNAMIC_KQ_MUST_EXIST | KEVENT_FLAG_DYNAMIC_KQ_MUST_NOT_EXIST)
+	        KEVENT_FLAG_DYNAMIC_KQ_MUST_EXIST | KEVENT_FLAG_DYNAMIC_KQ_MUST_NOT_EXIST | \
+	        KEVENT_FLAG_RING | KEVENT_FLAG_SHARED_PROCESSING)
 
 /*
  * Since some filter ops are not part of the standard sysfilt_ops, we use
@@ -205,6 +208,56 @@ typedef uint64_t kqueue_id_t;
 
 #define EV_SET_QOS 0
 
+/*
+ * Shared kevent ring, attached to a kqueue() file descriptor.
+ *
+ * kevent_qos(kq, NULL, 0, &addr, entries, NULL, NULL, KEVENT_FLAG_RING)
+ * creates the ring the first time, with `entries` (a power of 2, at most
+ * KEVENT_RING_MAX_ENTRIES) slots in each of its submission and completion
+ * queues, and maps it in the caller's address space at `addr`.
+ * The mapping outlives the kqueue and must be deallocated by the caller.
+ *
+ * Userspace posts registrations by writing kevents at
+ * KEVENT_RING_SQ(ring)[tail & (entries - 1)] and then publishing
+ * kr_sq_tail with release semantics.
+ *
+ * kevent_qos(kq, NULL, 0, NULL, 0, NULL, NULL, KEVENT_FLAG_RING) then
+ * registers everything posted in the submission queue, and fills the
+ * completion queue with receipts, errors and triggered events the way
+ * kevent_qos() would fill its event list. It waits for events unless
+ * KEVENT_FLAG_IMMEDIATE is passed, and returns the number of completions
+ * posted.
+ *
+ * Registration stops before an EV_RECEIPT kevent whose receipt can't be
+ * posted, which is left in the submission queue: the call fails with
+ * ENOSPC when the completion queue is full, or EAGAIN when another thread
+ * is filling it.
+ *
+ * Userspace consumes completions from KEVENT_RING_CQ(ring) and publishes
+ * kr_cq_head with release semantics so that the kernel can reuse the slots.
+ *
+ * Heads and tails are free running counters. Each lives on its own cache
+ * line since the kernel and userspace write them from different cores.
+ */
+#define KEVENT_RING_MAX_ENTRIES  32768
+#define KEVENT_RING_CACHELINE    128
+
+struct kevent_ring_s {
+	uint32_t        kr_entries;     /* number of entries in each queue */
+	uint32_t        kr_sq_offset;   /* offset of the submission queue */
+	uint32_t        kr_cq_offset;   /* offset of the completion queue */
+	uint32_t        kr_reserved;
+	uint32_t        kr_sq_head __attribute__((aligned(KEVENT_RING_CACHELINE))); /* kernel */
+	uint32_t        kr_sq_tail __attribute__((aligned(KEVENT_RING_CACHELINE))); /* user */
+	uint32_t        kr_cq_head __attribute__((aligned(KEVENT_RING_CACHELINE))); /* user */
+	uint32_t        kr_cq_tail __attribute__((aligned(KEVENT_RING_CACHELINE))); /* kernel */
+} __attribute__((aligned(KEVENT_RING_CACHELINE)));
+
+#define KEVENT_RING_SQ(ring) \
+	((struct kevent_qos_s *)((uintptr_t)(ring) + (ring)->kr_sq_offset))
+#define KEVENT_RING_CQ(ring) \
+	((struct kevent_qos_s *)((uintptr_t)(ring) + (ring)->kr_cq_offset))
+
 /*
  * data/hint fflags for EVFILT_WORKLOOP, shared with userspace
  *
@@ -359,6 +412,7 @@ typedef enum vm_pressure_level {
 #define NOTE_CONNINFO_UPDATED   0x00002000 /* connection info was updated */
 #define NOTE_NOTIFY_ACK         0x00004000 /* notify acknowledgement */
 #define NOTE_WAKE_PKT           0x00008000 /* received wake packet */
+#define NOTE_ZEROCOPY           0x00010000 /* zero-copy send completed */
 
 #define EVFILT_SOCK_LEVEL_TRIGGER_MASK \
 	        (NOTE_READCLOSED | NOTE_WRITECLOSED | NOTE_SUSPEND | NOTE_RESUME | \
@@ -369,7 +423,7 @@ typedef enum vm_pressure_level {
 	        NOTE_NOSRCADDR | NOTE_IFDENIED | NOTE_SUSPEND | NOTE_RESUME | \
 	        NOTE_KEEPALIVE | NOTE_ADAPTIVE_WTIMO | NOTE_ADAPTIVE_RTIMO | \
 	        NOTE_CONNECTED | NOTE_DISCONNECTED | NOTE_CONNINFO_UPDATED | \
-	        NOTE_NOTIFY_ACK | NOTE_WAKE_PKT)
+	        NOTE_NOTIFY_ACK | NOTE_WAKE_PKT | NOTE_ZEROCOPY)
 
 /*
  * data/hint fflags for EVFILT_NW_CHANNEL, shared with userspace.
@@ -457,7 +511,7 @@ struct knote {
 		struct proc        *XNU_PTRAUTH_SIGNED_PTR("knote.proc") kn_proc;
 		struct ipc_port    *XNU_PTRAUTH_SIGNED_PTR("knote.ipc_port") kn_ipc_port;
 		struct ipc_pset    *XNU_PTRAUTH_SIGNED_PTR("knote.ipc_pset") kn_ipc_pset;
-		struct thread_call *XNU_PTRAUTH_SIGNED_PTR("knote.thcall") kn_thcall;
+		struct kqtimer     *XNU_PTRAUTH_SIGNED_PTR("knote.timer") kn_timer;
 		struct thread      *XNU_PTRAUTH_SIGNED_PTR("knote.thread") kn_thread;
 #if CONFIG_EXCLAVES
 		struct exclaves_resource *XNU_PTRAUTH_SIGNED_PTR("knote.exclaves_resource") kn_exclaves_resource;
@@ -550,7 +604,11 @@ struct kevent_ctx_s {
 	int              kec_process_nevents;       /* user-level event count */
 	int              kec_process_noutputs;      /* number of events output */
 	unsigned int     kec_process_flags;         /* kevent flags, only set for process  */
-	user_addr_t      kec_process_eventlist;     /* user-level event list address */
+	kq_index_t       kec_process_slot;          /* kqfile suppression queue of this thread */
+	union {
+		user_addr_t          kec_process_eventlist; /* user-level event list address */
+		struct kevent_ring  *kec_process_ring;      /* shared ring (KEVENT_FLAG_RING) */
+	};
 };
 typedef struct kevent_ctx_s *kevent_ctx_t;
 
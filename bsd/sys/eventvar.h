@@ -67,6 +67,7 @@ typedef int (*kevent_callback_t)(struct kevent_qos_s *, struct kevent_ctx_s *);
 
 #include <stdint.h>
 #include <kern/locks.h>
+#include <kern/smr_types.h>
 #include <mach/thread_policy.h>
 #include <pthread/workqueue_internal.h>
 #include <os/refcnt.h>
@@ -160,6 +161,7 @@ struct kqueue {
 	uint32_t            kq_count;     /* number of queued events */
 	struct proc        *kq_p;         /* process containing kqueue */
 	struct knote_locks  kq_knlocks;   /* list of knote locks held */
+	struct kqtimers    *kq_timers;    /* EVFILT_TIMER queues, allocated lazily */
 };
 
 /*
@@ -169,11 +171,24 @@ struct kqueue {
  *          Adds selinfo support to the base kqueue definition, as these
  *          fds can be fed into select().
  */
+/*
+ * Number of threads that can process a kqfile at the same time
+ * (see KEVENT_FLAG_SHARED_PROCESSING).
+ *
+ * Each of them suppresses the knotes it delivers on its own queue,
+ * and while a knote is suppressed, kn_qos_index is the index of that queue.
+ */
+#define KQFILE_NPROCESSORS      8
+#define KQFILE_PROCESSING_FULL  ((1u << KQFILE_NPROCESSORS) - 1)
+
 struct kqfile {
 	struct kqueue       kqf_kqueue;     /* common kqueue core */
 	struct kqtailq      kqf_queue;      /* queue of woken up knotes */
-	struct kqtailq      kqf_suppressed; /* suppression queue */
+	struct kqtailq      kqf_suppressed[KQFILE_NPROCESSORS]; /* suppression queues */
 	struct selinfo      kqf_sel;        /* parent select/kqueue info */
+	struct kevent_ring *kqf_ring;       /* shared ring, see KEVENT_FLAG_RING */
+	uint8_t             kqf_processing; /* suppression queues in use */
+	uint32_t            kqf_exclwait;   /* exclusive processing threads waiting */
 #define kqf_lock     kqf_kqueue.kq_lock
 #define kqf_state    kqf_kqueue.kq_state
 #define kqf_level    kqf_kqueue.kq_level
@@ -407,7 +422,7 @@ struct kqworkloop {
 	struct turnstile   *kqwl_turnstile;               /* turnstile for sync IPC/waiters */
 	kqueue_id_t         kqwl_dynamicid;               /* dynamic identity */
 	uint64_t            kqwl_params;                  /* additional parameters */
-	LIST_ENTRY(kqworkloop) kqwl_hashlink;             /* linkage for search list */
+	struct smrq_slink   kqwl_hashlink;                /* linkage for fd_kqhash */
 #if CONFIG_WORKLOOP_DEBUG
 #define KQWL_HISTORY_COUNT 32
 #define KQWL_HISTORY_WRITE_ENTRY(kqwl, ...) ({ \
@@ -434,7 +449,6 @@ struct kqworkloop {
 	unsigned int kqwl_index;
 #endif // CONFIG_WORKLOOP_DEBUG
 };
-LIST_HEAD(kqwllist, kqworkloop);
 
 typedef union {
 	struct kqueue       *kq;
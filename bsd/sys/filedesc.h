@@ -87,9 +87,9 @@
 
 #include <sys/kernel_types.h>
 #include <kern/locks.h>
+#include <kern/smr_hash.h>
 
 struct klist;
-struct kqwllist;
 struct ucred;
 
 __options_decl(filedesc_flags_t, uint8_t, {
@@ -139,7 +139,7 @@ struct filedesc {
 #endif /* CONFIG_PROC_RESOURCE_LIMITS */
 
 	int                 fd_knlistsize;  /* (L) size of knlist */
-	int                 unused_padding;/* Due to alignment */
+	uint32_t            fd_kqring_pages; /* (A) pages wired by kqueue shared rings */
 	struct fileproc   **XNU_PTRAUTH_SIGNED_PTR("filedesc.fd_ofiles") fd_ofiles; /* (L) file structures for open files */
 	char               *fd_ofileflags;  /* (L) per-process open file flags */
 
@@ -151,8 +151,7 @@ struct filedesc {
 	lck_rw_t            fd_dirs_lock;   /* keeps fd_cdir and fd_rdir stable across a lookup */
 
 	lck_mtx_t           fd_kqhashlock;  /* (Q) lock for dynamic kqueue hash */
-	u_long              fd_kqhashmask;  /* (Q) size of dynamic kqueue hash */
-	struct  kqwllist   *fd_kqhash;      /* (Q) hash table for dynamic kqueues */
+	struct smr_hash     fd_kqhash;      /* (Q) SMR hash table for dynamic kqueues */
 
 	lck_mtx_t           fd_knhashlock;  /* (N) lock for hash table for attached knotes */
 	u_long              fd_knhashmask;  /* (N) size of knhash */
@@ -258,12 +258,43 @@
 #define SO_APPLICATION_ID          0x1133  /* ID of attributing app - so_application_id_t */
                                            /* 0x1134 is SO_BINDTODEVICE, see socket.h */
 #define SO_MARK_DOMAIN_INFO_SILENT 0x1135  /* Domain information should be silently withheld */
+#define SO_ZEROCOPY                0x1136  /* send from the user pages without copying (int) */
+#define SO_ZEROCOPY_COMPLETE       0x1137  /* completed zero-copy sends (struct so_zerocopy_complete) */
 
 struct so_mark_cellfallback_uuid_args {
 	uuid_t flow_uuid;
 	int flow_cellfallback;
 };
 
+/*
+ * When SO_ZEROCOPY is set on a TCP socket, large writes are not copied
+ * into the socket buffer: the user pages are wired and sent from in place.
+ * Each write that queues data consumes the next id, starting at 0, and the
+ * buffer it was given must not be modified until that id is reported as
+ * complete, which happens once the stack drops its last reference to the
+ * pages (normally when the data has been acknowledged).
+ *
+ * An application can register for NOTE_ZEROCOPY with EVFILT_SOCK and then
+ * retrieve the completed ids with getsockopt SO_ZEROCOPY_COMPLETE.
+ * Completions are reported as ranges of consecutive ids; zr_copied is set
+ * when the writes in the range were small enough that they were copied
+ * instead, in which case the buffer could have been reused right away.
+ * zc_pending is the number of writes not yet complete.
+ */
+#define SO_ZEROCOPY_MAX_RANGES  8
+
+struct so_zerocopy_range {
+	u_int32_t       zr_first;       /* first id in the range */
+	u_int32_t       zr_last;        /* last id in the range */
+	u_int32_t       zr_copied;      /* data was copied */
+};
+
+struct so_zerocopy_complete {
+	u_int32_t       zc_pending;
+	u_int32_t       zc_count;
+	struct so_zerocopy_range zc_ranges[SO_ZEROCOPY_MAX_RANGES];
+};
+
 typedef struct {
 	uid_t               uid;
 	uuid_t              effective_uuid;
@@ -82,6 +82,7 @@
 #include <net/kext_net.h>
 #include <sys/ev.h>
 #include <uuid/uuid.h>
+#include <kern/smr_types.h>
 #ifdef BSD_KERNEL_PRIVATE
 #include <sys/eventhandler.h>
 #endif /* BSD_KERNEL_PRIVATE */
@@ -99,6 +100,7 @@ struct socket_filter_entry;
 struct protosw;
 struct sockif;
 struct sockutil;
+struct so_zerocopy_state;
 
 /* strings for sleep message: */
 extern  char netio[], netcon[], netcls[];
@@ -218,6 +220,7 @@ struct socket {
 #define SB_LIMITED      0x8000          /* Socket buffer size limited */
 #define SB_KCTL         0x10000         /* kernel control socket buffer */
 #define SB_SENDHEAD     0x20000
+#define SB_RECORDHELD   0x40000         /* reads stop at a record held by the protocol */
 	/* XXX Note that Unix domain socket's sb_flags is defined as short */
 	caddr_t so_tpcb;                /* Misc. protocol control block, used
 	                                 *  by some kexts */
@@ -230,6 +233,7 @@ struct socket {
 	STAILQ_ENTRY(socket) so_cache_ent;      /* socache entry */
 	caddr_t         so_saved_pcb;           /* Saved pcb when cacheing */
 	u_int64_t       cache_timestamp;        /* time socket was cached */
+	struct smr_node so_cache_smr_node;      /* deferred return to socache */
 	uint32_t        so_eventmask;           /* event mask */
 
 	pid_t           last_pid;       /* pid of most recent accessor */
@@ -304,6 +308,7 @@ struct socket {
 #define SOF1_TRACKER_NON_APP_INITIATED  0x10000000 /* Tracker connection is non-app initiated */
 #define SOF1_APPROVED_APP_DOMAIN        0x20000000 /* Connection is for an approved associated app domain */
 #define SOF1_DOMAIN_INFO_SILENT         0x40000000 /* Maintain silence on any domain information */
+#define SOF1_ZEROCOPY                   0x80000000 /* SO_ZEROCOPY option is set */
 
 	uint32_t        so_upcallusecount; /* number of upcalls in progress */
 	int             so_usecount;    /* refcounting of socket use */
@@ -363,6 +368,8 @@ struct socket {
 	u_int8_t        so_log_seqn;    /* Multi-layer Packet Logging rolling sequence number */
 	uint8_t         so_mpkl_send_proto;
 	uuid_t          so_mpkl_send_uuid;
+
+	struct so_zerocopy_state *so_zerocopy; /* zero-copy send completions */
 };
 
 /* Control message accessor in mbufs */
@@ -643,13 +650,14 @@ struct kextcb {
 #define SO_FILT_HINT_NOTIFY_ACK         0x00080000      /* Notify Acknowledgement */
 #define SO_FILT_HINT_MP_SUB_ERROR       0x00100000      /* Error happend on subflow */
 #define SO_FILT_HINT_WAKE_PKT           0x00200000      /* received wake packet */
+#define SO_FILT_HINT_ZEROCOPY           0x00400000      /* zero-copy send completed */
 
 #define SO_FILT_HINT_BITS \
 	"\020\1LOCKED\2CONNRESET\3CANTRCVMORE\4CANTSENDMORE\5TIMEOUT"   \
 	"\6NOSRCADDR\7IFDENIED\10SUSPEND\11RESUME\12KEEPALIVE\13AWTIMO" \
 	"\14ARTIMO\15CONNECTED\16DISCONNECTED\17CONNINFO_UPDATED"       \
 	"\20MPFAILOVER\21MPSTATUS\22MUSTRST\23MPCANTRCVMORE\24NOTIFYACK"\
-	"\25MPSUBERROR\26WAKEPKT"
+	"\25MPSUBERROR\26WAKEPKT\27ZEROCOPY"
 
 /* Mask for hints that have corresponding kqueue events */
 #define SO_FILT_HINT_EV                                                 \
@@ -660,7 +668,8 @@ struct kextcb {
 	SO_FILT_HINT_KEEPALIVE | SO_FILT_HINT_ADAPTIVE_WTIMO |          \
 	SO_FILT_HINT_ADAPTIVE_RTIMO | SO_FILT_HINT_CONNECTED |          \
 	SO_FILT_HINT_DISCONNECTED | SO_FILT_HINT_CONNINFO_UPDATED |     \
-	SO_FILT_HINT_NOTIFY_ACK | SO_FILT_HINT_WAKE_PKT)
+	SO_FILT_HINT_NOTIFY_ACK | SO_FILT_HINT_WAKE_PKT |               \
+	SO_FILT_HINT_ZEROCOPY)
 
 #if SENDFILE
 struct sf_buf {
@@ -763,6 +772,8 @@ struct mbuf;
 struct sockaddr;
 struct ucred;
 struct uio;
+struct so_zerocopy;
+struct so_zerocopy_complete;
 
 #define SOCK_MSG_SA 0x01
 #define SOCK_MSG_CONTROL 0x02
@@ -854,6 +865,7 @@ extern void so_release_accept_list(struct socket *);
 
 extern int sbappend(struct sockbuf *sb, struct mbuf *m);
 extern int sbappend_nodrop(struct sockbuf *sb, struct mbuf *m);
+extern int sbappend_lastrecord(struct sockbuf *sb, struct mbuf *m0);
 extern int sbappendstream(struct sockbuf *sb, struct mbuf *m);
 extern int sbappendcontrol(struct sockbuf *sb, struct mbuf *m0,
     struct mbuf *control, int *error_out);
@@ -949,6 +961,15 @@ extern int socreate(int dom, struct socket **aso, int type, int proto);
 extern int socreate_delegate(int dom, struct socket **aso, int type, int proto,
     pid_t epid);
 extern void sodealloc(struct socket *so);
+extern struct so_zerocopy *so_zerocopy_alloc(struct socket *so);
+extern void so_zerocopy_done(struct so_zerocopy *zc, boolean_t moved);
+extern struct mbuf *so_zerocopy_uiomove(struct so_zerocopy *zc,
+    struct uio *uio, int len, int pkthdr, struct mbuf **lastp, int *lenp);
+extern int so_zerocopy_setopt(struct socket *so, int optval);
+extern void so_zerocopy_getcomplete(struct socket *so,
+    struct so_zerocopy_complete *zcc);
+extern boolean_t so_zerocopy_active(struct socket *so);
+extern void so_zerocopy_free(struct socket *so);
 extern int sodisconnectlocked(struct socket *so);
 extern void soreference(struct socket *so);
 extern void sodereference(struct socket *so);
@@ -87,6 +87,7 @@ extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
 #define UL_UNFAIR_LOCK64_SHARED         4
 #define UL_COMPARE_AND_WAIT64           5
 #define UL_COMPARE_AND_WAIT64_SHARED    6
+#define UL_RW_LOCK                      7
 /* obsolete names */
 #define UL_OSSPINLOCK                   UL_COMPARE_AND_WAIT
 #define UL_HANDOFFLOCK                  UL_UNFAIR_LOCK
@@ -116,10 +117,14 @@ extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
  * @const ULF_WAIT_ADAPTIVE_SPIN
  * Use adaptive spinning when the thread that currently holds the unfair lock
  * is on core.
+ *
+ * @const ULF_WAIT_RW_WRITER
+ * Only valid with UL_RW_LOCK: the waiter wants the lock exclusive.
  */
 #define ULF_WAIT_WORKQ_DATA_CONTENTION  0x00010000
 #define ULF_WAIT_CANCEL_POINT           0x00020000
 #define ULF_WAIT_ADAPTIVE_SPIN          0x00040000
+#define ULF_WAIT_RW_WRITER              0x00080000
 
 /*
  * operation bits [31, 24] contain the generic flags
@@ -131,6 +136,43 @@ extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
 #define ULF_NO_ERRNO                    0x01000000
 #define ULF_DEADLINE                    0x02000000
 
+/*
+ * UL_RW_LOCK lock word layout (64 bits)
+ *
+ * @const ULRW_OWNER_MASK
+ * Port name of the writer when ULRW_WRITE_LOCKED is set, otherwise the port
+ * name of a reader holding the lock (or 0). Readers that find their own name
+ * there on unlock clear it.
+ *
+ * @const ULRW_READERS_MASK
+ * Number of readers holding the lock.
+ *
+ * @const ULRW_READERS_WAITING, ULRW_WRITERS_WAITING
+ * Set by threads before they block in __ulock_wait2(UL_RW_LOCK), and cleared
+ * by the thread that drops the lock, which then calls __ulock_wake().
+ * When writers are waiting, new readers must wait too.
+ *
+ * @const ULRW_WRITE_LOCKED
+ * The lock is held exclusive.
+ *
+ * A reader that drops the lock while waiters are pending, but other readers
+ * still hold it, must also call __ulock_wake(UL_RW_LOCK) so that the kernel
+ * can move the waiters' priority push to the remaining readers.
+ *
+ * Once woken up, __ulock_wait2(UL_RW_LOCK) returns the waiting bits still
+ * pending in the kernel, shifted right by ULRW_WAITERS_SHIFT, which the
+ * thread must set again in the lock word when it acquires the lock or
+ * blocks again.
+ */
+#define ULRW_OWNER_MASK                 0x00000000ffffffffull
+#define ULRW_READERS_MASK               0x1fffffff00000000ull
+#define ULRW_READERS_SHIFT              32
+#define ULRW_READERS_WAITING            0x2000000000000000ull
+#define ULRW_WRITERS_WAITING            0x4000000000000000ull
+#define ULRW_WRITE_LOCKED               0x8000000000000000ull
+#define ULRW_WAITERS_MASK               (ULRW_READERS_WAITING | ULRW_WRITERS_WAITING)
+#define ULRW_WAITERS_SHIFT              32
+
 /*
  * masks
  */
@@ -140,7 +182,8 @@ extern int __ulock_wake(uint32_t operation, void *addr, uint64_t wake_value);
 
 #define ULF_WAIT_MASK           (ULF_NO_ERRNO | ULF_DEADLINE | \
 	                         ULF_WAIT_WORKQ_DATA_CONTENTION | \
-	                         ULF_WAIT_CANCEL_POINT | ULF_WAIT_ADAPTIVE_SPIN)
+	                         ULF_WAIT_CANCEL_POINT | ULF_WAIT_ADAPTIVE_SPIN | \
+	                         ULF_WAIT_RW_WRITER)
 
 #define ULF_WAKE_MASK           (ULF_NO_ERRNO | \
 	                         ULF_WAKE_ALL | \
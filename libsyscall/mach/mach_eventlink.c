@@ -33,6 +33,12 @@
 #include <mach/mach_types.h>
 #include <mach/clock_types.h>
 #include <mach/mach_eventlink_types.h>
+#include <mach/mach_eventlink.h>
+#include <mach/mach_init.h>
+#include <mach/mach_vm.h>
+#include <os/atomic_private.h>
+#include <stdbool.h>
+#include <strings.h>
 
 /*
  * __mach_eventlink* calls are bsd syscalls instead of mach traps because
@@ -103,3 +109,257 @@ mach_eventlink_signal_wait_until(
 	*wait_count_ptr = decode_eventlink_count_from_retval(retval);
 	return decode_eventlink_error_from_retval(retval);
 }
+
+/*
+ * Shared memory rings: see the layout described in <mach/mach_eventlink_types.h>.
+ */
+
+static inline mach_eventlink_ring_header_t *
+mach_eventlink_ring_header(
+	mach_eventlink_ring_t   ring,
+	uint32_t                index)
+{
+	return (mach_eventlink_ring_header_t *)ring->mer_address + index;
+}
+
+static inline uint8_t *
+mach_eventlink_ring_data(
+	mach_eventlink_ring_t   ring,
+	uint32_t                index)
+{
+	return (uint8_t *)ring->mer_address + MACH_EVENTLINK_RING_DATA_OFFSET +
+	       index * MACH_EVENTLINK_RING_DATA_SIZE(ring->mer_size);
+}
+
+kern_return_t
+mach_eventlink_ring_attach(
+	mach_port_t                          eventlink_port,
+	mach_vm_size_t                       size,
+	mach_eventlink_ring_t                ring)
+{
+	mach_vm_address_t address = 0;
+	uint32_t index = 0;
+	kern_return_t kr;
+
+	kr = mach_eventlink_ring_map(eventlink_port, mach_task_self(),
+	    &address, &size, &index);
+	if (kr != KERN_SUCCESS) {
+		return kr;
+	}
+
+	ring->mer_port = eventlink_port;
+	ring->mer_index = index;
+	ring->mer_address = address;
+	ring->mer_size = size;
+	ring->mer_wait_count = 0;
+	return KERN_SUCCESS;
+}
+
+kern_return_t
+mach_eventlink_ring_detach(
+	mach_eventlink_ring_t                ring)
+{
+	kern_return_t kr;
+
+	kr = mach_vm_deallocate(mach_task_self(), ring->mer_address, ring->mer_size);
+	ring->mer_address = 0;
+	ring->mer_size = 0;
+	return kr;
+}
+
+/*
+ * Enqueues a record in the ring written by this side.
+ * Returns whether the peer was blocked and needs a signal.
+ */
+static kern_return_t
+mach_eventlink_ring_enqueue(
+	mach_eventlink_ring_t                ring,
+	const void                           *data,
+	uint32_t                             size,
+	bool                                 *needs_signal)
+{
+	mach_eventlink_ring_header_t *hdr = mach_eventlink_ring_header(ring, ring->mer_index);
+	uint8_t *buf = mach_eventlink_ring_data(ring, ring->mer_index);
+	uint64_t data_size = MACH_EVENTLINK_RING_DATA_SIZE(ring->mer_size);
+	uint64_t len = (sizeof(uint32_t) + size + 7) & ~7ull;
+	uint64_t head, tail, offset, wrap = 0;
+
+	if (size > MACH_EVENTLINK_RING_MSG_MAX(ring->mer_size)) {
+		return KERN_INVALID_ARGUMENT;
+	}
+
+	tail = os_atomic_load_wide(&hdr->melr_tail, relaxed);
+	head = os_atomic_load_wide(&hdr->melr_head, acquire);
+	offset = tail % data_size;
+	if (offset + len > data_size) {
+		wrap = data_size - offset;
+	}
+	if (tail + wrap + len - head > data_size) {
+		return KERN_NO_SPACE;
+	}
+
+	if (wrap) {
+		*(uint32_t *)(buf + offset) = MACH_EVENTLINK_RING_WRAP;
+		offset = 0;
+	}
+	*(uint32_t *)(buf + offset) = size;
+	memcpy(buf + offset + sizeof(uint32_t), data, size);
+
+	/* Publish the record, then check whether the consumer went to sleep */
+	os_atomic_store_wide(&hdr->melr_tail, tail + wrap + len, seq_cst);
+	*needs_signal = os_atomic_xchg(&hdr->melr_waiting, 0, seq_cst) != 0;
+	return KERN_SUCCESS;
+}
+
+/*
+ * Dequeues a record from the ring written by the peer.
+ * Returns KERN_OPERATION_TIMED_OUT if it is empty.
+ */
+static kern_return_t
+mach_eventlink_ring_dequeue(
+	mach_eventlink_ring_t                ring,
+	void                                 *buffer,
+	uint32_t                             *size_ptr)
+{
+	mach_eventlink_ring_header_t *hdr = mach_eventlink_ring_header(ring, !ring->mer_index);
+	uint8_t *buf = mach_eventlink_ring_data(ring, !ring->mer_index);
+	uint64_t data_size = MACH_EVENTLINK_RING_DATA_SIZE(ring->mer_size);
+	uint64_t head, tail, offset, len, wrap = 0;
+	uint32_t size;
+
+	/*
+	 * The ring is writable by the peer: check every index and length
+	 * read from it against the data area before using it, and report
+	 * a corrupted ring with KERN_INVALID_VALUE.
+	 */
+	head = os_atomic_load_wide(&hdr->melr_head, relaxed);
+	tail = os_atomic_load_wide(&hdr->melr_tail, acquire);
+	if (head == tail) {
+		return KERN_OPERATION_TIMED_OUT;
+	}
+	if (tail - head > data_size || (head & 7) != 0) {
+		return KERN_INVALID_VALUE;
+	}
+
+	offset = head % data_size;
+	size = *(volatile uint32_t *)(buf + offset);
+	if (size == MACH_EVENTLINK_RING_WRAP) {
+		wrap = data_size - offset;
+		offset = 0;
+		size = *(volatile uint32_t *)buf;
+	}
+	len = (sizeof(uint32_t) + (uint64_t)size + 7) & ~7ull;
+	if (size > MACH_EVENTLINK_RING_MSG_MAX(ring->mer_size) ||
+	    offset + sizeof(uint32_t) + size > data_size ||
+	    wrap + len > tail - head) {
+		return KERN_INVALID_VALUE;
+	}
+	if (size > *size_ptr) {
+		*size_ptr = size;
+		return KERN_INSUFFICIENT_BUFFER_SIZE;
+	}
+
+	memcpy(buffer, buf + offset + sizeof(uint32_t), size);
+	*size_ptr = size;
+	os_atomic_store_wide(&hdr->melr_head, head + wrap + len, release);
+	return KERN_SUCCESS;
+}
+
+static kern_return_t
+mach_eventlink_ring_receive_internal(
+	mach_eventlink_ring_t                ring,
+	bool                                 needs_signal,
+	void                                 *buffer,
+	uint32_t                             *size_ptr,
+	mach_eventlink_signal_wait_option_t  option,
+	kern_clock_id_t                      clock_id,
+	uint64_t                             deadline)
+{
+	mach_eventlink_ring_header_t *hdr = mach_eventlink_ring_header(ring, !ring->mer_index);
+	kern_return_t kr;
+
+	for (;;) {
+		kr = mach_eventlink_ring_dequeue(ring, buffer, size_ptr);
+		if (kr != KERN_OPERATION_TIMED_OUT) {
+			break;
+		}
+
+		/* Advertise that we are about to block, then check again */
+		os_atomic_store(&hdr->melr_waiting, 1, relaxed);
+		os_atomic_thread_fence(seq_cst); // pairs with the producer's xchg of melr_waiting
+		kr = mach_eventlink_ring_dequeue(ring, buffer, size_ptr);
+		if (kr != KERN_OPERATION_TIMED_OUT) {
+			os_atomic_store(&hdr->melr_waiting, 0, relaxed);
+			break;
+		}
+
+		if (needs_signal) {
+			kr = mach_eventlink_signal_wait_until(ring->mer_port,
+			    &ring->mer_wait_count, 0, option, clock_id, deadline);
+			needs_signal = false;
+		} else {
+			kr = mach_eventlink_wait_until(ring->mer_port,
+			    &ring->mer_wait_count, option, clock_id, deadline);
+		}
+		if (kr != KERN_SUCCESS) {
+			os_atomic_store(&hdr->melr_waiting, 0, relaxed);
+			break;
+		}
+	}
+
+	if (needs_signal) {
+		(void)mach_eventlink_signal(ring->mer_port, 0);
+	}
+	return kr;
+}
+
+kern_return_t
+mach_eventlink_ring_send(
+	mach_eventlink_ring_t                ring,
+	const void                           *data,
+	uint32_t                             size)
+{
+	bool needs_signal = false;
+	kern_return_t kr;
+
+	kr = mach_eventlink_ring_enqueue(ring, data, size, &needs_signal);
+	if (kr == KERN_SUCCESS && needs_signal) {
+		kr = mach_eventlink_signal(ring->mer_port, 0);
+	}
+	return kr;
+}
+
+kern_return_t
+mach_eventlink_ring_receive(
+	mach_eventlink_ring_t                ring,
+	void                                 *buffer,
+	uint32_t                             *size_ptr,
+	mach_eventlink_signal_wait_option_t  option,
+	kern_clock_id_t                      clock_id,
+	uint64_t                             deadline)
+{
+	return mach_eventlink_ring_receive_internal(ring, false, buffer,
+	           size_ptr, option, clock_id, deadline);
+}
+
+kern_return_t
+mach_eventlink_ring_send_receive(
+	mach_eventlink_ring_t                ring,
+	const void                           *data,
+	uint32_t                             size,
+	void                                 *buffer,
+	uint32_t                             *size_ptr,
+	mach_eventlink_signal_wait_option_t  option,
+	kern_clock_id_t                      clock_id,
+	uint64_t                             deadline)
+{
+	bool needs_signal = false;
+	kern_return_t kr;
+
+	kr = mach_eventlink_ring_enqueue(ring, data, size, &needs_signal);
+	if (kr != KERN_SUCCESS) {
+		return kr;
+	}
+	return mach_eventlink_ring_receive_internal(ring, needs_signal, buffer,
+	           size_ptr, option, clock_id, deadline);
+}
@@ -146,6 +146,71 @@ mach_msg2_internal(
 	return mr;
 
 }
+
+/*
+ *	Routine:	mach_msg_batch
+ *	Purpose:
+ *		Send or receive up to MACH_MSG_BATCH_MAX_COUNT messages.
+ *		If the operation is interrupted, and the user did not
+ *		request an indication of that fact, then resume it from
+ *		the interrupted entry.
+ */
+mach_msg_return_t
+mach_msg_batch(
+	mach_msg_batch_entry_t *entries,
+	mach_msg_size_t count,
+	mach_msg_option64_t option64,
+	mach_port_name_t rcv_name,
+	uint64_t timeout,
+	mach_msg_priority_t priority,
+	mach_msg_size_t *processed)
+{
+	mach_msg_size_t done = 0, n = 0;
+	mach_msg_return_t mr;
+
+	if (option64 & MACH64_SEND_MSG) {
+		/* pass the headers out of line of the messages, like mach_msg2() */
+		for (mach_msg_size_t i = 0; i < count; i++) {
+			const mach_msg_header_t *hdr;
+
+			if (entries[i].msgb_size < sizeof(mach_msg_header_t)) {
+				/* the kernel rejects it as too small */
+				continue;
+			}
+			hdr = (const mach_msg_header_t *)(uintptr_t)entries[i].msgb_data;
+			entries[i].msgb_bits = hdr->msgh_bits;
+			entries[i].msgb_remote_port = hdr->msgh_remote_port;
+			entries[i].msgb_local_port = hdr->msgh_local_port;
+			entries[i].msgb_voucher_port = hdr->msgh_voucher_port;
+			entries[i].msgb_id = hdr->msgh_id;
+		}
+	}
+
+	for (;;) {
+		mr = mach_msg_batch_trap(entries + done,
+		    option64 & ~LIBMACH_OPTIONS64,
+		    (uint64_t)rcv_name << 32 | (count - done),
+		    timeout, priority, &n);
+
+		if (mr == MACH_SEND_INTERRUPTED &&
+		    (option64 & MACH64_SEND_INTERRUPT) == 0) {
+			/* the interrupted message wasn't sent */
+			done += n - 1;
+			continue;
+		}
+		if (mr == MACH_RCV_INTERRUPTED &&
+		    (option64 & MACH64_RCV_INTERRUPT) == 0) {
+			/* only the first receive can block */
+			continue;
+		}
+		break;
+	}
+
+	if (processed) {
+		*processed = done + n;
+	}
+	return mr;
+}
 #endif
 
 /*
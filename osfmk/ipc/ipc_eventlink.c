@@ -46,6 +46,9 @@
 #include <kern/mach_param.h>
 #include <mach/mach_traps.h>
 #include <mach/mach_eventlink_server.h>
+#include <mach/vm_map.h>
+#include <vm/vm_kern_xnu.h>
+#include <vm/vm_memory_entry_xnu.h>
 
 #include <libkern/OSAtomic.h>
 
@@ -172,6 +175,8 @@ ipc_eventlink_initialize(
 	/* Initialize the count to 2, refs for each ipc eventlink port */
 	os_ref_init_count(&ipc_eventlink_base->elb_ref_count, &ipc_eventlink_refgrp, 2);
 	ipc_eventlink_base->elb_type = IPC_EVENTLINK_TYPE_NO_COPYIN;
+	ipc_eventlink_base->elb_ring_entry = IPC_PORT_NULL;
+	ipc_eventlink_base->elb_ring_size = 0;
 
 	for (int i = 0; i < 2; i++) {
 		struct ipc_eventlink *ipc_eventlink = &(ipc_eventlink_base->elb_eventlink[i]);
@@ -472,6 +477,112 @@ mach_eventlink_disassociate(
 	return KERN_SUCCESS;
 }
 
+/*
+ * Name: mach_eventlink_ring_map
+ *
+ * Description: Map the shared ring of the eventlink pair
+ * into a task, allocating it on first use.
+ *
+ * Args:
+ *   eventlink: eventlink
+ *   map: map of the target task
+ *   address: address of the mapping (out)
+ *   size: size of the ring to allocate, or 0 to map an
+ *         existing ring (in), size of the ring (out)
+ *   index: index of the eventlink in the pair, which
+ *          selects the ring data area it writes to (out)
+ *
+ * Returns:
+ *   KERN_SUCCESS on Success.
+ */
+kern_return_t
+mach_eventlink_ring_map(
+	struct ipc_eventlink                  *ipc_eventlink,
+	vm_map_t                              map,
+	mach_vm_address_t                     *address,
+	mach_vm_size_t                        *size,
+	uint32_t                              *index)
+{
+	spl_t s;
+	struct ipc_eventlink_base *ipc_eventlink_base;
+	ipc_port_t ring_entry, new_entry = IPC_PORT_NULL;
+	memory_object_size_t ring_size;
+	mach_vm_offset_t addr = 0;
+	kern_return_t kr;
+
+	if (ipc_eventlink == IPC_EVENTLINK_NULL) {
+		return KERN_TERMINATED;
+	}
+
+	if (map == VM_MAP_NULL) {
+		return KERN_INVALID_ARGUMENT;
+	}
+
+	ipc_eventlink_base = ipc_eventlink->el_base;
+
+	s = splsched();
+	ipc_eventlink_lock(ipc_eventlink);
+	ring_entry = ipc_eventlink_base->elb_ring_entry;
+	ring_size = ipc_eventlink_base->elb_ring_size;
+	ipc_eventlink_unlock(ipc_eventlink);
+	splx(s);
+
+	if (ring_entry == IPC_PORT_NULL) {
+		if (*size < MACH_EVENTLINK_RING_MIN_SIZE ||
+		    *size > MACH_EVENTLINK_RING_MAX_SIZE) {
+			return KERN_INVALID_ARGUMENT;
+		}
+
+		/* Can't allocate under the eventlink lock */
+		ring_size = *size;
+		kr = mach_make_memory_entry_64(VM_MAP_NULL, &ring_size, 0,
+		    MAP_MEM_NAMED_CREATE | VM_PROT_DEFAULT, &new_entry, IPC_PORT_NULL);
+		if (kr != KERN_SUCCESS) {
+			return kr;
+		}
+
+		s = splsched();
+		ipc_eventlink_lock(ipc_eventlink);
+		if (ipc_eventlink_active(ipc_eventlink) &&
+		    ipc_eventlink_base->elb_ring_entry == IPC_PORT_NULL) {
+			ipc_eventlink_base->elb_ring_entry = new_entry;
+			ipc_eventlink_base->elb_ring_size = ring_size;
+			new_entry = IPC_PORT_NULL;
+		}
+		ring_entry = ipc_eventlink_base->elb_ring_entry;
+		ring_size = ipc_eventlink_base->elb_ring_size;
+		ipc_eventlink_unlock(ipc_eventlink);
+		splx(s);
+
+		/* Lost the race against the other side, or terminated */
+		if (new_entry != IPC_PORT_NULL) {
+			mach_memory_entry_port_release(new_entry);
+		}
+		if (ring_entry == IPC_PORT_NULL) {
+			return KERN_TERMINATED;
+		}
+	} else if (*size != 0 && *size != ring_size) {
+		return KERN_INVALID_ARGUMENT;
+	}
+
+	/*
+	 * The memory entry is only released with the eventlink base,
+	 * which the caller holds a reference on.
+	 */
+	kr = mach_vm_map_kernel(map, &addr, ring_size, 0,
+	    VM_MAP_KERNEL_FLAGS_ANYWHERE(), ring_entry, 0, FALSE,
+	    VM_PROT_READ | VM_PROT_WRITE, VM_PROT_READ | VM_PROT_WRITE,
+	    VM_INHERIT_NONE);
+	if (kr != KERN_SUCCESS) {
+		return kr;
+	}
+
+	*address = addr;
+	*size = ring_size;
+	*index = (ipc_eventlink == &ipc_eventlink_base->elb_eventlink[0]) ? 0 : 1;
+	return KERN_SUCCESS;
+}
+
 /*
  * Name: mach_eventlink_signal_trap
  *
@@ -944,6 +1055,11 @@ ipc_eventlink_deallocate(
 
 	assert(!ipc_eventlink_active(ipc_eventlink));
 
+	/* Existing mappings of the ring hold their own object reference */
+	if (ipc_eventlink_base->elb_ring_entry != IPC_PORT_NULL) {
+		mach_memory_entry_port_release(ipc_eventlink_base->elb_ring_entry);
+	}
+
 #if DEVELOPMENT || DEBUG
 	/* Remove ipc_eventlink to global list */
 	global_ipc_eventlink_lock();
@@ -78,6 +78,8 @@ struct ipc_eventlink_base {
 	struct waitq                  elb_waitq;         /* waitq */
 	os_refcnt_t                   elb_ref_count;     /* ref count for eventlink */
 	uint8_t                       elb_type;
+	ipc_port_t                    elb_ring_entry;    /* memory entry of the shared ring */
+	mach_vm_size_t                elb_ring_size;     /* size of the shared ring */
 #if DEVELOPMENT || DEBUG
 	queue_chain_t                 elb_global_elm;    /* Global list of eventlinks */
 #endif
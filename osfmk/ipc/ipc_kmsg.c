@@ -83,7 +83,9 @@
 #include <kern/assert.h>
 #include <kern/debug.h>
 #include <kern/ipc_kobject.h>
+#include <kern/counter.h>
 #include <kern/kalloc.h>
+#include <kern/percpu.h>
 #include <kern/zalloc.h>
 #include <kern/processor.h>
 #include <kern/thread.h>
@@ -191,6 +193,15 @@ KALLOC_TYPE_VAR_DEFINE(KT_IPC_KMSG_KDATA_OOL,
 
 static TUNABLE(bool, enforce_strict_reply, "ipc_strict_reply", false);
 
+/*
+ * Page aligned out-of-line regions in this size range are lent to the
+ * receiver: deallocated regions are moved rather than copied through a
+ * kernel buffer, and the resident pages of those lent regions are entered
+ * read-only in the receiver's pmap on copyout.
+ */
+static TUNABLE(vm_size_t, ipc_ool_lend_min, "ipc_ool_lend_min", 16 << 10);
+static TUNABLE(vm_size_t, ipc_ool_lend_max, "ipc_ool_lend_max", 1 << 20);
+
 
 #pragma mark ipc_kmsg layout and accessors
 
@@ -713,6 +724,192 @@ ikm_free_kdata_ool(void *ptr, size_t size)
 	kfree_type_var_impl(KT_IPC_KMSG_KDATA_OOL, ptr, size);
 }
 
+/*
+ * Per-CPU cache of free kmsgs.
+ *
+ * Message heavy workloads allocate and free kmsgs at a high rate, most of
+ * them small enough to be IKM_TYPE_ALL_INLINED or IKM_TYPE_UDATA_OOL.
+ * Freed kmsgs of those types are kept on the CPU that freed them (usually
+ * the receiver), along with their udata buffer, so that the next sender on
+ * that CPU can reuse them without going back to the zone and kalloc.
+ *
+ * Class 0 holds IKM_TYPE_ALL_INLINED kmsgs.  Class n > 0 holds
+ * IKM_TYPE_UDATA_OOL kmsgs whose udata buffer comes from the n-th
+ * KHEAP_DATA_BUFFERS zone (see the table in <kern/kalloc.h>), up to 8k.
+ * Any udata size served by that zone can reuse the buffer, so sizes are
+ * never rounded up and the cache costs no memory beyond what it holds.
+ * That is bounded by IKM_CACHE_DEPTH kmsgs per class and IKM_CACHE_BYTES
+ * per CPU.
+ *
+ * zfree() clears elements, and so does ipc_kmsg_cache_put(): a stale
+ * reference to a cached kmsg or udata buffer only finds zeroes.  Under
+ * KASAN the cache is compiled out so that freed kmsgs go through its
+ * quarantine.
+ */
+#define IKM_CACHE_UDATA_MAX     (8 << 10)
+#define IKM_CACHE_CLASSES       19              /* inline, 16, 32, ..., 8k */
+#define IKM_CACHE_DEPTH         4
+#define IKM_CACHE_BYTES         (32 << 10)
+
+struct ipc_kmsg_cache_entry {
+	ipc_kmsg_t      ikce_kmsg;
+	void           *ikce_udata;
+};
+
+struct ipc_kmsg_cache {
+	uint32_t        ikc_bytes;
+	uint8_t         ikc_count[IKM_CACHE_CLASSES];
+	struct ipc_kmsg_cache_entry ikc_entries[IKM_CACHE_CLASSES][IKM_CACHE_DEPTH];
+};
+static struct ipc_kmsg_cache PERCPU_DATA(ipc_kmsg_cache);
+
+#if KASAN
+#define ipc_kmsg_cache_enabled  false
+#else
+static TUNABLE(bool, ipc_kmsg_cache_enabled, "ipc_kmsg_cache", true);
+#endif
+SCALABLE_COUNTER_DEFINE(ipc_kmsg_cache_hits);
+SCALABLE_COUNTER_DEFINE(ipc_kmsg_cache_misses);
+
+/*
+ * Returns the index of the KHEAP_DATA_BUFFERS zone that kalloc_data()
+ * uses for this size, as kalloc_zone_for_size() computes it.
+ */
+static inline int
+ikm_cache_udata_zidx(mach_msg_size_t udata_size)
+{
+	uint32_t idx;
+
+	if (udata_size <= KHEAP_START_SIZE) {
+		return udata_size > 16;
+	}
+	idx = kalloc_log2down(udata_size - 1);
+	return KHEAP_EXTRA_ZONES + 2 * (idx - KHEAP_START_IDX) +
+	       ((udata_size - 1) >> (idx - 1)) - 2;
+}
+
+/*
+ * Returns the element size of the KHEAP_DATA_BUFFERS zone that kalloc_data()
+ * uses for this size.
+ */
+static inline uint32_t
+ikm_cache_udata_zsize(mach_msg_size_t udata_size)
+{
+	uint32_t idx;
+
+	if (udata_size <= KHEAP_START_SIZE) {
+		return udata_size > 16 ? 32 : 16;
+	}
+	idx = kalloc_log2down(udata_size - 1);
+	return (((udata_size - 1) >> (idx - 1)) + 1) << (idx - 1);
+}
+
+static_assert(IKM_CACHE_UDATA_MAX <= KHEAP_MAX_SIZE);
+
+/*
+ * Returns the cache class for a kmsg of this type and udata size,
+ * or -1 if such kmsgs aren't cached.
+ */
+static inline int
+ikm_cache_class(ipc_kmsg_type_t type, mach_msg_size_t udata_size)
+{
+	if (type == IKM_TYPE_ALL_INLINED) {
+		return 0;
+	}
+	if (type == IKM_TYPE_UDATA_OOL &&
+	    udata_size > 0 && udata_size <= IKM_CACHE_UDATA_MAX) {
+		return ikm_cache_udata_zidx(udata_size) + 1;
+	}
+	return -1;
+}
+
+/*
+ * Returns how many bytes a cached kmsg of this type and udata size holds.
+ */
+static inline uint32_t
+ikm_cache_bytes(ipc_kmsg_type_t type, mach_msg_size_t udata_size)
+{
+	if (type == IKM_TYPE_ALL_INLINED) {
+		return sizeof(struct ipc_kmsg);
+	}
+	return sizeof(struct ipc_kmsg) + ikm_cache_udata_zsize(udata_size);
+}
+
+static ipc_kmsg_t
+ipc_kmsg_cache_get(
+	ipc_kmsg_type_t         type,
+	mach_msg_size_t         udata_size,
+	void                  **udata)
+{
+	struct ipc_kmsg_cache_entry *entry;
+	struct ipc_kmsg_cache *cache;
+	ipc_kmsg_t kmsg = IKM_NULL;
+	int class = ikm_cache_class(type, udata_size);
+
+	if (class < 0 || !ipc_kmsg_cache_enabled) {
+		return IKM_NULL;
+	}
+
+	disable_preemption();
+	cache = PERCPU_GET(ipc_kmsg_cache);
+	if (cache->ikc_count[class] > 0) {
+		entry = &cache->ikc_entries[class][--cache->ikc_count[class]];
+		kmsg = entry->ikce_kmsg;
+		*udata = entry->ikce_udata;
+		*entry = (struct ipc_kmsg_cache_entry){ };
+		cache->ikc_bytes -= ikm_cache_bytes(type, udata_size);
+		counter_inc_preemption_disabled(&ipc_kmsg_cache_hits);
+	} else {
+		counter_inc_preemption_disabled(&ipc_kmsg_cache_misses);
+	}
+	enable_preemption();
+
+	return kmsg;
+}
+
+static bool
+ipc_kmsg_cache_put(ipc_kmsg_t kmsg)
+{
+	struct ipc_kmsg_cache *cache;
+	ipc_kmsg_type_t type = kmsg->ikm_type;
+	mach_msg_size_t udata_size = 0;
+	void *udata = NULL;
+	uint32_t bytes;
+	bool cached = false;
+	int class;
+
+	if (type == IKM_TYPE_UDATA_OOL) {
+		udata = kmsg->ikm_udata;
+		udata_size = kmsg->ikm_udata_size;
+	}
+	class = ikm_cache_class(type, udata_size);
+	if (class < 0 || !ipc_kmsg_cache_enabled) {
+		return false;
+	}
+	bytes = ikm_cache_bytes(type, udata_size);
+
+	disable_preemption();
+	cache = PERCPU_GET(ipc_kmsg_cache);
+	if (cache->ikc_count[class] < IKM_CACHE_DEPTH &&
+	    cache->ikc_bytes + bytes <= IKM_CACHE_BYTES) {
+		/* clear it like zfree() would, before anyone can take it */
+		bzero(kmsg, sizeof(*kmsg));
+		if (udata) {
+			bzero(udata, udata_size);
+		}
+		cache->ikc_entries[class][cache->ikc_count[class]++] =
+		    (struct ipc_kmsg_cache_entry){
+			.ikce_kmsg = kmsg,
+			.ikce_udata = udata,
+		};
+		cache->ikc_bytes += bytes;
+		cached = true;
+	}
+	enable_preemption();
+
+	return cached;
+}
+
 /*
  *	Routine:	ipc_kmsg_alloc
  *	Purpose:
@@ -842,6 +1039,19 @@ ipc_kmsg_alloc(
 		alloc_flags |= Z_NOFAIL;
 	}
 
+	static_assert(IPC_KMSG_MAX_AUX_DATA_SPACE <= UINT16_MAX,
+	    "casting aux_size won't truncate");
+
+	/* Try to recycle a kmsg of the same layout first */
+	kmsg = ipc_kmsg_cache_get(kmsg_type, max_udata_size, &msg_udata);
+	if (kmsg != IKM_NULL) {
+		if (msg_udata && (flags & IPC_KMSG_ALLOC_ZERO)) {
+			/* only the previous udata size was cleared */
+			bzero(msg_udata, max_udata_size);
+		}
+		goto init;
+	}
+
 	/* Then, allocate memory for both udata and kdata if needed, as well as kmsg */
 	if (max_udata_size > 0) {
 		msg_udata = kalloc_data(max_udata_size, alloc_flags);
@@ -864,10 +1074,9 @@ ipc_kmsg_alloc(
 		}
 	}
 
-	static_assert(IPC_KMSG_MAX_AUX_DATA_SPACE <= UINT16_MAX,
-	    "casting aux_size won't truncate");
-
 	kmsg = zalloc_id(ZONE_ID_IPC_KMSG, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+
+init:
 	kmsg->ikm_type = kmsg_type;
 	kmsg->ikm_aux_size = (uint16_t)aux_size;
 
@@ -1049,6 +1258,11 @@ ipc_kmsg_free(
 		return;
 	}
 
+	/* Keep the kmsg and its udata buffer for the next sender on this CPU */
+	if (ipc_kmsg_cache_put(kmsg)) {
+		return;
+	}
+
 	ipc_kmsg_free_allocations(kmsg);
 	zfree_id(ZONE_ID_IPC_KMSG, kmsg);
 	/* kmsg struct freed */
@@ -1958,6 +2172,63 @@ ipc_kmsg_copyin_dest_disposition(
 	ipc_unreachable("not a pair of copy/move-send");
 }
 
+/*
+ *	Routine:	ipc_kmsg_copyin_header_rights_smr
+ *	Purpose:
+ *		Fast path of ipc_kmsg_copyin_header_rights() for messages
+ *		with a copy-send destination, and no reply port or voucher.
+ *
+ *		Copying a send right doesn't modify the space, so the
+ *		destination is translated under SMR with
+ *		ipc_right_lookup_read(), without taking the space lock
+ *		that growing or mutating the space holds.
+ *
+ *		Anything out of the ordinary (dead or reply ports,
+ *		missing rights, send-possible notifications which need
+ *		the entry's request) goes through the slow path,
+ *		which is responsible for reporting errors.
+ *
+ *	Conditions:
+ *		Nothing locked.
+ *		Returns with the destination port locked on success.
+ */
+static bool
+ipc_kmsg_copyin_header_rights_smr(
+	ipc_space_t             space,
+	mach_msg_option64_t     options,
+	ikm_copyinhdr_state_t  *st)
+{
+	ipc_entry_bits_t bits;
+	ipc_object_t object;
+	ipc_port_t port;
+
+	if (st->dest_type != MACH_MSG_TYPE_COPY_SEND ||
+	    st->reply_name != MACH_PORT_NULL ||
+	    st->voucher_name != MACH_PORT_NULL ||
+	    (options & MACH64_SEND_NOTIFY)) {
+		return false;
+	}
+
+	if (ipc_right_lookup_read(space, st->dest_name, &bits, &object) != KERN_SUCCESS) {
+		return false;
+	}
+	/* object is locked */
+
+	port = ip_object_to_port(object);
+	if ((bits & MACH_PORT_TYPE_SEND) == 0 || !ip_active(port) ||
+	    ip_is_reply_port(port)) {
+		ip_mq_unlock(port);
+		return false;
+	}
+
+	ipc_port_copy_send_any_locked(port);
+
+	st->dest_port = port;
+	st->dest_request = IE_REQ_NONE;
+	st->reply_port = IP_NULL;
+	return true;
+}
+
 /*
  *	Routine:	ipc_kmsg_copyin_header_rights
  *	Purpose:
@@ -2153,7 +2424,8 @@ ipc_kmsg_copyin_header(
 	kern_return_t kr;
 
 	kr = ipc_kmsg_copyin_header_validate(kmsg, options, &st);
-	if (kr == KERN_SUCCESS) {
+	if (kr == KERN_SUCCESS &&
+	    !ipc_kmsg_copyin_header_rights_smr(space, options, &st)) {
 		kr = ipc_kmsg_copyin_header_rights(space, &st);
 	}
 
@@ -2494,9 +2766,23 @@ ipc_kmsg_copyin_ool_descriptor(
 		 *
 		 * NOTE: A virtual copy is OK if the original is being
 		 * deallocted, even if a physical copy was requested.
+		 *
+		 * Page aligned regions that are being deallocated are
+		 * always moved, since copying them through a kernel
+		 * buffer costs more than remapping their pages.
 		 */
-		switch (vm_map_copyin(map, dsc->u_address, length,
-		    dsc->deallocate, &copy)) {
+		kern_return_t kr;
+
+		if (dsc->deallocate && length >= ipc_ool_lend_min &&
+		    length <= ipc_ool_lend_max &&
+		    ((dsc->u_address | length) & VM_MAP_PAGE_MASK(map)) == 0) {
+			kr = vm_map_copyin_pages(map, dsc->u_address, length,
+			    true, &copy);
+		} else {
+			kr = vm_map_copyin(map, dsc->u_address, length,
+			    dsc->deallocate, &copy);
+		}
+		switch (kr) {
 		case KERN_SUCCESS:
 			break;
 		case KERN_RESOURCE_SHORTAGE:
@@ -3986,7 +4272,17 @@ ipc_kmsg_copyout_ool_descriptor(
 				kr = vm_map_copy_overwrite(map, rcv_addr, copy, size, FALSE);
 			}
 		} else {
+			/*
+			 * copyout consumes the copy, and only regions that were
+			 * lent by their sender are worth prefaulting.
+			 */
+			bool lend = copy->is_lent;
+
 			kr = vm_map_copyout_size(map, &rcv_addr, copy, size);
+			if (kr == KERN_SUCCESS && lend) {
+				vm_map_pmap_enter_resident(map, rcv_addr,
+				    rcv_addr + size);
+			}
 		}
 		if (kr != KERN_SUCCESS) {
 			if (kr == KERN_RESOURCE_SHORTAGE) {
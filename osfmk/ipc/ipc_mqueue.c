@@ -1257,6 +1257,95 @@ ipc_mqueue_select_on_thread_locked(
 	return;
 }
 
+/*
+ *	Routine:	ipc_mqueue_receive_batch
+ *	Purpose:
+ *		Pull up to max_count messages that are already queued
+ *		on a port, taking the port lock only once, on behalf of
+ *		mach_msg_batch_trap().
+ *
+ *		Stops at the first message that wouldn't fit in a buffer
+ *		of max_msg_size bytes, and leaves it on the queue for a
+ *		regular receive to deal with.
+ *
+ *		Like ipc_mqueue_receive_on_thread_and_unlock(), checks
+ *		before each message that the port is still alive and
+ *		still in the receiver's space, since it was unlocked
+ *		since the receive right was looked up.
+ *	Conditions:
+ *		Nothing locked.
+ *		Our caller holds a reference on the port.
+ *	Returns:
+ *		The number of messages appended to kmsgs, in countp.
+ *		The sequence number of the first one is returned
+ *		in seqnop, the others follow.
+ *
+ *		MACH_MSG_SUCCESS	No more messages that fit.
+ *		MACH_RCV_PORT_DIED	Port died; no more messages.
+ *		MACH_RCV_PORT_CHANGED	Port moved out of the space;
+ *					no more messages.
+ */
+mach_msg_return_t
+ipc_mqueue_receive_batch(
+	ipc_mqueue_t            port_mq,
+	mach_msg_option64_t     option64,
+	mach_msg_size_t         max_msg_size,
+	mach_msg_size_t         max_count,
+	ipc_kmsg_queue_t        kmsgs,
+	mach_msg_size_t        *countp,
+	mach_port_seqno_t      *seqnop)
+{
+	ipc_port_t port = ip_from_mq(port_mq);
+	ipc_space_t space = current_space();
+	vm_map_t map = current_map();
+	mach_msg_recv_bufs_t recv_bufs = {
+		.recv_msg_size = max_msg_size,
+	};
+	mach_msg_return_t mr = MACH_MSG_SUCCESS;
+	mach_msg_size_t count = 0, tsize;
+	ipc_kmsg_t kmsg;
+
+	tsize = ipc_kmsg_trailer_size(option64, map);
+
+	ip_mq_lock(port);
+	*seqnop = port_mq->imq_seqno;
+	while (count < max_count) {
+		if (!waitq_is_valid(&port->ip_waitq)) {
+			/* someone raced us to destroy this port */
+			mr = MACH_RCV_PORT_DIED;
+			break;
+		}
+		if (!ip_in_space(port, space)) {
+			/* the receive right was moved away */
+			mr = MACH_RCV_PORT_CHANGED;
+			break;
+		}
+
+		kmsg = ipc_kmsg_queue_first(&port_mq->imq_messages);
+		if (kmsg == IKM_NULL ||
+		    ipc_mqueue_msg_too_large(ipc_kmsg_copyout_size(kmsg, map),
+		    tsize, kmsg->ikm_aux_size, option64, &recv_bufs)) {
+			break;
+		}
+
+		ipc_kmsg_rmqueue(&port_mq->imq_messages, kmsg);
+#if MACH_FLIPC
+		if (MACH_NODE_VALID(kmsg->ikm_node) && FPORT_VALID(port_mq->imq_fport)) {
+			flipc_msg_ack(kmsg->ikm_node, port_mq, TRUE);
+		}
+#endif
+		ipc_mqueue_release_msgcount(port_mq);
+		port_mq->imq_seqno++;
+		ipc_kmsg_enqueue(kmsgs, kmsg);
+		count++;
+	}
+	ip_mq_unlock(port);
+
+	counter_add(&current_task()->messages_received, count);
+	*countp = count;
+	return mr;
+}
+
 /*
  *	Routine:	ipc_mqueue_peek_locked
  *	Purpose:
@@ -193,6 +193,16 @@ extern void ipc_mqueue_select_on_thread_locked(
 	mach_msg_option64_t     option64,
 	thread_t                thread);
 
+/* Pull the messages already queued on a port, for a batched receive */
+extern mach_msg_return_t ipc_mqueue_receive_batch(
+	ipc_mqueue_t            port_mq,
+	mach_msg_option64_t     option64,
+	mach_msg_size_t         max_msg_size,
+	mach_msg_size_t         max_count,
+	ipc_kmsg_queue_t        kmsgs,
+	mach_msg_size_t         *countp,
+	mach_port_seqno_t       *seqnop);
+
 /* Peek into a messaqe queue to see if there are messages */
 extern unsigned ipc_mqueue_peek(
 	ipc_mqueue_t            mqueue,
@@ -161,12 +161,21 @@ IPC_KOBJECT_DEFINE(IKOT_PORT_SUBST_ONCE,
     .iko_op_no_senders = ipc_kobject_subst_once_no_senders);
 
 #define MAX_MIG_ENTRIES 1031
-#define MIG_HASH(x) (x)
 
 #define KOBJ_IDX_NOT_SET (-1)
 
+/*
+ * The routines of a subsystem have consecutive msgh_ids, so rather than
+ * hashing them, mig_buckets[] holds the routines of each subsystem densely,
+ * and mig_ranges[] (sorted by msgh_id) tells where each subsystem starts.
+ */
+typedef struct {
+	mach_msg_id_t start;
+	mach_msg_id_t end;
+	uint32_t      base;             /* index of @c start in mig_buckets */
+} mig_range_t;
+
 static SECURITY_READ_ONLY_LATE(mig_hash_t) mig_buckets[MAX_MIG_ENTRIES];
-static SECURITY_READ_ONLY_LATE(int) mig_table_max_displ;
 SECURITY_READ_ONLY_LATE(int) mach_kobj_count; /* count of total number of kobjects */
 
 ZONE_DEFINE_TYPE(ipc_kobject_label_zone, "ipc kobject labels",
@@ -201,6 +210,8 @@ static struct mig_kern_subsystem *mig_e[] = {
 	(const struct mig_kern_subsystem *)&mach_eventlink_subsystem,
 };
 
+static SECURITY_READ_ONLY_LATE(mig_range_t) mig_ranges[sizeof(mig_e) / sizeof(mig_e[0])];
+
 static struct ipc_kobject_ops __security_const_late
     ipc_kobject_ops_array[IKOT_MAX_TYPE];
 
@@ -223,13 +234,54 @@ ipc_kobject_ops_get(ipc_kobject_type_t ikot)
 	return &ipc_kobject_ops_array[ikot];
 }
 
+/*
+ * Return the dispatch table slot for a given msgh_id,
+ * or 0 if no subsystem covers it.
+ */
+static mig_hash_t *
+find_mig_range_entry(mach_msg_id_t msgh_id)
+{
+	uint32_t lo = 0, hi = sizeof(mig_ranges) / sizeof(mig_ranges[0]);
+
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		const mig_range_t *range = &mig_ranges[mid];
+
+		if (msgh_id < range->start) {
+			hi = mid;
+		} else if (msgh_id >= range->end) {
+			lo = mid + 1;
+		} else {
+			return &mig_buckets[range->base + (msgh_id - range->start)];
+		}
+	}
+
+	return (mig_hash_t *)0;
+}
+
+/*
+ * Do a table lookup for given msgh_id. Return 0
+ * if not found.
+ */
+static mig_hash_t *
+find_mig_hash_entry(int msgh_id)
+{
+	mig_hash_t *ptr = find_mig_range_entry(msgh_id);
+
+	if (ptr && !ptr->kroutine) {
+		ptr = (mig_hash_t *)0;
+	}
+
+	return ptr;
+}
+
 __startup_func
 static void
 mig_init(void)
 {
-	unsigned int i, n = sizeof(mig_e) / sizeof(const struct mig_kern_subsystem *);
-	int howmany;
-	mach_msg_id_t j, pos, nentry, range;
+	unsigned int i, k, n = sizeof(mig_e) / sizeof(const struct mig_kern_subsystem *);
+	uint32_t base = 0;
+	mach_msg_id_t j, nentry, range;
 
 	for (i = 0; i < n; i++) {
 		range = mig_e[i]->end - mig_e[i]->start;
@@ -243,27 +295,44 @@ mig_init(void)
 			    KALLOC_SAFE_ALLOC_SIZE - MAX_TRAILER_SIZE);
 		}
 
+		/* insert the subsystem range, keeping mig_ranges[] sorted */
+		for (k = i; k > 0 && mig_ranges[k - 1].start > mig_e[i]->start; k--) {
+			mig_ranges[k] = mig_ranges[k - 1];
+		}
+		mig_ranges[k] = (mig_range_t){
+			.start = mig_e[i]->start,
+			.end   = mig_e[i]->end,
+		};
+	}
+
+	for (i = 0; i < n; i++) {
+		if (i > 0 && mig_ranges[i].start < mig_ranges[i - 1].end) {
+			printf("message id = %d\n", mig_ranges[i].start);
+			panic("multiple entries with the same msgh_id");
+		}
+		mig_ranges[i].base = base;
+		base += mig_ranges[i].end - mig_ranges[i].start;
+		if (base > MAX_MIG_ENTRIES) {
+			panic("the mig dispatch table is too small");
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		range = mig_e[i]->end - mig_e[i]->start;
+
 		for (j = 0; j < range; j++) {
 			if (mig_e[i]->kroutine[j].kstub_routine) {
+				mig_hash_t *ptr;
+
 				/* Only put real entries in the table */
 				nentry = j + mig_e[i]->start;
-				for (pos = MIG_HASH(nentry) % MAX_MIG_ENTRIES, howmany = 1;
-				    mig_buckets[pos].num;
-				    pos++, pos = pos % MAX_MIG_ENTRIES, howmany++) {
-					if (mig_buckets[pos].num == nentry) {
-						printf("message id = %d\n", nentry);
-						panic("multiple entries with the same msgh_id");
-					}
-					if (howmany == MAX_MIG_ENTRIES) {
-						panic("the mig dispatch table is too small");
-					}
-				}
+				ptr = find_mig_range_entry(nentry);
 
-				mig_buckets[pos].num = nentry;
-				mig_buckets[pos].kroutine = mig_e[i]->kroutine[j].kstub_routine;
+				ptr->num = nentry;
+				ptr->kroutine = mig_e[i]->kroutine[j].kstub_routine;
 				if (mig_e[i]->kroutine[j].max_reply_msg) {
-					mig_buckets[pos].kreply_size = mig_e[i]->kroutine[j].max_reply_msg;
-					mig_buckets[pos].kreply_desc_cnt = mig_e[i]->kroutine[j].reply_descr_count;
+					ptr->kreply_size = mig_e[i]->kroutine[j].max_reply_msg;
+					ptr->kreply_desc_cnt = mig_e[i]->kroutine[j].reply_descr_count;
 					assert3u(mig_e[i]->kroutine[j].descr_count,
 					    <=, IPC_KOBJECT_DESC_MAX);
 					assert3u(mig_e[i]->kroutine[j].reply_descr_count,
@@ -277,11 +346,8 @@ mig_init(void)
 					panic("kroutine must have precise size %d %d", mig_e[i]->start, j);
 				}
 
-				mig_buckets[pos].kobjidx = KOBJ_IDX_NOT_SET;
+				ptr->kobjidx = KOBJ_IDX_NOT_SET;
 
-				if (mig_table_max_displ < howmany) {
-					mig_table_max_displ = howmany;
-				}
 				mach_kobj_count++;
 			}
 		}
@@ -290,33 +356,11 @@ mig_init(void)
 	/* 77417305: pad to allow for MIG routines removals/cleanups */
 	mach_kobj_count += 32;
 
-	printf("mig_table_max_displ = %d mach_kobj_count = %d\n",
-	    mig_table_max_displ, mach_kobj_count);
+	printf("mig dispatch entries = %d mach_kobj_count = %d\n",
+	    base, mach_kobj_count);
 }
 STARTUP(MACH_IPC, STARTUP_RANK_FIRST, mig_init);
 
-/*
- * Do a hash table lookup for given msgh_id. Return 0
- * if not found.
- */
-static mig_hash_t *
-find_mig_hash_entry(int msgh_id)
-{
-	unsigned int i = (unsigned int)MIG_HASH(msgh_id);
-	int max_iter = mig_table_max_displ;
-	mig_hash_t *ptr;
-
-	do {
-		ptr = &mig_buckets[i++ % MAX_MIG_ENTRIES];
-	} while (msgh_id != ptr->num && ptr->num && --max_iter);
-
-	if (!ptr->kroutine || msgh_id != ptr->num) {
-		ptr = (mig_hash_t *)0;
-	}
-
-	return ptr;
-}
-
 /*
  * Routine: ipc_kobject_reply_status
  *
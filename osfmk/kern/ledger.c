@@ -35,6 +35,7 @@
 #include <kern/task.h>
 #include <kern/thread.h>
 #include <kern/coalition.h>
+#include <kern/counter.h>
 
 #include <kern/processor.h>
 #include <kern/machine.h>
@@ -65,6 +66,11 @@
 #define LF_TRACK_CREDIT_ONLY    0x10000 /* only update "credit" */
 #define LF_DIAG_WARNED          0x20000 /* callback was called for balance diag */
 #define LF_DIAG_DISABLED        0x40000 /* diagnostics threshold are disabled at the moment */
+#define LF_SHARDED              0x80000 /* updates are staged in per-CPU shards */
+#define LF_SHARD_SHIFT          24      /* shard slot of an LF_SHARDED entry */
+#define LF_SHARD_MASK           (LEDGER_SHARDS_MAX - 1)
+#define LF_SHARD_INDEX(flags)   (((flags) >> LF_SHARD_SHIFT) & LF_SHARD_MASK)
+_Static_assert((LEDGER_SHARDS_MAX & LF_SHARD_MASK) == 0, "LEDGER_SHARDS_MAX must be a power of 2");
 
 
 /*
@@ -214,8 +220,14 @@ struct ledger_template {
 	struct entry_template   *lt_entries;
 	/* Lookup table to go from entry_offset to index in the lt_entries table. */
 	uint16_t                *lt_entries_lut;
+	/* Per-CPU shard slots handed out by ledger_track_per_cpu(). */
+	uint16_t                lt_shard_cnt;
+	ledger_amount_t         lt_shard_batch[LEDGER_SHARDS_MAX];
 };
 
+static ZONE_DEFINE_TYPE(ledger_shards_zone, "ledger.shards",
+    struct ledger_shards, ZC_PERCPU | ZC_ALIGNMENT_REQUIRED | ZC_KASAN_NOREDZONE);
+
 static inline uint16_t
 ledger_template_entries_lut_size(uint16_t lt_table_size)
 {
@@ -388,6 +400,9 @@ ledger_template_copy(ledger_template_t template, const char *name)
 	new_template->lt_cnt = template->lt_cnt;
 	new_template->lt_next_offset = template->lt_next_offset;
 	new_template->lt_entries_lut = new_entries_lut;
+	new_template->lt_shard_cnt = template->lt_shard_cnt;
+	bcopy(template->lt_shard_batch, new_template->lt_shard_batch,
+	    sizeof(template->lt_shard_batch));
 
 out:
 	template_unlock(template);
@@ -674,6 +689,17 @@ ledger_instantiate(ledger_template_t template, int entry_type)
 	assert(entries_size > 0);
 	ledger->l_size = (uint16_t) entries_size;
 
+	/*
+	 * Ledgers owned by the pmap layer are updated from within the PPL,
+	 * which can't be handed kernel per-CPU memory: their sharded entries
+	 * fall back to plain atomics.
+	 */
+	ledger->l_shards = NULL;
+	if (template->lt_zone && template->lt_shard_cnt) {
+		ledger->l_shards = zalloc_percpu(ledger_shards_zone,
+		    Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	}
+
 	template_lock(template);
 	assert(ledger->l_size <= template->lt_next_offset);
 	for (i = 0; i < num_entries; i++) {
@@ -688,6 +714,11 @@ ledger_instantiate(ledger_template_t template, int entry_type)
 			struct ledger_entry *le = (struct ledger_entry *) les;
 
 			le->le_flags = et->et_flags;
+			/* panicking on a negative balance needs the exact balance */
+			if (ledger->l_shards == NULL ||
+			    (le->le_flags & LF_PANIC_ON_NEGATIVE)) {
+				flag_clear(&le->le_flags, LF_SHARDED);
+			}
 			/* make entry inactive by removing  active bit */
 			if (entry_type == LEDGER_CREATE_INACTIVE_ENTRIES) {
 				flag_clear(&le->le_flags, LF_ENTRY_ACTIVE);
@@ -754,6 +785,10 @@ ledger_dereference(ledger_t ledger)
 
 	if (os_ref_release(&ledger->l_refs) == 0) {
 		ledger_template_t template = ledger->l_template;
+		if (ledger->l_shards) {
+			zfree_percpu(ledger_shards_zone, ledger->l_shards);
+			ledger->l_shards = NULL;
+		}
 		if (template->lt_zone) {
 			zfree(template->lt_zone, ledger);
 		} else {
@@ -885,6 +920,148 @@ ledger_limit_entry_wakeup(struct ledger_entry *le)
 	}
 }
 
+/*
+ * Per-CPU sharded entries
+ *
+ * Hot entries such as cpu_time are updated by every thread of a task, and
+ * the atomics on le_credit/le_debit make that cache line bounce between all
+ * the cores the task runs on. Entries opted in with
+ * ledger_track_per_cpu() instead stage updates in a per-CPU shard, much like
+ * scalable counters, and only fold them into the entry once a shard has
+ * accumulated `batch` on either side, or when the entry is read.
+ *
+ * Whatever sits in the shards is invisible to limit and warning checks, and
+ * each shard holds strictly less than `batch` of credit and debit, so the
+ * balance the checks see is off by less than zpercpu_count() * batch. To keep
+ * enforcement exact, updates bypass the shards (and the shards get folded)
+ * as soon as the entry balance comes within that distance of its limit,
+ * warning level or diagnostics threshold.
+ *
+ * LF_TRACKING_MAX entries can't be sharded: a footprint sits at or near its
+ * maximum most of the time, so treating the maximum as one more threshold
+ * would bypass the shards on almost every update.
+ *
+ * On DEVELOPMENT and DEBUG kernels, ledger_shard_{staged,folded,bypassed}
+ * count the updates of sharded entries that stayed in a shard, that folded
+ * a full shard into the entry, and that went to the entry directly.
+ */
+#if DEVELOPMENT || DEBUG
+SCALABLE_COUNTER_DEFINE(ledger_shard_staged);
+SCALABLE_COUNTER_DEFINE(ledger_shard_folded);
+SCALABLE_COUNTER_DEFINE(ledger_shard_bypassed);
+#define ledger_shard_stat(name) counter_inc(&ledger_shard_##name)
+#else
+#define ledger_shard_stat(name) ((void)0)
+#endif /* DEVELOPMENT || DEBUG */
+
+static inline ledger_amount_t
+ledger_entry_shard_batch(ledger_t ledger, struct ledger_entry *le)
+{
+	return ledger->l_template->lt_shard_batch[LF_SHARD_INDEX(le->le_flags)];
+}
+
+static inline bool
+ledger_entry_shard_near_limit(ledger_t ledger, struct ledger_entry *le)
+{
+	ledger_amount_t threshold = le->le_limit;
+	ledger_amount_t slack, balance;
+
+	if (le->le_diag_threshold_scaled != LEDGER_DIAG_MEM_THRESHOLD_INFINITY) {
+		return true;
+	}
+	if (threshold == LEDGER_LIMIT_INFINITY) {
+		return false;
+	}
+	if (threshold <= 0) {
+		/* negative limits are rare enough not to bother */
+		return true;
+	}
+	if (le->le_warn_percent != LEDGER_PERCENT_NONE) {
+		threshold = (threshold * le->le_warn_percent) >> 16;
+	}
+
+	slack = ledger_entry_shard_batch(ledger, le) * zpercpu_count();
+	balance = le->le_credit - le->le_debit;
+	return balance > threshold - slack;
+}
+
+static inline void
+ledger_entry_shard_apply(struct ledger_entry *le,
+    ledger_amount_t credit, ledger_amount_t debit)
+{
+	if (credit) {
+		OSAddAtomic64(credit, &le->le_credit);
+	}
+	if (debit) {
+		OSAddAtomic64(debit, &le->le_debit);
+	}
+}
+
+/*
+ * Fold every CPU's shard for this entry back into the entry.
+ */
+static void
+ledger_entry_shard_fold(ledger_t ledger, struct ledger_entry *le)
+{
+	ledger_amount_t credit = 0, debit = 0;
+	uint32_t idx;
+
+	if (ledger->l_shards == NULL || (le->le_flags & LF_SHARDED) == 0) {
+		return;
+	}
+
+	idx = LF_SHARD_INDEX(le->le_flags);
+	zpercpu_foreach(ls, ledger->l_shards) {
+		credit += os_atomic_xchg(&ls->ls_shards[idx].lsh_credit, 0, relaxed);
+		debit  += os_atomic_xchg(&ls->ls_shards[idx].lsh_debit, 0, relaxed);
+	}
+	ledger_entry_shard_apply(le, credit, debit);
+}
+
+/*
+ * Stage an update in the current CPU's shard.
+ *
+ * Returns false if the entry isn't sharded or is close to its limit,
+ * in which case the caller must update the entry directly.
+ */
+static bool
+ledger_entry_shard_update(thread_t thread, ledger_t ledger, int entry,
+    struct ledger_entry *le, ledger_amount_t credit, ledger_amount_t debit)
+{
+	struct ledger_shard *lsh;
+	ledger_amount_t batch, c, d;
+
+	if (ledger->l_shards == NULL || (le->le_flags & LF_SHARDED) == 0) {
+		return false;
+	}
+	if (ledger_entry_shard_near_limit(ledger, le)) {
+		ledger_shard_stat(bypassed);
+		return false;
+	}
+
+	batch = ledger_entry_shard_batch(ledger, le);
+
+	disable_preemption();
+	lsh = &zpercpu_get(ledger->l_shards)->ls_shards[LF_SHARD_INDEX(le->le_flags)];
+	c = os_atomic_add(&lsh->lsh_credit, credit, relaxed);
+	d = os_atomic_add(&lsh->lsh_debit, debit, relaxed);
+	if (c < batch && c > -batch && d < batch) {
+		ledger_shard_stat(staged);
+		enable_preemption();
+		return true;
+	}
+	c = os_atomic_xchg(&lsh->lsh_credit, 0, relaxed);
+	d = os_atomic_xchg(&lsh->lsh_debit, 0, relaxed);
+	ledger_shard_stat(folded);
+	enable_preemption();
+
+	ledger_entry_shard_apply(le, c, d);
+	if (thread) {
+		ledger_entry_check_new_balance(thread, ledger, entry);
+	}
+	return true;
+}
+
 /*
  * Refill the coffers.
  */
@@ -1014,6 +1191,11 @@ ledger_entry_check_new_balance(thread_t thread, ledger_t ledger,
 		}
 	} else if (size == sizeof(struct ledger_entry)) {
 		le = (struct ledger_entry *)les;
+		if ((le->le_flags & LF_SHARDED) &&
+		    ledger_entry_shard_near_limit(ledger, le)) {
+			ledger_entry_shard_fold(ledger, le);
+		}
+
 		if (le->le_flags & LF_TRACKING_MAX) {
 			ledger_amount_t balance = le->le_credit - le->le_debit;
 
@@ -1152,6 +1334,10 @@ ledger_credit_thread(thread_t thread, ledger_t ledger, int entry, ledger_amount_
 	} else if (entry_size == sizeof(struct ledger_entry)) {
 		le = ledger_entry_identifier_to_entry(ledger, entry);
 
+		if (ledger_entry_shard_update(thread, ledger, entry, le, amount, 0)) {
+			return KERN_SUCCESS;
+		}
+
 		old = OSAddAtomic64(amount, &le->le_credit);
 		new = old + amount;
 	} else {
@@ -1233,6 +1419,7 @@ ledger_rollup_entry(ledger_t to_ledger, ledger_t from_ledger, int entry)
 		if (entry_size == sizeof(struct ledger_entry)) {
 			struct ledger_entry *from = (struct ledger_entry *)from_les;
 			struct ledger_entry *to = (struct ledger_entry *)to_les;
+			ledger_entry_shard_fold(from_ledger, from);
 			OSAddAtomic64(from->le_credit, &to->le_credit);
 			OSAddAtomic64(from->le_debit, &to->le_debit);
 		} else if (entry_size == sizeof(struct ledger_entry_small)) {
@@ -1274,6 +1461,7 @@ ledger_zero_balance(ledger_t ledger, int entry)
 		}
 	} else if (entry_size == sizeof(struct ledger_entry)) {
 		le = (struct ledger_entry *)les;
+		ledger_entry_shard_fold(ledger, le);
 top:
 		debit = le->le_debit;
 		credit = le->le_credit;
@@ -1349,6 +1537,7 @@ ledger_set_limit(ledger_t ledger, int entry, ledger_amount_t limit,
 
 	lprintf(("ledger_set_limit: %lld\n", limit));
 	le = ledger_entry_identifier_to_entry(ledger, entry);
+	ledger_entry_shard_fold(ledger, le);
 
 	if (limit == LEDGER_LIMIT_INFINITY) {
 		/*
@@ -1479,6 +1668,12 @@ ledger_track_maximum(ledger_template_t template, int entry,
 		goto out;
 	}
 
+	/* So is sharding, see "Per-CPU sharded entries". */
+	if (et->et_flags & LF_SHARDED) {
+		kr = KERN_INVALID_VALUE;
+		goto out;
+	}
+
 	et->et_flags |= LF_TRACKING_MAX;
 	kr = KERN_SUCCESS;
 out:
@@ -1547,6 +1742,67 @@ out:
 	return kr;
 }
 
+/*
+ * Stage updates to this entry in per-CPU shards of up to `batch`.
+ * See "Per-CPU sharded entries" above for the error this allows.
+ */
+kern_return_t
+ledger_track_per_cpu(ledger_template_t template, int entry, ledger_amount_t batch)
+{
+	const uint16_t *idx_p;
+	uint16_t idx;
+	struct entry_template *et = NULL;
+	kern_return_t kr = KERN_INVALID_VALUE;
+
+	if (batch <= 0) {
+		return KERN_INVALID_VALUE;
+	}
+
+	template_lock(template);
+
+	/* Shards are sized when the first ledger gets instantiated */
+	if (template->lt_initialized) {
+		goto out;
+	}
+	idx_p = ledger_entry_to_template_idx(template, entry);
+	if (idx_p == NULL) {
+		goto out;
+	}
+	idx = *idx_p;
+	if (idx >= template->lt_cnt) {
+		goto out;
+	}
+	et = &template->lt_entries[idx];
+	/* Small entries are already as cheap as they get */
+	if (et->et_size != sizeof(struct ledger_entry)) {
+		goto out;
+	}
+	/* A tracked maximum would bypass the shards on most updates */
+	if (et->et_flags & LF_TRACKING_MAX) {
+		goto out;
+	}
+	if (et->et_flags & LF_SHARDED) {
+		template->lt_shard_batch[LF_SHARD_INDEX(et->et_flags)] = batch;
+		kr = KERN_SUCCESS;
+		goto out;
+	}
+	if (template->lt_shard_cnt == LEDGER_SHARDS_MAX) {
+		kr = KERN_RESOURCE_SHORTAGE;
+		goto out;
+	}
+
+	template->lt_shard_batch[template->lt_shard_cnt] = batch;
+	et->et_flags |= LF_SHARDED |
+	    ((uint32_t)template->lt_shard_cnt << LF_SHARD_SHIFT);
+	template->lt_shard_cnt++;
+	kr = KERN_SUCCESS;
+
+out:
+	template_unlock(template);
+
+	return kr;
+}
+
 /*
  * Add a callback to be executed when the resource goes into deficit.
  */
@@ -1824,6 +2080,14 @@ ledger_debit_thread(thread_t thread, ledger_t ledger, int entry, ledger_amount_t
 	} else if (entry_size == sizeof(struct ledger_entry)) {
 		le = ledger_entry_identifier_to_entry(ledger, entry);
 
+		if (le->le_flags & LF_TRACK_CREDIT_ONLY) {
+			if (ledger_entry_shard_update(thread, ledger, entry, le, -amount, 0)) {
+				return KERN_SUCCESS;
+			}
+		} else if (ledger_entry_shard_update(thread, ledger, entry, le, 0, amount)) {
+			return KERN_SUCCESS;
+		}
+
 		if (le->le_flags & LF_TRACK_CREDIT_ONLY) {
 			assert(le->le_debit == 0);
 			old = OSAddAtomic64(-amount, &le->le_credit);
@@ -2036,6 +2300,7 @@ ledger_check_needblock(ledger_t l, uint64_t now)
 		}
 		assert(et->et_size == sizeof(struct ledger_entry));
 		le = (struct ledger_entry *) &l->l_entries[et->et_offset];
+		ledger_entry_shard_fold(l, le);
 
 		TEMPLATE_INUSE(s, template);
 		lc = template->lt_entries[i].et_callback;
@@ -2196,6 +2461,7 @@ ledger_get_entries(ledger_t ledger, int entry, ledger_amount_t *credit,
 	les = &ledger->l_entries[entry_offset];
 	if (entry_size == sizeof(struct ledger_entry)) {
 		le = (struct ledger_entry *)les;
+		ledger_entry_shard_fold(ledger, le);
 		*credit = le->le_credit;
 		*debit = le->le_debit;
 	} else if (entry_size == sizeof(struct ledger_entry_small)) {
@@ -2352,6 +2618,7 @@ ledger_fill_entry_info(ledger_t ledger,
 		lei->lei_last_refill = abstime_to_nsecs(now);
 	} else if (entry_size == sizeof(struct ledger_entry)) {
 		le = (struct ledger_entry *) les;
+		ledger_entry_shard_fold(ledger, le);
 		lei->lei_limit         = le->le_limit;
 		lei->lei_credit        = le->le_credit;
 		lei->lei_debit         = le->le_debit;
@@ -2446,8 +2713,9 @@ ledger_info(task_t task, struct ledger_info *info)
 ledger_amount_t
 ledger_get_remaining(ledger_t ledger, int entry)
 {
-	const struct ledger_entry *le =
-	    ledger_entry_identifier_to_entry(ledger, entry);
+	struct ledger_entry *le = ledger_entry_identifier_to_entry(ledger, entry);
+	ledger_entry_shard_fold(ledger, le);
+
 	const ledger_amount_t limit = le->le_limit;
 	const ledger_amount_t balance = le->le_credit - le->le_debit;
 
@@ -2466,6 +2734,7 @@ ledger_restart(ledger_t ledger, int entry, uint64_t now)
 {
 	struct ledger_entry *le = ledger_entry_identifier_to_entry(ledger, entry);
 
+	ledger_entry_shard_fold(ledger, le);
 	le->le_debit = le->le_credit;
 	le->_le.le_refill.le_last_refill = now;
 }
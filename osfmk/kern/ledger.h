@@ -102,11 +102,28 @@ struct ledger_entry_small {
 	volatile ledger_amount_t les_credit __attribute__((aligned(8)));
 } __attribute__((aligned(8)));
 
+/*
+ * Per-CPU staging area for entries opted in with ledger_track_per_cpu().
+ * Each sharded entry of a template is assigned one of the
+ * LEDGER_SHARDS_MAX slots.
+ */
+#define LEDGER_SHARDS_MAX       4
+
+struct ledger_shard {
+	ledger_amount_t         lsh_credit;
+	ledger_amount_t         lsh_debit;
+};
+
+struct ledger_shards {
+	struct ledger_shard     ls_shards[LEDGER_SHARDS_MAX];
+};
+
 struct ledger {
 	uint64_t                  l_id;
 	os_refcnt_t               l_refs;
 	int32_t                   l_size;
 	struct ledger_template *  l_template;
+	struct ledger_shards *__unsafe_indexable l_shards; /* per-CPU, may be NULL */
 	struct ledger_entry_small l_entries[] __attribute__((aligned(8)));
 };
 #endif /* MACH_KERNEL_PRIVATE */
@@ -163,6 +180,18 @@ extern kern_return_t ledger_panic_on_negative(ledger_template_t template,
     int entry);
 extern kern_return_t ledger_track_credit_only(ledger_template_t template,
     int entry);
+/*
+ * Buffer credits and debits to this entry in per-CPU shards, folding them
+ * into the entry once either side accumulates `batch` on a CPU, or whenever
+ * the entry is read or its limit is checked. The balance observed by limit
+ * and warning checks may lag by at most zpercpu_count() * batch, and
+ * sharding is bypassed entirely once the balance is within that distance
+ * of the limit or warning level. Must be called before the template is
+ * completed, and fails for entries tracking their maximum; ledgers
+ * allocated by the pmap layer are never sharded.
+ */
+extern kern_return_t ledger_track_per_cpu(ledger_template_t template,
+    int entry, ledger_amount_t batch);
 extern int ledger_key_lookup(ledger_template_t template, const char *key);
 
 /*
@@ -276,6 +305,15 @@ extern kern_return_t ledger_set_diag_mem_threshold(ledger_t ledger, int entry,
 extern kern_return_t ledger_set_diag_mem_threshold_disabled(ledger_t ledger, int entry);
 extern kern_return_t ledger_set_diag_mem_threshold_enabled(ledger_t ledger, int entry);
 extern kern_return_t ledger_is_diag_threshold_enabled(ledger_t ledger, int entry, bool *status);
+
+#ifdef XNU_KERNEL_PRIVATE
+#include <kern/counter.h>
+
+/* Updates of sharded entries: kept in a shard, folding a shard, or direct */
+SCALABLE_COUNTER_DECLARE(ledger_shard_staged);
+SCALABLE_COUNTER_DECLARE(ledger_shard_folded);
+SCALABLE_COUNTER_DECLARE(ledger_shard_bypassed);
+#endif /* XNU_KERNEL_PRIVATE */
 #endif // DEBUG || DEVELOPMENT
 
 #endif /* KERNEL_PRIVATE */
@@ -59,6 +59,7 @@
 #include <kern/lock_stat.h>
 #include <kern/locks.h>
 #include <kern/zalloc.h>
+#include <kern/counter.h>
 #include <kern/thread.h>
 #include <kern/processor.h>
 #include <kern/sched_prim.h>
@@ -67,6 +68,30 @@
 #include <machine/machine_cpu.h>
 
 KALLOC_TYPE_DEFINE(KT_LCK_RW, lck_rw_t, KT_PRIV_ACCT);
+ZONE_VIEW_DEFINE(ZV_LCK_RW_BR, "lck_rw_br_readers",
+    .zv_zone = &percpu_u64_zone, sizeof(uint64_t));
+
+/*
+ * Adaptive spinning.
+ *
+ * Waiters spin for MutexSpin before blocking. When the lock is held
+ * exclusively, lck_rw_owner names the holder and the spin is adjusted:
+ * - if the owner runs on another core, it is likely to release the lock
+ *   soon, so spinning is allowed to continue past the base deadline,
+ *   for up to lck_rw_adaptive_spin_mult times MutexSpin;
+ * - if the owner is off core, it will not release the lock before it is
+ *   scheduled again, so waiters stop spinning and block right away.
+ *
+ * Shared holders are anonymous: waits on readers keep the fixed policy.
+ */
+static TUNABLE(bool, lck_rw_adaptive_spin, "lck_rw_adaptive_spin", true);
+static TUNABLE(uint32_t, lck_rw_adaptive_spin_mult, "lck_rw_adaptive_spin_mult", 4);
+
+SCALABLE_COUNTER_DEFINE(lck_rw_adaptive_spin_extended);
+SCALABLE_COUNTER_DEFINE(lck_rw_adaptive_spin_off_core);
+SCALABLE_COUNTER_DEFINE(lck_rw_br_read_fast);
+SCALABLE_COUNTER_DEFINE(lck_rw_br_read_slow);
+SCALABLE_COUNTER_DEFINE(lck_rw_br_write_drain_block);
 
 #define LCK_RW_WRITER_EVENT(lck)                (event_t)((uintptr_t)(lck)+1)
 #define LCK_RW_READER_EVENT(lck)                (event_t)((uintptr_t)(lck)+2)
@@ -650,6 +675,32 @@ lck_interlock_unlock(
 	ml_set_interrupts_enabled(istate);
 }
 
+/*
+ * Returns whether the thread with this ctid is running on a core.
+ */
+static inline bool
+lck_rw_ctid_on_core(uint32_t ctid)
+{
+	thread_t th = ctid_get_thread_unsafe(ctid);
+
+	return th && machine_thread_on_core_allow_invalid(th);
+}
+
+/*
+ * Returns the ctid of the exclusive owner of a sleepable lock
+ * if adaptive spinning applies to it, 0 otherwise.
+ */
+static inline uint32_t
+lck_rw_adaptive_owner(
+	lck_rw_t        *lck,
+	lck_rw_word_t   word)
+{
+	if (!lck_rw_adaptive_spin || !word.can_sleep) {
+		return 0;
+	}
+	return os_atomic_load(&lck->lck_rw_owner, relaxed);
+}
+
 /*
  * compute the deadline to spin against when
  * waiting for a change of state on a lck_rw_t
@@ -659,9 +710,19 @@ lck_rw_deadline_for_spin(
 	lck_rw_t        *lck)
 {
 	lck_rw_word_t   word;
+	uint32_t        owner;
 
 	word.data = ordered_load_rw(lck);
 	if (word.can_sleep) {
+		owner = lck_rw_adaptive_owner(lck, word);
+		if (owner && lck_rw_ctid_on_core(owner)) {
+			/*
+			 * The writer holding the lock is running:
+			 * spin even if others already gave up and blocked,
+			 * the lock is about to be released.
+			 */
+			return mach_absolute_time() + os_atomic_load(&MutexSpin, relaxed);
+		}
 		if (word.r_waiting || word.w_waiting || (word.shared_count > machine_info.max_cpus)) {
 			/*
 			 * there are already threads waiting on this lock... this
@@ -681,6 +742,49 @@ lck_rw_deadline_for_spin(
 	}
 }
 
+/*
+ * Evaluates whether a thread spinning on a lck_rw_t should give up
+ * and return to its caller (which will typically block).
+ *
+ * @c deadline is the value returned by lck_rw_deadline_for_spin()
+ * and is updated when the spin is extended.
+ */
+static inline bool
+lck_rw_spin_should_stop(
+	lck_rw_t        *lck,
+	uint64_t        *deadline,
+	bool            *extended)
+{
+	lck_rw_word_t   word;
+	uint64_t        now = mach_absolute_time();
+	uint32_t        owner;
+
+	word.data = ordered_load_rw(lck);
+	owner = lck_rw_adaptive_owner(lck, word);
+	if (owner == 0) {
+		return now >= *deadline;
+	}
+
+	if (!lck_rw_ctid_on_core(owner)) {
+		counter_inc(&lck_rw_adaptive_spin_off_core);
+		return true;
+	}
+
+	if (now < *deadline) {
+		return false;
+	}
+
+	if (!*extended) {
+		*extended = true;
+		*deadline += os_atomic_load(&MutexSpin, relaxed) *
+		    (lck_rw_adaptive_spin_mult ? lck_rw_adaptive_spin_mult - 1 : 0);
+		counter_inc(&lck_rw_adaptive_spin_extended);
+		return now >= *deadline;
+	}
+
+	return true;
+}
+
 /*
  * This inline is used when busy-waiting for an rw lock.
  * If interrupts were disabled when the lock primitive was called,
@@ -718,6 +822,7 @@ lck_rw_drain_status(
 	uint64_t        deadline = 0;
 	uint32_t        data;
 	boolean_t       istate = FALSE;
+	bool            extended = false;
 
 	if (wait) {
 		deadline = lck_rw_deadline_for_spin(lock);
@@ -744,7 +849,7 @@ lck_rw_drain_status(
 
 		lck_rw_lock_pause(istate);
 
-		if (mach_absolute_time() >= deadline) {
+		if (lck_rw_spin_should_stop(lock, &deadline, &extended)) {
 			return LCK_RW_DRAIN_S_TIMED_OUT;
 		}
 
@@ -803,6 +908,7 @@ lck_rw_grab(
 	uint64_t        deadline = 0;
 	uint32_t        data, prev;
 	boolean_t       do_exch, istate = FALSE;
+	bool            extended = false;
 
 	assert3u(flags & ~(LCK_RW_GRAB_F_WANT_EXCL | LCK_RW_GRAB_F_WAIT), ==, 0);
 
@@ -845,7 +951,7 @@ lck_rw_grab(
 
 			lck_rw_lock_pause(istate);
 
-			if (mach_absolute_time() >= deadline) {
+			if (lck_rw_spin_should_stop(lock, &deadline, &extended)) {
 				return LCK_RW_GRAB_S_TIMED_OUT;
 			}
 			if (lock_pause && lock_pause()) {
@@ -2763,6 +2869,169 @@ lck_rw_sleep_deadline(
 	return res;
 }
 
+/*
+ * Big reader locks
+ *
+ * Readers announce themselves by incrementing the slot of the CPU they run
+ * on in lbr_readers, then check lbr_writer. Writers serialize on lbr_rw,
+ * set lbr_writer, then wait for the sum of all slots to drop to 0.
+ *
+ * Both sides publish their store before observing the other side's
+ * (with a full barrier in between), which guarantees that either the
+ * reader sees the writer and backs off, or the writer sees the reader
+ * and waits for it.
+ *
+ * Readers that back off take lbr_rw shared, which blocks until the writer
+ * is done, then account for themselves in the per-CPU counters: all shared
+ * holders are released the same way regardless of how they acquired it.
+ *
+ * A reader may release the lock on a different CPU than it took it:
+ * individual slots can wrap around, only their sum is meaningful.
+ */
+#define LCK_RW_BR_DRAIN_EVENT(lck)      ((event_t)&(lck)->lbr_writer)
+
+static uint64_t
+lck_rw_br_readers(lck_rw_br_t *lck)
+{
+	uint64_t readers = 0;
+
+	zpercpu_foreach(it, lck->lbr_readers) {
+		readers += os_atomic_load_wide(it, relaxed);
+	}
+	return readers;
+}
+
+void
+lck_rw_br_init(
+	lck_rw_br_t     *lck,
+	lck_grp_t       *grp,
+	lck_attr_t      *attr)
+{
+	lck_rw_init(&lck->lbr_rw, grp, attr);
+	lck->lbr_writer = 0;
+	lck->lbr_readers = zalloc_percpu(ZV_LCK_RW_BR, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+}
+
+void
+lck_rw_br_destroy(
+	lck_rw_br_t     *lck,
+	lck_grp_t       *grp)
+{
+	if (lck->lbr_writer || lck_rw_br_readers(lck)) {
+		panic("Destroying big reader lock %p which is held", lck);
+	}
+	zfree_percpu(ZV_LCK_RW_BR, lck->lbr_readers);
+	lck->lbr_readers = NULL;
+	lck_rw_destroy(&lck->lbr_rw, grp);
+}
+
+void
+lck_rw_br_lock_shared(
+	lck_rw_br_t     *lck)
+{
+	thread_t thread = current_thread();
+	uint64_t *readers;
+
+	lck_rw_lock_count_inc(thread, lck);
+
+	disable_preemption();
+	readers = zpercpu_get(lck->lbr_readers);
+	os_atomic_inc(readers, relaxed);
+	os_atomic_thread_fence(seq_cst);
+	if (__probable(os_atomic_load(&lck->lbr_writer, relaxed) == 0)) {
+		counter_inc_preemption_disabled(&lck_rw_br_read_fast);
+		enable_preemption();
+		return;
+	}
+
+	/*
+	 * A writer is active: back off from the slot we incremented
+	 * before we can migrate, and wait for the writer to be done.
+	 * The writer may have observed our increment already.
+	 */
+	os_atomic_dec(readers, release);
+	thread_wakeup(LCK_RW_BR_DRAIN_EVENT(lck));
+	enable_preemption();
+
+	lck_rw_lock_shared(&lck->lbr_rw);
+	disable_preemption();
+	os_atomic_inc(zpercpu_get(lck->lbr_readers), relaxed);
+	counter_inc_preemption_disabled(&lck_rw_br_read_slow);
+	enable_preemption();
+	lck_rw_unlock_shared(&lck->lbr_rw);
+}
+
+void
+lck_rw_br_unlock_shared(
+	lck_rw_br_t     *lck)
+{
+	disable_preemption();
+	os_atomic_dec(zpercpu_get(lck->lbr_readers), release);
+	enable_preemption();
+
+	os_atomic_thread_fence(seq_cst);
+	if (__improbable(os_atomic_load(&lck->lbr_writer, relaxed))) {
+		thread_wakeup(LCK_RW_BR_DRAIN_EVENT(lck));
+	}
+
+	lck_rw_lock_count_dec(current_thread(), lck);
+}
+
+void
+lck_rw_br_lock_exclusive(
+	lck_rw_br_t     *lck)
+{
+	uint64_t deadline;
+	boolean_t istate = FALSE;
+
+	lck_rw_lock_exclusive(&lck->lbr_rw);
+
+	os_atomic_store(&lck->lbr_writer, 1, relaxed);
+	os_atomic_thread_fence(seq_cst);
+
+	if (lck_rw_br_readers(lck) == 0) {
+		os_atomic_thread_fence(acquire);
+		return;
+	}
+
+#if __x86_64__
+	istate = ml_get_interrupts_enabled();
+#endif
+	/*
+	 * Readers are usually short lived: spin for a while
+	 * before sleeping, like for regular lck_rw_t.
+	 */
+	deadline = mach_absolute_time() + os_atomic_load(&MutexSpin, relaxed);
+	while (mach_absolute_time() < deadline) {
+		lck_rw_lock_pause(istate);
+		if (lck_rw_br_readers(lck) == 0) {
+			os_atomic_thread_fence(acquire);
+			return;
+		}
+	}
+
+	counter_inc(&lck_rw_br_write_drain_block);
+	for (;;) {
+		thread_set_pending_block_hint(current_thread(), kThreadWaitKernelRWLockWrite);
+		assert_wait(LCK_RW_BR_DRAIN_EVENT(lck),
+		    THREAD_UNINT | THREAD_WAIT_NOREPORT_USER);
+		if (lck_rw_br_readers(lck) == 0) {
+			clear_wait(current_thread(), THREAD_AWAKENED);
+			break;
+		}
+		thread_block(THREAD_CONTINUE_NULL);
+	}
+	os_atomic_thread_fence(acquire);
+}
+
+void
+lck_rw_br_unlock_exclusive(
+	lck_rw_br_t     *lck)
+{
+	os_atomic_store(&lck->lbr_writer, 0, release);
+	lck_rw_unlock_exclusive(&lck->lbr_rw);
+}
+
 /*
  * Reader-writer lock promotion
  *
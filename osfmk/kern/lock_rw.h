@@ -668,6 +668,112 @@ extern bool             lck_rw_lock_would_yield_exclusive(
 	lck_rw_t                *lck,
 	lck_rw_yield_t          mode);
 
+/*
+ * Big reader locks
+ * ----------------
+ *
+ * A big reader lock is a read-write lock optimized for read-mostly traffic:
+ * readers only touch a per-CPU counter and never write to a shared
+ * cache line, while writers pay for a scan of all CPUs.
+ *
+ * Readers are allowed to block while holding the lock, and may drop it
+ * from a different CPU than the one they acquired it on.
+ *
+ * Shared holds are not recursive, and there is no upgrade or downgrade.
+ */
+typedef struct lck_rw_br {
+	lck_rw_t                lbr_rw;         /* writers, and readers racing with them */
+	uint32_t                lbr_writer;     /* a writer holds or is draining the lock */
+	uint64_t *__unsafe_indexable lbr_readers; /* per-CPU count of fast path readers */
+} lck_rw_br_t;
+
+/*!
+ * @function lck_rw_br_init
+ *
+ * @abstract
+ * Initializes a big reader lock.
+ *
+ * @discussion
+ * This function can block, and allocates per-CPU memory
+ * which is freed by lck_rw_br_destroy().
+ *
+ * @param lck           lock to initialize.
+ * @param grp           lock group to associate with the lock.
+ * @param attr          lock attribute to initialize the lock.
+ */
+extern void             lck_rw_br_init(
+	lck_rw_br_t             *lck,
+	lck_grp_t               *grp,
+	lck_attr_t              *attr);
+
+/*!
+ * @function lck_rw_br_destroy
+ *
+ * @abstract
+ * Destroys a big reader lock previously initialized with lck_rw_br_init().
+ *
+ * @discussion
+ * The lock must be not held by any thread.
+ *
+ * @param lck           lock to destroy.
+ * @param grp           lock group the lock was initialized with.
+ */
+extern void             lck_rw_br_destroy(
+	lck_rw_br_t             *lck,
+	lck_grp_t               *grp);
+
+/*!
+ * @function lck_rw_br_lock_shared
+ *
+ * @abstract
+ * Locks a big reader lock in shared mode.
+ *
+ * @discussion
+ * This function can block if a writer holds, or is waiting for, the lock.
+ * When there are no writers it only increments a per-CPU counter.
+ *
+ * @param lck           lock to lock.
+ */
+extern void             lck_rw_br_lock_shared(
+	lck_rw_br_t             *lck);
+
+/*!
+ * @function lck_rw_br_unlock_shared
+ *
+ * @abstract
+ * Unlocks a big reader lock held in shared mode.
+ *
+ * @param lck           lock to unlock.
+ */
+extern void             lck_rw_br_unlock_shared(
+	lck_rw_br_t             *lck);
+
+/*!
+ * @function lck_rw_br_lock_exclusive
+ *
+ * @abstract
+ * Locks a big reader lock in exclusive mode.
+ *
+ * @discussion
+ * This function can block, and waits for all the readers
+ * currently holding the lock to drop it.
+ *
+ * @param lck           lock to lock.
+ */
+extern void             lck_rw_br_lock_exclusive(
+	lck_rw_br_t             *lck);
+
+/*!
+ * @function lck_rw_br_unlock_exclusive
+ *
+ * @abstract
+ * Unlocks a big reader lock held in exclusive mode.
+ *
+ * @param lck           lock to unlock.
+ */
+extern void             lck_rw_br_unlock_exclusive(
+	lck_rw_br_t             *lck);
+
 #endif /* XNU_KERNEL_PRIVATE */
 
 #if MACH_KERNEL_PRIVATE
@@ -32,6 +32,7 @@
 #include <machine/atomic.h>
 #include <kern/lock_group.h>
 #include <kern/lock_mtx.h>
+#include <kern/counter.h>
 
 __BEGIN_DECLS
 #pragma GCC visibility push(hidden)
@@ -101,6 +102,25 @@ enum lockstat_probe_id {
 	LS_NPROBES
 };
 
+/*
+ * Global lck_rw_t contention statistics, exported as debug.lck_rw_* sysctls
+ * on DEVELOPMENT and DEBUG kernels.
+ *
+ * - lck_rw_adaptive_spin_extended: a waiter kept spinning past the base spin
+ *   window because the exclusive owner was running on another core,
+ * - lck_rw_adaptive_spin_off_core: a waiter stopped spinning early because
+ *   the exclusive owner was not running,
+ * - lck_rw_br_read_fast / lck_rw_br_read_slow: big reader lock shared
+ *   acquisitions that did / did not avoid the shared lck_rw_t,
+ * - lck_rw_br_write_drain_block: big reader lock writers which had to block
+ *   waiting for readers to drain.
+ */
+SCALABLE_COUNTER_DECLARE(lck_rw_adaptive_spin_extended);
+SCALABLE_COUNTER_DECLARE(lck_rw_adaptive_spin_off_core);
+SCALABLE_COUNTER_DECLARE(lck_rw_br_read_fast);
+SCALABLE_COUNTER_DECLARE(lck_rw_br_read_slow);
+SCALABLE_COUNTER_DECLARE(lck_rw_br_write_drain_block);
+
 #if CONFIG_DTRACE
 /*
  * Time threshold before dtrace lockstat spin
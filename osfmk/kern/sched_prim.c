@@ -83,6 +83,7 @@
 #include <kern/kern_types.h>
 #include <kern/backtrace.h>
 #include <kern/clock.h>
+#include <kern/counter.h>
 #include <kern/cpu_number.h>
 #include <kern/cpu_data.h>
 #include <kern/smp.h>
@@ -136,6 +137,20 @@
 struct sched_statistics PERCPU_DATA(sched_stats);
 bool sched_stats_active;
 
+/*
+ * IPIs held back by sched_ipi_batch_begin() on this processor,
+ * at most one per destination processor.
+ */
+struct sched_ipi_batch {
+	uint32_t                sib_depth;
+	bitmap_t                sib_pending[BITMAP_LEN(MAX_SCHED_CPUS)];
+	uint8_t                 sib_type[MAX_SCHED_CPUS];
+};
+static struct sched_ipi_batch PERCPU_DATA(sched_ipi_batch);
+
+TUNABLE(bool, sched_ipi_batching, "sched_ipi_batching", true);
+SCALABLE_COUNTER_DEFINE(sched_ipi_batch_coalesced);
+
 static uint64_t
 deadline_add(uint64_t d, uint64_t e)
 {
@@ -5140,9 +5155,95 @@ sched_ipi_policy(processor_t dst, thread_t thread, boolean_t dst_idle, sched_ipi
 	return ipi_type;
 }
 
+/*
+ * Wakeup batching
+ *
+ * Waking up many threads at once (waitq broadcasts, semaphore_signal_all,
+ * ...) used to send one IPI per woken thread, even when several of them
+ * were dispatched to the same processor. Between sched_ipi_batch_begin()
+ * and sched_ipi_batch_end(), IPIs that the current processor would send
+ * from thread context are instead coalesced per destination and sent once
+ * at the end of the batch, and idle processors of the waker's own cluster
+ * are preferred as the starting point for the threads being dispatched.
+ *
+ * The batch is per processor, so sched_ipi_batch_begin() disables
+ * preemption until the matching sched_ipi_batch_end(). IPIs sent from
+ * interrupt context are never held back.
+ */
+static inline bool
+sched_ipi_batch_active(void)
+{
+	return PERCPU_GET(sched_ipi_batch)->sib_depth != 0 &&
+	       !ml_at_interrupt_context();
+}
+
+void
+sched_ipi_batch_begin(void)
+{
+	disable_preemption();
+
+	if (sched_ipi_batching) {
+		PERCPU_GET(sched_ipi_batch)->sib_depth++;
+	}
+}
+
+void
+sched_ipi_batch_end(void)
+{
+	struct sched_ipi_batch *sib = PERCPU_GET(sched_ipi_batch);
+	int cpu;
+
+	if (sched_ipi_batching) {
+		assert(sib->sib_depth > 0);
+		if (--sib->sib_depth == 0) {
+			while ((cpu = bitmap_first(sib->sib_pending,
+			    MAX_SCHED_CPUS)) >= 0) {
+				bitmap_clear(sib->sib_pending, cpu);
+				sched_ipi_perform(processor_array[cpu],
+				    sib->sib_type[cpu]);
+			}
+		}
+	}
+
+	enable_preemption();
+}
+
+/*
+ * Hold back an IPI while a batch is active on this processor,
+ * merging it with the one already pending for this destination:
+ * a deferred IPI is upgraded by any other kind, otherwise the
+ * latest decision wins as it reflects the latest processor state.
+ */
+static bool
+sched_ipi_batch_add(processor_t dst, sched_ipi_type_t ipi)
+{
+	struct sched_ipi_batch *sib;
+
+	if (!sched_ipi_batch_active()) {
+		return false;
+	}
+
+	sib = PERCPU_GET(sched_ipi_batch);
+	if (!bitmap_test(sib->sib_pending, dst->cpu_id)) {
+		bitmap_set(sib->sib_pending, dst->cpu_id);
+		sib->sib_type[dst->cpu_id] = (uint8_t)ipi;
+		return true;
+	}
+
+	counter_inc_preemption_disabled(&sched_ipi_batch_coalesced);
+	if (ipi != SCHED_IPI_DEFERRED) {
+		sib->sib_type[dst->cpu_id] = (uint8_t)ipi;
+	}
+	return true;
+}
+
 void
 sched_ipi_perform(processor_t dst, sched_ipi_type_t ipi)
 {
+	if (ipi != SCHED_IPI_NONE && sched_ipi_batch_add(dst, ipi)) {
+		return;
+	}
+
 	switch (ipi) {
 	case SCHED_IPI_NONE:
 		break;
@@ -6284,7 +6385,15 @@ choose_starting_pset(pset_node_t node, thread_t thread, processor_t *processor_h
 	} else {
 		pset_map_t idle_map = atomic_load(&node->pset_idle_map);
 		if (!bit_test(idle_map, pset->pset_id)) {
+			processor_set_t waker_pset = current_processor()->processor_set;
 			int next_idle_pset_id = lsb_first(idle_map);
+
+			/* batched wakeups stay in the waker's cluster if it has idle cores */
+			if (sched_ipi_batch_active() &&
+			    bit_test(idle_map, waker_pset->pset_id) &&
+			    waker_pset->pset_cluster_type == pset->pset_cluster_type) {
+				next_idle_pset_id = waker_pset->pset_id;
+			}
 			if (next_idle_pset_id >= 0) {
 				pset = pset_array[next_idle_pset_id];
 			}
@@ -416,6 +416,14 @@ typedef enum {
 extern sched_ipi_type_t sched_ipi_action(processor_t dst, thread_t thread, sched_ipi_event_t event);
 extern void sched_ipi_perform(processor_t dst, sched_ipi_type_t ipi);
 
+/*
+ * Coalesce the IPIs sent by sched_ipi_perform() on the current processor
+ * until sched_ipi_batch_end(), sending at most one per destination.
+ * Preemption is disabled for the duration of the batch; batches nest.
+ */
+extern void sched_ipi_batch_begin(void);
+extern void sched_ipi_batch_end(void);
+
 /* sched_ipi_policy() is the global default IPI policy for all schedulers */
 extern sched_ipi_type_t sched_ipi_policy(processor_t dst, thread_t thread,
     boolean_t dst_idle, sched_ipi_event_t event);
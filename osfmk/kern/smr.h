@@ -1106,6 +1106,22 @@ extern struct smr smr_system_sleepable;
 #define smr_oslog_barrier()             smr_barrier(&smr_oslog)
 
 
+/*!
+ * @macro smr_inpcb
+ *
+ * @brief
+ * The SMR domain for the hash chains of the network protocol control blocks.
+ */
+#define smr_inpcb                       smr_system
+#define smr_inpcb_entered()             smr_entered(&smr_inpcb)
+#define smr_inpcb_enter()               smr_enter(&smr_inpcb)
+#define smr_inpcb_leave()               smr_leave(&smr_inpcb)
+
+#define smr_inpcb_call(n, sz, cb)       smr_call(&smr_inpcb, n, sz, cb)
+#define smr_inpcb_synchronize()         smr_synchronize(&smr_inpcb)
+#define smr_inpcb_barrier()             smr_barrier(&smr_inpcb)
+
+
 #pragma mark XNU only: implementation details
 
 extern void __smr_domain_init(smr_t);
@@ -161,7 +161,11 @@ const mach_trap_t       mach_trap_table[MACH_TRAP_TABLE_COUNT] = {
 /* 51 */ MACH_TRAP(macx_triggers, 4, 4, munge_wwww),
 /* 52 */ MACH_TRAP(macx_backing_store_suspend, 1, 1, munge_w),
 /* 53 */ MACH_TRAP(macx_backing_store_recovery, 1, 1, munge_w),
-/* 54 */ MACH_TRAP(kern_invalid, 0, 0, NULL),
+#if defined(__LP64__) || defined(__arm64__)
+/* 54 */ MACH_TRAP(mach_msg_batch_trap, 6, 12, munge_llllll),
+#else
+/* 54 */ MACH_TRAP(kern_invalid, 0, 0, NULL), /* Do not take */
+#endif
 /* 55 */ MACH_TRAP(kern_invalid, 0, 0, NULL),
 /* 56 */ MACH_TRAP(kern_invalid, 0, 0, NULL),
 /* 57 */ MACH_TRAP(kern_invalid, 0, 0, NULL),
@@ -297,7 +301,11 @@ const char * const mach_syscall_name_table[MACH_TRAP_TABLE_COUNT] = {
 /* 51 */ "macx_triggers",
 /* 52 */ "macx_backing_store_suspend",
 /* 53 */ "macx_backing_store_recovery",
+#if defined(__LP64__) || defined(__arm64__)
+/* 54 */ "mach_msg_batch_trap",
+#else
 /* 54 */ "kern_invalid",
+#endif
 /* 55 */ "kern_invalid",
 /* 56 */ "kern_invalid",
 /* 57 */ "kern_invalid",
@@ -1420,6 +1420,12 @@ init_task_ledgers(void)
 	ledger_track_maximum(t, task_ledgers.reusable, 60);
 	ledger_track_maximum(t, task_ledgers.external, 60);
 	ledger_track_maximum(t, task_ledgers.neural_nofootprint_total, 60);
+
+	/*
+	 * Every thread of a task charges cpu_time on context switches: stage
+	 * it per-CPU rather than bouncing the entry between cores.
+	 */
+	ledger_track_per_cpu(t, task_ledgers.cpu_time, NSEC_PER_MSEC);
 #if MACH_ASSERT
 	if (pmap_ledgers_panic) {
 		ledger_panic_on_negative(t, task_ledgers.phys_footprint);
@@ -91,6 +91,24 @@
  */
 static TUNABLE(uint32_t, waitq_set_unlink_batch, "waitq_set_unlink_batch", 64);
 
+/*!
+ * @var waitq_set_prepost_skip
+ *
+ * @brief
+ * How many contended preposted queues a port-set receive skips over
+ * before it waits for the lock of the first one.
+ *
+ * @discussion
+ * When many threads receive on a busy port set, they all go for the
+ * first preposted port, and serialize on its lock behind the senders
+ * and the receiver already dequeuing from it.
+ *
+ * Instead, a receiver moves a contended port to the back of the
+ * prepost list and tries the next one, which spreads concurrent
+ * receivers over the ready ports of the set.
+ */
+static TUNABLE(uint32_t, waitq_set_prepost_skip, "waitq_set_prepost_skip", 8);
+
 /*!
  * @const WQL_PREPOST_MARKER
  *
@@ -891,6 +909,14 @@ TUNABLE_DEV_WRITEABLE(uint32_t, waitq_flush_excess_time_mt, "waitq_flush_excess_
 
 #endif /* SCHED_HYGIENE_DEBUG */
 
+/*
+ * Threads woken together are dispatched under a scheduler IPI batch
+ * (see sched_ipi_batch_begin()), so that a broadcast sends at most one
+ * IPI per target processor. The batch is flushed every
+ * WAITQ_FLUSH_IPI_BATCH threads so that the first threads woken
+ * don't wait for the whole queue to be dispatched.
+ */
+#define WAITQ_FLUSH_IPI_BATCH   16
 
 static void
 waitq_select_queue_flush(waitq_t waitq, struct waitq_select_args *args)
@@ -900,12 +926,18 @@ waitq_select_queue_flush(waitq_t waitq, struct waitq_select_args *args)
 	assert(!circle_queue_empty(&args->threadq));
 
 	int flushed_threads = 0;
+	bool batch = circle_queue_first(&args->threadq) !=
+	    circle_queue_last(&args->threadq);
 
 #if SCHED_HYGIENE_DEBUG
 	uint64_t start_time = ml_get_sched_hygiene_timebase();
 	disable_preemption();
 #endif /* SCHED_HYGIENE_DEBUG */
 
+	if (batch) {
+		sched_ipi_batch_begin();
+	}
+
 	cqe_foreach_element_safe(thread, &args->threadq, wait_links) {
 		circle_dequeue(&args->threadq, &thread->wait_links);
 		assert_thread_magic(thread);
@@ -920,6 +952,14 @@ waitq_select_queue_flush(waitq_t waitq, struct waitq_select_args *args)
 		splx(s);
 
 		flushed_threads++;
+		if (batch && flushed_threads % WAITQ_FLUSH_IPI_BATCH == 0) {
+			sched_ipi_batch_end();
+			sched_ipi_batch_begin();
+		}
+	}
+
+	if (batch) {
+		sched_ipi_batch_end();
 	}
 
 #if SCHED_HYGIENE_DEBUG
@@ -2007,6 +2047,7 @@ waitq_set_first_prepost(struct waitq_set *wqset, wqs_prepost_flags_t flags)
 	struct waitq_link *link;
 	struct waitq *wq;
 	uint32_t ticket;
+	uint32_t skips = 0;
 
 	if (__improbable(!waitq_valid(wqset))) {
 		return NULL;
@@ -2017,7 +2058,19 @@ waitq_set_first_prepost(struct waitq_set *wqset, wqs_prepost_flags_t flags)
 		link = cqe_element(elt, struct waitq_link, wql_slink);
 		wq   = link->wql_wq;
 
-		if (__improbable(!waitq_lock_reserve(wq, &ticket))) {
+		if (waitq_lock_try(wq)) {
+			/* fast path */
+		} else if ((flags & WQS_PREPOST_PEEK) == 0 &&
+		    skips < waitq_set_prepost_skip &&
+		    elt != circle_queue_last(q)) {
+			/*
+			 * Someone else is busy with this queue,
+			 * give it to them and try the next one.
+			 */
+			circle_queue_rotate_head_forward(q);
+			skips++;
+			continue;
+		} else if (__improbable(!waitq_lock_reserve(wq, &ticket))) {
 			waitq_unlock(wqset);
 			waitq_lock_wait(wq, ticket);
 			waitq_lock(wqset);
@@ -997,6 +997,10 @@ __options_decl(wqs_prepost_flags_t, uint32_t, {
  * @discussion
  * The @c wqset lock might be dropped and reacquired during this call.
  *
+ * Unless @c WQS_PREPOST_PEEK is set, preposted wait queues whose lock
+ * is contended may be skipped and moved to the end of the prepost list,
+ * so that concurrent receivers pick different wait queues.
+ *
  * @param wqset         the port-set wait queue set to unlink, must be locked.
  * @param flags
  *     - if @c WQS_PREPOST_LOCK is set, the returned wait queue is locked
@@ -69,6 +69,44 @@ __options_decl(mach_eventlink_signal_wait_option_t, uint32_t, {
 #define decode_eventlink_error_from_retval(retval) \
 	((kern_return_t)(((retval) >> EVENTLINK_SIGNAL_ERROR_SHIFT) & EVENTLINK_SIGNAL_ERROR_MASK))
 
+/*
+ * Shared memory ring attached to an eventlink pair by mach_eventlink_ring_map().
+ *
+ * The mapping starts with one mach_eventlink_ring_header_t per eventlink of
+ * the pair, followed by one data area per eventlink, each of
+ * MACH_EVENTLINK_RING_DATA_SIZE(size) bytes.  The data area at index i is
+ * written by the holder of eventlink i and read by its peer, and the header
+ * at index i describes it.
+ *
+ * Records are a 32-bit length followed by the payload, padded to 8 bytes.
+ * A record never wraps around the end of the data area: the producer writes
+ * a MACH_EVENTLINK_RING_WRAP length and restarts at offset 0 instead.
+ *
+ * melr_head and melr_tail are free running byte counts.  The consumer sets
+ * melr_waiting before it blocks in mach_eventlink_wait_until(), and the
+ * producer signals the eventlink after publishing a record only if it finds
+ * it set, so that a ring with an active consumer needs no trap at all.
+ */
+typedef struct mach_eventlink_ring_header {
+	uint64_t        melr_tail;              /* written by the producer */
+	uint64_t        melr_reserved0[15];
+	uint64_t        melr_head;              /* written by the consumer */
+	uint32_t        melr_waiting;           /* consumer is about to block */
+	uint32_t        melr_reserved1[29];
+} mach_eventlink_ring_header_t;
+
+#define MACH_EVENTLINK_RING_MIN_SIZE    (16ull << 10)
+#define MACH_EVENTLINK_RING_MAX_SIZE    (64ull << 20)
+#define MACH_EVENTLINK_RING_WRAP        UINT32_MAX
+
+#define MACH_EVENTLINK_RING_DATA_OFFSET \
+	(2 * sizeof(mach_eventlink_ring_header_t))
+#define MACH_EVENTLINK_RING_DATA_SIZE(size) \
+	((((size) - MACH_EVENTLINK_RING_DATA_OFFSET) / 2) & ~7ull)
+/* largest payload that is guaranteed to eventually fit in the ring */
+#define MACH_EVENTLINK_RING_MSG_MAX(size) \
+	((uint32_t)(MACH_EVENTLINK_RING_DATA_SIZE(size) / 2 - sizeof(uint64_t)))
+
 #ifndef KERNEL
 kern_return_t
 mach_eventlink_signal(
@@ -92,6 +130,77 @@ mach_eventlink_signal_wait_until(
 	kern_clock_id_t                      clock_id,
 	uint64_t                             deadline);
 
+/*
+ * Userspace handle on the ring of an eventlink, see mach_eventlink_ring_attach().
+ */
+typedef struct mach_eventlink_ring {
+	mach_port_t                     mer_port;
+	uint32_t                        mer_index;
+	mach_vm_address_t               mer_address;
+	mach_vm_size_t                  mer_size;
+	uint64_t                        mer_wait_count;
+} *mach_eventlink_ring_t;
+
+/*
+ * Maps the ring shared by the eventlink pair in the calling task.
+ * The first side to attach sets the ring size, the peer may pass 0.
+ */
+kern_return_t
+mach_eventlink_ring_attach(
+	mach_port_t                          eventlink_port,
+	mach_vm_size_t                       size,
+	mach_eventlink_ring_t                ring);
+
+kern_return_t
+mach_eventlink_ring_detach(
+	mach_eventlink_ring_t                ring);
+
+/*
+ * Copies a message into the ring and wakes up the peer if it is blocked.
+ *
+ * The ring only carries plain data: messages with port rights or out of line
+ * memory must be sent with mach_msg().  Returns KERN_NO_SPACE when the ring
+ * is full, and KERN_INVALID_ARGUMENT for messages larger than
+ * MACH_EVENTLINK_RING_MSG_MAX(), which callers can send with mach_msg()
+ * instead.
+ */
+kern_return_t
+mach_eventlink_ring_send(
+	mach_eventlink_ring_t                ring,
+	const void                           *data,
+	uint32_t                             size);
+
+/*
+ * Dequeues the next message sent by the peer, blocking on the eventlink
+ * until one arrives or the deadline passes.  The calling thread must be
+ * associated with the eventlink.  On KERN_INSUFFICIENT_BUFFER_SIZE, *size_ptr
+ * is set to the size of the message, which is left in the ring.
+ */
+kern_return_t
+mach_eventlink_ring_receive(
+	mach_eventlink_ring_t                ring,
+	void                                 *buffer,
+	uint32_t                             *size_ptr,
+	mach_eventlink_signal_wait_option_t  option,
+	kern_clock_id_t                      clock_id,
+	uint64_t                             deadline);
+
+/*
+ * mach_eventlink_ring_send() followed by mach_eventlink_ring_receive(), which
+ * hands the CPU off to the peer with mach_eventlink_signal_wait_until() when
+ * it needs to be woken up.
+ */
+kern_return_t
+mach_eventlink_ring_send_receive(
+	mach_eventlink_ring_t                ring,
+	const void                           *data,
+	uint32_t                             size,
+	void                                 *buffer,
+	uint32_t                             *size_ptr,
+	mach_eventlink_signal_wait_option_t  option,
+	kern_clock_id_t                      clock_id,
+	uint64_t                             deadline);
+
 #endif
 
 #endif  /* _MACH_EVENTLINK_TYPES_H_ */
@@ -112,6 +112,14 @@ extern mach_msg_return_t mach_msg2_trap(
 	uint64_t desc_count_and_rcv_name,
 	uint64_t rcv_size_and_priority,
 	uint64_t timeout);
+
+extern mach_msg_return_t mach_msg_batch_trap(
+	mach_msg_batch_entry_t *entries,
+	mach_msg_option64_t options,
+	uint64_t count_and_rcv_name,
+	uint64_t timeout,
+	uint64_t priority,
+	mach_msg_size_t *processed);
 #endif
 
 extern mach_msg_return_t mach_msg_overwrite_trap(
@@ -475,6 +483,18 @@ struct mach_msg2_trap_args {
 
 extern mach_msg_return_t mach_msg2_trap(
 	struct mach_msg2_trap_args *args);
+
+struct mach_msg_batch_trap_args {
+	PAD_ARG_(mach_vm_address_t, entries);
+	PAD_ARG_(mach_msg_option64_t, options);
+	PAD_ARG_(uint64_t, count_and_rcv_name);
+	PAD_ARG_(uint64_t, timeout);
+	PAD_ARG_(uint64_t, priority);
+	PAD_ARG_(mach_vm_address_t, processed);
+};
+
+extern mach_msg_return_t mach_msg_batch_trap(
+	struct mach_msg_batch_trap_args *args);
 #endif
 
 struct semaphore_signal_trap_args {
@@ -628,6 +628,28 @@ typedef struct {
 	uint32_t                        msgdh_reserved; /* For future */
 } mach_msg_aux_header_t;
 
+/* maximum number of messages a mach_msg_batch() call can process */
+#define MACH_MSG_BATCH_MAX_COUNT        32
+
+typedef struct {
+	/* a mach_msg_header_t*: the message to send, or the receive buffer */
+	mach_vm_address_t               msgb_data;
+	/* size of the message to send, or of the receive buffer */
+	mach_msg_size_t                 msgb_size;
+	/* out: result of the send or receive for this entry */
+	mach_msg_return_t               msgb_return;
+	/*
+	 * sends only: the header of the message, used instead of the one
+	 * in the msgb_data buffer, like mach_msg2() passes it to the trap
+	 */
+	mach_msg_bits_t                 msgb_bits;
+	mach_port_name_t                msgb_remote_port;
+	mach_port_name_t                msgb_local_port;
+	mach_port_name_t                msgb_voucher_port;
+	mach_msg_id_t                   msgb_id;
+	uint32_t                        msgb_reserved;
+} mach_msg_batch_entry_t;
+
 #endif /* PRIVATE */
 
 #define msgh_reserved                 msgh_voucher_port
@@ -1526,6 +1548,46 @@ mach_msg2(
 	           MACH_MSG2_SHIFT_ARGS(rcv_size, priority), timeout);
 #undef MACH_MSG2_SHIFT_ARGS
 }
+
+/*
+ *	Routine:	mach_msg_batch
+ *	Purpose:
+ *		Send, or receive, up to MACH_MSG_BATCH_MAX_COUNT messages
+ *		in a single trap.
+ *
+ *		option64 must have exactly one of MACH64_SEND_MSG or
+ *		MACH64_RCV_MSG set, and applies to every entry, as do
+ *		timeout, priority (sends) and rcv_name (receives).
+ *		Vector messages and MACH64_RCV_SYNC_WAIT aren't supported.
+ *
+ *		Sends go out in order and stop after the first message that
+ *		fails to send. The header of each message is taken from the
+ *		msgb_bits, msgb_remote_port, msgb_local_port, msgb_voucher_port
+ *		and msgb_id fields of its entry, which mach_msg_batch() fills
+ *		in from the header in the msgb_data buffer.
+ *
+ *		Receives wait, up to the timeout, for the first message,
+ *		then only pick up messages that are already queued, and stop
+ *		once the queue is empty, or at the first message that doesn't
+ *		fit in the smallest receive buffer of the remaining entries
+ *		(it stays queued). If the port dies or its receive right moves
+ *		meanwhile, the next entry reports MACH_RCV_PORT_DIED or
+ *		MACH_RCV_PORT_CHANGED.
+ *
+ *		On return, *processed holds the number of entries that were
+ *		sent, or received into, and each of them has its own result
+ *		in msgb_return. The call returns MACH_MSG_SUCCESS if all of
+ *		them succeeded, and the first error otherwise.
+ */
+__IOS_PROHIBITED __WATCHOS_PROHIBITED __TVOS_PROHIBITED
+extern mach_msg_return_t mach_msg_batch(
+	mach_msg_batch_entry_t *entries,
+	mach_msg_size_t count,
+	mach_msg_option64_t option64,
+	mach_port_name_t rcv_name,
+	uint64_t timeout,
+	mach_msg_priority_t priority,
+	mach_msg_size_t *processed);
 #endif
 #endif /* PRIVATE */
 
@@ -140,6 +140,10 @@ kernel_trap(macx_triggers,-51, 4)
 kernel_trap(macx_backing_store_suspend,-52, 1)
 kernel_trap(macx_backing_store_recovery,-53, 1)
 
+#if defined(__LP64__) || defined(__arm64__)
+kernel_trap(mach_msg_batch_trap, -54, 6)
+#endif
+
 /* These are currently used by pthreads even on LP64 */
 /* But as soon as that is fixed - they will go away there */
 kernel_trap(swtch_pri,-59,1)
@@ -115,6 +115,8 @@ extern kern_return_t arm64_speculation_guard_test(void);
 #endif /* __arm64__ */
 
 extern kern_return_t test_thread_call(void);
+extern kern_return_t lck_rw_contention_test(void);
+extern kern_return_t ledger_shard_test(void);
 
 struct xnupost_panic_widget xt_panic_widgets = {.xtp_context_p = NULL,
 	                                        .xtp_outval_p = NULL,
@@ -150,6 +152,8 @@ struct xnupost_test kernel_post_tests[] = {
 	XNUPOST_TEST_CONFIG_BASIC(bitmap_post_test),
 	//XNUPOST_TEST_CONFIG_TEST_PANIC(kcdata_api_assert_tests)
 	XNUPOST_TEST_CONFIG_BASIC(test_thread_call),
+	XNUPOST_TEST_CONFIG_BASIC(lck_rw_contention_test),
+	XNUPOST_TEST_CONFIG_BASIC(ledger_shard_test),
 	XNUPOST_TEST_CONFIG_BASIC(ts_kernel_primitive_test),
 	XNUPOST_TEST_CONFIG_BASIC(ts_kernel_sleep_inheritor_test),
 	XNUPOST_TEST_CONFIG_BASIC(ts_kernel_gate_test),
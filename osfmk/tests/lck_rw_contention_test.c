@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+#if !(DEVELOPMENT || DEBUG)
+#error "Testing is not enabled on RELEASE configurations"
+#endif
+
+#include <tests/xnupost.h>
+#include <kern/counter.h>
+#include <kern/kalloc.h>
+#include <kern/locks.h>
+#include <kern/lock_stat.h>
+#include <kern/sched_prim.h>
+#include <kern/thread.h>
+#include <machine/machine_routines.h>
+
+kern_return_t lck_rw_contention_test(void);
+
+/*
+ * Contention microbenchmark for lck_rw_t and lck_rw_br_t.
+ *
+ * Each worker spins on the lock for a fixed duration, taking it exclusive
+ * once every `write_every` iterations and shared otherwise, and checks that
+ * the two words protected by the lock are always observed equal.
+ *
+ * The throughput of every configuration is logged along with the
+ * adaptive spinning and big reader lock counters it moved.
+ */
+
+#define LCK_RW_BENCH_DURATION_MS        100
+#define LCK_RW_BENCH_MAX_THREADS        64
+
+LCK_GRP_DECLARE(lck_rw_bench_grp, "lck_rw_bench");
+
+struct lck_rw_bench {
+	bool                    lrb_big_reader;
+	uint32_t                lrb_write_every;
+	uint64_t                lrb_deadline;
+	lck_rw_t                lrb_rw;
+	lck_rw_br_t             lrb_br;
+
+	uint64_t                lrb_a;
+	uint64_t                lrb_b;
+
+	uint32_t                lrb_started;
+	uint32_t                lrb_finished;
+	uint32_t                lrb_torn;
+	uint64_t                lrb_ops;
+};
+
+static void
+lck_rw_bench_lock(struct lck_rw_bench *b, bool write)
+{
+	if (b->lrb_big_reader) {
+		if (write) {
+			lck_rw_br_lock_exclusive(&b->lrb_br);
+		} else {
+			lck_rw_br_lock_shared(&b->lrb_br);
+		}
+	} else {
+		if (write) {
+			lck_rw_lock_exclusive(&b->lrb_rw);
+		} else {
+			lck_rw_lock_shared(&b->lrb_rw);
+		}
+	}
+}
+
+static void
+lck_rw_bench_unlock(struct lck_rw_bench *b, bool write)
+{
+	if (b->lrb_big_reader) {
+		if (write) {
+			lck_rw_br_unlock_exclusive(&b->lrb_br);
+		} else {
+			lck_rw_br_unlock_shared(&b->lrb_br);
+		}
+	} else {
+		if (write) {
+			lck_rw_unlock_exclusive(&b->lrb_rw);
+		} else {
+			lck_rw_unlock_shared(&b->lrb_rw);
+		}
+	}
+}
+
+static void
+lck_rw_bench_worker(void *arg, wait_result_t __unused wr)
+{
+	struct lck_rw_bench *b = arg;
+	uint64_t ops = 0;
+	uint32_t torn = 0;
+
+	os_atomic_inc(&b->lrb_started, relaxed);
+
+	while (mach_absolute_time() < b->lrb_deadline) {
+		bool write = b->lrb_write_every &&
+		    (ops % b->lrb_write_every) == b->lrb_write_every - 1;
+
+		lck_rw_bench_lock(b, write);
+		if (write) {
+			os_atomic_store(&b->lrb_a, b->lrb_a + 1, relaxed);
+			os_atomic_store(&b->lrb_b, b->lrb_b + 1, relaxed);
+		} else if (os_atomic_load(&b->lrb_a, relaxed) !=
+		    os_atomic_load(&b->lrb_b, relaxed)) {
+			torn++;
+		}
+		lck_rw_bench_unlock(b, write);
+		ops++;
+	}
+
+	os_atomic_add(&b->lrb_ops, ops, relaxed);
+	os_atomic_add(&b->lrb_torn, torn, relaxed);
+	os_atomic_inc(&b->lrb_finished, release);
+	thread_wakeup(&b->lrb_finished);
+	thread_terminate_self();
+	__builtin_unreachable();
+}
+
+static void
+lck_rw_bench_run(uint32_t nthreads, bool big_reader, uint32_t write_every)
+{
+	struct lck_rw_bench *b;
+	uint64_t extended, off_core, fast, slow, drain;
+	uint64_t interval;
+	thread_t th;
+
+	b = kalloc_type(struct lck_rw_bench, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	b->lrb_big_reader = big_reader;
+	b->lrb_write_every = write_every;
+	if (big_reader) {
+		lck_rw_br_init(&b->lrb_br, &lck_rw_bench_grp, LCK_ATTR_NULL);
+	} else {
+		lck_rw_init(&b->lrb_rw, &lck_rw_bench_grp, LCK_ATTR_NULL);
+	}
+
+	extended = counter_load(&lck_rw_adaptive_spin_extended);
+	off_core = counter_load(&lck_rw_adaptive_spin_off_core);
+	fast     = counter_load(&lck_rw_br_read_fast);
+	slow     = counter_load(&lck_rw_br_read_slow);
+	drain    = counter_load(&lck_rw_br_write_drain_block);
+
+	clock_interval_to_absolutetime_interval(LCK_RW_BENCH_DURATION_MS,
+	    NSEC_PER_MSEC, &interval);
+	b->lrb_deadline = mach_absolute_time() + interval;
+
+	for (uint32_t i = 0; i < nthreads; i++) {
+		T_ASSERT_EQ_INT(kernel_thread_start_priority(lck_rw_bench_worker,
+		    b, BASEPRI_DEFAULT, &th), KERN_SUCCESS, "start worker %d", i);
+		thread_deallocate(th);
+	}
+
+	while (os_atomic_load(&b->lrb_finished, acquire) != nthreads) {
+		assert_wait(&b->lrb_finished, THREAD_UNINT);
+		if (os_atomic_load(&b->lrb_finished, acquire) != nthreads) {
+			thread_block(THREAD_CONTINUE_NULL);
+		} else {
+			clear_wait(current_thread(), THREAD_AWAKENED);
+		}
+	}
+
+	T_EXPECT_EQ_UINT(b->lrb_torn, 0,
+	    "%s, %d threads, 1/%d writes: readers never observed a torn update",
+	    big_reader ? "lck_rw_br_t" : "lck_rw_t", nthreads, write_every);
+	T_LOG("%s, %d threads, 1/%d writes: %lld ops/ms "
+	    "(adaptive spin extended %lld, owner off core %lld, "
+	    "br fast %lld, br slow %lld, br drain blocks %lld)",
+	    big_reader ? "lck_rw_br_t" : "lck_rw_t", nthreads, write_every,
+	    b->lrb_ops / LCK_RW_BENCH_DURATION_MS,
+	    counter_load(&lck_rw_adaptive_spin_extended) - extended,
+	    counter_load(&lck_rw_adaptive_spin_off_core) - off_core,
+	    counter_load(&lck_rw_br_read_fast) - fast,
+	    counter_load(&lck_rw_br_read_slow) - slow,
+	    counter_load(&lck_rw_br_write_drain_block) - drain);
+
+	if (big_reader) {
+		lck_rw_br_destroy(&b->lrb_br, &lck_rw_bench_grp);
+	} else {
+		lck_rw_destroy(&b->lrb_rw, &lck_rw_bench_grp);
+	}
+	kfree_type(struct lck_rw_bench, b);
+}
+
+kern_return_t
+lck_rw_contention_test(void)
+{
+	static const uint32_t write_ratios[] = { 0, 1000, 16, 1 };
+	uint32_t ncpus = MIN(ml_wait_max_cpus(), LCK_RW_BENCH_MAX_THREADS);
+
+	for (uint32_t n = 1; n <= ncpus; n *= 2) {
+		for (uint32_t i = 0; i < ARRAY_COUNT(write_ratios); i++) {
+			lck_rw_bench_run(n, false, write_ratios[i]);
+			lck_rw_bench_run(n, true, write_ratios[i]);
+		}
+	}
+
+	return KERN_SUCCESS;
+}
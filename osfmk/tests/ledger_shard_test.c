@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. The rights granted to you under the License
+ * may not be used to create, or enable the creation or redistribution of,
+ * unlawful or unlicensed copies of an Apple operating system, or to
+ * circumvent, violate, or enable the circumvention or violation of, any
+ * terms of an Apple operating system software license agreement.
+ *
+ * Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_OSREFERENCE_LICENSE_HEADER_END@
+ */
+
+
+#if !(DEVELOPMENT || DEBUG)
+#error "Testing is not enabled on RELEASE configurations"
+#endif
+
+#include <tests/xnupost.h>
+#include <kern/ast.h>
+#include <kern/counter.h>
+#include <kern/kalloc.h>
+#include <kern/ledger.h>
+#include <kern/sched_prim.h>
+#include <kern/thread.h>
+#include <machine/machine_routines.h>
+
+kern_return_t ledger_shard_test(void);
+
+/*
+ * Contention microbenchmark for per-CPU sharded ledger entries.
+ *
+ * Workers hammer either a plain or a sharded entry of a shared ledger for a
+ * fixed duration, the way the threads of a task charge their cpu_time, then
+ * check that no update was lost once shards are folded, and report how many
+ * updates of the sharded entry stayed in a shard. A single threaded pass
+ * checks that a sharded entry still trips its limit on the exact update that
+ * crosses it.
+ */
+
+#define LEDGER_BENCH_DURATION_MS        100
+#define LEDGER_BENCH_MAX_THREADS        64
+#define LEDGER_BENCH_BATCH              1024
+
+struct ledger_bench {
+	ledger_t                lb_ledger;
+	int                     lb_entry;
+	uint64_t                lb_deadline;
+
+	uint32_t                lb_finished;
+	uint64_t                lb_ops;
+};
+
+static void
+ledger_bench_worker(void *arg, wait_result_t __unused wr)
+{
+	struct ledger_bench *b = arg;
+	uint64_t ops = 0;
+
+	while (mach_absolute_time() < b->lb_deadline) {
+		ledger_credit(b->lb_ledger, b->lb_entry, 3);
+		ledger_debit(b->lb_ledger, b->lb_entry, 1);
+		ops++;
+	}
+
+	os_atomic_add(&b->lb_ops, ops, relaxed);
+	os_atomic_inc(&b->lb_finished, release);
+	thread_wakeup(&b->lb_finished);
+	thread_terminate_self();
+	__builtin_unreachable();
+}
+
+static void
+ledger_bench_run(ledger_t ledger, int entry, bool sharded, uint32_t nthreads)
+{
+	struct ledger_bench *b;
+	ledger_amount_t credit0, debit0, credit, debit;
+	uint64_t staged, folded, bypassed;
+	uint64_t interval;
+	thread_t th;
+
+	b = kalloc_type(struct ledger_bench, Z_WAITOK | Z_ZERO | Z_NOFAIL);
+	b->lb_ledger = ledger;
+	b->lb_entry = entry;
+	ledger_get_entries(ledger, entry, &credit0, &debit0);
+	staged = counter_load(&ledger_shard_staged);
+	folded = counter_load(&ledger_shard_folded);
+	bypassed = counter_load(&ledger_shard_bypassed);
+
+	clock_interval_to_absolutetime_interval(LEDGER_BENCH_DURATION_MS,
+	    NSEC_PER_MSEC, &interval);
+	b->lb_deadline = mach_absolute_time() + interval;
+
+	for (uint32_t i = 0; i < nthreads; i++) {
+		T_ASSERT_EQ_INT(kernel_thread_start_priority(ledger_bench_worker,
+		    b, BASEPRI_DEFAULT, &th), KERN_SUCCESS, "start worker %d", i);
+		thread_deallocate(th);
+	}
+
+	while (os_atomic_load(&b->lb_finished, acquire) != nthreads) {
+		assert_wait(&b->lb_finished, THREAD_UNINT);
+		if (os_atomic_load(&b->lb_finished, acquire) != nthreads) {
+			thread_block(THREAD_CONTINUE_NULL);
+		} else {
+			clear_wait(current_thread(), THREAD_AWAKENED);
+		}
+	}
+
+	staged = counter_load(&ledger_shard_staged) - staged;
+	folded = counter_load(&ledger_shard_folded) - folded;
+	bypassed = counter_load(&ledger_shard_bypassed) - bypassed;
+
+	ledger_get_entries(ledger, entry, &credit, &debit);
+	T_EXPECT_EQ_LLONG(credit - credit0, (ledger_amount_t)(3 * b->lb_ops),
+	    "%s entry, %d threads: no credit lost",
+	    sharded ? "sharded" : "plain", nthreads);
+	T_EXPECT_EQ_LLONG(debit - debit0, (ledger_amount_t)b->lb_ops,
+	    "%s entry, %d threads: no debit lost",
+	    sharded ? "sharded" : "plain", nthreads);
+	T_LOG("%s entry, %d threads: %lld ops/ms",
+	    sharded ? "sharded" : "plain", nthreads,
+	    b->lb_ops / LEDGER_BENCH_DURATION_MS);
+	if (sharded) {
+		/* other sharded ledgers can add to the counters, never remove */
+		T_LOG("sharded entry, %d threads: %llu updates staged, %llu folded, "
+		    "%llu bypassed", nthreads, staged, folded, bypassed);
+		T_EXPECT_GE_ULLONG(staged, 2 * b->lb_ops - 2 * b->lb_ops / 64,
+		    "%d threads: at least 63/64 of the updates stay in a shard",
+		    nthreads);
+	}
+
+	kfree_type(struct ledger_bench, b);
+}
+
+static void
+ledger_shard_limit_test(ledger_t ledger, int entry)
+{
+	const ledger_amount_t limit = 16 * LEDGER_BENCH_BATCH * zpercpu_count();
+	thread_t self = current_thread();
+	ledger_amount_t balance;
+
+	ledger_zero_balance(ledger, entry);
+	T_ASSERT_EQ_INT(ledger_set_limit(ledger, entry, limit, 0), KERN_SUCCESS,
+	    "set limit");
+	T_ASSERT_EQ_INT(ledger_set_action(ledger, entry, LEDGER_ACTION_BLOCK),
+	    KERN_SUCCESS, "set block action");
+	thread_ast_clear(self, AST_LEDGER);
+
+	ledger_get_balance(ledger, entry, &balance);
+	while (balance < limit) {
+		ledger_credit(ledger, entry, 1);
+		T_QUIET; T_ASSERT_EQ_UINT(thread_ast_get(self) & AST_LEDGER, 0,
+		    "limit not hit at balance %lld", balance);
+		balance++;
+	}
+	ledger_credit(ledger, entry, 1);
+	T_EXPECT_NE_UINT(thread_ast_get(self) & AST_LEDGER, 0,
+	    "limit hit on the update crossing it");
+
+	thread_ast_clear(self, AST_LEDGER);
+	ledger_set_limit(ledger, entry, LEDGER_LIMIT_INFINITY, 0);
+	ledger_set_action(ledger, entry, LEDGER_ACTION_IGNORE);
+	ledger_zero_balance(ledger, entry);
+}
+
+kern_return_t
+ledger_shard_test(void)
+{
+	uint32_t ncpus = MIN(ml_wait_max_cpus(), LEDGER_BENCH_MAX_THREADS);
+	ledger_template_t template;
+	int plain, sharded, tracked;
+	ledger_t ledger;
+
+	template = ledger_template_create("ledger_shard_test");
+	T_ASSERT_NOTNULL(template, "create template");
+	plain = ledger_entry_add(template, "plain", "test", "count");
+	sharded = ledger_entry_add(template, "sharded", "test", "count");
+	tracked = ledger_entry_add(template, "tracked", "test", "count");
+	T_ASSERT_GE_INT(plain, 0, "add plain entry");
+	T_ASSERT_GE_INT(sharded, 0, "add sharded entry");
+	T_ASSERT_GE_INT(tracked, 0, "add tracked entry");
+	T_ASSERT_EQ_INT(ledger_track_per_cpu(template, sharded,
+	    LEDGER_BENCH_BATCH), KERN_SUCCESS, "shard entry");
+	T_ASSERT_EQ_INT(ledger_track_maximum(template, tracked, 60),
+	    KERN_SUCCESS, "track max");
+	T_EXPECT_EQ_INT(ledger_track_per_cpu(template, tracked,
+	    LEDGER_BENCH_BATCH), KERN_INVALID_VALUE,
+	    "can't shard entries tracking their maximum");
+	T_EXPECT_EQ_INT(ledger_track_maximum(template, sharded, 60),
+	    KERN_INVALID_VALUE, "can't track the maximum of sharded entries");
+	ledger_template_complete(template);
+	T_EXPECT_EQ_INT(ledger_track_per_cpu(template, plain,
+	    LEDGER_BENCH_BATCH), KERN_INVALID_VALUE,
+	    "can't shard entries of a completed template");
+
+	ledger = ledger_instantiate(template, LEDGER_CREATE_ACTIVE_ENTRIES);
+	T_ASSERT_NOTNULL(ledger, "instantiate ledger");
+
+	for (uint32_t n = 1; n <= ncpus; n *= 2) {
+		ledger_bench_run(ledger, plain, false, n);
+		ledger_bench_run(ledger, sharded, true, n);
+	}
+
+	ledger_shard_limit_test(ledger, sharded);
+
+	ledger_dereference(ledger);
+	ledger_template_dereference(template);
+
+	return KERN_SUCCESS;
+}
@@ -2704,6 +2704,97 @@ vm_map_pmap_enter(
 	}
 }
 
+/*
+ *	Routine:	vm_map_pmap_enter_resident
+ *
+ *	Description:
+ *		Enter the pages resident in the top level objects of
+ *		the entries covering [start, end) into the map's pmap,
+ *		so that reading them doesn't fault.  Pages are only
+ *		entered for reading: a write still faults and goes
+ *		through the usual copy-on-write handling.
+ *
+ *		This is best effort: submaps, wired entries, pages that
+ *		aren't resident in the top level object or are busy
+ *		are left to be faulted in.
+ *
+ *	In/out conditions:
+ *		The map should not be locked on entry.
+ */
+void
+vm_map_pmap_enter_resident(
+	vm_map_t                map,
+	vm_map_offset_t         start,
+	vm_map_offset_t         end)
+{
+	vm_map_entry_t          entry;
+	uint8_t                 object_lock_type = OBJECT_LOCK_EXCLUSIVE;
+
+	if (map->pmap == PMAP_NULL || VM_MAP_PAGE_SHIFT(map) != PAGE_SHIFT) {
+		return;
+	}
+
+	vm_map_lock_read(map);
+
+	if (!vm_map_lookup_entry(map, start, &entry)) {
+		entry = entry->vme_next;
+	}
+
+	for (; entry != vm_map_to_entry(map) && entry->vme_start < end;
+	    entry = entry->vme_next) {
+		struct vm_object_fault_info fault_info = {
+			.interruptible = THREAD_UNINT,
+		};
+		vm_object_t             object;
+		vm_object_offset_t      offset;
+		vm_map_offset_t         va, va_end;
+
+		if (entry->is_sub_map || entry->wired_count ||
+		    !(entry->protection & VM_PROT_READ)) {
+			continue;
+		}
+		object = VME_OBJECT(entry);
+		if (object == VM_OBJECT_NULL) {
+			continue;
+		}
+
+		va = MAX(start, entry->vme_start);
+		va_end = MIN(end, entry->vme_end);
+		offset = VME_OFFSET(entry) + (va - entry->vme_start);
+
+		fault_info.user_tag = VME_ALIAS(entry);
+		if (entry->iokit_acct || !entry->use_pmap) {
+			fault_info.pmap_options |= PMAP_OPTIONS_ALT_ACCT;
+		}
+
+		vm_object_lock(object);
+		for (; va < va_end; va += PAGE_SIZE, offset += PAGE_SIZE_64) {
+			int             type_of_fault = DBG_CACHE_HIT_FAULT;
+			vm_page_t       m;
+
+			m = vm_page_lookup(object, offset);
+			if (m == VM_PAGE_NULL || m->vmp_busy || vm_page_is_fictitious(m) ||
+			    (m->vmp_unusual && (VMP_ERROR_GET(m) || m->vmp_restart || m->vmp_absent))) {
+				continue;
+			}
+
+			(void)vm_fault_enter(m, map->pmap,
+			    va,
+			    PAGE_SIZE, 0,
+			    VM_PROT_READ, VM_PROT_READ,
+			    VM_PAGE_WIRED(m),
+			    VM_KERN_MEMORY_NONE,                 /* tag - not wiring */
+			    &fault_info,
+			    NULL,                  /* need_retry */
+			    &type_of_fault,
+			    &object_lock_type); /* Exclusive lock mode. Will remain unchanged.*/
+		}
+		vm_object_unlock(object);
+	}
+
+	vm_map_unlock_read(map);
+}
+
 #define MAX_TRIES_TO_GET_RANDOM_ADDRESS 1000
 static kern_return_t
 vm_map_random_address_for_size(
@@ -11950,6 +12041,39 @@ vm_map_copyin(
 	           FALSE, copy_result, FALSE);
 }
 
+/*
+ *	Routine:	vm_map_copyin_pages
+ *
+ *	Description:
+ *		Like vm_map_copyin(), but always makes an entry list
+ *		copy, even for regions small enough to be copied through
+ *		a kernel buffer.  When the source is destroyed, its pages
+ *		are moved to the destination map rather than copied, and
+ *		the copy is marked is_lent.
+ */
+kern_return_t
+vm_map_copyin_pages(
+	vm_map_t                src_map,
+	vm_map_address_ut       src_addr,
+	vm_map_size_ut          len,
+	boolean_t               src_destroy,
+	vm_map_copy_t          *copy_result)   /* OUT */
+{
+	int flags = VM_MAP_COPYIN_ENTRY_LIST;
+	kern_return_t kr;
+
+	if (src_destroy) {
+		flags |= VM_MAP_COPYIN_SRC_DESTROY;
+	}
+	kr = vm_map_copyin_internal(src_map, src_addr, len, flags,
+	    copy_result);
+	if (kr == KERN_SUCCESS && src_destroy &&
+	    *copy_result != VM_MAP_COPY_NULL) {
+		(*copy_result)->is_lent = true;
+	}
+	return kr;
+}
+
 /*
  *	Routine:	vm_map_copyin_common
  *
@@ -529,6 +529,7 @@ struct vm_map_copy {
 	uint16_t                type;
 	bool                    is_kernel_range;
 	bool                    is_user_range;
+	bool                    is_lent;        /* pages moved by vm_map_copyin_pages() */
 	vm_map_range_id_t       orig_range;
 	vm_object_offset_t      offset;
 	vm_map_size_t           size;
@@ -868,6 +869,23 @@ extern kern_return_t    vm_map_copyout_size(
 	vm_map_copy_t           copy,
 	vm_map_size_ut          copy_size);
 
+/*
+ * Like vm_map_copyin(), but never copies through a kernel buffer.
+ * Copies moving the source pages are marked is_lent.
+ */
+extern kern_return_t    vm_map_copyin_pages(
+	vm_map_t                src_map,
+	vm_map_address_ut       src_addr,
+	vm_map_size_ut          len,
+	boolean_t               src_destroy,
+	vm_map_copy_t          *copy_result); /* OUT */
+
+/* Map the resident pages backing a range read-only ahead of any fault */
+extern void             vm_map_pmap_enter_resident(
+	vm_map_t                map,
+	vm_map_offset_t         start,
+	vm_map_offset_t         end);
+
 extern void             vm_map_disable_NX(
 	vm_map_t                map);
 
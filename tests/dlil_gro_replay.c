@@ -0,0 +1,374 @@
+#include <darwintest.h>
+
+#include <sys/ioctl.h>
+#include <sys/sysctl.h>
+#include <sys/uio.h>
+
+#include <net/if.h>
+#include <net/bpf.h>
+#include <net/ethernet.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+#include <arpa/inet.h>
+#include <libkern/OSByteOrder.h>
+#include <mach/mach_time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "net_test_lib.h"
+#include "bpflib.h"
+#include "in_cksum.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_ASROOT(true),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_TAG_PERF,
+	T_META_TAG_VM_NOT_ELIGIBLE,
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * Replays a TCP trace into a feth interface with hardware checksum
+ * emulation and measures how many segments the receive offload stage of
+ * the legacy input path merges into each packet handed to tcp_input.
+ *
+ * The trace is read from the pcap file named by DLIL_GRO_PCAP, whose
+ * Ethernet IPv4 TCP frames are readdressed to the interface; without
+ * one, a trace of interleaved flows with timestamps, pushes and some
+ * reordering is generated.
+ */
+
+#define MSS                     1448
+#define NUM_FLOWS               8
+#define SEGS_PER_FLOW           4096
+#define BURST                   16      /* segments of a flow in a row */
+#define REORDER_EVERY           128     /* segments between reorderings */
+#define WRITE_BATCH             64      /* frames per bpf write */
+#define SYNTH_FRAME_LEN \
+	(ETHER_HDR_LEN + sizeof(ip_tcp_header_t) + TCPOLEN_TSTAMP_APPA + MSS)
+
+static char ifname1[IF_NAMESIZE];
+static char ifname2[IF_NAMESIZE];
+static int default_hwcsum = -1;
+static int default_rx_gro = -1;
+
+static struct in_addr rx_ip, tx_ip;
+static ether_addr_t rx_eaddr, tx_eaddr;
+
+static struct iovec *frames;            /* bpf header and frame */
+static u_int nframes, maxframes;
+
+static void
+cleanup(void)
+{
+	if (ifname1[0] != '\0') {
+		(void)ifnet_destroy(ifname1, false);
+	}
+	if (ifname2[0] != '\0') {
+		(void)ifnet_destroy(ifname2, false);
+	}
+	if (default_hwcsum != -1) {
+		(void)sysctlbyname("net.link.fake.hwcsum", NULL, NULL,
+		    &default_hwcsum, sizeof(default_hwcsum));
+	}
+	if (default_rx_gro != -1) {
+		(void)sysctlbyname("net.link.generic.system.rx_gro", NULL, NULL,
+		    &default_rx_gro, sizeof(default_rx_gro));
+	}
+}
+
+static void
+setup_feth_pair(void)
+{
+	size_t oldlen = sizeof(default_hwcsum);
+	int one = 1;
+
+	T_ATEND(cleanup);
+
+	/* the checksum emulation is picked up when an interface is created */
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("net.link.fake.hwcsum",
+	    &default_hwcsum, &oldlen, &one, sizeof(one)), "net.link.fake.hwcsum");
+
+	/* the offload stage is off by default */
+	oldlen = sizeof(default_rx_gro);
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("net.link.generic.system.rx_gro",
+	    &default_rx_gro, &oldlen, &one, sizeof(one)),
+	    "net.link.generic.system.rx_gro");
+
+	strlcpy(ifname1, FETH_NAME, sizeof(ifname1));
+	T_ASSERT_POSIX_ZERO(ifnet_create_2(ifname1, sizeof(ifname1)), NULL);
+	strlcpy(ifname2, FETH_NAME, sizeof(ifname2));
+	T_ASSERT_POSIX_ZERO(ifnet_create_2(ifname2, sizeof(ifname2)), NULL);
+	fake_set_peer(ifname1, ifname2);
+
+	inet_aton("10.201.0.1", &rx_ip);
+	inet_aton("10.201.0.2", &tx_ip);
+	ifnet_attach_ip(ifname1);
+	ifnet_add_ip_address(ifname1, rx_ip, inet_class_c_subnet_mask);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ifnet_set_flags(ifname2, IFF_UP, 0),
+	    NULL);
+
+	ifnet_get_lladdr(ifname1, &rx_eaddr);
+	ifnet_get_lladdr(ifname2, &tx_eaddr);
+}
+
+static uint16_t
+tcp_cksum(struct ip *ip, struct tcphdr *th, u_int tcp_len)
+{
+	char buf[sizeof(tcp_pseudo_hdr_t) + IP_MAXPACKET];
+	tcp_pseudo_hdr_t *ph = (tcp_pseudo_hdr_t *)(void *)buf;
+
+	*ph = (tcp_pseudo_hdr_t){
+		.src_ip = ip->ip_src,
+		.dst_ip = ip->ip_dst,
+		.proto = IPPROTO_TCP,
+		.length = htons((uint16_t)tcp_len),
+	};
+	th->th_sum = 0;
+	memcpy(buf + sizeof(*ph), th, tcp_len);
+	return in_cksum(buf, (int)(sizeof(*ph) + tcp_len));
+}
+
+/* readdresses an Ethernet IPv4 TCP frame to ifname1 and adds it */
+static void
+frame_add(const void *data, u_int len)
+{
+	struct ether_header *eh;
+	struct bpf_hdr *bh;
+	struct tcphdr *th;
+	struct ip *ip;
+	u_int iphlen;
+	char *buf;
+
+	if (nframes == maxframes) {
+		maxframes = maxframes != 0 ? 2 * maxframes : 1024;
+		frames = realloc(frames, maxframes * sizeof(*frames));
+		T_QUIET; T_ASSERT_NOTNULL(frames, "realloc");
+	}
+
+	buf = calloc(1, BPF_WORDALIGN(sizeof(*bh) + len));
+	T_QUIET; T_ASSERT_NOTNULL(buf, "calloc");
+	bh = (struct bpf_hdr *)(void *)buf;
+	bh->bh_hdrlen = sizeof(*bh);
+	bh->bh_caplen = bh->bh_datalen = len;
+	memcpy(buf + sizeof(*bh), data, len);
+
+	eh = (struct ether_header *)(void *)(buf + sizeof(*bh));
+	bcopy(&rx_eaddr, eh->ether_dhost, ETHER_ADDR_LEN);
+	bcopy(&tx_eaddr, eh->ether_shost, ETHER_ADDR_LEN);
+
+	ip = (struct ip *)(void *)(eh + 1);
+	iphlen = ip->ip_hl << 2;
+	ip->ip_src = tx_ip;
+	ip->ip_dst = rx_ip;
+	ip->ip_sum = 0;
+	ip->ip_sum = in_cksum(ip, (int)iphlen);
+	th = (struct tcphdr *)(void *)((char *)ip + iphlen);
+	th->th_sum = tcp_cksum(ip, th, ntohs(ip->ip_len) - iphlen);
+
+	frames[nframes].iov_base = buf;
+	frames[nframes].iov_len = BPF_WORDALIGN(sizeof(*bh) + len);
+	nframes++;
+}
+
+static void
+synth_segment(uint16_t port, uint32_t seq, uint32_t tsval, bool push)
+{
+	char buf[SYNTH_FRAME_LEN] = { 0 };
+	struct ether_header *eh = (struct ether_header *)(void *)buf;
+	ip_tcp_header_t *h = (ip_tcp_header_t *)(void *)(eh + 1);
+	uint32_t *opt = (uint32_t *)(void *)(h + 1);
+
+	eh->ether_type = htons(ETHERTYPE_IP);
+	h->ip.ip_v = IPVERSION;
+	h->ip.ip_hl = sizeof(struct ip) >> 2;
+	h->ip.ip_len = htons(sizeof(*h) + TCPOLEN_TSTAMP_APPA + MSS);
+	h->ip.ip_off = htons(IP_DF);
+	h->ip.ip_ttl = 64;
+	h->ip.ip_p = IPPROTO_TCP;
+	h->tcp.th_sport = htons(port);
+	h->tcp.th_dport = htons(5001);
+	h->tcp.th_seq = htonl(seq);
+	h->tcp.th_ack = htonl(1);
+	h->tcp.th_off = (sizeof(struct tcphdr) + TCPOLEN_TSTAMP_APPA) >> 2;
+	h->tcp.th_flags = TH_ACK | (push ? TH_PUSH : 0);
+	h->tcp.th_win = htons(65535);
+	opt[0] = htonl(TCPOPT_TSTAMP_HDR);
+	opt[1] = htonl(tsval);
+	opt[2] = htonl(1);
+	memset(opt + 3, 'a' + port % 26, MSS);
+
+	frame_add(buf, sizeof(buf));
+}
+
+static void
+synth_trace(void)
+{
+	uint32_t seq[NUM_FLOWS] = { 0 };
+
+	for (int seg = 0; seg < SEGS_PER_FLOW; seg += BURST) {
+		for (int f = 0; f < NUM_FLOWS; f++) {
+			for (int i = 0; i < BURST; i++) {
+				uint32_t s = seq[f];
+
+				/* swap two segments now and then */
+				if ((seg + i) % REORDER_EVERY == 1) {
+					s += MSS;
+				} else if ((seg + i) % REORDER_EVERY == 2) {
+					s -= MSS;
+				}
+				synth_segment((uint16_t)(40000 + f), s,
+				    (uint32_t)(seg + i) / 4, i == BURST - 1);
+				seq[f] += MSS;
+			}
+		}
+	}
+}
+
+struct pcap_file_hdr {
+	uint32_t        magic;
+	uint16_t        version_major;
+	uint16_t        version_minor;
+	int32_t         thiszone;
+	uint32_t        sigfigs;
+	uint32_t        snaplen;
+	uint32_t        linktype;
+};
+
+struct pcap_rec_hdr {
+	uint32_t        ts_sec;
+	uint32_t        ts_usec;
+	uint32_t        caplen;
+	uint32_t        len;
+};
+
+#define PCAP_MAGIC              0xa1b2c3d4
+#define PCAP_MAGIC_NSEC         0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET  1
+
+static uint32_t
+pcap_u32(uint32_t v, bool swap)
+{
+	return swap ? OSSwapInt32(v) : v;
+}
+
+static void
+pcap_trace(const char *path)
+{
+	struct pcap_file_hdr fh;
+	struct pcap_rec_hdr rh;
+	char buf[65536];
+	bool swap;
+	FILE *f;
+
+	f = fopen(path, "r");
+	T_ASSERT_NOTNULL(f, "open %s", path);
+	T_QUIET; T_ASSERT_EQ(fread(&fh, sizeof(fh), 1, f), 1UL, "pcap header");
+	swap = (fh.magic != PCAP_MAGIC && fh.magic != PCAP_MAGIC_NSEC);
+	T_QUIET; T_ASSERT_EQ(pcap_u32(fh.linktype, swap),
+	    (uint32_t)PCAP_LINKTYPE_ETHERNET, "Ethernet capture");
+
+	while (fread(&rh, sizeof(rh), 1, f) == 1) {
+		uint32_t caplen = pcap_u32(rh.caplen, swap);
+		struct ether_header *eh = (struct ether_header *)(void *)buf;
+		struct ip *ip = (struct ip *)(void *)(eh + 1);
+
+		T_QUIET; T_ASSERT_LE(caplen, (uint32_t)sizeof(buf), "record size");
+		T_QUIET; T_ASSERT_EQ(fread(buf, caplen, 1, f), 1UL, "record");
+
+		/* only complete IPv4 TCP frames that fit the MTU are replayed */
+		if (caplen != pcap_u32(rh.len, swap) ||
+		    caplen < ETHER_HDR_LEN + sizeof(ip_tcp_header_t) ||
+		    caplen > ETHER_PKT_LEN ||
+		    ntohs(eh->ether_type) != ETHERTYPE_IP ||
+		    ip->ip_v != IPVERSION || ip->ip_hl != sizeof(*ip) >> 2 ||
+		    ip->ip_p != IPPROTO_TCP ||
+		    ntohs(ip->ip_len) < sizeof(ip_tcp_header_t) ||
+		    ETHER_HDR_LEN + ntohs(ip->ip_len) > caplen) {
+			continue;
+		}
+		frame_add(buf, ETHER_HDR_LEN + ntohs(ip->ip_len));
+	}
+	fclose(f);
+}
+
+static uint64_t
+gro_counter(const char *name)
+{
+	uint64_t value = 0;
+	size_t len = sizeof(value);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, &value, &len,
+	    NULL, 0), "%s", name);
+	return value;
+}
+
+static void
+replay(void)
+{
+	int bpf_fd;
+
+	bpf_fd = bpf_new();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_fd, "bpf_new");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_setif(bpf_fd, ifname2), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_header_complete(bpf_fd, 1), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_batch_write(bpf_fd, 1), NULL);
+
+	for (u_int i = 0; i < nframes; i += WRITE_BATCH) {
+		u_int n = MIN(WRITE_BATCH, nframes - i);
+
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(writev(bpf_fd, frames + i, (int)n),
+		    "write bpf");
+	}
+	close(bpf_fd);
+
+	/* let the input thread drain the interface */
+	usleep(500000);
+}
+
+T_DECL(dlil_gro_replay,
+    "Measure the TCP segments merged per packet passed to tcp_input")
+{
+	const char *path = getenv("DLIL_GRO_PCAP");
+	uint64_t segs, pkts, start;
+	mach_timebase_info_data_t tb;
+	double ratio, ms;
+
+	setup_feth_pair();
+
+	if (path != NULL) {
+		pcap_trace(path);
+	} else {
+		synth_trace();
+	}
+	T_ASSERT_GT(nframes, 0U, "%u TCP frames to replay", nframes);
+
+	segs = gro_counter("net.link.generic.system.rx_gro_segs_in");
+	pkts = gro_counter("net.link.generic.system.rx_gro_pkts_out");
+	start = mach_absolute_time();
+	replay();
+	mach_timebase_info(&tb);
+	ms = (double)(mach_absolute_time() - start) * tb.numer / tb.denom /
+	    NSEC_PER_MSEC;
+	segs = gro_counter("net.link.generic.system.rx_gro_segs_in") - segs;
+	pkts = gro_counter("net.link.generic.system.rx_gro_pkts_out") - pkts;
+
+	T_LOG("%llu segments passed up as %llu packets in %.0f ms",
+	    segs, pkts, ms);
+	T_ASSERT_GT(pkts, 0ULL, "segments reached the offload stage");
+	ratio = (double)segs / (double)pkts;
+	T_EXPECT_GE(ratio, 1.0, "%.2f segments per tcp_input call", ratio);
+	T_PERF("dlil_gro_segs_per_pkt", ratio, "segments",
+	    "TCP segments per packet passed to tcp_input");
+
+	for (u_int i = 0; i < nframes; i++) {
+		free(frames[i].iov_base);
+	}
+	free(frames);
+}
@@ -3,12 +3,14 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <mach/mach_time.h>
 
 #include <darwintest.h>
 
 T_GLOBAL_META(T_META_RUN_CONCURRENTLY(true));
 
 extern uint32_t os_cpu_in_cksum(const void *, uint32_t, uint32_t);
+extern uint32_t os_cpu_copy_in_cksum(const void *, void *, uint32_t, uint32_t);
 
 /****************************************************************/
 static void
@@ -119,6 +121,46 @@ test_one_random_packet(uint32_t maxlen)
 	test_checksum(data, len);
 }
 
+/* Copy and checksum a buffer in two segments, folding the partial sum */
+static uint16_t
+split_copy_in_cksum(const uint8_t *src, uint8_t *dst, uint32_t len, uint32_t split)
+{
+	uint32_t partial;
+
+	partial = os_cpu_copy_in_cksum(src, dst, split, 0);
+	partial = os_cpu_copy_in_cksum(src + split, dst + split, len - split, partial);
+	partial = (partial >> 16) + (partial & 0xffff);
+	partial = (partial >> 16) + (partial & 0xffff);
+
+	return ~partial & 0xffff;
+}
+
+static void
+test_copy_checksum(const uint8_t *data, uint32_t len)
+{
+	uint16_t dsum = dumb_in_cksum(data, len);
+
+	const uint8_t MAXALIGN = 8;
+
+	uint8_t srcbuf[len + MAXALIGN];
+	uint8_t dstbuf[len + MAXALIGN];
+	uint32_t split = arc4random_uniform(len / 2 + 1) * 2;
+	for (uint8_t salign = 0; salign < MAXALIGN; salign++) {
+		memcpy(srcbuf + salign, data, len);
+		for (uint8_t dalign = 0; dalign < MAXALIGN; dalign++) {
+			memset(dstbuf, 0, sizeof(dstbuf));
+			uint16_t osum = split_copy_in_cksum(srcbuf + salign, dstbuf + dalign, len, split);
+			T_QUIET; T_ASSERT_EQ(memcmp(dstbuf + dalign, data, len), 0,
+			    "copy mismatch len %d split %d align src %d dst %d", len, split, salign, dalign);
+			if (osum != dsum) {
+				log_hexdump(data, len);
+				T_LOG("len %d split %d align src %d dst %d\n", len, split, salign, dalign);
+			}
+			T_QUIET; T_ASSERT_EQ(osum, dsum, "checksum mismatch got 0x%04x expecting 0x%04x", htons(osum), htons(dsum));
+		}
+	}
+}
+
 /*
  * This is the checksummed portion of the first packet in checksum_error.pcap
  * It is known to cause a problem at splits 44 and 46 with second alignment of 1 or 3
@@ -233,3 +275,74 @@ T_DECL(in_cksum_49479689b, "tests os_cpu_in_cksum with many random packets in va
 		test_one_random_packet(4096);
 	}
 }
+
+T_DECL(in_cksum_copy, "tests os_cpu_copy_in_cksum with many random packets in various random segmentation and memory alignment", T_META_TAG_VM_NOT_PREFERRED)
+{
+	for (int i = 0; i < 1000; i++) {
+		uint32_t len = arc4random_uniform(i < 900 ? 256 : 16384);
+		uint8_t data[len];
+		arc4random_buf(data, len);
+		test_copy_checksum(data, len);
+	}
+	T_PASS("OK");
+}
+
+/*
+ * Report the throughput of the checksum and of the copy and checksum
+ * routines over cache resident buffers of typical packet sizes.
+ */
+#define CKSUM_PERF_BYTES        (1ULL << 30)
+
+static double
+cksum_throughput(const uint8_t *src, uint8_t *dst, uint32_t len)
+{
+	mach_timebase_info_data_t tb;
+	uint64_t iters = CKSUM_PERF_BYTES / len, start, elapsed;
+	volatile uint32_t sum = 0;
+
+	start = mach_absolute_time();
+	for (uint64_t i = 0; i < iters; i++) {
+		if (dst == NULL) {
+			sum += os_cpu_in_cksum(src, len, 0);
+		} else {
+			sum += os_cpu_copy_in_cksum(src, dst, len, 0);
+		}
+	}
+	elapsed = mach_absolute_time() - start;
+
+	mach_timebase_info(&tb);
+	return (double)(iters * len) / ((double)elapsed * tb.numer / tb.denom);
+}
+
+T_DECL(in_cksum_perf, "measures os_cpu_in_cksum and os_cpu_copy_in_cksum throughput",
+    T_META_TAG_PERF, T_META_TAG_VM_NOT_ELIGIBLE, T_META_RUN_CONCURRENTLY(false))
+{
+	static const uint32_t sizes[] = { 64, 576, 1500, 9000, 65535 };
+	uint8_t *src, *dst;
+	char name[64];
+	double rate;
+
+	src = malloc(65536 + 1);
+	dst = malloc(65536 + 1);
+	T_QUIET; T_ASSERT_NOTNULL(src, "malloc");
+	T_QUIET; T_ASSERT_NOTNULL(dst, "malloc");
+	arc4random_buf(src, 65536 + 1);
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		/* odd start, as for a payload following an odd-sized header */
+		for (uint32_t off = 0; off < 2; off++) {
+			rate = cksum_throughput(src + off, NULL, sizes[i]);
+			T_LOG("in_cksum %5u bytes at offset %u: %.2f GB/s", sizes[i], off, rate);
+			snprintf(name, sizeof(name), "in_cksum_%u_%u", sizes[i], off);
+			T_PERF(name, rate, "GB/s", "os_cpu_in_cksum throughput");
+
+			rate = cksum_throughput(src + off, dst, sizes[i]);
+			T_LOG("copy_in_cksum %5u bytes at offset %u: %.2f GB/s", sizes[i], off, rate);
+			snprintf(name, sizeof(name), "copy_in_cksum_%u_%u", sizes[i], off);
+			T_PERF(name, rate, "GB/s", "os_cpu_copy_in_cksum throughput");
+		}
+	}
+
+	free(src);
+	free(dst);
+}
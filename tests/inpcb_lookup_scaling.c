@@ -0,0 +1,167 @@
+#include <darwintest.h>
+
+#include <mach/mach_time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_TAG_PERF,
+	T_META_TAG_VM_NOT_ELIGIBLE,
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * Measures how the loopback UDP receive rate scales with the number of
+ * CPUs, every thread exchanging datagrams over its own connected pair
+ * of sockets so that all of them look up pcbs in the same hash.
+ */
+
+#define MEASURE_SECONDS         3
+#define BATCH                   32
+
+static _Atomic uint64_t received;
+static _Atomic bool stop;
+
+struct flow {
+	pthread_t       thread;
+	int             tx;
+	int             rx;
+};
+
+static int
+udp_bound_socket(struct sockaddr_in *sin)
+{
+	socklen_t len = sizeof(*sin);
+	int fd, rc;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "socket");
+
+	*sin = (struct sockaddr_in){
+		.sin_len = sizeof(*sin),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	rc = bind(fd, (struct sockaddr *)sin, sizeof(*sin));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "bind");
+	rc = getsockname(fd, (struct sockaddr *)sin, &len);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "getsockname");
+
+	return fd;
+}
+
+static void
+flow_create(struct flow *f)
+{
+	struct sockaddr_in tx_addr, rx_addr;
+	int rc;
+
+	f->tx = udp_bound_socket(&tx_addr);
+	f->rx = udp_bound_socket(&rx_addr);
+
+	rc = connect(f->tx, (struct sockaddr *)&rx_addr, sizeof(rx_addr));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "connect");
+	rc = connect(f->rx, (struct sockaddr *)&tx_addr, sizeof(tx_addr));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "connect");
+}
+
+static void *
+flow_main(void *arg)
+{
+	struct flow *f = arg;
+	char buf[64] = { 0 };
+
+	while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+		int n = 0;
+
+		for (int i = 0; i < BATCH; i++) {
+			if (send(f->tx, buf, sizeof(buf), 0) > 0) {
+				n++;
+			}
+		}
+		for (int i = 0; i < n; i++) {
+			if (recv(f->rx, buf, sizeof(buf), 0) <= 0) {
+				break;
+			}
+			atomic_fetch_add_explicit(&received, 1, memory_order_relaxed);
+		}
+	}
+
+	return NULL;
+}
+
+static double
+measure(struct flow *flows, uint32_t nthreads)
+{
+	mach_timebase_info_data_t tb;
+	uint64_t start, elapsed;
+
+	atomic_store(&received, 0);
+	atomic_store(&stop, false);
+
+	start = mach_absolute_time();
+	for (uint32_t i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&flows[i].thread, NULL,
+		    flow_main, &flows[i]), "pthread_create");
+	}
+	sleep(MEASURE_SECONDS);
+	atomic_store(&stop, true);
+	for (uint32_t i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(flows[i].thread, NULL), NULL);
+	}
+	elapsed = mach_absolute_time() - start;
+
+	mach_timebase_info(&tb);
+	return (double)atomic_load(&received) * NSEC_PER_SEC /
+	       ((double)elapsed * tb.numer / tb.denom);
+}
+
+T_DECL(inpcb_lookup_scaling,
+    "Measure the loopback UDP receive rate from 1 CPU to all CPUs")
+{
+	uint32_t ncpus = 0;
+	size_t size = sizeof(ncpus);
+	struct flow *flows;
+	double one = 0, rate;
+	char name[64];
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpus, &size,
+	    NULL, 0), "hw.ncpu");
+
+	flows = calloc(ncpus, sizeof(*flows));
+	T_QUIET; T_ASSERT_NOTNULL(flows, "calloc");
+	for (uint32_t i = 0; i < ncpus; i++) {
+		flow_create(&flows[i]);
+	}
+
+	for (uint32_t n = 1;; n = MIN(2 * n, ncpus)) {
+		rate = measure(flows, n);
+		if (n == 1) {
+			one = rate;
+		}
+
+		T_LOG("%3u CPUs: %.0f packets/s (%.2fx)", n, rate, rate / one);
+		snprintf(name, sizeof(name), "udp_rx_pps_%u_cpus", n);
+		T_PERF(name, rate, "packets/s",
+		    "loopback UDP datagrams received over connected sockets");
+		if (n == ncpus) {
+			break;
+		}
+	}
+
+	for (uint32_t i = 0; i < ncpus; i++) {
+		close(flows[i].tx);
+		close(flows[i].rx);
+	}
+	free(flows);
+}
@@ -0,0 +1,341 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/message.h>
+#include <mach/mach_eventlink.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.ipc"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("IPC"),
+	T_META_TAG_VM_PREFERRED);
+
+#define RING_SIZE               MACH_EVENTLINK_RING_MIN_SIZE
+#define RPC_ITERATIONS          100000
+#define RPC_PAYLOAD             64
+
+static void
+ring_pair_create(mach_port_t pair[2])
+{
+	kern_return_t kr;
+
+	kr = mach_eventlink_create(mach_task_self(), MELC_OPTION_NO_COPYIN, pair);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_eventlink_create");
+}
+
+static void
+ring_associate(mach_port_t port)
+{
+	kern_return_t kr;
+
+	kr = mach_eventlink_associate(port, mach_thread_self(), 0, 0, 0, 0,
+	    MELA_OPTION_NONE);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_eventlink_associate");
+}
+
+T_DECL(eventlink_ring_basic, "eventlink rings carry data in order")
+{
+	struct mach_eventlink_ring ring[2];
+	mach_port_t pair[2];
+	uint8_t msg[1000], buf[1000];
+	uint32_t size;
+	kern_return_t kr;
+	int sent = 0;
+
+	ring_pair_create(pair);
+	ring_associate(pair[1]);
+
+	kr = mach_eventlink_ring_attach(pair[1], 0, &ring[1]);
+	T_EXPECT_MACH_ERROR(kr, KERN_INVALID_ARGUMENT, "the first side must set the size");
+
+	kr = mach_eventlink_ring_attach(pair[0], RING_SIZE, &ring[0]);
+	T_ASSERT_MACH_SUCCESS(kr, "mach_eventlink_ring_attach(%llu)", RING_SIZE);
+	kr = mach_eventlink_ring_attach(pair[1], RING_SIZE * 2, &ring[1]);
+	T_EXPECT_MACH_ERROR(kr, KERN_INVALID_ARGUMENT, "size mismatch is rejected");
+	kr = mach_eventlink_ring_attach(pair[1], 0, &ring[1]);
+	T_ASSERT_MACH_SUCCESS(kr, "peer attaches to the existing ring");
+
+	T_EXPECT_EQ(ring[0].mer_size, ring[1].mer_size, "both sides see the same size");
+	T_EXPECT_NE(ring[0].mer_address, ring[1].mer_address, "separate mappings");
+	T_EXPECT_EQ(ring[0].mer_index, 0, "index of the first eventlink");
+	T_EXPECT_EQ(ring[1].mer_index, 1, "index of the second eventlink");
+
+	kr = mach_eventlink_ring_send(&ring[0], msg,
+	    MACH_EVENTLINK_RING_MSG_MAX(ring[0].mer_size) + 1);
+	T_EXPECT_MACH_ERROR(kr, KERN_INVALID_ARGUMENT, "oversized messages are rejected");
+
+	/* fill the ring, then drain it, a few times to exercise wrapping */
+	for (int round = 0; round < 4; round++) {
+		int received = sent;
+
+		for (;;) {
+			memset(msg, sent & 0xff, sizeof(msg));
+			kr = mach_eventlink_ring_send(&ring[0], msg, sizeof(msg) - (sent % 8));
+			if (kr == KERN_NO_SPACE) {
+				break;
+			}
+			T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_eventlink_ring_send");
+			sent++;
+		}
+		T_QUIET; T_ASSERT_GT(sent, received, "sent messages before the ring filled up");
+
+		size = 8;
+		kr = mach_eventlink_ring_receive(&ring[1], buf, &size,
+		    MELSW_OPTION_NO_WAIT, KERN_CLOCK_MACH_ABSOLUTE_TIME, 0);
+		T_QUIET; T_EXPECT_MACH_ERROR(kr, KERN_INSUFFICIENT_BUFFER_SIZE, "small buffer");
+		T_QUIET; T_EXPECT_EQ(size, sizeof(msg) - (received % 8), "reports the message size");
+
+		for (; received < sent; received++) {
+			size = sizeof(buf);
+			kr = mach_eventlink_ring_receive(&ring[1], buf, &size,
+			    MELSW_OPTION_NO_WAIT, KERN_CLOCK_MACH_ABSOLUTE_TIME, 0);
+			T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_eventlink_ring_receive");
+			T_QUIET; T_ASSERT_EQ(size, sizeof(msg) - (received % 8), "message size");
+			T_QUIET; T_ASSERT_EQ(buf[0], received & 0xff, "messages are in order");
+			T_QUIET; T_ASSERT_EQ(buf[size - 1], received & 0xff, "message contents");
+		}
+
+		size = sizeof(buf);
+		kr = mach_eventlink_ring_receive(&ring[1], buf, &size,
+		    MELSW_OPTION_NO_WAIT, KERN_CLOCK_MACH_ABSOLUTE_TIME, 0);
+		T_QUIET; T_ASSERT_MACH_ERROR(kr, KERN_OPERATION_TIMED_OUT, "ring is empty");
+	}
+	T_PASS("sent and received %d messages in order", sent);
+
+	T_EXPECT_MACH_SUCCESS(mach_eventlink_ring_detach(&ring[0]), "detach");
+	T_EXPECT_MACH_SUCCESS(mach_eventlink_ring_detach(&ring[1]), "detach");
+	mach_eventlink_destroy(pair[0]);
+	mach_port_deallocate(mach_task_self(), pair[1]);
+}
+
+T_DECL(eventlink_ring_corrupt, "eventlink rings reject records corrupted by the peer")
+{
+	struct mach_eventlink_ring ring[2];
+	mach_eventlink_ring_header_t *hdr;
+	mach_port_t pair[2];
+	uint8_t msg[100] = { }, buf[1000];
+	uint32_t *len, size;
+	uint64_t tail, data_size;
+	kern_return_t kr;
+
+	ring_pair_create(pair);
+	ring_associate(pair[1]);
+	kr = mach_eventlink_ring_attach(pair[0], RING_SIZE, &ring[0]);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_eventlink_ring_attach");
+	kr = mach_eventlink_ring_attach(pair[1], 0, &ring[1]);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_eventlink_ring_attach");
+
+	/* corrupt the ring written by the first side through its own mapping */
+	hdr = (mach_eventlink_ring_header_t *)ring[0].mer_address;
+	len = (uint32_t *)(ring[0].mer_address + MACH_EVENTLINK_RING_DATA_OFFSET);
+	data_size = MACH_EVENTLINK_RING_DATA_SIZE(ring[0].mer_size);
+
+	kr = mach_eventlink_ring_send(&ring[0], msg, sizeof(msg));
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_eventlink_ring_send");
+	tail = hdr->melr_tail;
+
+	hdr->melr_tail = data_size + 8;
+	size = sizeof(buf);
+	kr = mach_eventlink_ring_receive(&ring[1], buf, &size,
+	    MELSW_OPTION_NO_WAIT, KERN_CLOCK_MACH_ABSOLUTE_TIME, 0);
+	T_EXPECT_MACH_ERROR(kr, KERN_INVALID_VALUE, "tail beyond the data area");
+
+	hdr->melr_tail = tail - 8;
+	size = sizeof(buf);
+	kr = mach_eventlink_ring_receive(&ring[1], buf, &size,
+	    MELSW_OPTION_NO_WAIT, KERN_CLOCK_MACH_ABSOLUTE_TIME, 0);
+	T_EXPECT_MACH_ERROR(kr, KERN_INVALID_VALUE, "record beyond the tail");
+
+	hdr->melr_tail = tail;
+	*len = (uint32_t)MACH_EVENTLINK_RING_MSG_MAX(ring[0].mer_size) + 1;
+	size = sizeof(buf);
+	kr = mach_eventlink_ring_receive(&ring[1], buf, &size,
+	    MELSW_OPTION_NO_WAIT, KERN_CLOCK_MACH_ABSOLUTE_TIME, 0);
+	T_EXPECT_MACH_ERROR(kr, KERN_INVALID_VALUE, "oversized record");
+
+	*len = sizeof(msg);
+	size = sizeof(buf);
+	kr = mach_eventlink_ring_receive(&ring[1], buf, &size,
+	    MELSW_OPTION_NO_WAIT, KERN_CLOCK_MACH_ABSOLUTE_TIME, 0);
+	T_EXPECT_MACH_SUCCESS(kr, "the repaired record is received");
+	T_EXPECT_EQ(size, (uint32_t)sizeof(msg), "message size");
+
+	mach_eventlink_ring_detach(&ring[0]);
+	mach_eventlink_ring_detach(&ring[1]);
+	mach_eventlink_destroy(pair[0]);
+	mach_port_deallocate(mach_task_self(), pair[1]);
+}
+
+#pragma mark latency
+
+static mach_timebase_info_data_t timebase_info;
+static struct mach_eventlink_ring rpc_ring[2];
+static mach_port_t rpc_eventlink[2];
+static mach_port_t rpc_port;
+
+typedef struct {
+	mach_msg_header_t header;
+	uint8_t payload[RPC_PAYLOAD];
+} rpc_message_t;
+
+typedef struct {
+	rpc_message_t msg;
+	mach_msg_max_trailer_t trailer;
+} rpc_rcv_buffer_t;
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void *
+ring_server(void *arg __unused)
+{
+	uint8_t buf[RPC_PAYLOAD];
+	uint32_t size = sizeof(buf);
+	mach_eventlink_signal_wait_option_t option = MELSW_OPTION_NONE;
+	kern_return_t kr;
+
+	ring_associate(rpc_eventlink[1]);
+	kr = mach_eventlink_ring_receive(&rpc_ring[1], buf, &size,
+	    MELSW_OPTION_NONE, KERN_CLOCK_MACH_ABSOLUTE_TIME, 0);
+	for (int i = 0; i < RPC_ITERATIONS; i++) {
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "server receive");
+		size = sizeof(buf);
+		if (i + 1 == RPC_ITERATIONS) {
+			/* only reply to the last request */
+			option = MELSW_OPTION_NO_WAIT;
+		}
+		kr = mach_eventlink_ring_send_receive(&rpc_ring[1], buf, sizeof(buf),
+		    buf, &size, option, KERN_CLOCK_MACH_ABSOLUTE_TIME, 0);
+	}
+
+	return NULL;
+}
+
+static void *
+mach_msg_server(void *arg __unused)
+{
+	rpc_rcv_buffer_t buf;
+	mach_msg_return_t mr;
+
+	mr = mach_msg2(&buf, MACH64_RCV_MSG, (mach_msg_header_t){ }, 0,
+	    sizeof(buf), rpc_port, 0, 0);
+	for (int i = 0; i < RPC_ITERATIONS; i++) {
+		T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "server receive");
+		buf.msg.header.msgh_bits = MACH_MSGH_BITS_SET(
+			MACH_MSGH_BITS_REMOTE(buf.msg.header.msgh_bits), 0, 0, 0);
+		buf.msg.header.msgh_local_port = MACH_PORT_NULL;
+		buf.msg.header.msgh_size = sizeof(buf.msg);
+		if (i + 1 == RPC_ITERATIONS) {
+			mr = mach_msg2(&buf, MACH64_SEND_MSG, buf.msg.header,
+			    sizeof(buf.msg), 0, MACH_PORT_NULL, 0, 0);
+			T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "server reply");
+			break;
+		}
+		mr = mach_msg2(&buf, MACH64_SEND_MSG | MACH64_RCV_MSG, buf.msg.header,
+		    sizeof(buf.msg), sizeof(buf), rpc_port, 0, 0);
+	}
+
+	return NULL;
+}
+
+static uint64_t
+rpc_run(bool ring, uint64_t *samples)
+{
+	uint8_t payload[RPC_PAYLOAD] = { };
+	rpc_rcv_buffer_t buf;
+	mach_port_t reply_port;
+	pthread_t server;
+	kern_return_t kr;
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&server, NULL,
+	    ring ? ring_server : mach_msg_server, NULL), "pthread_create");
+
+	kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &reply_port);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_allocate");
+
+	for (int i = 0; i < RPC_ITERATIONS; i++) {
+		uint64_t start = mach_absolute_time();
+
+		if (ring) {
+			uint32_t size = sizeof(payload);
+
+			kr = mach_eventlink_ring_send_receive(&rpc_ring[0], payload,
+			    sizeof(payload), payload, &size, MELSW_OPTION_NONE,
+			    KERN_CLOCK_MACH_ABSOLUTE_TIME, 0);
+			T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "ring rpc");
+		} else {
+			buf.msg.header = (mach_msg_header_t){
+				.msgh_bits = MACH_MSGH_BITS_SET(MACH_MSG_TYPE_COPY_SEND,
+				    MACH_MSG_TYPE_MAKE_SEND_ONCE, 0, 0),
+				.msgh_size = sizeof(buf.msg),
+				.msgh_remote_port = rpc_port,
+				.msgh_local_port = reply_port,
+			};
+			kr = mach_msg2(&buf, MACH64_SEND_MSG | MACH64_RCV_MSG |
+			    MACH64_SEND_MQ_CALL, buf.msg.header, sizeof(buf.msg),
+			    sizeof(buf), reply_port, 0, 0);
+			T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_msg rpc");
+		}
+		samples[i] = mach_absolute_time() - start;
+	}
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(server, NULL), "pthread_join");
+	mach_port_mod_refs(mach_task_self(), reply_port, MACH_PORT_RIGHT_RECEIVE, -1);
+
+	qsort(samples, RPC_ITERATIONS, sizeof(samples[0]), compare_u64);
+	return samples[RPC_ITERATIONS / 2] * timebase_info.numer / timebase_info.denom;
+}
+
+T_DECL(eventlink_ring_latency,
+    "Compare round trip latency of eventlink rings and mach_msg",
+    T_META_TAG_PERF, T_META_TAG_VM_NOT_ELIGIBLE, T_META_CHECK_LEAKS(false))
+{
+	uint64_t *samples, msg_p50, ring_p50;
+	kern_return_t kr;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_timebase_info(&timebase_info),
+	    "mach_timebase_info");
+	samples = calloc(RPC_ITERATIONS, sizeof(*samples));
+	T_QUIET; T_ASSERT_NOTNULL(samples, "calloc");
+
+	kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &rpc_port);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_allocate");
+	kr = mach_port_insert_right(mach_task_self(), rpc_port, rpc_port,
+	    MACH_MSG_TYPE_MAKE_SEND);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_insert_right");
+
+	ring_pair_create(rpc_eventlink);
+	ring_associate(rpc_eventlink[0]);
+	kr = mach_eventlink_ring_attach(rpc_eventlink[0], RING_SIZE, &rpc_ring[0]);
+	T_ASSERT_MACH_SUCCESS(kr, "mach_eventlink_ring_attach");
+	kr = mach_eventlink_ring_attach(rpc_eventlink[1], 0, &rpc_ring[1]);
+	T_ASSERT_MACH_SUCCESS(kr, "mach_eventlink_ring_attach");
+
+	msg_p50 = rpc_run(false, samples);
+	ring_p50 = rpc_run(true, samples);
+
+	T_LOG("%d byte round trips: mach_msg p50 %llu ns, eventlink ring p50 %llu ns",
+	    RPC_PAYLOAD, msg_p50, ring_p50);
+	T_PERF("mach_msg_rpc_p50", (double)msg_p50, "ns",
+	    "median mach_msg2() round trip latency");
+	T_PERF("eventlink_ring_rpc_p50", (double)ring_p50, "ns",
+	    "median eventlink ring round trip latency");
+
+	mach_eventlink_ring_detach(&rpc_ring[0]);
+	mach_eventlink_ring_detach(&rpc_ring[1]);
+	mach_eventlink_destroy(rpc_eventlink[0]);
+	mach_port_destruct(mach_task_self(), rpc_port, -1, 0);
+	free(samples);
+}
@@ -0,0 +1,125 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/message.h>
+
+#include <string.h>
+#include <sys/sysctl.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.ipc"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("IPC"),
+	T_META_TAG_VM_PREFERRED);
+
+#define MAX_PAYLOAD             (6 << 10)
+#define ITERATIONS              100000
+
+typedef struct {
+	mach_msg_header_t header;
+	uint8_t payload[MAX_PAYLOAD];
+} cache_message_t;
+
+typedef struct {
+	cache_message_t msg;
+	mach_msg_max_trailer_t trailer;
+} cache_rcv_buffer_t;
+
+static uint64_t
+read_counter(const char *name)
+{
+	uint64_t value = 0;
+	size_t size = sizeof(value);
+
+	if (sysctlbyname(name, &value, &size, NULL, 0) != 0) {
+		T_SKIP("%s is only available on DEVELOPMENT and DEBUG kernels", name);
+	}
+	return value;
+}
+
+/* The cache is compiled out on KASAN kernels and can be turned off */
+static bool
+kmsg_cache_disabled(void)
+{
+	char bootargs[1024] = "";
+	size_t size = sizeof(bootargs);
+
+	if (sysctlbyname("kern.bootargs", bootargs, &size, NULL, 0) != 0) {
+		return false;
+	}
+	return strstr(bootargs, "ipc_kmsg_cache=0") != NULL;
+}
+
+static double
+send_receive(mach_port_t port, mach_msg_size_t payload)
+{
+	static cache_message_t msg;
+	static cache_rcv_buffer_t buf;
+	mach_timebase_info_data_t tb;
+	mach_msg_return_t mr;
+	uint64_t start, elapsed;
+
+	msg.header = (mach_msg_header_t){
+		.msgh_bits = MACH_MSGH_BITS_SET(MACH_MSG_TYPE_COPY_SEND, 0, 0, 0),
+		.msgh_size = (mach_msg_size_t)sizeof(msg.header) + payload,
+		.msgh_remote_port = port,
+	};
+
+	start = mach_absolute_time();
+	for (int i = 0; i < ITERATIONS; i++) {
+		mr = mach_msg2(&msg, MACH64_SEND_MSG | MACH64_SEND_MQ_CALL, msg.header,
+		    msg.header.msgh_size, 0, MACH_PORT_NULL, 0, 0);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg2(MACH64_SEND_MSG)");
+		mr = mach_msg2(&buf, MACH64_RCV_MSG, (mach_msg_header_t){ }, 0,
+		    sizeof(buf), port, 0, 0);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg2(MACH64_RCV_MSG)");
+	}
+	elapsed = mach_absolute_time() - start;
+
+	mach_timebase_info(&tb);
+	return (double)ITERATIONS * NSEC_PER_SEC /
+	       ((double)elapsed * tb.numer / tb.denom);
+}
+
+T_DECL(kmsg_cache_reuse, "kmsgs are recycled through the per-cpu kmsg cache",
+    T_META_CHECK_LEAKS(false))
+{
+	static const mach_msg_size_t payloads[] = { 16, 200, 1000, 4000, MAX_PAYLOAD };
+	uint64_t hits, misses;
+	mach_port_t port;
+	kern_return_t kr;
+
+	if (kmsg_cache_disabled()) {
+		T_SKIP("the kmsg cache is disabled with ipc_kmsg_cache=0");
+	}
+
+	kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_allocate");
+	kr = mach_port_insert_right(mach_task_self(), port, port,
+	    MACH_MSG_TYPE_MAKE_SEND);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_insert_right");
+
+	for (size_t i = 0; i < sizeof(payloads) / sizeof(payloads[0]); i++) {
+		double rate;
+
+		hits = read_counter("debug.ipc_kmsg_cache_hits");
+		misses = read_counter("debug.ipc_kmsg_cache_misses");
+
+		rate = send_receive(port, payloads[i]);
+
+		hits = read_counter("debug.ipc_kmsg_cache_hits") - hits;
+		misses = read_counter("debug.ipc_kmsg_cache_misses") - misses;
+
+		T_LOG("%u byte messages: %.0f msgs/s, %llu cache hits, %llu misses",
+		    payloads[i], rate, hits, misses);
+		if (hits == 0 && misses == 0) {
+			T_SKIP("the kmsg cache isn't used on this kernel");
+		}
+		T_EXPECT_GT(hits, misses, "most %u byte kmsgs come from the cache",
+		    payloads[i]);
+	}
+
+	mach_port_destruct(mach_task_self(), port, -1, 0);
+}
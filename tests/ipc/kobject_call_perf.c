@@ -0,0 +1,112 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_status.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.ipc"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("IPC"),
+	T_META_TAG_PERF,
+	T_META_TAG_VM_NOT_ELIGIBLE,
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * Measures the latency of some of the most frequently called
+ * kernel MIG routines.
+ */
+
+#define ITERATIONS              200000
+
+#if defined(__arm64__)
+#define KOBJ_THREAD_STATE       ARM_THREAD_STATE64
+#define KOBJ_THREAD_STATE_COUNT ARM_THREAD_STATE64_COUNT
+typedef arm_thread_state64_t kobj_thread_state_t;
+#elif defined(__x86_64__)
+#define KOBJ_THREAD_STATE       x86_THREAD_STATE64
+#define KOBJ_THREAD_STATE_COUNT x86_THREAD_STATE64_COUNT
+typedef x86_thread_state64_t kobj_thread_state_t;
+#endif
+
+static mach_timebase_info_data_t timebase_info;
+
+static void
+report(const char *name, uint64_t elapsed)
+{
+	double ns = (double)elapsed * timebase_info.numer / timebase_info.denom /
+	    ITERATIONS;
+
+	T_LOG("%-24s %8.0f ns/call", name, ns);
+	T_PERF(name, ns, "ns", "average latency of the kernel MIG routine");
+}
+
+#define MEASURE(name, call) ({ \
+	uint64_t __start = mach_absolute_time(); \
+	for (int __i = 0; __i < ITERATIONS; __i++) { \
+	        kern_return_t __kr = (call); \
+	        T_QUIET; T_ASSERT_MACH_SUCCESS(__kr, name); \
+	} \
+	report(name, mach_absolute_time() - __start); \
+})
+
+#ifdef KOBJ_THREAD_STATE
+static void *
+idle_thread(void *arg __unused)
+{
+	for (;;) {
+		pause();
+	}
+	return NULL;
+}
+#endif /* KOBJ_THREAD_STATE */
+
+T_DECL(kobject_call_perf, "Measure the latency of common kernel MIG routines")
+{
+	task_basic_info_64_data_t tbi;
+	mach_msg_type_number_t count;
+	mach_port_urefs_t refs;
+	mach_port_context_t context;
+	mach_port_t port;
+	kern_return_t kr;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_timebase_info(&timebase_info),
+	    "mach_timebase_info");
+
+	kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_allocate");
+
+	MEASURE("task_info", (count = TASK_BASIC_INFO_64_COUNT,
+	    task_info(mach_task_self(), TASK_BASIC_INFO_64,
+	    (task_info_t)&tbi, &count)));
+
+	MEASURE("mach_port_get_refs", mach_port_get_refs(mach_task_self(),
+	    port, MACH_PORT_RIGHT_RECEIVE, &refs));
+
+	MEASURE("mach_port_get_context", mach_port_get_context(mach_task_self(),
+	    port, &context));
+
+#ifdef KOBJ_THREAD_STATE
+	kobj_thread_state_t state;
+	mach_port_t thread;
+	pthread_t pth;
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&pth, NULL, idle_thread, NULL),
+	    "pthread_create");
+	thread = pthread_mach_thread_np(pth);
+	kr = thread_suspend(thread);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "thread_suspend");
+
+	MEASURE("thread_get_state", (count = KOBJ_THREAD_STATE_COUNT,
+	    thread_get_state(thread, KOBJ_THREAD_STATE,
+	    (thread_state_t)&state, &count)));
+
+	thread_resume(thread);
+#endif /* KOBJ_THREAD_STATE */
+
+	mach_port_mod_refs(mach_task_self(), port, MACH_PORT_RIGHT_RECEIVE, -1);
+}
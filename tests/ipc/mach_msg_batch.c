@@ -0,0 +1,262 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/message.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.ipc"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("IPC"),
+	T_META_TAG_VM_PREFERRED);
+
+/* Skip the whole test on armv7k */
+#if defined(__LP64__) || defined (__arm64__)
+
+#define BATCH_SIZE              MACH_MSG_BATCH_MAX_COUNT
+#define PERF_MESSAGES           (1024 * 1024)
+
+typedef struct {
+	mach_msg_header_t header;
+	uint64_t seq;
+} batch_message_t;
+
+typedef struct {
+	batch_message_t msg;
+	mach_msg_max_trailer_t trailer;
+} batch_rcv_buffer_t;
+
+static mach_port_t
+batch_port_create(void)
+{
+	mach_port_limits_t limits = { .mpl_qlimit = MACH_PORT_QLIMIT_MAX };
+	mach_port_t port;
+	kern_return_t kr;
+
+	kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_allocate");
+	kr = mach_port_insert_right(mach_task_self(), port, port,
+	    MACH_MSG_TYPE_MAKE_SEND);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_insert_right");
+	kr = mach_port_set_attributes(mach_task_self(), port,
+	    MACH_PORT_LIMITS_INFO, (mach_port_info_t)&limits,
+	    MACH_PORT_LIMITS_INFO_COUNT);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_set_attributes");
+
+	return port;
+}
+
+static void
+batch_message_init(batch_message_t *msg, mach_port_t port, uint64_t seq)
+{
+	*msg = (batch_message_t){
+		.header = {
+			.msgh_bits = MACH_MSGH_BITS_SET(MACH_MSG_TYPE_COPY_SEND, 0, 0, 0),
+			.msgh_size = sizeof(*msg),
+			.msgh_remote_port = port,
+			.msgh_id = 0x42,
+		},
+		.seq = seq,
+	};
+}
+
+static mach_msg_return_t
+batch_send(mach_port_t port, uint64_t first_seq, mach_msg_size_t count)
+{
+	batch_message_t msgs[BATCH_SIZE];
+	mach_msg_batch_entry_t entries[BATCH_SIZE];
+	mach_msg_size_t processed = 0;
+	mach_msg_return_t mr;
+
+	for (mach_msg_size_t i = 0; i < count; i++) {
+		batch_message_init(&msgs[i], port, first_seq + i);
+		entries[i] = (mach_msg_batch_entry_t){
+			.msgb_data = (mach_vm_address_t)&msgs[i],
+			.msgb_size = sizeof(msgs[i]),
+		};
+	}
+
+	mr = mach_msg_batch(entries, count, MACH64_SEND_MSG | MACH64_SEND_MQ_CALL,
+	    MACH_PORT_NULL, 0, 0, &processed);
+	if (mr == MACH_MSG_SUCCESS) {
+		T_QUIET; T_ASSERT_EQ(processed, count, "every message was sent");
+	}
+	return mr;
+}
+
+static mach_msg_size_t
+batch_receive(mach_port_t port, batch_rcv_buffer_t *bufs, mach_msg_size_t count,
+    mach_msg_option64_t options, mach_msg_return_t *mrp)
+{
+	mach_msg_batch_entry_t entries[BATCH_SIZE];
+	mach_msg_size_t processed = 0;
+
+	for (mach_msg_size_t i = 0; i < count; i++) {
+		entries[i] = (mach_msg_batch_entry_t){
+			.msgb_data = (mach_vm_address_t)&bufs[i],
+			.msgb_size = sizeof(bufs[i]),
+		};
+	}
+
+	*mrp = mach_msg_batch(entries, count, MACH64_RCV_MSG | options, port,
+	    0, 0, &processed);
+	if (*mrp != MACH_MSG_SUCCESS) {
+		return 0;
+	}
+	for (mach_msg_size_t i = 0; i < processed; i++) {
+		T_QUIET; T_ASSERT_MACH_SUCCESS(entries[i].msgb_return,
+		    "entry %d received", i);
+	}
+	return processed;
+}
+
+T_DECL(mach_msg_batch_basic, "mach_msg_batch() sends and receives messages in order")
+{
+	batch_rcv_buffer_t bufs[BATCH_SIZE];
+	mach_port_t port = batch_port_create();
+	mach_msg_batch_entry_t entry = { };
+	mach_msg_size_t n, processed;
+	mach_msg_return_t mr;
+	uint64_t seq = 0;
+
+	mr = batch_send(port, 0, BATCH_SIZE);
+	T_ASSERT_MACH_SUCCESS(mr, "send a batch of %d messages", BATCH_SIZE);
+	mr = batch_send(port, BATCH_SIZE, BATCH_SIZE / 2);
+	T_ASSERT_MACH_SUCCESS(mr, "send a batch of %d messages", BATCH_SIZE / 2);
+
+	while (seq < BATCH_SIZE + BATCH_SIZE / 2) {
+		n = batch_receive(port, bufs, BATCH_SIZE, MACH64_RCV_TIMEOUT, &mr);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg_batch(MACH64_RCV_MSG)");
+		T_QUIET; T_ASSERT_GT(n, 0, "received messages");
+		for (mach_msg_size_t i = 0; i < n; i++) {
+			T_QUIET; T_ASSERT_EQ(bufs[i].msg.seq, seq, "messages are in order");
+			T_QUIET; T_ASSERT_EQ(bufs[i].msg.header.msgh_id, 0x42, "msgh_id");
+			seq++;
+		}
+	}
+	T_PASS("received %llu messages in order", seq);
+
+	entry = (mach_msg_batch_entry_t){
+		.msgb_data = (mach_vm_address_t)&bufs[0],
+		.msgb_size = sizeof(bufs[0]),
+	};
+	mr = mach_msg_batch(&entry, 1, MACH64_RCV_MSG | MACH64_RCV_TIMEOUT, port,
+	    0, 0, &processed);
+	T_EXPECT_EQ(mr, MACH_RCV_TIMED_OUT, "empty queue times out");
+	T_EXPECT_EQ(processed, 1, "the first entry reports the timeout");
+	T_EXPECT_EQ(entry.msgb_return, MACH_RCV_TIMED_OUT, "msgb_return");
+
+	mr = mach_msg_batch(&entry, 1, MACH64_SEND_MSG | MACH64_RCV_MSG |
+	    MACH64_SEND_MQ_CALL, port, 0, 0, &processed);
+	T_EXPECT_EQ(mr, MACH_SEND_INVALID_OPTIONS, "combined send/receive is rejected");
+
+	mr = mach_msg_batch(&entry, 0, MACH64_RCV_MSG, port, 0, 0, &processed);
+	T_EXPECT_EQ(mr, MACH_RCV_INVALID_ARGUMENTS, "empty batches are rejected");
+
+	mach_port_destruct(mach_task_self(), port, -1, 0);
+}
+
+#pragma mark throughput
+
+static mach_port_t perf_port;
+static bool perf_batched;
+static _Atomic bool perf_receiver_ready;
+
+static void *
+perf_receiver(void *arg __unused)
+{
+	batch_rcv_buffer_t bufs[BATCH_SIZE];
+	mach_msg_return_t mr;
+	uint64_t received = 0;
+
+	atomic_store(&perf_receiver_ready, true);
+	while (received < PERF_MESSAGES) {
+		if (perf_batched) {
+			received += batch_receive(perf_port, bufs, BATCH_SIZE, 0, &mr);
+			T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg_batch(MACH64_RCV_MSG)");
+			continue;
+		}
+
+		mr = mach_msg2(&bufs[0], MACH64_RCV_MSG, (mach_msg_header_t){ },
+		    0, sizeof(bufs[0]), perf_port, 0, 0);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg2(MACH64_RCV_MSG)");
+		received++;
+	}
+
+	return NULL;
+}
+
+static double
+perf_run(bool batched)
+{
+	mach_timebase_info_data_t tb;
+	batch_message_t msg;
+	pthread_t receiver;
+	uint64_t start, elapsed;
+	mach_msg_return_t mr;
+
+	perf_batched = batched;
+	atomic_store(&perf_receiver_ready, false);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&receiver, NULL,
+	    perf_receiver, NULL), "pthread_create");
+	while (!atomic_load(&perf_receiver_ready)) {
+		;
+	}
+
+	start = mach_absolute_time();
+	for (uint64_t seq = 0; seq < PERF_MESSAGES;) {
+		if (batched) {
+			mr = batch_send(perf_port, seq, BATCH_SIZE);
+			T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg_batch(MACH64_SEND_MSG)");
+			seq += BATCH_SIZE;
+			continue;
+		}
+
+		batch_message_init(&msg, perf_port, seq);
+		mr = mach_msg2(&msg, MACH64_SEND_MSG | MACH64_SEND_MQ_CALL,
+		    msg.header, sizeof(msg), 0, MACH_PORT_NULL, 0, 0);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg2(MACH64_SEND_MSG)");
+		seq++;
+	}
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(receiver, NULL), "pthread_join");
+	elapsed = mach_absolute_time() - start;
+
+	mach_timebase_info(&tb);
+	return (double)PERF_MESSAGES * NSEC_PER_SEC /
+	       ((double)elapsed * tb.numer / tb.denom);
+}
+
+T_DECL(mach_msg_batch_perf,
+    "Compare mach_msg_batch() and mach_msg2() messages per second",
+    T_META_TAG_PERF, T_META_TAG_VM_NOT_ELIGIBLE, T_META_CHECK_LEAKS(false))
+{
+	double single, batched;
+
+	static_assert(PERF_MESSAGES % BATCH_SIZE == 0);
+	perf_port = batch_port_create();
+
+	single = perf_run(false);
+	batched = perf_run(true);
+
+	T_LOG("mach_msg2: %.0f msgs/s, mach_msg_batch(%d): %.0f msgs/s (%.2fx)",
+	    single, BATCH_SIZE, batched, batched / single);
+	T_PERF("mach_msg2_rate", single, "msgs/s",
+	    "messages per second through a port with mach_msg2()");
+	T_PERF("mach_msg_batch_rate", batched, "msgs/s",
+	    "messages per second through a port with mach_msg_batch()");
+
+	mach_port_destruct(mach_task_self(), perf_port, -1, 0);
+}
+
+#else /* defined(__LP64__) || defined (__arm64__) */
+
+T_DECL(mach_msg_batch_unsupported, "mach_msg_batch() is only on LP64")
+{
+	T_SKIP("mach_msg_batch() is not supported on this platform");
+}
+
+#endif /* defined(__LP64__) || defined (__arm64__) */
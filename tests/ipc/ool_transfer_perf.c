@@ -0,0 +1,220 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/message.h>
+
+#include <stdio.h>
+#include <string.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.ipc"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("IPC"),
+	T_META_TAG_VM_PREFERRED);
+
+#define MIN_SIZE                (4ull << 10)
+#define MAX_SIZE                (64ull << 20)
+#define BYTES_PER_SIZE          (1ull << 30)
+#define MIN_ITERATIONS          16
+
+typedef struct {
+	mach_msg_header_t header;
+	mach_msg_body_t body;
+	mach_msg_ool_descriptor_t ool;
+} ool_message_t;
+
+typedef struct {
+	ool_message_t msg;
+	mach_msg_max_trailer_t trailer;
+} ool_rcv_buffer_t;
+
+static mach_port_t
+ool_port_create(void)
+{
+	mach_port_t port;
+	kern_return_t kr;
+
+	kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_allocate");
+	kr = mach_port_insert_right(mach_task_self(), port, port,
+	    MACH_MSG_TYPE_MAKE_SEND);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_insert_right");
+
+	return port;
+}
+
+static mach_vm_address_t
+ool_buffer_create(mach_vm_size_t size, uint8_t pattern)
+{
+	mach_vm_address_t addr = 0;
+	kern_return_t kr;
+
+	kr = mach_vm_allocate(mach_task_self(), &addr, size, VM_FLAGS_ANYWHERE);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_vm_allocate(%llu)", size);
+	memset((void *)addr, pattern, (size_t)size);
+
+	return addr;
+}
+
+static void
+ool_send(mach_port_t port, mach_vm_address_t addr, mach_vm_size_t size,
+    bool deallocate)
+{
+	ool_message_t msg = {
+		.header = {
+			.msgh_bits = MACH_MSGH_BITS_SET(MACH_MSG_TYPE_COPY_SEND, 0, 0,
+			    MACH_MSGH_BITS_COMPLEX),
+			.msgh_size = sizeof(msg),
+			.msgh_remote_port = port,
+		},
+		.body.msgh_descriptor_count = 1,
+		.ool = {
+			.address = (void *)addr,
+			.size = (mach_msg_size_t)size,
+			.deallocate = deallocate,
+			.copy = MACH_MSG_VIRTUAL_COPY,
+			.type = MACH_MSG_OOL_DESCRIPTOR,
+		},
+	};
+	mach_msg_return_t mr;
+
+	mr = mach_msg2(&msg, MACH64_SEND_MSG | MACH64_SEND_MQ_CALL, msg.header,
+	    sizeof(msg), 0, MACH_PORT_NULL, 0, 0);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg2(MACH64_SEND_MSG)");
+}
+
+static mach_vm_address_t
+ool_receive(mach_port_t port, mach_vm_size_t size)
+{
+	ool_rcv_buffer_t buf;
+	mach_msg_return_t mr;
+
+	mr = mach_msg2(&buf, MACH64_RCV_MSG, (mach_msg_header_t){ }, 0,
+	    sizeof(buf), port, 0, 0);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg2(MACH64_RCV_MSG)");
+	T_QUIET; T_ASSERT_EQ((mach_vm_size_t)buf.msg.ool.size, size,
+	    "received the whole region");
+
+	return (mach_vm_address_t)buf.msg.ool.address;
+}
+
+/* Read one word per page, the way a receiver consuming the data would */
+static uint64_t
+ool_touch(mach_vm_address_t addr, mach_vm_size_t size)
+{
+	uint64_t sum = 0;
+
+	for (mach_vm_size_t off = 0; off < size; off += vm_page_size) {
+		sum += *(volatile uint64_t *)(addr + off);
+	}
+	return sum;
+}
+
+static double
+ool_transfer(mach_port_t port, mach_vm_size_t size, bool deallocate)
+{
+	uint64_t iterations = BYTES_PER_SIZE / size;
+	mach_vm_address_t src = 0, dst;
+	mach_timebase_info_data_t tb;
+	uint64_t start, elapsed = 0;
+
+	if (iterations < MIN_ITERATIONS) {
+		iterations = MIN_ITERATIONS;
+	}
+	if (!deallocate) {
+		src = ool_buffer_create(size, 0x5a);
+	}
+
+	for (uint64_t i = 0; i < iterations; i++) {
+		if (deallocate) {
+			/* the buffer is given away, so each send needs a fresh one */
+			src = ool_buffer_create(size, 0x5a);
+		}
+
+		start = mach_absolute_time();
+		ool_send(port, src, size, deallocate);
+		dst = ool_receive(port, size);
+		ool_touch(dst, size);
+		elapsed += mach_absolute_time() - start;
+
+		T_QUIET; T_ASSERT_EQ(*(uint8_t *)(dst + size - 1), 0x5a,
+		    "received data is intact");
+		mach_vm_deallocate(mach_task_self(), dst, size);
+	}
+
+	if (!deallocate) {
+		mach_vm_deallocate(mach_task_self(), src, size);
+	}
+
+	mach_timebase_info(&tb);
+	return (double)elapsed * tb.numer / tb.denom / (double)iterations;
+}
+
+T_DECL(ool_transfer_cow, "OOL regions keep copy-on-write semantics",
+    T_META_CHECK_LEAKS(false))
+{
+	static const mach_vm_size_t sizes[] = { 16 << 10, 256 << 10, 1 << 20, 4 << 20 };
+	mach_port_t port = ool_port_create();
+
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		mach_vm_size_t size = sizes[i];
+		mach_vm_address_t src, dst;
+
+		src = ool_buffer_create(size, 0x11);
+		ool_send(port, src, size, false);
+		dst = ool_receive(port, size);
+
+		/* writes on either side must not be seen by the other */
+		memset((void *)src, 0x22, (size_t)size);
+		T_QUIET; T_EXPECT_EQ(*(uint8_t *)dst, 0x11,
+		    "sender writes aren't seen by the receiver");
+		memset((void *)dst, 0x33, (size_t)size);
+		T_QUIET; T_EXPECT_EQ(*(uint8_t *)(src + size - 1), 0x22,
+		    "receiver writes aren't seen by the sender");
+
+		mach_vm_deallocate(mach_task_self(), src, size);
+		mach_vm_deallocate(mach_task_self(), dst, size);
+
+		src = ool_buffer_create(size, 0x44);
+		ool_send(port, src, size, true);
+		dst = ool_receive(port, size);
+		T_QUIET; T_EXPECT_EQ(*(uint8_t *)(dst + size - 1), 0x44,
+		    "deallocated region is received intact");
+		memset((void *)dst, 0x55, (size_t)size);
+		mach_vm_deallocate(mach_task_self(), dst, size);
+
+		T_PASS("%llu byte OOL regions are copy-on-write", size);
+	}
+
+	mach_port_destruct(mach_task_self(), port, -1, 0);
+}
+
+T_DECL(ool_transfer_perf,
+    "Measure OOL descriptor send/receive latency from 4KB to 64MB",
+    T_META_TAG_PERF, T_META_TAG_VM_NOT_ELIGIBLE, T_META_CHECK_LEAKS(false))
+{
+	mach_port_t port = ool_port_create();
+
+	for (mach_vm_size_t size = MIN_SIZE; size <= MAX_SIZE; size <<= 1) {
+		double copy_ns, move_ns;
+		char name[64];
+
+		copy_ns = ool_transfer(port, size, false);
+		move_ns = ool_transfer(port, size, true);
+
+		T_LOG("%8llu KB: %10.0f ns copied, %10.0f ns deallocated (%.1f MB/s)",
+		    size >> 10, copy_ns, move_ns,
+		    (double)size * NSEC_PER_SEC / copy_ns / (1 << 20));
+
+		snprintf(name, sizeof(name), "ool_copy_%lluk", size >> 10);
+		T_PERF(name, copy_ns, "ns",
+		    "send and receive of an OOL region, then read every page");
+		snprintf(name, sizeof(name), "ool_dealloc_%lluk", size >> 10);
+		T_PERF(name, move_ns, "ns",
+		    "send with deallocate and receive of an OOL region, then read every page");
+	}
+
+	mach_port_destruct(mach_task_self(), port, -1, 0);
+}
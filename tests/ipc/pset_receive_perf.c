@@ -0,0 +1,278 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/message.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.ipc"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("IPC"),
+	T_META_TAG_PERF,
+	T_META_TAG_VM_NOT_ELIGIBLE,
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * Measures receive latency and throughput on a port set as its number
+ * of members grows, with one sender per receiver posting messages to
+ * random members of the set.
+ */
+
+#define MESSAGES_PER_THREAD     100000
+#define STOP_MSG_ID             0x5354
+
+typedef struct {
+	mach_msg_header_t header;
+	uint64_t sent_at;
+} pset_message_t;
+
+typedef struct {
+	pset_message_t msg;
+	mach_msg_max_trailer_t trailer;
+} pset_rcv_buffer_t;
+
+struct pset_thread {
+	pthread_t       thread;
+	uint32_t        seed;
+	uint64_t        received;
+	uint64_t       *latencies;
+};
+
+static mach_timebase_info_data_t timebase_info;
+static mach_port_t pset;
+static mach_port_t *members;
+static uint32_t nmembers;
+static _Atomic uint32_t threads_ready;
+static _Atomic uint64_t messages_received;
+static _Atomic bool go;
+
+static uint64_t
+abs_to_nanos(uint64_t abs)
+{
+	return abs * timebase_info.numer / timebase_info.denom;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+wait_for_go(void)
+{
+	atomic_fetch_add(&threads_ready, 1);
+	while (!atomic_load_explicit(&go, memory_order_relaxed)) {
+		;
+	}
+}
+
+static void
+pset_send(mach_port_t port, mach_msg_id_t id)
+{
+	pset_message_t msg = {
+		.header = {
+			.msgh_bits = MACH_MSGH_BITS_SET(MACH_MSG_TYPE_COPY_SEND, 0, 0, 0),
+			.msgh_size = sizeof(msg),
+			.msgh_remote_port = port,
+			.msgh_id = id,
+		},
+		.sent_at = mach_absolute_time(),
+	};
+	mach_msg_return_t mr;
+
+	mr = mach_msg2(&msg, MACH64_SEND_MSG | MACH64_SEND_MQ_CALL, msg.header,
+	    sizeof(msg), 0, MACH_PORT_NULL, 0, 0);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg2(MACH64_SEND_MSG)");
+}
+
+static void *
+sender_main(void *arg)
+{
+	struct pset_thread *pt = arg;
+
+	wait_for_go();
+	for (int i = 0; i < MESSAGES_PER_THREAD; i++) {
+		pset_send(members[rand_r(&pt->seed) % nmembers], 0);
+	}
+
+	return NULL;
+}
+
+static void *
+receiver_main(void *arg)
+{
+	struct pset_thread *pt = arg;
+	pset_rcv_buffer_t buf;
+	mach_msg_return_t mr;
+
+	wait_for_go();
+	for (;;) {
+		mr = mach_msg2(&buf, MACH64_RCV_MSG, (mach_msg_header_t){ }, 0,
+		    sizeof(buf), pset, 0, 0);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg2(MACH64_RCV_MSG)");
+		if (buf.msg.header.msgh_id == STOP_MSG_ID) {
+			break;
+		}
+		pt->latencies[pt->received++] =
+		    mach_absolute_time() - buf.msg.sent_at;
+		atomic_fetch_add_explicit(&messages_received, 1, memory_order_relaxed);
+	}
+
+	return NULL;
+}
+
+static void
+pset_create(uint32_t count)
+{
+	kern_return_t kr;
+
+	kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_PORT_SET, &pset);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_allocate(PORT_SET)");
+
+	members = calloc(count, sizeof(members[0]));
+	T_QUIET; T_ASSERT_NOTNULL(members, "calloc");
+	nmembers = count;
+
+	for (uint32_t i = 0; i < count; i++) {
+		kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE,
+		    &members[i]);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_allocate");
+		kr = mach_port_insert_right(mach_task_self(), members[i], members[i],
+		    MACH_MSG_TYPE_MAKE_SEND);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_insert_right");
+		kr = mach_port_insert_member(mach_task_self(), members[i], pset);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_insert_member");
+	}
+}
+
+static void
+pset_destroy(void)
+{
+	for (uint32_t i = 0; i < nmembers; i++) {
+		mach_port_destruct(mach_task_self(), members[i], -1, 0);
+	}
+	mach_port_mod_refs(mach_task_self(), pset, MACH_PORT_RIGHT_PORT_SET, -1);
+	free(members);
+}
+
+static void
+run_pset(uint32_t count, uint32_t nthreads)
+{
+	struct pset_thread *senders, *receivers;
+	uint64_t *latencies, nsamples = 0, start, elapsed;
+	double msgs_per_sec;
+	char name[64];
+
+	pset_create(count);
+
+	senders = calloc(nthreads, sizeof(*senders));
+	receivers = calloc(nthreads, sizeof(*receivers));
+	latencies = calloc((size_t)nthreads * MESSAGES_PER_THREAD,
+	    sizeof(*latencies));
+	T_QUIET; T_ASSERT_NOTNULL(senders, "calloc");
+	T_QUIET; T_ASSERT_NOTNULL(receivers, "calloc");
+	T_QUIET; T_ASSERT_NOTNULL(latencies, "calloc");
+
+	atomic_store(&threads_ready, 0);
+	atomic_store(&messages_received, 0);
+	atomic_store(&go, false);
+
+	for (uint32_t i = 0; i < nthreads; i++) {
+		/*
+		 * Any receiver can get any message, so each has room
+		 * for all of them.
+		 */
+		receivers[i].latencies = calloc((size_t)nthreads * MESSAGES_PER_THREAD,
+		    sizeof(uint64_t));
+		T_QUIET; T_ASSERT_NOTNULL(receivers[i].latencies, "calloc");
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&receivers[i].thread,
+		    NULL, receiver_main, &receivers[i]), "pthread_create");
+
+		senders[i].seed = i + 1;
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&senders[i].thread,
+		    NULL, sender_main, &senders[i]), "pthread_create");
+	}
+	while (atomic_load(&threads_ready) != 2 * nthreads) {
+		usleep(100);
+	}
+
+	start = mach_absolute_time();
+	atomic_store(&go, true);
+	for (uint32_t i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(senders[i].thread, NULL), NULL);
+	}
+	while (atomic_load(&messages_received) != (uint64_t)nthreads * MESSAGES_PER_THREAD) {
+		usleep(100);
+	}
+	elapsed = mach_absolute_time() - start;
+
+	/* every message was received, send one stop message per receiver */
+	for (uint32_t i = 0; i < nthreads; i++) {
+		pset_send(members[0], STOP_MSG_ID);
+	}
+	for (uint32_t i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(receivers[i].thread, NULL), NULL);
+	}
+
+	for (uint32_t i = 0; i < nthreads; i++) {
+		memcpy(latencies + nsamples, receivers[i].latencies,
+		    receivers[i].received * sizeof(uint64_t));
+		nsamples += receivers[i].received;
+		free(receivers[i].latencies);
+	}
+	T_QUIET; T_ASSERT_EQ(nsamples, (uint64_t)nthreads * MESSAGES_PER_THREAD,
+	    "every message was received");
+
+	qsort(latencies, nsamples, sizeof(latencies[0]), compare_u64);
+	msgs_per_sec = (double)nsamples * NSEC_PER_SEC / (double)abs_to_nanos(elapsed);
+
+	T_LOG("%6u members, %u receivers: %.0f msgs/s, p50 %llu ns, p99 %llu ns",
+	    count, nthreads, msgs_per_sec,
+	    abs_to_nanos(latencies[nsamples / 2]),
+	    abs_to_nanos(latencies[nsamples * 99 / 100]));
+
+	snprintf(name, sizeof(name), "pset_receive_rate_%u", count);
+	T_PERF(name, msgs_per_sec, "msgs/s",
+	    "messages per second received from a port set");
+	snprintf(name, sizeof(name), "pset_receive_p99_%u", count);
+	T_PERF(name, (double)abs_to_nanos(latencies[nsamples * 99 / 100]), "ns",
+	    "99th percentile latency from send to port set receive");
+
+	free(latencies);
+	free(receivers);
+	free(senders);
+	pset_destroy();
+}
+
+T_DECL(pset_receive_perf,
+    "Measure port set receive rate and latency from 10 to 100k members")
+{
+	uint32_t ncpus = 0;
+	size_t size = sizeof(ncpus);
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_timebase_info(&timebase_info),
+	    "mach_timebase_info");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpus, &size,
+	    NULL, 0), "hw.ncpu");
+	if (ncpus > 2) {
+		ncpus /= 2;
+	}
+
+	for (uint32_t count = 10; count <= 100000; count *= 10) {
+		run_pset(count, ncpus);
+	}
+
+	T_PASS("received from port sets of up to 100k members");
+}
@@ -0,0 +1,201 @@
+#include <darwintest.h>
+#include <darwintest_utils.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/message.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.ipc"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("IPC"),
+	T_META_TAG_PERF,
+	T_META_TAG_VM_NOT_ELIGIBLE,
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * Measures how fast threads can send to their own port while another
+ * thread keeps growing the IPC space to hundreds of thousands of rights.
+ */
+
+#define SENDS_PER_THREAD        200000
+#define GROWER_PORTS            300000
+
+typedef struct {
+	mach_msg_header_t header;
+} lookup_message_t;
+
+typedef struct {
+	lookup_message_t msg;
+	mach_msg_max_trailer_t trailer;
+} lookup_rcv_buffer_t;
+
+struct sender {
+	pthread_t       thread;
+	mach_port_t     port;
+	uint64_t        elapsed;
+};
+
+static mach_timebase_info_data_t timebase_info;
+static _Atomic uint32_t threads_ready;
+static _Atomic bool go;
+static _Atomic bool senders_done;
+
+static uint64_t
+abs_to_nanos(uint64_t abs)
+{
+	return abs * timebase_info.numer / timebase_info.denom;
+}
+
+static mach_port_t
+lookup_port_create(void)
+{
+	mach_port_t port;
+	kern_return_t kr;
+
+	kr = mach_port_allocate(mach_task_self(), MACH_PORT_RIGHT_RECEIVE, &port);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_allocate");
+	kr = mach_port_insert_right(mach_task_self(), port, port,
+	    MACH_MSG_TYPE_MAKE_SEND);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "mach_port_insert_right");
+
+	return port;
+}
+
+static void
+wait_for_go(void)
+{
+	atomic_fetch_add(&threads_ready, 1);
+	while (!atomic_load_explicit(&go, memory_order_relaxed)) {
+		;
+	}
+}
+
+static void *
+sender_main(void *arg)
+{
+	struct sender *s = arg;
+	lookup_message_t msg = {
+		.header = {
+			.msgh_bits = MACH_MSGH_BITS_SET(MACH_MSG_TYPE_COPY_SEND, 0, 0, 0),
+			.msgh_size = sizeof(msg),
+			.msgh_remote_port = s->port,
+		},
+	};
+	lookup_rcv_buffer_t buf;
+	mach_msg_return_t mr;
+	uint64_t start;
+
+	wait_for_go();
+	start = mach_absolute_time();
+	for (int i = 0; i < SENDS_PER_THREAD; i++) {
+		mr = mach_msg2(&msg, MACH64_SEND_MSG | MACH64_SEND_MQ_CALL,
+		    msg.header, sizeof(msg), 0, MACH_PORT_NULL, 0, 0);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg2(MACH64_SEND_MSG)");
+		mr = mach_msg2(&buf, MACH64_RCV_MSG, (mach_msg_header_t){ }, 0,
+		    sizeof(buf), s->port, 0, 0);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(mr, "mach_msg2(MACH64_RCV_MSG)");
+	}
+	s->elapsed = mach_absolute_time() - start;
+
+	return NULL;
+}
+
+static void *
+grower_main(void *arg)
+{
+	mach_port_t *ports = arg;
+	uint32_t n = 0;
+
+	wait_for_go();
+	while (n < GROWER_PORTS && !atomic_load(&senders_done)) {
+		ports[n] = lookup_port_create();
+		n++;
+	}
+	for (uint32_t i = 0; i < n; i++) {
+		mach_port_destruct(mach_task_self(), ports[i], -1, 0);
+	}
+
+	return NULL;
+}
+
+static double
+run_senders(uint32_t nthreads, bool grow)
+{
+	struct sender *senders;
+	mach_port_t *ports = NULL;
+	pthread_t grower;
+	uint64_t elapsed = 0;
+
+	senders = calloc(nthreads, sizeof(*senders));
+	T_QUIET; T_ASSERT_NOTNULL(senders, "calloc");
+
+	atomic_store(&threads_ready, 0);
+	atomic_store(&go, false);
+	atomic_store(&senders_done, false);
+
+	for (uint32_t i = 0; i < nthreads; i++) {
+		senders[i].port = lookup_port_create();
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&senders[i].thread, NULL,
+		    sender_main, &senders[i]), "pthread_create");
+	}
+	if (grow) {
+		ports = calloc(GROWER_PORTS, sizeof(*ports));
+		T_QUIET; T_ASSERT_NOTNULL(ports, "calloc");
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&grower, NULL,
+		    grower_main, ports), "pthread_create");
+	}
+	while (atomic_load(&threads_ready) != nthreads + grow) {
+		usleep(100);
+	}
+	atomic_store(&go, true);
+
+	for (uint32_t i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(senders[i].thread, NULL), NULL);
+		if (senders[i].elapsed > elapsed) {
+			elapsed = senders[i].elapsed;
+		}
+		mach_port_destruct(mach_task_self(), senders[i].port, -1, 0);
+	}
+	atomic_store(&senders_done, true);
+	if (grow) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(grower, NULL), NULL);
+		free(ports);
+	}
+	free(senders);
+
+	return (double)nthreads * SENDS_PER_THREAD * NSEC_PER_SEC /
+	       (double)abs_to_nanos(elapsed);
+}
+
+T_DECL(space_lookup_perf,
+    "Measure send rate while the IPC space grows to 300k rights")
+{
+	uint32_t ncpus = 0;
+	size_t size = sizeof(ncpus);
+	double idle, growing;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_timebase_info(&timebase_info),
+	    "mach_timebase_info");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpus, &size,
+	    NULL, 0), "hw.ncpu");
+	if (ncpus > 1) {
+		ncpus--;
+	}
+
+	idle = run_senders(ncpus, false);
+	growing = run_senders(ncpus, true);
+
+	T_LOG("%u senders: %.0f msgs/s, %.0f msgs/s while the space grows (%.2fx)",
+	    ncpus, idle, growing, growing / idle);
+	T_PERF("space_lookup_send_rate", idle, "msgs/s",
+	    "copy-send messages per second, one port per thread");
+	T_PERF("space_lookup_send_rate_growing", growing, "msgs/s",
+	    "copy-send messages per second while another thread allocates rights");
+}
@@ -0,0 +1,306 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <mach/mach_vm.h>
+#include <mach/mach_time.h>
+#include <sys/event.h>
+#include <sys/sysctl.h>
+
+#include <darwintest.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.kevent"),
+    T_META_RADAR_COMPONENT_NAME("xnu"),
+    T_META_RADAR_COMPONENT_VERSION("kevent"),
+    T_META_CHECK_LEAKS(false));
+
+/*
+ * Registers and harvests batches of always-writable pipes, either through
+ * the change and event lists of kevent_qos(), or through the shared ring
+ * of the kqueue (KEVENT_FLAG_RING).
+ */
+
+#define NUM_FDS                 1024
+#define RING_ENTRIES            2048
+#define ITERATIONS              2000
+
+static int fds[NUM_FDS][2];
+static struct kevent_qos_s kevs[NUM_FDS];
+
+static void
+pipes_create(void)
+{
+	for (int i = 0; i < NUM_FDS; i++) {
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(pipe(fds[i]), "pipe");
+	}
+}
+
+static void
+pipes_destroy(void)
+{
+	for (int i = 0; i < NUM_FDS; i++) {
+		close(fds[i][0]);
+		close(fds[i][1]);
+	}
+}
+
+static void
+changes_fill(uint16_t flags)
+{
+	for (int i = 0; i < NUM_FDS; i++) {
+		kevs[i] = (struct kevent_qos_s){
+			.ident  = (uint64_t)fds[i][1],
+			.filter = EVFILT_WRITE,
+			.flags  = flags,
+			.udata  = (uint64_t)i,
+		};
+	}
+}
+
+static struct kevent_ring_s *
+ring_create(int kq)
+{
+	uint64_t addr = 0;
+	int rc;
+
+	rc = kevent_qos(kq, NULL, 0, (struct kevent_qos_s *)&addr, RING_ENTRIES,
+	    NULL, NULL, KEVENT_FLAG_RING);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "kevent_qos(KEVENT_FLAG_RING) setup");
+	T_QUIET; T_ASSERT_NE(addr, 0ull, "the ring is mapped");
+
+	return (struct kevent_ring_s *)addr;
+}
+
+static void
+ring_destroy(struct kevent_ring_s *ring)
+{
+	mach_vm_size_t size = ring->kr_cq_offset +
+	    (mach_vm_size_t)ring->kr_entries * sizeof(struct kevent_qos_s);
+
+	mach_vm_deallocate(mach_task_self(), (mach_vm_address_t)ring,
+	    mach_vm_round_page(size));
+}
+
+static void
+ring_submit(struct kevent_ring_s *ring, const struct kevent_qos_s *changes,
+    int nchanges)
+{
+	_Atomic uint32_t *tailp = (_Atomic uint32_t *)&ring->kr_sq_tail;
+	_Atomic uint32_t *headp = (_Atomic uint32_t *)&ring->kr_sq_head;
+	uint32_t tail = atomic_load_explicit(tailp, memory_order_relaxed);
+	uint32_t mask = ring->kr_entries - 1;
+
+	T_QUIET; T_ASSERT_LE(tail + (uint32_t)nchanges -
+	    atomic_load_explicit(headp, memory_order_acquire), ring->kr_entries,
+	    "room in the submission queue");
+
+	for (int i = 0; i < nchanges; i++) {
+		KEVENT_RING_SQ(ring)[(tail + (uint32_t)i) & mask] = changes[i];
+	}
+	atomic_store_explicit(tailp, tail + (uint32_t)nchanges,
+	    memory_order_release);
+}
+
+static int
+ring_enter(int kq)
+{
+	int rc;
+
+	rc = kevent_qos(kq, NULL, 0, NULL, 0, NULL, NULL,
+	    KEVENT_FLAG_RING | KEVENT_FLAG_IMMEDIATE);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "kevent_qos(KEVENT_FLAG_RING)");
+	return rc;
+}
+
+/* Consumes every completion, returns how many had EV_ERROR set to a non 0 value */
+static int
+ring_reap(struct kevent_ring_s *ring, int expected)
+{
+	_Atomic uint32_t *tailp = (_Atomic uint32_t *)&ring->kr_cq_tail;
+	_Atomic uint32_t *headp = (_Atomic uint32_t *)&ring->kr_cq_head;
+	uint32_t head = atomic_load_explicit(headp, memory_order_relaxed);
+	uint32_t tail = atomic_load_explicit(tailp, memory_order_acquire);
+	uint32_t mask = ring->kr_entries - 1;
+	int errors = 0;
+
+	T_QUIET; T_ASSERT_EQ(tail - head, (uint32_t)expected, "completions posted");
+	for (; head != tail; head++) {
+		struct kevent_qos_s *kev = &KEVENT_RING_CQ(ring)[head & mask];
+
+		if ((kev->flags & EV_ERROR) && kev->data) {
+			errors++;
+		}
+	}
+	atomic_store_explicit(headp, head, memory_order_release);
+	return errors;
+}
+
+T_DECL(kevent_ring, "Register and harvest events through the kqueue shared ring")
+{
+	struct kevent_ring_s *ring;
+	uint64_t addr;
+	int kq, rc;
+
+	pipes_create();
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+
+	ring = ring_create(kq);
+	T_ASSERT_EQ(ring->kr_entries, RING_ENTRIES, "ring geometry");
+
+	rc = kevent_qos(kq, NULL, 0, (struct kevent_qos_s *)&addr, RING_ENTRIES,
+	    NULL, NULL, KEVENT_FLAG_RING);
+	T_ASSERT_POSIX_FAILURE(rc, EEXIST, "a kqueue has a single ring");
+
+	changes_fill(EV_ADD | EV_RECEIPT);
+	ring_submit(ring, kevs, NUM_FDS);
+	rc = ring_enter(kq);
+	T_ASSERT_EQ(rc, NUM_FDS, "one receipt per registration");
+	T_ASSERT_EQ(ring_reap(ring, rc), 0, "every registration succeeded");
+
+	rc = ring_enter(kq);
+	T_ASSERT_EQ(rc, NUM_FDS, "every pipe is writable");
+	T_ASSERT_EQ(ring_reap(ring, rc), 0, "no errors harvested");
+
+	kevs[0].ident = (uint64_t)-1;
+	kevs[0].flags = EV_ADD;
+	ring_submit(ring, kevs, 1);
+	rc = ring_enter(kq);
+	T_ASSERT_EQ(rc, 1, "registration errors are posted as completions");
+	T_ASSERT_EQ(ring_reap(ring, rc), 1, "the bad registration failed");
+
+	changes_fill(EV_ADD | EV_RECEIPT);
+	for (int i = 0; i < RING_ENTRIES / NUM_FDS; i++) {
+		ring_submit(ring, kevs, NUM_FDS);
+		T_QUIET; T_ASSERT_EQ(ring_enter(kq), NUM_FDS, "receipts posted");
+	}
+	ring_submit(ring, kevs, 1);
+	rc = kevent_qos(kq, NULL, 0, NULL, 0, NULL, NULL,
+	    KEVENT_FLAG_RING | KEVENT_FLAG_IMMEDIATE);
+	T_ASSERT_POSIX_FAILURE(rc, ENOSPC, "no room for the receipt");
+	T_ASSERT_NE(ring->kr_sq_head, ring->kr_sq_tail,
+	    "the registration is left in the submission queue");
+	ring_reap(ring, RING_ENTRIES);
+	rc = ring_enter(kq);
+	T_ASSERT_EQ(rc, 1, "the receipt is posted once there is room");
+	T_ASSERT_EQ(ring_reap(ring, rc), 0, "the registration succeeded");
+
+	close(kq);
+	T_ASSERT_EQ(ring->kr_entries, RING_ENTRIES, "the ring outlives the kqueue");
+	ring_destroy(ring);
+	pipes_destroy();
+}
+
+T_DECL(kevent_ring_limit, "The shared rings of a process are bounded")
+{
+	uint32_t max_bytes;
+	size_t size = sizeof(max_bytes);
+	uint64_t addr;
+	int kq, nkqs = 0, rc = 0;
+	int kqs[64];
+
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.kern_event.ring_max_bytes",
+	    &max_bytes, &size, NULL, 0), "kern.kern_event.ring_max_bytes");
+
+	while (nkqs < 64) {
+		kq = kqueue();
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+		kqs[nkqs++] = kq;
+
+		addr = 0;
+		rc = kevent_qos(kq, NULL, 0, (struct kevent_qos_s *)&addr,
+		    KEVENT_RING_MAX_ENTRIES, NULL, NULL, KEVENT_FLAG_RING);
+		if (rc < 0) {
+			break;
+		}
+		ring_destroy((struct kevent_ring_s *)addr);
+	}
+	T_ASSERT_POSIX_FAILURE(rc, ENOMEM, "ring creation fails after %d rings "
+	    "(%u bytes allowed)", nkqs - 1, max_bytes);
+
+	close(kqs[0]);
+	rc = kevent_qos(kq, NULL, 0, (struct kevent_qos_s *)&addr,
+	    KEVENT_RING_MAX_ENTRIES, NULL, NULL, KEVENT_FLAG_RING);
+	T_ASSERT_POSIX_SUCCESS(rc, "closing a kqueue gives its ring back");
+	ring_destroy((struct kevent_ring_s *)addr);
+
+	for (int i = 1; i < nkqs; i++) {
+		close(kqs[i]);
+	}
+}
+
+static mach_timebase_info_data_t timebase_info;
+
+static double
+per_event_ns(uint64_t elapsed)
+{
+	return (double)elapsed * timebase_info.numer / timebase_info.denom /
+	       ((double)ITERATIONS * NUM_FDS);
+}
+
+T_DECL(kevent_ring_perf,
+    "Compare the kqueue shared ring with kevent_qos() change and event lists",
+    T_META_TAG_PERF, T_META_TAG_VM_NOT_ELIGIBLE)
+{
+	static struct kevent_qos_s events[NUM_FDS];
+	struct kevent_ring_s *ring;
+	uint64_t start, list_elapsed, ring_elapsed;
+	int kq, rc;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_timebase_info(&timebase_info),
+	    "mach_timebase_info");
+	pipes_create();
+
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+	changes_fill(EV_ADD | EV_DISABLE);
+	rc = kevent_qos(kq, kevs, NUM_FDS, NULL, 0, NULL, NULL, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "register");
+
+	start = mach_absolute_time();
+	for (int i = 0; i < ITERATIONS; i++) {
+		changes_fill(EV_ENABLE);
+		rc = kevent_qos(kq, kevs, NUM_FDS, events, NUM_FDS, NULL, NULL,
+		    KEVENT_FLAG_IMMEDIATE);
+		T_QUIET; T_ASSERT_EQ(rc, NUM_FDS, "harvested every pipe");
+		changes_fill(EV_DISABLE);
+		rc = kevent_qos(kq, kevs, NUM_FDS, NULL, 0, NULL, NULL,
+		    KEVENT_FLAG_IMMEDIATE);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "disable");
+	}
+	list_elapsed = mach_absolute_time() - start;
+	close(kq);
+
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+	ring = ring_create(kq);
+	changes_fill(EV_ADD | EV_DISABLE);
+	ring_submit(ring, kevs, NUM_FDS);
+	T_QUIET; T_ASSERT_EQ(ring_enter(kq), 0, "register");
+
+	start = mach_absolute_time();
+	for (int i = 0; i < ITERATIONS; i++) {
+		changes_fill(EV_ENABLE);
+		ring_submit(ring, kevs, NUM_FDS);
+		rc = ring_enter(kq);
+		T_QUIET; T_ASSERT_EQ(rc, NUM_FDS, "harvested every pipe");
+		ring_reap(ring, rc);
+		changes_fill(EV_DISABLE);
+		ring_submit(ring, kevs, NUM_FDS);
+		ring_enter(kq);
+	}
+	ring_elapsed = mach_absolute_time() - start;
+	close(kq);
+	ring_destroy(ring);
+	pipes_destroy();
+
+	T_LOG("%d events per batch: %.1f ns/event with lists, %.1f ns/event "
+	    "with the ring (%.2fx)", NUM_FDS, per_event_ns(list_elapsed),
+	    per_event_ns(ring_elapsed),
+	    (double)list_elapsed / (double)ring_elapsed);
+	T_PERF("kevent_list_ns_per_event", per_event_ns(list_elapsed), "ns",
+	    "enable, harvest and disable of an event through kevent_qos() lists");
+	T_PERF("kevent_ring_ns_per_event", per_event_ns(ring_elapsed), "ns",
+	    "enable, harvest and disable of an event through the kqueue ring");
+}
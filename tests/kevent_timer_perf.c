@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+#include <sys/event.h>
+
+#include <darwintest.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.kevent"),
+    T_META_RADAR_COMPONENT_NAME("xnu"),
+    T_META_RADAR_COMPONENT_VERSION("kevent"),
+    T_META_CHECK_LEAKS(false));
+
+/*
+ * Arms many EVFILT_TIMER knotes on a single kqueue, the way servers
+ * with per-connection timeouts do, and checks that they all fire once,
+ * never early, whatever clock they use.
+ */
+
+#define NUM_TIMERS              100000
+#define NUM_FIRED               10000
+#define FIRE_WINDOW_US          200000
+
+static mach_timebase_info_data_t timebase_info;
+static uint64_t deadlines[NUM_TIMERS];
+static uint8_t fired[NUM_TIMERS];
+
+static uint64_t
+abs_to_nanos(uint64_t abs)
+{
+	return abs * timebase_info.numer / timebase_info.denom;
+}
+
+static uint64_t
+nanos_to_abs(uint64_t ns)
+{
+	return ns * timebase_info.denom / timebase_info.numer;
+}
+
+static void
+timer_register(int kq, uint64_t i, uint32_t fflags, int64_t us)
+{
+	struct kevent_qos_s kev = {
+		.ident  = i,
+		.filter = EVFILT_TIMER,
+		.flags  = EV_ADD | EV_ONESHOT,
+		.fflags = NOTE_USECONDS | fflags,
+		.data   = us,
+	};
+	int rc;
+
+	rc = kevent_qos(kq, &kev, 1, NULL, 0, NULL, NULL, KEVENT_FLAG_IMMEDIATE);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "register timer %llu", i);
+}
+
+static void
+timer_delete(int kq, uint64_t i)
+{
+	struct kevent_qos_s kev = {
+		.ident  = i,
+		.filter = EVFILT_TIMER,
+		.flags  = EV_DELETE,
+	};
+	int rc;
+
+	rc = kevent_qos(kq, &kev, 1, NULL, 0, NULL, NULL, KEVENT_FLAG_IMMEDIATE);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "delete timer %llu", i);
+}
+
+T_DECL(kevent_timer_many,
+    "Many timers on a kqueue fire once, in time, and can be moved or deleted")
+{
+	struct kevent_qos_s events[64];
+	uint64_t now;
+	int kq, n, received = 0;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_timebase_info(&timebase_info),
+	    "mach_timebase_info");
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+
+	for (uint64_t i = 0; i < NUM_FIRED; i++) {
+		/* spread timers over the window, every other one continuous */
+		int64_t us = (int64_t)((i * 7919) % FIRE_WINDOW_US) + 1;
+		uint32_t fflags = (i & 1) ? NOTE_MACH_CONTINUOUS_TIME : 0;
+
+		now = (i & 1) ? mach_continuous_time() : mach_absolute_time();
+		deadlines[i] = now + nanos_to_abs((uint64_t)us * NSEC_PER_USEC);
+		timer_register(kq, i, fflags, us);
+	}
+
+	/* move the first tenth far away, and delete the second tenth */
+	for (uint64_t i = 0; i < NUM_FIRED / 10; i++) {
+		timer_register(kq, i, (i & 1) ? NOTE_MACH_CONTINUOUS_TIME : 0,
+		    60 * USEC_PER_SEC);
+		timer_delete(kq, i + NUM_FIRED / 10);
+	}
+
+	while (received < NUM_FIRED * 8 / 10) {
+		n = kevent_qos(kq, NULL, 0, events, 64, NULL, NULL, 0);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "kevent_qos");
+
+		for (int j = 0; j < n; j++) {
+			uint64_t i = events[j].ident;
+
+			now = (i & 1) ? mach_continuous_time() : mach_absolute_time();
+			T_QUIET; T_ASSERT_GE(i, (uint64_t)NUM_FIRED / 5,
+			    "moved and deleted timers don't fire");
+			T_QUIET; T_ASSERT_GE(now, deadlines[i],
+			    "timer %llu doesn't fire early", i);
+			T_QUIET; T_ASSERT_EQ(fired[i], 0, "timer %llu fires once", i);
+			fired[i] = 1;
+		}
+		received += n;
+	}
+
+	n = kevent_qos(kq, NULL, 0, events, 64, NULL, NULL, KEVENT_FLAG_IMMEDIATE);
+	T_EXPECT_EQ(n, 0, "nothing fires beyond the expected timers");
+	T_PASS("%d timers fired once and in time", received);
+
+	close(kq);
+}
+
+T_DECL(kevent_timer_perf,
+    "Measure the cost of arming and deleting 100k timers on a kqueue",
+    T_META_TAG_PERF, T_META_TAG_VM_NOT_ELIGIBLE)
+{
+	uint64_t start, armed, deleted;
+	int kq;
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_timebase_info(&timebase_info),
+	    "mach_timebase_info");
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+
+	start = mach_absolute_time();
+	for (uint64_t i = 0; i < NUM_TIMERS; i++) {
+		/* per-connection timeouts, all between 30 and 60s */
+		timer_register(kq, i, 0, (int64_t)(30 + i % 30) * USEC_PER_SEC);
+	}
+	armed = mach_absolute_time() - start;
+
+	start = mach_absolute_time();
+	for (uint64_t i = 0; i < NUM_TIMERS; i++) {
+		timer_register(kq, i, 0, (int64_t)(60 - i % 30) * USEC_PER_SEC);
+	}
+	for (uint64_t i = 0; i < NUM_TIMERS; i++) {
+		timer_delete(kq, i);
+	}
+	deleted = mach_absolute_time() - start;
+
+	close(kq);
+
+	T_LOG("%d timers: %.0f ns to arm, %.0f ns to rearm and delete", NUM_TIMERS,
+	    (double)abs_to_nanos(armed) / NUM_TIMERS,
+	    (double)abs_to_nanos(deleted) / NUM_TIMERS);
+	T_PERF("kevent_timer_arm_ns", (double)abs_to_nanos(armed) / NUM_TIMERS,
+	    "ns", "registration of a timer on a kqueue with 100k timers");
+	T_PERF("kevent_timer_rearm_delete_ns",
+	    (double)abs_to_nanos(deleted) / NUM_TIMERS,
+	    "ns", "rearm and deletion of a timer on a kqueue with 100k timers");
+}
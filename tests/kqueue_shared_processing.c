@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <mach/mach_time.h>
+#include <sys/event.h>
+#include <sys/sysctl.h>
+
+#include <darwintest.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.kevent"),
+    T_META_RADAR_COMPONENT_NAME("xnu"),
+    T_META_RADAR_COMPONENT_VERSION("kevent"),
+    T_META_CHECK_LEAKS(false));
+
+/*
+ * A pool of threads harvests EV_DISPATCH user events from a single kqueue
+ * and re-arms them, either taking turns to process the kqueue or processing
+ * it at the same time (KEVENT_FLAG_SHARED_PROCESSING).
+ */
+
+#define NUM_KNOTES              4096
+#define EVENTS_PER_CALL         16
+#define EVENTS_PER_RUN          2000000
+#define EXCLUSIVE_CALLS         100
+#define EXCLUSIVE_DEADLINE      10      /* seconds */
+
+static _Atomic uint8_t in_flight[NUM_KNOTES];
+static _Atomic uint64_t delivered;
+static _Atomic uint64_t events_limit;
+static _Atomic uint32_t duplicates;
+static _Atomic uint32_t threads_ready;
+static _Atomic bool go;
+
+struct harvester {
+	pthread_t       thread;
+	int             kq;
+	int             flags;
+};
+
+static void
+harvest(int kq, int flags)
+{
+	struct kevent_qos_s events[EVENTS_PER_CALL];
+	struct kevent_qos_s changes[EVENTS_PER_CALL];
+	int n, rc;
+
+	n = kevent_qos(kq, NULL, 0, events, EVENTS_PER_CALL, NULL, NULL,
+	    KEVENT_FLAG_IMMEDIATE | flags);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "kevent_qos");
+
+	for (int i = 0; i < n; i++) {
+		/* EV_DISPATCH: never delivered again before being re-enabled */
+		if (atomic_exchange(&in_flight[events[i].ident], 1)) {
+			atomic_fetch_add(&duplicates, 1);
+		}
+		changes[i] = (struct kevent_qos_s){
+			.ident  = events[i].ident,
+			.filter = EVFILT_USER,
+			.flags  = EV_ENABLE,
+			.fflags = NOTE_TRIGGER,
+		};
+	}
+	atomic_fetch_add_explicit(&delivered, (uint64_t)n, memory_order_relaxed);
+
+	if (n) {
+		for (int i = 0; i < n; i++) {
+			atomic_store(&in_flight[events[i].ident], 0);
+		}
+		rc = kevent_qos(kq, changes, n, NULL, 0, NULL, NULL,
+		    KEVENT_FLAG_IMMEDIATE);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "re-arm");
+	}
+}
+
+static void *
+harvester_main(void *arg)
+{
+	struct harvester *h = arg;
+
+	atomic_fetch_add(&threads_ready, 1);
+	while (!atomic_load_explicit(&go, memory_order_relaxed)) {
+		;
+	}
+
+	while (atomic_load_explicit(&delivered, memory_order_relaxed) <
+	    atomic_load_explicit(&events_limit, memory_order_relaxed)) {
+		harvest(h->kq, h->flags);
+	}
+
+	return NULL;
+}
+
+static int
+harvest_kqueue(void)
+{
+	int kq, rc;
+
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+	for (int i = 0; i < NUM_KNOTES; i++) {
+		struct kevent_qos_s kev = {
+			.ident  = (uint64_t)i,
+			.filter = EVFILT_USER,
+			.flags  = EV_ADD | EV_CLEAR | EV_DISPATCH,
+			.fflags = NOTE_TRIGGER,
+		};
+
+		rc = kevent_qos(kq, &kev, 1, NULL, 0, NULL, NULL, 0);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "register");
+	}
+	return kq;
+}
+
+static struct harvester *
+harvesters_start(int kq, uint32_t nthreads, int flags, uint64_t limit)
+{
+	struct harvester *harvesters;
+
+	harvesters = calloc(nthreads, sizeof(*harvesters));
+	T_QUIET; T_ASSERT_NOTNULL(harvesters, "calloc");
+	atomic_store(&threads_ready, 0);
+	atomic_store(&delivered, 0);
+	atomic_store(&events_limit, limit);
+	atomic_store(&duplicates, 0);
+	atomic_store(&go, false);
+
+	for (uint32_t i = 0; i < nthreads; i++) {
+		harvesters[i].kq = kq;
+		harvesters[i].flags = flags;
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&harvesters[i].thread,
+		    NULL, harvester_main, &harvesters[i]), "pthread_create");
+	}
+	while (atomic_load(&threads_ready) != nthreads) {
+		usleep(100);
+	}
+	return harvesters;
+}
+
+static void
+harvesters_join(struct harvester *harvesters, uint32_t nthreads)
+{
+	for (uint32_t i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(harvesters[i].thread, NULL), NULL);
+	}
+	free(harvesters);
+}
+
+static double
+run_harvesters(uint32_t nthreads, int flags)
+{
+	struct harvester *harvesters;
+	mach_timebase_info_data_t tb;
+	uint64_t start, elapsed;
+	int kq;
+
+	kq = harvest_kqueue();
+	harvesters = harvesters_start(kq, nthreads, flags, EVENTS_PER_RUN);
+
+	start = mach_absolute_time();
+	atomic_store(&go, true);
+	harvesters_join(harvesters, nthreads);
+	elapsed = mach_absolute_time() - start;
+
+	T_EXPECT_EQ(atomic_load(&duplicates), 0u,
+	    "EV_DISPATCH events are delivered to a single thread at a time");
+
+	close(kq);
+
+	mach_timebase_info(&tb);
+	return (double)atomic_load(&delivered) * NSEC_PER_SEC /
+	       ((double)elapsed * tb.numer / tb.denom);
+}
+
+T_DECL(kqueue_shared_processing,
+    "Harvest a kqueue from many threads with and without shared processing",
+    T_META_TAG_PERF, T_META_TAG_VM_NOT_ELIGIBLE)
+{
+	uint32_t ncpus = 0;
+	size_t size = sizeof(ncpus);
+	double exclusive, shared;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpus, &size,
+	    NULL, 0), "hw.ncpu");
+
+	exclusive = run_harvesters(ncpus, 0);
+	shared = run_harvesters(ncpus, KEVENT_FLAG_SHARED_PROCESSING);
+
+	T_LOG("%u threads: %.0f events/s taking turns, %.0f events/s shared (%.2fx)",
+	    ncpus, exclusive, shared, shared / exclusive);
+	T_PERF("kqueue_exclusive_events_per_sec", exclusive, "events/s",
+	    "EV_DISPATCH events harvested by threads taking turns on a kqueue");
+	T_PERF("kqueue_shared_events_per_sec", shared, "events/s",
+	    "EV_DISPATCH events harvested with KEVENT_FLAG_SHARED_PROCESSING");
+}
+
+T_DECL(kqueue_shared_processing_exclusive,
+    "Shared processing threads don't starve exclusive ones",
+    T_META_TAG_VM_NOT_ELIGIBLE)
+{
+	struct harvester *harvesters;
+	mach_timebase_info_data_t tb;
+	uint32_t ncpus = 0;
+	size_t size = sizeof(ncpus);
+	struct pollfd pfd;
+	uint64_t deadline;
+	int kq;
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpus, &size,
+	    NULL, 0), "hw.ncpu");
+
+	kq = harvest_kqueue();
+	harvesters = harvesters_start(kq, ncpus, KEVENT_FLAG_SHARED_PROCESSING,
+	    UINT64_MAX);
+	atomic_store(&go, true);
+
+	mach_timebase_info(&tb);
+	deadline = mach_absolute_time() +
+	    (uint64_t)EXCLUSIVE_DEADLINE * NSEC_PER_SEC * tb.denom / tb.numer;
+
+	/* kevent() without the flag and poll() both process exclusively */
+	for (int i = 0; i < EXCLUSIVE_CALLS; i++) {
+		harvest(kq, 0);
+		pfd = (struct pollfd){ .fd = kq, .events = POLLIN };
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(poll(&pfd, 1, 0), "poll");
+		T_QUIET; T_ASSERT_LT(mach_absolute_time(), deadline,
+		    "%d exclusive calls in %d seconds", i + 1, EXCLUSIVE_DEADLINE);
+	}
+	T_PASS("%d exclusive calls alongside %u shared processing threads",
+	    EXCLUSIVE_CALLS, ncpus);
+
+	atomic_store(&events_limit, 0);
+	harvesters_join(harvesters, ncpus);
+	T_EXPECT_EQ(atomic_load(&duplicates), 0u,
+	    "EV_DISPATCH events are delivered to a single thread at a time");
+	close(kq);
+}
@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <pthread/qos_private.h>
+#include <sys/event.h>
+#include <sys/sysctl.h>
+
+#include <darwintest.h>
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.kevent"),
+    T_META_RADAR_COMPONENT_NAME("xnu"),
+    T_META_RADAR_COMPONENT_VERSION("kevent"),
+    T_META_TAG_PERF,
+    T_META_TAG_VM_NOT_ELIGIBLE,
+    T_META_CHECK_LEAKS(false));
+
+/*
+ * Creates a large number of dynamic workloops, then measures how fast
+ * concurrent threads can look them up by ID with kevent_id(), which
+ * exercises the per-process workloop hash table.
+ */
+
+#define NUM_WORKLOOPS           10000
+#define LOOKUPS_PER_THREAD      200000
+#define LATENCY_SAMPLES         20000
+#define WORKLOOP_ID_BASE        0x10000ull
+
+static mach_timebase_info_data_t timebase_info;
+static _Atomic uint32_t lookup_threads_ready;
+static _Atomic bool lookup_go;
+
+struct lookup_thread {
+	pthread_t       thread;
+	uint32_t        seed;
+	uint64_t        elapsed;
+	uint64_t        samples[LATENCY_SAMPLES];
+};
+
+static void
+create_workloop(kqueue_id_t id)
+{
+	struct kevent_qos_s kev = {
+		.filter = EVFILT_USER,
+		.ident  = 1,
+		.flags  = EV_ADD | EV_DISABLE,
+		.qos    = (int)_pthread_qos_class_encode(QOS_CLASS_DEFAULT, 0, 0),
+	};
+	int rc;
+
+	rc = kevent_id(id, &kev, 1, NULL, 0, NULL, NULL,
+	    KEVENT_FLAG_WORKLOOP | KEVENT_FLAG_IMMEDIATE |
+	    KEVENT_FLAG_DYNAMIC_KQ_MUST_NOT_EXIST);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "create workloop %#llx", id);
+}
+
+static void
+lookup_workloop(kqueue_id_t id)
+{
+	int rc;
+
+	rc = kevent_id(id, NULL, 0, NULL, 0, NULL, NULL,
+	    KEVENT_FLAG_WORKLOOP | KEVENT_FLAG_IMMEDIATE |
+	    KEVENT_FLAG_DYNAMIC_KQ_MUST_EXIST);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "lookup workloop %#llx", id);
+}
+
+static void *
+lookup_thread_main(void *arg)
+{
+	struct lookup_thread *lt = arg;
+	uint64_t start;
+
+	atomic_fetch_add(&lookup_threads_ready, 1);
+	while (!atomic_load_explicit(&lookup_go, memory_order_relaxed)) {
+		;
+	}
+
+	start = mach_absolute_time();
+	for (int i = 0; i < LOOKUPS_PER_THREAD; i++) {
+		kqueue_id_t id = WORKLOOP_ID_BASE +
+		    (uint64_t)(rand_r(&lt->seed) % NUM_WORKLOOPS);
+
+		if (i % (LOOKUPS_PER_THREAD / LATENCY_SAMPLES) == 0) {
+			uint64_t t = mach_absolute_time();
+
+			lookup_workloop(id);
+			lt->samples[i / (LOOKUPS_PER_THREAD / LATENCY_SAMPLES)] =
+			    mach_absolute_time() - t;
+		} else {
+			lookup_workloop(id);
+		}
+	}
+	lt->elapsed = mach_absolute_time() - start;
+
+	return NULL;
+}
+
+static uint64_t
+abs_to_nanos(uint64_t abs)
+{
+	return abs * timebase_info.numer / timebase_info.denom;
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+run_lookups(uint32_t nthreads)
+{
+	struct lookup_thread *threads;
+	uint64_t *samples, elapsed = 0;
+	size_t nsamples = (size_t)nthreads * LATENCY_SAMPLES;
+	double lookups_per_sec;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	samples = calloc(nsamples, sizeof(*samples));
+	T_QUIET; T_ASSERT_NOTNULL(threads, "calloc");
+	T_QUIET; T_ASSERT_NOTNULL(samples, "calloc");
+
+	atomic_store(&lookup_threads_ready, 0);
+	atomic_store(&lookup_go, false);
+
+	for (uint32_t i = 0; i < nthreads; i++) {
+		threads[i].seed = i + 1;
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&threads[i].thread, NULL,
+		    lookup_thread_main, &threads[i]), "pthread_create");
+	}
+	while (atomic_load(&lookup_threads_ready) != nthreads) {
+		usleep(100);
+	}
+	atomic_store(&lookup_go, true);
+
+	for (uint32_t i = 0; i < nthreads; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i].thread, NULL), NULL);
+		memcpy(samples + (size_t)i * LATENCY_SAMPLES, threads[i].samples,
+		    sizeof(threads[i].samples));
+		if (threads[i].elapsed > elapsed) {
+			elapsed = threads[i].elapsed;
+		}
+	}
+
+	qsort(samples, nsamples, sizeof(samples[0]), compare_u64);
+
+	lookups_per_sec = (double)nthreads * LOOKUPS_PER_THREAD * NSEC_PER_SEC /
+	    (double)abs_to_nanos(elapsed);
+
+	T_LOG("%u threads: %.0f lookups/s, p50 %llu ns, p99 %llu ns, p99.9 %llu ns",
+	    nthreads, lookups_per_sec,
+	    abs_to_nanos(samples[nsamples / 2]),
+	    abs_to_nanos(samples[nsamples * 99 / 100]),
+	    abs_to_nanos(samples[nsamples * 999 / 1000]));
+
+	if (nthreads == 1) {
+		T_PERF("workloop_lookup_rate_1thr", lookups_per_sec, "lookups/s",
+		    "kevent_id() workloop lookups per second, single thread");
+		T_PERF("workloop_lookup_p99_1thr",
+		    (double)abs_to_nanos(samples[nsamples * 99 / 100]), "ns",
+		    "99th percentile kevent_id() workloop lookup latency, single thread");
+	} else {
+		T_PERF("workloop_lookup_rate", lookups_per_sec, "lookups/s",
+		    "kevent_id() workloop lookups per second, one thread per CPU");
+		T_PERF("workloop_lookup_p50",
+		    (double)abs_to_nanos(samples[nsamples / 2]), "ns",
+		    "median kevent_id() workloop lookup latency, one thread per CPU");
+		T_PERF("workloop_lookup_p99",
+		    (double)abs_to_nanos(samples[nsamples * 99 / 100]), "ns",
+		    "99th percentile kevent_id() workloop lookup latency, one thread per CPU");
+	}
+
+	free(samples);
+	free(threads);
+}
+
+T_DECL(kqworkloop_lookup_perf,
+    "Measure kevent_id() lookup rate and latency with 10k workloops")
+{
+	uint32_t ncpus = 0;
+	size_t size = sizeof(ncpus);
+
+	T_QUIET; T_ASSERT_MACH_SUCCESS(mach_timebase_info(&timebase_info),
+	    "mach_timebase_info");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("hw.ncpu", &ncpus, &size,
+	    NULL, 0), "hw.ncpu");
+
+	for (uint64_t i = 0; i < NUM_WORKLOOPS; i++) {
+		create_workloop(WORKLOOP_ID_BASE + i);
+	}
+	T_LOG("created %d workloops", NUM_WORKLOOPS);
+
+	run_lookups(1);
+	run_lookups(ncpus);
+
+	T_PASS("looked up %d workloops from up to %u threads", NUM_WORKLOOPS, ncpus);
+}
@@ -0,0 +1,152 @@
+// Copyright (c) 2026 Apple Inc.  All rights reserved.
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/semaphore.h>
+#include <sys/sysctl.h>
+#include <stdatomic.h>
+
+#include <darwintest.h>
+#include <darwintest_utils.h>
+#include "sched_test_utils.h"
+
+T_GLOBAL_META(T_META_NAMESPACE("xnu.scheduler"),
+    T_META_RADAR_COMPONENT_NAME("xnu"),
+    T_META_RADAR_COMPONENT_VERSION("scheduler"),
+    T_META_TAG_PERF,
+    T_META_TAG_VM_NOT_ELIGIBLE);
+
+/*
+ * Measures how long it takes for every one of a large number of threads
+ * blocked on the same semaphore to get back on core after a single
+ * semaphore_signal_all(), which exercises the batched waitq wakeup path.
+ */
+
+#define NUM_WAITERS             1000
+#define NUM_ROUNDS              10
+#define WAITER_STACK_SIZE       (16 * 1024)
+
+static semaphore_t wake_sem;
+static _Atomic uint32_t waiters_ready;
+static uint64_t wake_time[NUM_WAITERS];
+
+static void *
+waiter(void *arg)
+{
+	uintptr_t idx = (uintptr_t)arg;
+	kern_return_t kr;
+
+	atomic_fetch_add_explicit(&waiters_ready, 1, memory_order_relaxed);
+	kr = semaphore_wait(wake_sem);
+	wake_time[idx] = mach_absolute_time();
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "semaphore_wait");
+
+	return NULL;
+}
+
+/* Wait until the waiter is blocked in semaphore_wait(), its only wait */
+static void
+waiter_wait_blocked(pthread_t thread)
+{
+	mach_port_t port = pthread_mach_thread_np(thread);
+	thread_basic_info_data_t info;
+	mach_msg_type_number_t count;
+	kern_return_t kr;
+
+	for (;;) {
+		count = THREAD_BASIC_INFO_COUNT;
+		kr = thread_info(port, THREAD_BASIC_INFO, (thread_info_t)&info, &count);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "thread_info");
+		if (info.run_state == TH_STATE_WAITING) {
+			return;
+		}
+		usleep(100);
+	}
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint64_t
+read_coalesced_ipis(void)
+{
+	uint64_t value = 0;
+	size_t size = sizeof(value);
+
+	/* only exported on DEVELOPMENT and DEBUG kernels */
+	(void)sysctlbyname("debug.sched_ipi_batch_coalesced", &value, &size, NULL, 0);
+	return value;
+}
+
+T_DECL(broadcast_wakeup_latency,
+    "Measure wake latency of a semaphore broadcast to 1000 waiters")
+{
+	static pthread_t threads[NUM_WAITERS];
+	uint64_t p50 = 0, p99 = 0, max = 0, coalesced;
+	pthread_attr_t attr;
+	kern_return_t kr;
+
+	wait_for_quiescence_default(argc, argv);
+
+	kr = semaphore_create(mach_task_self(), &wake_sem, SYNC_POLICY_FIFO, 0);
+	T_ASSERT_MACH_SUCCESS(kr, "semaphore_create");
+
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_attr_init(&attr), NULL);
+	T_QUIET; T_ASSERT_POSIX_ZERO(pthread_attr_setstacksize(&attr,
+	    WAITER_STACK_SIZE), NULL);
+
+	coalesced = read_coalesced_ipis();
+
+	for (int round = 0; round < NUM_ROUNDS; round++) {
+		uint64_t start;
+
+		atomic_store(&waiters_ready, 0);
+		for (uintptr_t i = 0; i < NUM_WAITERS; i++) {
+			create_thread(&threads[i], &attr, waiter, (void *)i);
+		}
+		while (atomic_load(&waiters_ready) != NUM_WAITERS) {
+			usleep(1000);
+		}
+		for (int i = 0; i < NUM_WAITERS; i++) {
+			waiter_wait_blocked(threads[i]);
+		}
+
+		start = mach_absolute_time();
+		kr = semaphore_signal_all(wake_sem);
+		T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "semaphore_signal_all");
+
+		for (int i = 0; i < NUM_WAITERS; i++) {
+			T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(threads[i], NULL), NULL);
+			wake_time[i] -= start;
+		}
+
+		qsort(wake_time, NUM_WAITERS, sizeof(wake_time[0]), compare_u64);
+		p50 += abs_to_nanos(wake_time[NUM_WAITERS / 2]);
+		p99 += abs_to_nanos(wake_time[NUM_WAITERS * 99 / 100]);
+		max += abs_to_nanos(wake_time[NUM_WAITERS - 1]);
+	}
+
+	coalesced = read_coalesced_ipis() - coalesced;
+
+	T_LOG("%d waiters, average over %d rounds: p50 %llu ns, p99 %llu ns, "
+	    "max %llu ns, %llu IPIs coalesced", NUM_WAITERS, NUM_ROUNDS,
+	    p50 / NUM_ROUNDS, p99 / NUM_ROUNDS, max / NUM_ROUNDS, coalesced);
+	T_PERF("broadcast_wake_p50", (double)(p50 / NUM_ROUNDS), "ns",
+	    "median wake latency after semaphore_signal_all");
+	T_PERF("broadcast_wake_p99", (double)(p99 / NUM_ROUNDS), "ns",
+	    "99th percentile wake latency after semaphore_signal_all");
+	T_PERF("broadcast_wake_max", (double)(max / NUM_ROUNDS), "ns",
+	    "time for all waiters to be back on core after semaphore_signal_all");
+
+	pthread_attr_destroy(&attr);
+	semaphore_destroy(mach_task_self(), wake_sem);
+	T_PASS("all %d waiters woke up in each of %d rounds", NUM_WAITERS, NUM_ROUNDS);
+}
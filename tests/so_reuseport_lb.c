@@ -0,0 +1,237 @@
+#include <darwintest.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * Sockets sharing a port with SO_REUSEPORT form a load balancing group:
+ * incoming connections and datagrams are spread over all of them, and
+ * flows stay with their socket when another member leaves the group.
+ */
+
+#define NUM_MEMBERS             4
+#define NUM_FLOWS               400
+
+static int members[NUM_MEMBERS];
+static struct sockaddr_in group_addr;
+
+static void
+group_create(int type, in_addr_t addr)
+{
+	socklen_t len = sizeof(group_addr);
+	int one = 1, rc;
+
+	group_addr = (struct sockaddr_in){
+		.sin_len = sizeof(group_addr),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(addr),
+	};
+
+	for (int i = 0; i < NUM_MEMBERS; i++) {
+		members[i] = socket(AF_INET, type, 0);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(members[i], "socket");
+		rc = setsockopt(members[i], SOL_SOCKET, SO_REUSEPORT, &one,
+		    sizeof(one));
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "SO_REUSEPORT");
+		rc = fcntl(members[i], F_SETFL, O_NONBLOCK);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "O_NONBLOCK");
+		rc = bind(members[i], (struct sockaddr *)&group_addr,
+		    sizeof(group_addr));
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "bind");
+		if (i == 0) {
+			rc = getsockname(members[0], (struct sockaddr *)&group_addr,
+			    &len);
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "getsockname");
+		}
+		if (type == SOCK_STREAM) {
+			rc = listen(members[i], NUM_FLOWS);
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "listen");
+		}
+	}
+}
+
+static void
+check_spread(const int *counts, int nmembers, int total)
+{
+	for (int i = 0; i < nmembers; i++) {
+		T_LOG("member %d: %d flows", i, counts[i]);
+		/* a fair share is total / nmembers, allow for hash imbalance */
+		T_EXPECT_GE(counts[i], total / nmembers / 2,
+		    "member %d gets a share of the flows", i);
+	}
+}
+
+T_DECL(so_reuseport_lb_tcp,
+    "Connections to SO_REUSEPORT listeners are spread over the listeners")
+{
+	int counts[NUM_MEMBERS] = { 0 };
+	int fds[NUM_FLOWS];
+
+	group_create(SOCK_STREAM, INADDR_LOOPBACK);
+
+	for (int n = 0; n < NUM_FLOWS; n++) {
+		int rc, fd = -1;
+
+		fds[n] = socket(AF_INET, SOCK_STREAM, 0);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(fds[n], "socket");
+		rc = connect(fds[n], (struct sockaddr *)&group_addr,
+		    sizeof(group_addr));
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "connect");
+
+		for (int tries = 0; fd < 0 && tries < 1000; tries++) {
+			for (int i = 0; i < NUM_MEMBERS && fd < 0; i++) {
+				fd = accept(members[i], NULL, NULL);
+				if (fd >= 0) {
+					counts[i]++;
+					close(fd);
+				} else {
+					T_QUIET; T_ASSERT_EQ(errno, EWOULDBLOCK, "accept");
+				}
+			}
+			if (fd < 0) {
+				usleep(1000);
+			}
+		}
+		T_QUIET; T_ASSERT_GE(fd, 0, "connection %d is accepted", n);
+	}
+
+	check_spread(counts, NUM_MEMBERS, NUM_FLOWS);
+
+	for (int n = 0; n < NUM_FLOWS; n++) {
+		close(fds[n]);
+	}
+	for (int i = 0; i < NUM_MEMBERS; i++) {
+		close(members[i]);
+	}
+}
+
+static int senders[NUM_FLOWS];
+static int owner[NUM_FLOWS];
+
+static void
+udp_round(int first, int *counts)
+{
+	char buf[16];
+	ssize_t len;
+
+	for (int n = 0; n < NUM_FLOWS; n++) {
+		len = send(senders[n], &n, sizeof(n), 0);
+		T_QUIET; T_ASSERT_EQ(len, (ssize_t)sizeof(n), "send");
+	}
+	usleep(100000);
+
+	for (int i = first; i < NUM_MEMBERS; i++) {
+		while ((len = recv(members[i], buf, sizeof(buf), 0)) > 0) {
+			int n;
+
+			T_QUIET; T_ASSERT_EQ(len, (ssize_t)sizeof(n), "recv");
+			memcpy(&n, buf, sizeof(n));
+			if (first > 0 && owner[n] >= first) {
+				T_QUIET; T_EXPECT_EQ(i, owner[n],
+				    "flow %d stays with member %d", n, owner[n]);
+			}
+			owner[n] = i;
+			counts[i]++;
+		}
+		T_QUIET; T_ASSERT_EQ(errno, EWOULDBLOCK, "recv");
+	}
+}
+
+T_DECL(so_reuseport_lb_udp,
+    "Datagrams to SO_REUSEPORT sockets are spread over the sockets")
+{
+	int counts[NUM_MEMBERS] = { 0 };
+	int total = 0;
+
+	group_create(SOCK_DGRAM, INADDR_LOOPBACK);
+
+	for (int n = 0; n < NUM_FLOWS; n++) {
+		int rc;
+
+		senders[n] = socket(AF_INET, SOCK_DGRAM, 0);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(senders[n], "socket");
+		rc = connect(senders[n], (struct sockaddr *)&group_addr,
+		    sizeof(group_addr));
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "connect");
+	}
+
+	udp_round(0, counts);
+	check_spread(counts, NUM_MEMBERS, NUM_FLOWS);
+
+	/* the flows of a member leaving are spread over the others */
+	close(members[0]);
+	memset(counts, 0, sizeof(counts));
+	udp_round(1, counts);
+	for (int i = 1; i < NUM_MEMBERS; i++) {
+		total += counts[i];
+	}
+	T_EXPECT_EQ(total, NUM_FLOWS, "every datagram is received");
+	check_spread(counts + 1, NUM_MEMBERS - 1, NUM_FLOWS);
+
+	for (int n = 0; n < NUM_FLOWS; n++) {
+		close(senders[n]);
+	}
+	for (int i = 1; i < NUM_MEMBERS; i++) {
+		close(members[i]);
+	}
+}
+
+T_DECL(so_reuseport_lb_exact_addr,
+    "A listener bound to the address wins over a wildcard SO_REUSEPORT group")
+{
+	struct sockaddr_in sin;
+	int listener, one = 1, rc;
+
+	group_create(SOCK_STREAM, INADDR_ANY);
+
+	sin = group_addr;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listener, "socket");
+	rc = setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "SO_REUSEADDR");
+	rc = fcntl(listener, F_SETFL, O_NONBLOCK);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "O_NONBLOCK");
+	T_ASSERT_POSIX_SUCCESS(bind(listener, (struct sockaddr *)&sin,
+	    sizeof(sin)), "bind 127.0.0.1 next to the wildcard group");
+	rc = listen(listener, NUM_MEMBERS * 4);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "listen");
+
+	for (int n = 0; n < NUM_MEMBERS * 4; n++) {
+		int fd = -1, conn;
+
+		conn = socket(AF_INET, SOCK_STREAM, 0);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(conn, "socket");
+		rc = connect(conn, (struct sockaddr *)&sin, sizeof(sin));
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "connect");
+
+		for (int tries = 0; fd < 0 && tries < 1000; tries++) {
+			fd = accept(listener, NULL, NULL);
+			if (fd < 0) {
+				T_QUIET; T_ASSERT_EQ(errno, EWOULDBLOCK, "accept");
+				usleep(1000);
+			}
+		}
+		T_QUIET; T_ASSERT_GE(fd, 0, "connection %d goes to the listener", n);
+		close(fd);
+		close(conn);
+	}
+
+	for (int i = 0; i < NUM_MEMBERS; i++) {
+		T_EXPECT_POSIX_FAILURE(accept(members[i], NULL, NULL), EWOULDBLOCK,
+		    "member %d of the wildcard group got no connection", i);
+		close(members[i]);
+	}
+	close(listener);
+}
@@ -0,0 +1,231 @@
+#include <darwintest.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/event.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * With SO_ZEROCOPY, a large write is sent from the user pages and is
+ * reported complete once the stack is done with them; a small one is
+ * copied and reported complete as such.
+ */
+
+#define LARGE_SIZE      (64 * 1024)
+#define SMALL_SIZE      100
+
+static char rcvbuf[LARGE_SIZE];
+
+static void
+tcp_pair(int *client, int *server)
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct timeval tv = { .tv_sec = 5 };
+	socklen_t len = sizeof(sin);
+	int listener, rc;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listener, "socket");
+	rc = bind(listener, (struct sockaddr *)&sin, sizeof(sin));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "bind");
+	rc = getsockname(listener, (struct sockaddr *)&sin, &len);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "getsockname");
+	rc = listen(listener, 1);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "listen");
+
+	*client = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(*client, "socket");
+	rc = connect(*client, (struct sockaddr *)&sin, sizeof(sin));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "connect");
+	*server = accept(listener, NULL, NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(*server, "accept");
+	close(listener);
+
+	rc = setsockopt(*server, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "SO_RCVTIMEO");
+}
+
+static void
+recv_all(int fd, char *buf, size_t size)
+{
+	size_t received = 0;
+	ssize_t len;
+
+	while (received < size) {
+		len = recv(fd, buf + received, size - received, 0);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(len, "recv at %zu", received);
+		T_QUIET; T_ASSERT_GT(len, 0L, "no EOF at %zu", received);
+		received += (size_t)len;
+	}
+}
+
+/*
+ * Wait for the completion of writes 0 to count - 1 and return the
+ * copied flag of each in copied[].
+ */
+static void
+wait_complete(int fd, int count, int *copied)
+{
+	struct so_zerocopy_complete zcc;
+	struct kevent kev;
+	struct timespec ts = { .tv_sec = 5 };
+	socklen_t optlen;
+	int kq, done = 0, rc;
+
+	kq = kqueue();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(kq, "kqueue");
+	EV_SET(&kev, fd, EVFILT_SOCK, EV_ADD | EV_CLEAR, NOTE_ZEROCOPY, 0, NULL);
+	rc = kevent(kq, &kev, 1, NULL, 0, NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "kevent EV_ADD");
+
+	for (int i = 0; i < count; i++) {
+		copied[i] = -1;
+	}
+	while (done < count) {
+		rc = kevent(kq, NULL, 0, &kev, 1, &ts);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "kevent");
+		T_QUIET; T_ASSERT_EQ(rc, 1, "NOTE_ZEROCOPY before the timeout");
+		T_QUIET; T_EXPECT_TRUE(kev.fflags & NOTE_ZEROCOPY, "NOTE_ZEROCOPY");
+
+		optlen = sizeof(zcc);
+		rc = getsockopt(fd, SOL_SOCKET, SO_ZEROCOPY_COMPLETE, &zcc,
+		    &optlen);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "SO_ZEROCOPY_COMPLETE");
+		for (u_int32_t r = 0; r < zcc.zc_count; r++) {
+			struct so_zerocopy_range *zr = &zcc.zc_ranges[r];
+
+			T_QUIET; T_ASSERT_LT(zr->zr_last, (u_int32_t)count,
+			    "range %u-%u", zr->zr_first, zr->zr_last);
+			for (u_int32_t id = zr->zr_first; id <= zr->zr_last; id++) {
+				T_QUIET; T_EXPECT_EQ(copied[id], -1,
+				    "write %u completed once", id);
+				copied[id] = zr->zr_copied;
+				done++;
+			}
+		}
+	}
+	close(kq);
+}
+
+T_DECL(so_zerocopy_send, "Large writes are sent in place, small ones copied")
+{
+	char *sndbuf;
+	int client, server, on = 1, copied[2];
+	ssize_t len;
+
+	sndbuf = mmap(NULL, LARGE_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)sndbuf, MAP_FAILED, "mmap");
+	for (size_t i = 0; i < LARGE_SIZE; i++) {
+		sndbuf[i] = (char)(i * 7);
+	}
+
+	tcp_pair(&client, &server);
+	T_ASSERT_POSIX_SUCCESS(setsockopt(client, SOL_SOCKET, SO_ZEROCOPY,
+	    &on, sizeof(on)), "SO_ZEROCOPY");
+
+	len = send(client, sndbuf, LARGE_SIZE, 0);
+	T_QUIET; T_ASSERT_EQ(len, (ssize_t)LARGE_SIZE, "send");
+	len = send(client, sndbuf, SMALL_SIZE, 0);
+	T_QUIET; T_ASSERT_EQ(len, (ssize_t)SMALL_SIZE, "send");
+
+	recv_all(server, rcvbuf, LARGE_SIZE);
+	T_EXPECT_EQ(memcmp(rcvbuf, sndbuf, LARGE_SIZE), 0,
+	    "%d bytes sent in place read back", LARGE_SIZE);
+	recv_all(server, rcvbuf, SMALL_SIZE);
+	T_EXPECT_EQ(memcmp(rcvbuf, sndbuf, SMALL_SIZE), 0,
+	    "%d bytes copied read back", SMALL_SIZE);
+
+	wait_complete(client, 2, copied);
+	T_EXPECT_EQ(copied[0], 0, "the large write was not copied");
+	T_EXPECT_EQ(copied[1], 1, "the small write was copied");
+
+	close(client);
+	close(server);
+	munmap(sndbuf, LARGE_SIZE);
+}
+
+T_DECL(so_zerocopy_unaligned,
+    "Writes after an unaligned write don't land in the user pages")
+{
+	size_t map_size = LARGE_SIZE + 2 * PAGE_SIZE;
+	size_t offset = 100, size = LARGE_SIZE - 300;
+	char *map, *saved, small[SMALL_SIZE];
+	int client, server, on = 1, copied[2];
+	ssize_t len;
+
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+	    MAP_ANON | MAP_PRIVATE, -1, 0);
+	T_QUIET; T_ASSERT_NE((void *)map, MAP_FAILED, "mmap");
+	for (size_t i = 0; i < map_size; i++) {
+		map[i] = (char)(i * 13);
+	}
+	saved = malloc(map_size);
+	T_QUIET; T_ASSERT_NOTNULL(saved, "malloc");
+	memcpy(saved, map, map_size);
+	memset(small, 'x', sizeof(small));
+
+	tcp_pair(&client, &server);
+	T_ASSERT_POSIX_SUCCESS(setsockopt(client, SOL_SOCKET, SO_ZEROCOPY,
+	    &on, sizeof(on)), "SO_ZEROCOPY");
+
+	/* the buffer starts and ends in the middle of a page */
+	len = send(client, map + offset, size, 0);
+	T_QUIET; T_ASSERT_EQ(len, (ssize_t)size, "send");
+	len = send(client, small, SMALL_SIZE, 0);
+	T_QUIET; T_ASSERT_EQ(len, (ssize_t)SMALL_SIZE, "send");
+
+	recv_all(server, rcvbuf, size + SMALL_SIZE);
+	T_EXPECT_EQ(memcmp(rcvbuf, map + offset, size), 0,
+	    "%zu bytes sent in place read back", size);
+	T_EXPECT_EQ(memcmp(rcvbuf + size, small, SMALL_SIZE), 0,
+	    "%d bytes copied read back", SMALL_SIZE);
+	wait_complete(client, 2, copied);
+	T_EXPECT_EQ(copied[0], 0, "the unaligned write was not copied");
+
+	T_EXPECT_EQ(memcmp(map, saved, map_size), 0,
+	    "the pages around the buffer are unchanged");
+
+	close(client);
+	close(server);
+	free(saved);
+	munmap(map, map_size);
+}
+
+T_DECL(so_zerocopy_setsockopt, "SO_ZEROCOPY is only for TCP")
+{
+	int fd, on = 1, optval = 0;
+	socklen_t optlen = sizeof(optval);
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "socket");
+	T_EXPECT_POSIX_FAILURE(setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on,
+	    sizeof(on)), EOPNOTSUPP, "UDP sockets are refused");
+	close(fd);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "socket");
+	T_ASSERT_POSIX_SUCCESS(setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on,
+	    sizeof(on)), "SO_ZEROCOPY");
+	T_ASSERT_POSIX_SUCCESS(getsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &optval,
+	    &optlen), "SO_ZEROCOPY");
+	T_EXPECT_EQ(optval, 1, "SO_ZEROCOPY is set");
+	close(fd);
+}
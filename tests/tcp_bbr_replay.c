@@ -0,0 +1,962 @@
+#include <darwintest.h>
+
+#include <sys/ioctl.h>
+#include <sys/kern_control.h>
+#include <sys/param.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/sys_domain.h>
+#include <sys/sysctl.h>
+
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/bpf.h>
+#include <net/ethernet.h>
+#include <net/ntstat.h>
+
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_cc.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mach/mach_time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "net_test_lib.h"
+#include "bpflib.h"
+#include "in_cksum.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_ASROOT(true),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_TAG_VM_NOT_ELIGIBLE,
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * Replays a bottleneck link against a local TCP sender using BBR.  A
+ * socket connects over a feth interface to an address that only exists as
+ * a scripted receiver reading and writing frames with bpf on the peer
+ * interface.  The receiver plays the part of a link of LINK_RATE bytes per
+ * second with a round trip time of LINK_DELAY and a tail drop queue of
+ * LINK_QUEUE bytes: a segment is delivered, and acknowledged with SACK
+ * blocks, once it has gone through the queue and the delay.  From
+ * LOSS_OFFSET on, the first transmission of one segment in LOSS_EVERY is
+ * also dropped.
+ *
+ * While the transfer runs, the path model of the connection is polled
+ * with ntstat.  The bandwidth and min_rtt estimates must match the link,
+ * the pacing rate and the congestion window must follow from the model,
+ * and the loss must bound inflight_hi.
+ */
+
+#define TOTAL_BYTES             (16 * 1024 * 1024)
+#define LINK_RATE               2000000         /* bytes per second */
+#define LINK_DELAY              20000           /* usec */
+#define LINK_QUEUE              (64 * 1024)
+#define LOSS_OFFSET             (TOTAL_BYTES / 2)
+#define LOSS_EVERY              20
+#define PEER_MSS                1448
+#define PEER_WSCALE             7
+#define PEER_PORT               5002
+#define PEER_ISS                1000
+#define MAX_RANGES              1024    /* out of order ranges at the receiver */
+#define MAX_SACK_BLOCKS         3
+#define MAX_PENDING             1024    /* segments in the queue and the delay */
+#define SEND_CHUNK              (64 * 1024)
+#define BPF_BUFSIZE             (512 * 1024)
+#define POLL_INTERVAL           250000          /* usec */
+#define MAX_SAMPLES             1024
+#define DEADLINE_SECONDS        60
+
+static char ifname1[IF_NAMESIZE];
+static char ifname2[IF_NAMESIZE];
+static int default_use_bbr = -1;
+
+static struct in_addr local_ip, peer_ip;
+static ether_addr_t local_eaddr, peer_eaddr;
+static int bpf_fd = -1;
+static int nstat_fd = -1;
+static uint64_t nstat_context;
+static mach_timebase_info_data_t tb;
+
+static uint8_t *pattern;
+static uint8_t *bpf_buf;
+static uint8_t nstat_buf[64 * 1024];
+
+struct range {
+	uint32_t        start;
+	uint32_t        end;
+};
+
+/* a segment going through the link, or the SYN */
+struct pending {
+	uint64_t        deliver;        /* usec */
+	uint32_t        start;
+	uint32_t        end;
+	uint8_t         flags;
+};
+
+/* link and receiver state, offsets are relative to the first byte of data */
+static struct {
+	uint32_t        irs;            /* initial sequence number of the sender */
+	uint16_t        sport;
+	bool            syn;
+	bool            fin;
+	bool            done;
+	uint32_t        rcv_nxt;
+	struct range    ranges[MAX_RANGES]; /* received above rcv_nxt, sorted */
+	u_int           nranges;
+	struct range    last;           /* most recent segment, SACKed first */
+	uint8_t         dropped[TOTAL_BYTES / PEER_MSS / 8 + 1];
+	uint64_t        link_free;      /* usec, when the queue is empty */
+	struct pending  pending[MAX_PENDING];
+	u_int           pending_head;
+	u_int           pending_count;
+	uint64_t        segs;
+	uint64_t        queue_drops;
+	uint64_t        loss_drops;
+} rcv;
+
+struct sample {
+	uint64_t                time;   /* usec since the start */
+	uint32_t                offset; /* data received in order */
+	nstat_tcp_cc_model      model;
+};
+
+static struct sample samples[MAX_SAMPLES];
+static u_int nsamples;
+
+static void
+cleanup(void)
+{
+	if (nstat_fd != -1) {
+		close(nstat_fd);
+	}
+	if (bpf_fd != -1) {
+		close(bpf_fd);
+	}
+	if (ifname1[0] != '\0') {
+		(void)ifnet_destroy(ifname1, false);
+	}
+	if (ifname2[0] != '\0') {
+		(void)ifnet_destroy(ifname2, false);
+	}
+	if (default_use_bbr != -1) {
+		(void)sysctlbyname("net.inet.tcp.use_bbr", NULL, NULL,
+		    &default_use_bbr, sizeof(default_use_bbr));
+	}
+}
+
+static uint64_t
+now_usec(void)
+{
+	return mach_absolute_time() * tb.numer / tb.denom / NSEC_PER_USEC;
+}
+
+static void
+setup(void)
+{
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 10000 };
+	size_t oldlen = sizeof(default_use_bbr);
+	int on = 1;
+
+	T_ATEND(cleanup);
+	mach_timebase_info(&tb);
+
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname("net.inet.tcp.use_bbr",
+	    &default_use_bbr, &oldlen, &on, sizeof(on)), "net.inet.tcp.use_bbr=1");
+
+	strlcpy(ifname1, FETH_NAME, sizeof(ifname1));
+	T_ASSERT_POSIX_ZERO(ifnet_create_2(ifname1, sizeof(ifname1)), NULL);
+	strlcpy(ifname2, FETH_NAME, sizeof(ifname2));
+	T_ASSERT_POSIX_ZERO(ifnet_create_2(ifname2, sizeof(ifname2)), NULL);
+	fake_set_peer(ifname1, ifname2);
+
+	inet_aton("10.202.0.1", &local_ip);
+	inet_aton("10.202.0.2", &peer_ip);
+	ifnet_attach_ip(ifname1);
+	ifnet_add_ip_address(ifname1, local_ip, inet_class_c_subnet_mask);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ifnet_set_flags(ifname2, IFF_UP, 0),
+	    NULL);
+
+	ifnet_get_lladdr(ifname1, &local_eaddr);
+	ifnet_get_lladdr(ifname2, &peer_eaddr);
+
+	bpf_fd = bpf_new();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_fd, "bpf_new");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_blen(bpf_fd, BPF_BUFSIZE), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_setif(bpf_fd, ifname2), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_header_complete(bpf_fd, 1), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_see_sent(bpf_fd, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_immediate(bpf_fd, 1), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_timeout(bpf_fd, &tv), NULL);
+
+	pattern = malloc(TOTAL_BYTES);
+	T_QUIET; T_ASSERT_NOTNULL(pattern, "malloc");
+	for (u_int i = 0; i < TOTAL_BYTES; i++) {
+		pattern[i] = (uint8_t)(i % 251);
+	}
+	bpf_buf = malloc(BPF_BUFSIZE);
+	T_QUIET; T_ASSERT_NOTNULL(bpf_buf, "malloc");
+}
+
+/*
+ * ntstat
+ */
+
+static void
+nstat_send(void *msg, size_t len)
+{
+	ssize_t n;
+
+	n = send(nstat_fd, msg, len, 0);
+	T_QUIET; T_ASSERT_EQ(n, (ssize_t)len, "send ntstat message");
+}
+
+/*
+ * Reads messages until the one acknowledging the request with context,
+ * handing the TCP updates to update()
+ */
+static void
+nstat_wait(uint64_t context, void (^update)(const nstat_tcp_descriptor *,
+    const nstat_tcp_cc_model *))
+{
+	const nstat_msg_hdr *hdr;
+	ssize_t n;
+
+	for (;;) {
+		n = recv(nstat_fd, nstat_buf, sizeof(nstat_buf), 0);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(n, "recv ntstat message");
+
+		for (size_t off = 0; off + sizeof(*hdr) <= (size_t)n;
+		    off += hdr->length) {
+			hdr = (const nstat_msg_hdr *)(void *)(nstat_buf + off);
+			T_QUIET; T_ASSERT_GE((size_t)hdr->length, sizeof(*hdr),
+			    "ntstat message length");
+			T_QUIET; T_ASSERT_LE(off + hdr->length, (size_t)n,
+			    "ntstat message length");
+
+			switch (hdr->type) {
+			case NSTAT_MSG_TYPE_SUCCESS:
+				if (hdr->context == context) {
+					return;
+				}
+				break;
+			case NSTAT_MSG_TYPE_ERROR: {
+				const nstat_msg_error *err = (const void *)hdr;
+
+				T_QUIET; T_ASSERT_NE(hdr->context, context,
+				    "ntstat request failed: %d", err->error);
+				break;
+			}
+			case NSTAT_MSG_TYPE_SRC_UPDATE:
+			case NSTAT_MSG_TYPE_SRC_EXTENDED_UPDATE: {
+				const nstat_msg_src_update_hdr *uh = (const void *)hdr;
+				const nstat_tcp_descriptor *desc = (const void *)(uh + 1);
+				const nstat_msg_src_extended_item_hdr *ext;
+				const nstat_tcp_cc_model *model = NULL;
+				size_t end = off + hdr->length;
+				size_t pos = off + sizeof(*uh) + sizeof(*desc);
+
+				if (uh->provider != NSTAT_PROVIDER_TCP_KERNEL ||
+				    pos > end) {
+					break;
+				}
+				while (hdr->type == NSTAT_MSG_TYPE_SRC_EXTENDED_UPDATE &&
+				    pos + sizeof(*ext) <= end) {
+					ext = (const void *)(nstat_buf + pos);
+					pos += sizeof(*ext);
+					if (ext->type == NSTAT_EXTENDED_UPDATE_TYPE_TCP_CC_MODEL &&
+					    ext->length >= sizeof(*model) &&
+					    pos + ext->length <= end) {
+						model = (const void *)(nstat_buf + pos);
+					}
+					pos += roundup(ext->length, sizeof(uint64_t));
+				}
+				update(desc, model);
+				break;
+			}
+			default:
+				break;
+			}
+		}
+	}
+}
+
+/* Watches the TCP connections of this process, with their path model */
+static void
+nstat_open(void)
+{
+	struct ctl_info info = { 0 };
+	struct sockaddr_ctl sc = {
+		.sc_len = sizeof(sc),
+		.sc_family = AF_SYSTEM,
+		.ss_sysaddr = AF_SYS_CONTROL,
+	};
+	nstat_msg_add_all_srcs req = {
+		.hdr.type = NSTAT_MSG_TYPE_ADD_ALL_SRCS,
+		.hdr.length = sizeof(req),
+		.filter = NSTAT_FILTER_SPECIFIC_USER_BY_PID |
+		    NSTAT_FILTER_SUPPRESS_SRC_ADDED |
+		    NSTAT_EXTENSION_FILTER_TCP_CC_MODEL,
+		.provider = NSTAT_PROVIDER_TCP_KERNEL,
+		.target_pid = getpid(),
+	};
+	struct timeval tv = { .tv_sec = 5 };
+
+	nstat_fd = socket(PF_SYSTEM, SOCK_DGRAM, SYSPROTO_CONTROL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(nstat_fd, "socket PF_SYSTEM");
+	strlcpy(info.ctl_name, NET_STAT_CONTROL_NAME, sizeof(info.ctl_name));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ioctl(nstat_fd, CTLIOCGINFO, &info),
+	    "CTLIOCGINFO %s", NET_STAT_CONTROL_NAME);
+	sc.sc_id = info.ctl_id;
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(connect(nstat_fd, (struct sockaddr *)&sc,
+	    sizeof(sc)), "connect %s", NET_STAT_CONTROL_NAME);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(nstat_fd, SOL_SOCKET,
+	    SO_RCVTIMEO, &tv, sizeof(tv)), "SO_RCVTIMEO");
+
+	req.hdr.context = ++nstat_context;
+	nstat_send(&req, sizeof(req));
+	nstat_wait(req.hdr.context, ^(const nstat_tcp_descriptor *desc __unused,
+	    const nstat_tcp_cc_model *model __unused) {
+	});
+}
+
+/* Returns the path model of the connection from port, false if not reported */
+static bool
+nstat_poll(in_port_t port, nstat_tcp_cc_model *model)
+{
+	nstat_msg_query_src_req req = {
+		.hdr.type = NSTAT_MSG_TYPE_GET_UPDATE,
+		.hdr.length = sizeof(req),
+		.srcref = NSTAT_SRC_REF_ALL,
+	};
+	__block bool found = false;
+
+	req.hdr.context = ++nstat_context;
+	nstat_send(&req, sizeof(req));
+	nstat_wait(req.hdr.context, ^(const nstat_tcp_descriptor *desc,
+	    const nstat_tcp_cc_model *m) {
+		if (desc->local.v4.sin_family != AF_INET ||
+		    desc->local.v4.sin_port != port ||
+		    desc->remote.v4.sin_port != htons(PEER_PORT)) {
+			return;
+		}
+		T_QUIET; T_EXPECT_EQ_STR(desc->cc_algo, "bbr",
+		    "the connection uses BBR");
+		if (m != NULL) {
+			*model = *m;
+			found = true;
+		}
+	});
+	return found;
+}
+
+/*
+ * Receiver
+ */
+
+static void
+peer_write(const void *frame, u_int len)
+{
+	ssize_t n;
+
+	n = write(bpf_fd, frame, len);
+	T_QUIET; T_ASSERT_EQ(n, (ssize_t)len, "write bpf");
+}
+
+static void
+peer_arp_reply(const struct ether_arp *req)
+{
+	char buf[ETHER_HDR_LEN + sizeof(struct ether_arp)] = { 0 };
+	struct ether_header *eh = (struct ether_header *)(void *)buf;
+	struct ether_arp *ea = (struct ether_arp *)(void *)(eh + 1);
+
+	bcopy(req->arp_sha, eh->ether_dhost, ETHER_ADDR_LEN);
+	bcopy(&peer_eaddr, eh->ether_shost, ETHER_ADDR_LEN);
+	eh->ether_type = htons(ETHERTYPE_ARP);
+	ea->arp_hrd = htons(ARPHRD_ETHER);
+	ea->arp_pro = htons(ETHERTYPE_IP);
+	ea->arp_hln = ETHER_ADDR_LEN;
+	ea->arp_pln = sizeof(struct in_addr);
+	ea->arp_op = htons(ARPOP_REPLY);
+	bcopy(&peer_eaddr, ea->arp_sha, ETHER_ADDR_LEN);
+	bcopy(&peer_ip, ea->arp_spa, sizeof(peer_ip));
+	bcopy(req->arp_sha, ea->arp_tha, ETHER_ADDR_LEN);
+	bcopy(req->arp_spa, ea->arp_tpa, sizeof(struct in_addr));
+	peer_write(buf, sizeof(buf));
+}
+
+static uint16_t
+tcp_cksum(struct ip *ip, struct tcphdr *th, u_int tcp_len)
+{
+	char buf[sizeof(tcp_pseudo_hdr_t) + 128];
+	tcp_pseudo_hdr_t *ph = (tcp_pseudo_hdr_t *)(void *)buf;
+
+	*ph = (tcp_pseudo_hdr_t){
+		.src_ip = ip->ip_src,
+		.dst_ip = ip->ip_dst,
+		.proto = IPPROTO_TCP,
+		.length = htons((uint16_t)tcp_len),
+	};
+	th->th_sum = 0;
+	memcpy(buf + sizeof(*ph), th, tcp_len);
+	return in_cksum(buf, (int)(sizeof(*ph) + tcp_len));
+}
+
+static void
+peer_send(uint8_t flags, uint32_t seq, uint32_t ack, const void *opts,
+    u_int optlen)
+{
+	char buf[ETHER_HDR_LEN + sizeof(ip_tcp_header_t) + MAX_TCPOPTLEN] = { 0 };
+	struct ether_header *eh = (struct ether_header *)(void *)buf;
+	ip_tcp_header_t *h = (ip_tcp_header_t *)(void *)(eh + 1);
+	u_int len = sizeof(*h) + optlen;
+
+	bcopy(&local_eaddr, eh->ether_dhost, ETHER_ADDR_LEN);
+	bcopy(&peer_eaddr, eh->ether_shost, ETHER_ADDR_LEN);
+	eh->ether_type = htons(ETHERTYPE_IP);
+	h->ip.ip_v = IPVERSION;
+	h->ip.ip_hl = sizeof(struct ip) >> 2;
+	h->ip.ip_len = htons((uint16_t)len);
+	h->ip.ip_off = htons(IP_DF);
+	h->ip.ip_ttl = 64;
+	h->ip.ip_p = IPPROTO_TCP;
+	h->ip.ip_src = peer_ip;
+	h->ip.ip_dst = local_ip;
+	h->ip.ip_sum = in_cksum(&h->ip, sizeof(h->ip));
+	h->tcp.th_sport = htons(PEER_PORT);
+	h->tcp.th_dport = rcv.sport;
+	h->tcp.th_seq = htonl(seq);
+	h->tcp.th_ack = htonl(ack);
+	h->tcp.th_off = (sizeof(struct tcphdr) + optlen) >> 2;
+	h->tcp.th_flags = flags;
+	h->tcp.th_win = htons(65535);
+	if (optlen > 0) {
+		memcpy(h + 1, opts, optlen);
+	}
+	h->tcp.th_sum = tcp_cksum(&h->ip, &h->tcp, sizeof(h->tcp) + optlen);
+	peer_write(buf, ETHER_HDR_LEN + len);
+}
+
+static void
+peer_syn_ack(void)
+{
+	uint8_t opts[] = {
+		TCPOPT_MAXSEG, TCPOLEN_MAXSEG, PEER_MSS >> 8, PEER_MSS & 0xff,
+		TCPOPT_NOP, TCPOPT_WINDOW, TCPOLEN_WINDOW, PEER_WSCALE,
+		TCPOPT_NOP, TCPOPT_NOP, TCPOPT_SACK_PERMITTED, TCPOLEN_SACK_PERMITTED,
+	};
+
+	peer_send(TH_SYN | TH_ACK, PEER_ISS, rcv.irs + 1, opts, sizeof(opts));
+}
+
+/* acknowledges rcv_nxt and SACKs the most recent segment first */
+static void
+peer_ack(void)
+{
+	uint32_t opts[1 + 2 * MAX_SACK_BLOCKS];
+	uint32_t ack = rcv.irs + 1 + rcv.rcv_nxt + (rcv.done ? 1 : 0);
+	u_int nblocks = 0, first = rcv.nranges;
+
+	for (u_int i = 0; i < rcv.nranges; i++) {
+		if (rcv.ranges[i].start <= rcv.last.start &&
+		    rcv.last.end <= rcv.ranges[i].end) {
+			first = i;
+			opts[1] = htonl(rcv.irs + 1 + rcv.ranges[i].start);
+			opts[2] = htonl(rcv.irs + 1 + rcv.ranges[i].end);
+			nblocks++;
+			break;
+		}
+	}
+	for (u_int i = rcv.nranges; i-- > 0 && nblocks < MAX_SACK_BLOCKS;) {
+		if (i == first) {
+			continue;
+		}
+		opts[1 + 2 * nblocks] = htonl(rcv.irs + 1 + rcv.ranges[i].start);
+		opts[2 + 2 * nblocks] = htonl(rcv.irs + 1 + rcv.ranges[i].end);
+		nblocks++;
+	}
+	if (nblocks == 0) {
+		peer_send(TH_ACK, PEER_ISS + 1, ack, NULL, 0);
+		return;
+	}
+	opts[0] = htonl(TCPOPT_NOP << 24 | TCPOPT_NOP << 16 | TCPOPT_SACK << 8 |
+	    (TCPOLEN_SACK * nblocks + 2));
+	peer_send(TH_ACK, PEER_ISS + 1, ack, opts,
+	    sizeof(uint32_t) * (1 + 2 * nblocks));
+}
+
+/* adds [start, end) to the data received and advances rcv_nxt */
+static void
+rcv_add(uint32_t start, uint32_t end)
+{
+	u_int i, j;
+
+	if (end <= rcv.rcv_nxt) {
+		return;
+	}
+	start = MAX(start, rcv.rcv_nxt);
+
+	for (i = 0; i < rcv.nranges && rcv.ranges[i].end < start; i++) {
+		;
+	}
+	for (j = i; j < rcv.nranges && rcv.ranges[j].start <= end; j++) {
+		start = MIN(start, rcv.ranges[j].start);
+		end = MAX(end, rcv.ranges[j].end);
+	}
+	if (j == i) {
+		T_QUIET; T_ASSERT_LT(rcv.nranges, MAX_RANGES, "out of order ranges");
+		memmove(&rcv.ranges[i + 1], &rcv.ranges[i],
+		    (rcv.nranges - i) * sizeof(rcv.ranges[0]));
+		rcv.nranges++;
+	} else if (j > i + 1) {
+		memmove(&rcv.ranges[i + 1], &rcv.ranges[j],
+		    (rcv.nranges - j) * sizeof(rcv.ranges[0]));
+		rcv.nranges -= j - i - 1;
+	}
+	rcv.ranges[i] = (struct range){ .start = start, .end = end };
+
+	if (rcv.ranges[0].start <= rcv.rcv_nxt) {
+		rcv.rcv_nxt = rcv.ranges[0].end;
+		rcv.nranges--;
+		memmove(&rcv.ranges[0], &rcv.ranges[1],
+		    rcv.nranges * sizeof(rcv.ranges[0]));
+	}
+}
+
+/* queues a segment on the link, false if the queue is full */
+static bool
+link_enqueue(uint64_t now, uint32_t start, uint32_t end, uint8_t flags)
+{
+	uint64_t backlog = 0;
+	struct pending *p;
+
+	if (rcv.link_free > now) {
+		backlog = (rcv.link_free - now) * LINK_RATE / USEC_PER_SEC;
+	}
+	if (backlog + (end - start) > LINK_QUEUE) {
+		return false;
+	}
+	rcv.link_free = MAX(rcv.link_free, now) +
+	    (uint64_t)(end - start) * USEC_PER_SEC / LINK_RATE;
+
+	T_QUIET; T_ASSERT_LT(rcv.pending_count, MAX_PENDING, "segments on the link");
+	p = &rcv.pending[(rcv.pending_head + rcv.pending_count) % MAX_PENDING];
+	*p = (struct pending){
+		.deliver = rcv.link_free + LINK_DELAY,
+		.start = start,
+		.end = end,
+		.flags = flags,
+	};
+	rcv.pending_count++;
+	return true;
+}
+
+/* delivers the segments through the link by now */
+static void
+link_deliver(uint64_t now)
+{
+	struct pending *p;
+
+	while (rcv.pending_count > 0) {
+		p = &rcv.pending[rcv.pending_head];
+		if (p->deliver > now) {
+			break;
+		}
+		rcv.pending_head = (rcv.pending_head + 1) % MAX_PENDING;
+		rcv.pending_count--;
+
+		if (p->flags & TH_SYN) {
+			peer_syn_ack();
+			continue;
+		}
+		if (p->end > p->start) {
+			rcv.last = (struct range){ .start = p->start, .end = p->end };
+			rcv_add(p->start, p->end);
+		}
+		if (p->flags & TH_FIN) {
+			rcv.fin = true;
+		}
+		if (rcv.fin && rcv.rcv_nxt == TOTAL_BYTES) {
+			rcv.done = true;
+		}
+		peer_ack();
+	}
+}
+
+static void
+peer_input_tcp(struct ip *ip, u_int len, uint64_t now)
+{
+	struct tcphdr *th;
+	u_int iphlen, thlen, datalen;
+	uint32_t off, idx;
+	const uint8_t *data;
+
+	iphlen = ip->ip_hl << 2;
+	T_QUIET; T_ASSERT_GE(len, iphlen + sizeof(*th), "TCP segment");
+	th = (struct tcphdr *)(void *)((char *)ip + iphlen);
+	if (ip->ip_dst.s_addr != peer_ip.s_addr ||
+	    ntohs(th->th_dport) != PEER_PORT) {
+		return;
+	}
+	T_QUIET; T_ASSERT_EQ(th->th_flags & TH_RST, 0, "the sender resets");
+
+	if (th->th_flags & TH_SYN) {
+		rcv.irs = ntohl(th->th_seq);
+		rcv.sport = th->th_sport;
+		rcv.syn = true;
+		(void)link_enqueue(now, 0, 0, TH_SYN);
+		return;
+	}
+	if (!rcv.syn) {
+		return;
+	}
+
+	thlen = th->th_off << 2;
+	datalen = ntohs(ip->ip_len) - iphlen - thlen;
+	off = ntohl(th->th_seq) - (rcv.irs + 1);
+	if (datalen == 0 && (th->th_flags & TH_FIN) == 0) {
+		return;
+	}
+	if (datalen > 0) {
+		T_QUIET; T_ASSERT_LE(off + datalen, (uint32_t)TOTAL_BYTES,
+		    "segment at %u is within the data", off);
+		data = (const uint8_t *)th + thlen;
+		T_QUIET; T_ASSERT_EQ(memcmp(data, pattern + off, datalen), 0,
+		    "segment at %u has the data sent", off);
+
+		/* past LOSS_OFFSET, lose the first transmission of one segment in LOSS_EVERY */
+		idx = off / PEER_MSS;
+		if (off >= LOSS_OFFSET && idx % LOSS_EVERY == LOSS_EVERY / 2 &&
+		    (rcv.dropped[idx / 8] & (1 << (idx % 8))) == 0) {
+			rcv.dropped[idx / 8] |= (uint8_t)(1 << (idx % 8));
+			rcv.loss_drops++;
+			return;
+		}
+	}
+	if (!link_enqueue(now, off, off + datalen, th->th_flags & TH_FIN)) {
+		rcv.queue_drops++;
+		return;
+	}
+	rcv.segs++;
+}
+
+static void
+peer_input(uint64_t now)
+{
+	struct ether_header *eh;
+	struct bpf_hdr *bh;
+	ssize_t n;
+
+	n = read(bpf_fd, bpf_buf, BPF_BUFSIZE);
+	if (n < 0) {
+		T_QUIET; T_ASSERT_TRUE(errno == EINTR || errno == EWOULDBLOCK,
+		    "read bpf: %s", strerror(errno));
+		return;
+	}
+	for (char *p = (char *)bpf_buf; p < (char *)bpf_buf + n;
+	    p += BPF_WORDALIGN(bh->bh_hdrlen + bh->bh_caplen)) {
+		bh = (struct bpf_hdr *)(void *)p;
+		eh = (struct ether_header *)(void *)(p + bh->bh_hdrlen);
+		if (bh->bh_caplen < ETHER_HDR_LEN) {
+			continue;
+		}
+		switch (ntohs(eh->ether_type)) {
+		case ETHERTYPE_ARP: {
+			struct ether_arp *ea = (struct ether_arp *)(void *)(eh + 1);
+
+			if (bh->bh_caplen >= ETHER_HDR_LEN + sizeof(*ea) &&
+			    ntohs(ea->arp_op) == ARPOP_REQUEST &&
+			    bcmp(ea->arp_tpa, &peer_ip, sizeof(peer_ip)) == 0) {
+				peer_arp_reply(ea);
+			}
+			break;
+		}
+		case ETHERTYPE_IP: {
+			struct ip *ip = (struct ip *)(void *)(eh + 1);
+
+			if (bh->bh_caplen >= ETHER_HDR_LEN + sizeof(*ip) &&
+			    ip->ip_p == IPPROTO_TCP) {
+				peer_input_tcp(ip, bh->bh_caplen - ETHER_HDR_LEN, now);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+}
+
+/* waits for a frame from the sender until the next event at most */
+static void
+peer_wait(uint64_t now, uint64_t next_poll)
+{
+	uint64_t wait = MIN(next_poll > now ? next_poll - now : 0, 10000);
+	struct timeval tv;
+	fd_set fds;
+	int rc;
+
+	if (rcv.pending_count > 0) {
+		uint64_t deliver = rcv.pending[rcv.pending_head].deliver;
+
+		wait = MIN(wait, deliver > now ? deliver - now : 0);
+	}
+	tv.tv_sec = 0;
+	tv.tv_usec = (suseconds_t)wait;
+	FD_ZERO(&fds);
+	FD_SET(bpf_fd, &fds);
+	rc = select(bpf_fd + 1, &fds, NULL, NULL, &tv);
+	if (rc < 0) {
+		T_QUIET; T_ASSERT_EQ(errno, EINTR, "select: %s", strerror(errno));
+		return;
+	}
+	if (rc > 0) {
+		peer_input(now_usec());
+	}
+}
+
+/*
+ * Checks
+ */
+
+static uint64_t
+model_bdp(const nstat_tcp_cc_model *m, uint64_t gain)
+{
+	return ((m->nstat_cc_bw * m->nstat_cc_min_rtt / USEC_PER_SEC) * gain) >> 8;
+}
+
+/*
+ * Pacing follows the bandwidth estimate at the pacing gain, less a margin
+ * of 1%, once STARTUP is over.  The short-term model may lower the
+ * bandwidth used after loss.
+ */
+static bool
+check_pacing(const struct sample *s)
+{
+	const nstat_tcp_cc_model *m = &s->model;
+	uint64_t expected;
+
+	if (m->nstat_cc_state == TCP_CC_BBR_STARTUP || m->nstat_cc_bw == 0) {
+		return true;
+	}
+	expected = (m->nstat_cc_bw * m->nstat_cc_pacing_gain) >> 8;
+	expected = expected * 99 / 100;
+	if (m->nstat_cc_inflight_lo != 0) {
+		return m->nstat_cc_pacing_rate <= expected + expected / 100;
+	}
+	return m->nstat_cc_pacing_rate + expected / 100 >= expected &&
+	       m->nstat_cc_pacing_rate <= expected + expected / 100;
+}
+
+/*
+ * The congestion window is bounded by the BDP at the cwnd gain plus three
+ * TSO bursts, and by inflight_hi and inflight_lo when they are set, but is
+ * never below four segments.
+ */
+static bool
+check_cwnd(const struct sample *s)
+{
+	const nstat_tcp_cc_model *m = &s->model;
+	uint64_t min_cwnd = 4 * PEER_MSS, burst, cap;
+
+	if (m->nstat_cc_state == TCP_CC_BBR_STARTUP || m->nstat_cc_bw == 0 ||
+	    m->nstat_cc_min_rtt == 0) {
+		return true;
+	}
+	burst = MAX(PEER_MSS, m->nstat_cc_pacing_rate >> 12);
+	cap = model_bdp(m, m->nstat_cc_cwnd_gain) + 3 * burst;
+	if (m->nstat_cc_state == TCP_CC_BBR_PROBE_BW &&
+	    m->nstat_cc_inflight_hi != 0) {
+		cap = MIN(cap, m->nstat_cc_inflight_hi);
+	}
+	if (m->nstat_cc_inflight_lo != 0) {
+		cap = MIN(cap, m->nstat_cc_inflight_lo);
+	}
+	/* a segment of slack for the bursts sized at the previous rate */
+	return m->nstat_cc_cwnd <= MAX(cap, min_cwnd) + PEER_MSS;
+}
+
+static void
+log_sample(const char *what, const struct sample *s)
+{
+	const nstat_tcp_cc_model *m = &s->model;
+
+	T_LOG("%s at %llu ms, %u bytes: state %u phase %u bw %llu pacing %llu "
+	    "(gain %u) delivery %llu min_rtt %u cwnd %u (gain %u) inflight_hi %u "
+	    "inflight_lo %u", what, s->time / 1000, s->offset, m->nstat_cc_state,
+	    m->nstat_cc_phase, m->nstat_cc_bw, m->nstat_cc_pacing_rate,
+	    m->nstat_cc_pacing_gain, m->nstat_cc_delivery_rate,
+	    m->nstat_cc_min_rtt, m->nstat_cc_cwnd, m->nstat_cc_cwnd_gain,
+	    m->nstat_cc_inflight_hi, m->nstat_cc_inflight_lo);
+}
+
+T_DECL(tcp_bbr_replay,
+    "BBR models a bottleneck link and paces and bounds cwnd by the model")
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+	};
+	socklen_t len = sizeof(sin);
+	uint64_t start, now, next_poll, deadline;
+	u_int pacing_ok = 0, cwnd_ok = 0, checked = 0;
+	const struct sample *last_clean = NULL;
+	bool probe_bw = false, inflight_hi = false;
+	int fd, rc, size = 4 * 1024 * 1024;
+	in_port_t port;
+	u_int sent = 0;
+	bool shut = false;
+	ssize_t n;
+
+	setup();
+	nstat_open();
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "socket");
+	rc = setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "SO_SNDBUF");
+	sin.sin_addr = local_ip;
+	rc = bind(fd, (struct sockaddr *)&sin, sizeof(sin));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "bind");
+	rc = getsockname(fd, (struct sockaddr *)&sin, &len);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "getsockname");
+	port = sin.sin_port;
+	rc = fcntl(fd, F_SETFL, O_NONBLOCK);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "O_NONBLOCK");
+	sin.sin_addr = peer_ip;
+	sin.sin_port = htons(PEER_PORT);
+	rc = connect(fd, (struct sockaddr *)&sin, sizeof(sin));
+	T_QUIET; T_ASSERT_POSIX_FAILURE(rc, EINPROGRESS, "connect");
+
+	start = now_usec();
+	next_poll = start + POLL_INTERVAL;
+	deadline = start + (uint64_t)DEADLINE_SECONDS * USEC_PER_SEC;
+
+	while (!rcv.done) {
+		now = now_usec();
+		T_QUIET; T_ASSERT_LT(now, deadline,
+		    "transfer completes, %u bytes in order", rcv.rcv_nxt);
+
+		while (rcv.syn && sent < TOTAL_BYTES) {
+			n = write(fd, pattern + sent, MIN(SEND_CHUNK, TOTAL_BYTES - sent));
+			if (n < 0) {
+				T_QUIET; T_ASSERT_TRUE(errno == EWOULDBLOCK ||
+				    errno == ENOTCONN, "write: %s", strerror(errno));
+				break;
+			}
+			sent += (u_int)n;
+		}
+		if (sent == TOTAL_BYTES && !shut) {
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(shutdown(fd, SHUT_WR),
+			    "shutdown");
+			shut = true;
+		}
+
+		link_deliver(now);
+		if (now >= next_poll && nsamples < MAX_SAMPLES) {
+			struct sample *s = &samples[nsamples];
+
+			next_poll = now + POLL_INTERVAL;
+			if (nstat_poll(port, &s->model) && s->model.nstat_cc_state != 0) {
+				s->time = now - start;
+				s->offset = rcv.rcv_nxt;
+				nsamples++;
+			}
+		}
+		peer_wait(now_usec(), next_poll);
+	}
+
+	/* the FIN is acknowledged, close the connection */
+	peer_send(TH_RST | TH_ACK, PEER_ISS + 1, rcv.irs + 2 + TOTAL_BYTES,
+	    NULL, 0);
+	close(fd);
+
+	T_LOG("%u bytes in %llu ms: %llu segments received, %llu dropped by the "
+	    "queue, %llu lost", TOTAL_BYTES, (now_usec() - start) / 1000,
+	    rcv.segs, rcv.queue_drops, rcv.loss_drops);
+	T_ASSERT_EQ(rcv.rcv_nxt, (uint32_t)TOTAL_BYTES, "all the data is received");
+	T_ASSERT_GT(nsamples, 0U, "the path model is reported by ntstat");
+
+	for (u_int i = 0; i < nsamples; i++) {
+		const struct sample *s = &samples[i];
+		const nstat_tcp_cc_model *m = &s->model;
+
+		T_QUIET; T_EXPECT_GE(m->nstat_cc_state, TCP_CC_BBR_STARTUP, "state");
+		T_QUIET; T_EXPECT_LE(m->nstat_cc_state, TCP_CC_BBR_PROBE_RTT, "state");
+		if (m->nstat_cc_min_rtt != 0) {
+			/* the round trip time is in ms without samples from the segments */
+			T_QUIET; T_EXPECT_GE(m->nstat_cc_min_rtt, LINK_DELAY - 1000,
+			    "min_rtt %u is not below the link delay", m->nstat_cc_min_rtt);
+			T_QUIET; T_EXPECT_LE(m->nstat_cc_min_rtt,
+			    LINK_DELAY + LINK_QUEUE * USEC_PER_SEC / LINK_RATE,
+			    "min_rtt %u is within the delay and a full queue",
+			    m->nstat_cc_min_rtt);
+		}
+		T_QUIET; T_EXPECT_LE(m->nstat_cc_bw, 3ULL * LINK_RATE / 2,
+		    "bw %llu does not exceed the link rate", m->nstat_cc_bw);
+
+		if (m->nstat_cc_state == TCP_CC_BBR_PROBE_BW) {
+			probe_bw = true;
+			if (s->offset < LOSS_OFFSET) {
+				last_clean = s;
+			}
+		}
+		if (s->offset >= LOSS_OFFSET && m->nstat_cc_inflight_hi != 0) {
+			inflight_hi = true;
+		}
+
+		if (m->nstat_cc_state == TCP_CC_BBR_STARTUP || m->nstat_cc_bw == 0) {
+			continue;
+		}
+		checked++;
+		if (check_pacing(s)) {
+			pacing_ok++;
+		} else {
+			log_sample("pacing off the model", s);
+		}
+		if (check_cwnd(s)) {
+			cwnd_ok++;
+		} else {
+			log_sample("cwnd off the model", s);
+		}
+	}
+
+	T_EXPECT_TRUE(probe_bw, "BBR reaches PROBE_BW");
+	T_EXPECT_NOTNULL(last_clean, "the model is reported in PROBE_BW before loss");
+	if (last_clean != NULL) {
+		log_sample("before loss", last_clean);
+		T_EXPECT_GE(last_clean->model.nstat_cc_bw, 4ULL * LINK_RATE / 5,
+		    "bw is at least 80%% of the link rate");
+		T_EXPECT_LE(last_clean->model.nstat_cc_bw, 5ULL * LINK_RATE / 4,
+		    "bw is at most 125%% of the link rate");
+		T_EXPECT_GE(last_clean->model.nstat_cc_min_rtt, LINK_DELAY - 1000,
+		    "min_rtt is the link delay");
+		T_EXPECT_LE(last_clean->model.nstat_cc_min_rtt, 2 * LINK_DELAY,
+		    "min_rtt is the link delay");
+	}
+	log_sample("last", &samples[nsamples - 1]);
+	T_EXPECT_TRUE(inflight_hi, "loss sets inflight_hi");
+	T_EXPECT_GT(rcv.loss_drops, 0ULL, "segments were lost");
+
+	/*
+	 * A sample can fall between an update of the model and the next
+	 * ACK applying it, allow for a few of them.
+	 */
+	T_EXPECT_GE(pacing_ok * 10, checked * 9,
+	    "pacing follows the model in %u of %u samples", pacing_ok, checked);
+	T_EXPECT_GE(cwnd_ok * 10, checked * 9,
+	    "cwnd follows the model in %u of %u samples", cwnd_ok, checked);
+
+	free(pattern);
+	free(bpf_buf);
+}
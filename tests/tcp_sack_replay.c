@@ -0,0 +1,541 @@
+#include <darwintest.h>
+
+#include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/bpf.h>
+#include <net/ethernet.h>
+
+#include <netinet/in.h>
+#include <netinet/if_ether.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <mach/mach_time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "net_test_lib.h"
+#include "bpflib.h"
+#include "in_cksum.h"
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_ASROOT(true),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_TAG_PERF,
+	T_META_TAG_VM_NOT_ELIGIBLE,
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * Replays SACK loss recovery against the local TCP sender.  A socket
+ * connects over a feth interface to an address that only exists as a
+ * scripted receiver reading and writing frames with bpf on the peer
+ * interface.  The receiver drops the first transmission of one segment in
+ * DROP_EVERY and acknowledges every other segment with SACK blocks, so that
+ * the sender recovers with hundreds of holes outstanding at once.  All the
+ * data must get through, and the time the transfer took is reported with
+ * RACK and with the SACK scoreboard.
+ */
+
+#define TOTAL_BYTES             (8 * 1024 * 1024)
+#define PEER_MSS                1448
+#define PEER_WSCALE             7
+#define PEER_PORT               5001
+#define PEER_ISS                1000
+#define DROP_EVERY              8
+#define MAX_RANGES              4096    /* out of order ranges at the receiver */
+#define MAX_SACK_BLOCKS         3
+#define SACK_MAXHOLES           4096
+#define SEND_CHUNK              (64 * 1024)
+#define BPF_BUFSIZE             (512 * 1024)
+#define DEADLINE_SECONDS        120
+
+static char ifname1[IF_NAMESIZE];
+static char ifname2[IF_NAMESIZE];
+static int default_rack = -1;
+static int default_sack_maxholes = -1;
+
+static struct in_addr local_ip, peer_ip;
+static ether_addr_t local_eaddr, peer_eaddr;
+static int bpf_fd = -1;
+
+static uint8_t *pattern;
+static uint8_t *bpf_buf;
+
+struct range {
+	uint32_t        start;
+	uint32_t        end;
+};
+
+/* receiver state, offsets are relative to the first byte of data */
+static struct {
+	uint32_t        irs;            /* initial sequence number of the sender */
+	uint16_t        sport;
+	bool            syn;
+	bool            fin;
+	bool            done;
+	uint32_t        rcv_nxt;
+	struct range    ranges[MAX_RANGES]; /* received above rcv_nxt, sorted */
+	u_int           nranges;
+	struct range    last;           /* most recent segment, SACKed first */
+	uint8_t         dropped[TOTAL_BYTES / PEER_MSS / 8 + 1];
+	uint64_t        segs;
+	uint64_t        dup_segs;
+	uint64_t        drops;
+	uint64_t        max_ranges;
+} rcv;
+
+static void
+cleanup(void)
+{
+	if (bpf_fd != -1) {
+		close(bpf_fd);
+	}
+	if (ifname1[0] != '\0') {
+		(void)ifnet_destroy(ifname1, false);
+	}
+	if (ifname2[0] != '\0') {
+		(void)ifnet_destroy(ifname2, false);
+	}
+	if (default_rack != -1) {
+		(void)sysctlbyname("net.inet.tcp.rack", NULL, NULL,
+		    &default_rack, sizeof(default_rack));
+	}
+	if (default_sack_maxholes != -1) {
+		(void)sysctlbyname("net.inet.tcp.sack_maxholes", NULL, NULL,
+		    &default_sack_maxholes, sizeof(default_sack_maxholes));
+	}
+}
+
+static void
+set_sysctl(const char *name, int *old, int value)
+{
+	size_t oldlen = sizeof(*old);
+
+	T_ASSERT_POSIX_SUCCESS(sysctlbyname(name, old, &oldlen, &value,
+	    sizeof(value)), "%s=%d", name, value);
+}
+
+static void
+setup(int rack)
+{
+	struct timeval tv = { .tv_sec = 0, .tv_usec = 10000 };
+
+	T_ATEND(cleanup);
+
+	set_sysctl("net.inet.tcp.rack", &default_rack, rack);
+	/* let the scoreboard track every hole instead of falling back to RTO */
+	set_sysctl("net.inet.tcp.sack_maxholes", &default_sack_maxholes,
+	    SACK_MAXHOLES);
+
+	strlcpy(ifname1, FETH_NAME, sizeof(ifname1));
+	T_ASSERT_POSIX_ZERO(ifnet_create_2(ifname1, sizeof(ifname1)), NULL);
+	strlcpy(ifname2, FETH_NAME, sizeof(ifname2));
+	T_ASSERT_POSIX_ZERO(ifnet_create_2(ifname2, sizeof(ifname2)), NULL);
+	fake_set_peer(ifname1, ifname2);
+
+	inet_aton("10.201.0.1", &local_ip);
+	inet_aton("10.201.0.2", &peer_ip);
+	ifnet_attach_ip(ifname1);
+	ifnet_add_ip_address(ifname1, local_ip, inet_class_c_subnet_mask);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(ifnet_set_flags(ifname2, IFF_UP, 0),
+	    NULL);
+
+	ifnet_get_lladdr(ifname1, &local_eaddr);
+	ifnet_get_lladdr(ifname2, &peer_eaddr);
+
+	bpf_fd = bpf_new();
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_fd, "bpf_new");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_blen(bpf_fd, BPF_BUFSIZE), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_setif(bpf_fd, ifname2), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_header_complete(bpf_fd, 1), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_see_sent(bpf_fd, 0), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_immediate(bpf_fd, 1), NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(bpf_set_timeout(bpf_fd, &tv), NULL);
+
+	pattern = malloc(TOTAL_BYTES);
+	T_QUIET; T_ASSERT_NOTNULL(pattern, "malloc");
+	for (u_int i = 0; i < TOTAL_BYTES; i++) {
+		pattern[i] = (uint8_t)(i % 251);
+	}
+	bpf_buf = malloc(BPF_BUFSIZE);
+	T_QUIET; T_ASSERT_NOTNULL(bpf_buf, "malloc");
+}
+
+static void
+peer_write(const void *frame, u_int len)
+{
+	ssize_t n;
+
+	n = write(bpf_fd, frame, len);
+	T_QUIET; T_ASSERT_EQ(n, (ssize_t)len, "write bpf");
+}
+
+static void
+peer_arp_reply(const struct ether_arp *req)
+{
+	char buf[ETHER_HDR_LEN + sizeof(struct ether_arp)] = { 0 };
+	struct ether_header *eh = (struct ether_header *)(void *)buf;
+	struct ether_arp *ea = (struct ether_arp *)(void *)(eh + 1);
+
+	bcopy(req->arp_sha, eh->ether_dhost, ETHER_ADDR_LEN);
+	bcopy(&peer_eaddr, eh->ether_shost, ETHER_ADDR_LEN);
+	eh->ether_type = htons(ETHERTYPE_ARP);
+	ea->arp_hrd = htons(ARPHRD_ETHER);
+	ea->arp_pro = htons(ETHERTYPE_IP);
+	ea->arp_hln = ETHER_ADDR_LEN;
+	ea->arp_pln = sizeof(struct in_addr);
+	ea->arp_op = htons(ARPOP_REPLY);
+	bcopy(&peer_eaddr, ea->arp_sha, ETHER_ADDR_LEN);
+	bcopy(&peer_ip, ea->arp_spa, sizeof(peer_ip));
+	bcopy(req->arp_sha, ea->arp_tha, ETHER_ADDR_LEN);
+	bcopy(req->arp_spa, ea->arp_tpa, sizeof(struct in_addr));
+	peer_write(buf, sizeof(buf));
+}
+
+static uint16_t
+tcp_cksum(struct ip *ip, struct tcphdr *th, u_int tcp_len)
+{
+	char buf[sizeof(tcp_pseudo_hdr_t) + 128];
+	tcp_pseudo_hdr_t *ph = (tcp_pseudo_hdr_t *)(void *)buf;
+
+	*ph = (tcp_pseudo_hdr_t){
+		.src_ip = ip->ip_src,
+		.dst_ip = ip->ip_dst,
+		.proto = IPPROTO_TCP,
+		.length = htons((uint16_t)tcp_len),
+	};
+	th->th_sum = 0;
+	memcpy(buf + sizeof(*ph), th, tcp_len);
+	return in_cksum(buf, (int)(sizeof(*ph) + tcp_len));
+}
+
+static void
+peer_send(uint8_t flags, uint32_t seq, uint32_t ack, const void *opts,
+    u_int optlen)
+{
+	char buf[ETHER_HDR_LEN + sizeof(ip_tcp_header_t) + MAX_TCPOPTLEN] = { 0 };
+	struct ether_header *eh = (struct ether_header *)(void *)buf;
+	ip_tcp_header_t *h = (ip_tcp_header_t *)(void *)(eh + 1);
+	u_int len = sizeof(*h) + optlen;
+
+	bcopy(&local_eaddr, eh->ether_dhost, ETHER_ADDR_LEN);
+	bcopy(&peer_eaddr, eh->ether_shost, ETHER_ADDR_LEN);
+	eh->ether_type = htons(ETHERTYPE_IP);
+	h->ip.ip_v = IPVERSION;
+	h->ip.ip_hl = sizeof(struct ip) >> 2;
+	h->ip.ip_len = htons((uint16_t)len);
+	h->ip.ip_off = htons(IP_DF);
+	h->ip.ip_ttl = 64;
+	h->ip.ip_p = IPPROTO_TCP;
+	h->ip.ip_src = peer_ip;
+	h->ip.ip_dst = local_ip;
+	h->ip.ip_sum = in_cksum(&h->ip, sizeof(h->ip));
+	h->tcp.th_sport = htons(PEER_PORT);
+	h->tcp.th_dport = rcv.sport;
+	h->tcp.th_seq = htonl(seq);
+	h->tcp.th_ack = htonl(ack);
+	h->tcp.th_off = (sizeof(struct tcphdr) + optlen) >> 2;
+	h->tcp.th_flags = flags;
+	h->tcp.th_win = htons(65535);
+	if (optlen > 0) {
+		memcpy(h + 1, opts, optlen);
+	}
+	h->tcp.th_sum = tcp_cksum(&h->ip, &h->tcp, sizeof(h->tcp) + optlen);
+	peer_write(buf, ETHER_HDR_LEN + len);
+}
+
+static void
+peer_syn_ack(void)
+{
+	uint8_t opts[] = {
+		TCPOPT_MAXSEG, TCPOLEN_MAXSEG, PEER_MSS >> 8, PEER_MSS & 0xff,
+		TCPOPT_NOP, TCPOPT_WINDOW, TCPOLEN_WINDOW, PEER_WSCALE,
+		TCPOPT_NOP, TCPOPT_NOP, TCPOPT_SACK_PERMITTED, TCPOLEN_SACK_PERMITTED,
+	};
+
+	peer_send(TH_SYN | TH_ACK, PEER_ISS, rcv.irs + 1, opts, sizeof(opts));
+}
+
+/* acknowledges rcv_nxt and SACKs the most recent segment first */
+static void
+peer_ack(void)
+{
+	uint32_t opts[1 + 2 * MAX_SACK_BLOCKS];
+	uint32_t ack = rcv.irs + 1 + rcv.rcv_nxt + (rcv.done ? 1 : 0);
+	u_int nblocks = 0, first = rcv.nranges;
+
+	for (u_int i = 0; i < rcv.nranges; i++) {
+		if (rcv.ranges[i].start <= rcv.last.start &&
+		    rcv.last.end <= rcv.ranges[i].end) {
+			first = i;
+			opts[1] = htonl(rcv.irs + 1 + rcv.ranges[i].start);
+			opts[2] = htonl(rcv.irs + 1 + rcv.ranges[i].end);
+			nblocks++;
+			break;
+		}
+	}
+	for (u_int i = rcv.nranges; i-- > 0 && nblocks < MAX_SACK_BLOCKS;) {
+		if (i == first) {
+			continue;
+		}
+		opts[1 + 2 * nblocks] = htonl(rcv.irs + 1 + rcv.ranges[i].start);
+		opts[2 + 2 * nblocks] = htonl(rcv.irs + 1 + rcv.ranges[i].end);
+		nblocks++;
+	}
+	if (nblocks == 0) {
+		peer_send(TH_ACK, PEER_ISS + 1, ack, NULL, 0);
+		return;
+	}
+	opts[0] = htonl(TCPOPT_NOP << 24 | TCPOPT_NOP << 16 | TCPOPT_SACK << 8 |
+	    (TCPOLEN_SACK * nblocks + 2));
+	peer_send(TH_ACK, PEER_ISS + 1, ack, opts,
+	    sizeof(uint32_t) * (1 + 2 * nblocks));
+}
+
+/* adds [start, end) to the data received and advances rcv_nxt */
+static void
+rcv_add(uint32_t start, uint32_t end)
+{
+	u_int i, j;
+
+	if (end <= rcv.rcv_nxt) {
+		rcv.dup_segs++;
+		return;
+	}
+	start = MAX(start, rcv.rcv_nxt);
+
+	for (i = 0; i < rcv.nranges && rcv.ranges[i].end < start; i++) {
+		;
+	}
+	for (j = i; j < rcv.nranges && rcv.ranges[j].start <= end; j++) {
+		start = MIN(start, rcv.ranges[j].start);
+		end = MAX(end, rcv.ranges[j].end);
+	}
+	if (j == i) {
+		T_QUIET; T_ASSERT_LT(rcv.nranges, MAX_RANGES, "out of order ranges");
+		memmove(&rcv.ranges[i + 1], &rcv.ranges[i],
+		    (rcv.nranges - i) * sizeof(rcv.ranges[0]));
+		rcv.nranges++;
+	} else if (j > i + 1) {
+		memmove(&rcv.ranges[i + 1], &rcv.ranges[j],
+		    (rcv.nranges - j) * sizeof(rcv.ranges[0]));
+		rcv.nranges -= j - i - 1;
+	}
+	rcv.ranges[i] = (struct range){ .start = start, .end = end };
+	rcv.max_ranges = MAX(rcv.max_ranges, rcv.nranges);
+
+	if (rcv.ranges[0].start <= rcv.rcv_nxt) {
+		rcv.rcv_nxt = rcv.ranges[0].end;
+		rcv.nranges--;
+		memmove(&rcv.ranges[0], &rcv.ranges[1],
+		    rcv.nranges * sizeof(rcv.ranges[0]));
+	}
+}
+
+static void
+peer_input_tcp(struct ip *ip, u_int len)
+{
+	struct tcphdr *th;
+	u_int iphlen, thlen, datalen;
+	uint32_t off, idx;
+	const uint8_t *data;
+
+	iphlen = ip->ip_hl << 2;
+	T_QUIET; T_ASSERT_GE(len, iphlen + sizeof(*th), "TCP segment");
+	th = (struct tcphdr *)(void *)((char *)ip + iphlen);
+	if (ip->ip_dst.s_addr != peer_ip.s_addr ||
+	    ntohs(th->th_dport) != PEER_PORT) {
+		return;
+	}
+	T_QUIET; T_ASSERT_EQ(th->th_flags & TH_RST, 0, "the sender resets");
+
+	if (th->th_flags & TH_SYN) {
+		rcv.irs = ntohl(th->th_seq);
+		rcv.sport = th->th_sport;
+		rcv.syn = true;
+		peer_syn_ack();
+		return;
+	}
+	if (!rcv.syn) {
+		return;
+	}
+
+	thlen = th->th_off << 2;
+	datalen = ntohs(ip->ip_len) - iphlen - thlen;
+	off = ntohl(th->th_seq) - (rcv.irs + 1);
+	if (datalen > 0) {
+		T_QUIET; T_ASSERT_LE(off + datalen, (uint32_t)TOTAL_BYTES,
+		    "segment at %u is within the data", off);
+
+		/* drop the first transmission of one segment in DROP_EVERY */
+		idx = off / PEER_MSS;
+		if (idx % DROP_EVERY == DROP_EVERY / 2 &&
+		    (rcv.dropped[idx / 8] & (1 << (idx % 8))) == 0) {
+			rcv.dropped[idx / 8] |= (uint8_t)(1 << (idx % 8));
+			rcv.drops++;
+			return;
+		}
+
+		data = (const uint8_t *)th + thlen;
+		T_QUIET; T_ASSERT_EQ(memcmp(data, pattern + off, datalen), 0,
+		    "segment at %u has the data sent", off);
+		rcv.segs++;
+		rcv.last = (struct range){ .start = off, .end = off + datalen };
+		rcv_add(off, off + datalen);
+	}
+	if (th->th_flags & TH_FIN) {
+		rcv.fin = true;
+	}
+	if (rcv.fin && rcv.rcv_nxt == TOTAL_BYTES) {
+		rcv.done = true;
+	}
+	if (datalen > 0 || (th->th_flags & TH_FIN)) {
+		peer_ack();
+	}
+}
+
+static void
+peer_input(void)
+{
+	struct ether_header *eh;
+	struct bpf_hdr *bh;
+	ssize_t n;
+
+	n = read(bpf_fd, bpf_buf, BPF_BUFSIZE);
+	if (n < 0) {
+		T_QUIET; T_ASSERT_TRUE(errno == EINTR || errno == EWOULDBLOCK,
+		    "read bpf: %s", strerror(errno));
+		return;
+	}
+	for (char *p = (char *)bpf_buf; p < (char *)bpf_buf + n;
+	    p += BPF_WORDALIGN(bh->bh_hdrlen + bh->bh_caplen)) {
+		bh = (struct bpf_hdr *)(void *)p;
+		eh = (struct ether_header *)(void *)(p + bh->bh_hdrlen);
+		if (bh->bh_caplen < ETHER_HDR_LEN) {
+			continue;
+		}
+		switch (ntohs(eh->ether_type)) {
+		case ETHERTYPE_ARP: {
+			struct ether_arp *ea = (struct ether_arp *)(void *)(eh + 1);
+
+			if (bh->bh_caplen >= ETHER_HDR_LEN + sizeof(*ea) &&
+			    ntohs(ea->arp_op) == ARPOP_REQUEST &&
+			    bcmp(ea->arp_tpa, &peer_ip, sizeof(peer_ip)) == 0) {
+				peer_arp_reply(ea);
+			}
+			break;
+		}
+		case ETHERTYPE_IP: {
+			struct ip *ip = (struct ip *)(void *)(eh + 1);
+
+			if (bh->bh_caplen >= ETHER_HDR_LEN + sizeof(*ip) &&
+			    ip->ip_p == IPPROTO_TCP) {
+				peer_input_tcp(ip, bh->bh_caplen - ETHER_HDR_LEN);
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+}
+
+static void
+sack_replay(int rack, const char *metric)
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+	};
+	mach_timebase_info_data_t tb;
+	uint64_t start, deadline;
+	int fd, rc, size = 4 * 1024 * 1024;
+	u_int sent = 0;
+	bool shut = false;
+	ssize_t n;
+	double ms;
+
+	setup(rack);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "socket");
+	rc = setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "SO_SNDBUF");
+	sin.sin_addr = local_ip;
+	rc = bind(fd, (struct sockaddr *)&sin, sizeof(sin));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "bind");
+	rc = fcntl(fd, F_SETFL, O_NONBLOCK);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "O_NONBLOCK");
+	sin.sin_addr = peer_ip;
+	sin.sin_port = htons(PEER_PORT);
+	rc = connect(fd, (struct sockaddr *)&sin, sizeof(sin));
+	T_QUIET; T_ASSERT_POSIX_FAILURE(rc, EINPROGRESS, "connect");
+
+	mach_timebase_info(&tb);
+	start = mach_absolute_time();
+	deadline = start + (uint64_t)DEADLINE_SECONDS * NSEC_PER_SEC *
+	    tb.denom / tb.numer;
+
+	while (!rcv.done) {
+		T_QUIET; T_ASSERT_LT(mach_absolute_time(), deadline,
+		    "transfer completes, %u bytes in order", rcv.rcv_nxt);
+
+		while (rcv.syn && sent < TOTAL_BYTES) {
+			n = write(fd, pattern + sent, MIN(SEND_CHUNK, TOTAL_BYTES - sent));
+			if (n < 0) {
+				T_QUIET; T_ASSERT_TRUE(errno == EWOULDBLOCK ||
+				    errno == ENOTCONN, "write: %s", strerror(errno));
+				break;
+			}
+			sent += (u_int)n;
+		}
+		if (sent == TOTAL_BYTES && !shut) {
+			T_QUIET; T_ASSERT_POSIX_SUCCESS(shutdown(fd, SHUT_WR),
+			    "shutdown");
+			shut = true;
+		}
+		peer_input();
+	}
+	ms = (double)(mach_absolute_time() - start) * tb.numer / tb.denom /
+	    NSEC_PER_MSEC;
+
+	/* the FIN is acknowledged, close the connection */
+	peer_send(TH_RST | TH_ACK, PEER_ISS + 1, rcv.irs + 2 + TOTAL_BYTES,
+	    NULL, 0);
+	close(fd);
+
+	T_LOG("%u bytes in %.0f ms: %llu segments dropped, %llu received, "
+	    "%llu duplicates, up to %llu out of order ranges",
+	    TOTAL_BYTES, ms, rcv.drops, rcv.segs, rcv.dup_segs, rcv.max_ranges);
+	T_ASSERT_EQ(rcv.rcv_nxt, (uint32_t)TOTAL_BYTES, "all the data is received");
+	T_EXPECT_GT(rcv.drops, 0ULL, "segments were dropped and retransmitted");
+	T_PERF(metric, ms, "ms",
+	    "time to transfer with one segment in DROP_EVERY lost");
+
+	free(pattern);
+	free(bpf_buf);
+}
+
+T_DECL(tcp_sack_replay_rack,
+    "Measure SACK loss recovery with RACK")
+{
+	sack_replay(1, "tcp_sack_recovery_ms_rack");
+}
+
+T_DECL(tcp_sack_replay_scoreboard,
+    "Measure SACK loss recovery with the SACK scoreboard")
+{
+	sack_replay(0, "tcp_sack_recovery_ms_scoreboard");
+}
@@ -0,0 +1,163 @@
+#include <darwintest.h>
+
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/sysctl.h>
+#include <unistd.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_TAG_PERF,
+	T_META_TAG_VM_NOT_ELIGIBLE,
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * Measures the system CPU time spent running TCP timers as the number of
+ * idle loopback connections grows, with every connection sending a
+ * keepalive probe each second.
+ */
+
+#define MEASURE_SECONDS         5
+#define MAX_CONNECTIONS         16000
+
+static int listen_fd;
+static struct sockaddr_in listen_addr;
+static int fds[2 * MAX_CONNECTIONS];
+
+static uint64_t
+system_ticks(void)
+{
+	host_cpu_load_info_data_t info;
+	mach_msg_type_number_t count = HOST_CPU_LOAD_INFO_COUNT;
+	kern_return_t kr;
+
+	kr = host_statistics(mach_host_self(), HOST_CPU_LOAD_INFO,
+	    (host_info_t)&info, &count);
+	T_QUIET; T_ASSERT_MACH_SUCCESS(kr, "host_statistics(HOST_CPU_LOAD_INFO)");
+
+	return info.cpu_ticks[CPU_STATE_SYSTEM];
+}
+
+static uint64_t
+measure_system_ticks(void)
+{
+	uint64_t start = system_ticks();
+
+	sleep(MEASURE_SECONDS);
+	return system_ticks() - start;
+}
+
+static void
+listener_create(void)
+{
+	socklen_t len = sizeof(listen_addr);
+	int rc;
+
+	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listen_fd, "socket");
+
+	listen_addr = (struct sockaddr_in){
+		.sin_len = sizeof(listen_addr),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	rc = bind(listen_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "bind");
+	rc = getsockname(listen_fd, (struct sockaddr *)&listen_addr, &len);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "getsockname");
+	rc = listen(listen_fd, 128);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "listen");
+}
+
+static void
+connection_create(int i)
+{
+	int one = 1, keepalive = 1;
+	int rc;
+
+	fds[2 * i] = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fds[2 * i], "socket");
+
+	rc = setsockopt(fds[2 * i], SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "SO_KEEPALIVE");
+	rc = setsockopt(fds[2 * i], IPPROTO_TCP, TCP_KEEPALIVE, &keepalive,
+	    sizeof(keepalive));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "TCP_KEEPALIVE");
+	rc = setsockopt(fds[2 * i], IPPROTO_TCP, TCP_KEEPINTVL, &keepalive,
+	    sizeof(keepalive));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "TCP_KEEPINTVL");
+
+	rc = connect(fds[2 * i], (struct sockaddr *)&listen_addr,
+	    sizeof(listen_addr));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "connect");
+	fds[2 * i + 1] = accept(listen_fd, NULL, NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fds[2 * i + 1], "accept");
+}
+
+static int
+max_connections(void)
+{
+	struct rlimit rl;
+	int maxfiles = 0;
+	size_t size = sizeof(maxfiles);
+
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(sysctlbyname("kern.maxfilesperproc",
+	    &maxfiles, &size, NULL, 0), "kern.maxfilesperproc");
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(getrlimit(RLIMIT_NOFILE, &rl), "getrlimit");
+	rl.rlim_cur = MIN((rlim_t)maxfiles, rl.rlim_max);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setrlimit(RLIMIT_NOFILE, &rl), "setrlimit");
+
+	return (int)MIN((rl.rlim_cur - 64) / 2, MAX_CONNECTIONS);
+}
+
+T_DECL(tcp_timer_scaling,
+    "Measure the TCP timer CPU cost per connection from 1k to 16k connections")
+{
+	uint32_t nlists = 0;
+	size_t size = sizeof(nlists);
+	uint64_t baseline, ticks;
+	int limit, n = 0;
+	char name[64];
+
+	if (sysctlbyname("net.inet.tcp.timer_lists", &nlists, &size, NULL, 0) == 0) {
+		T_LOG("connections are spread over %u timer lists", nlists);
+	}
+
+	limit = max_connections();
+	listener_create();
+	baseline = measure_system_ticks();
+
+	for (int count = 1000; count <= limit; count *= 4) {
+		double ns;
+
+		for (; n < count; n++) {
+			connection_create(n);
+		}
+
+		ticks = measure_system_ticks();
+		ticks = ticks > baseline ? ticks - baseline : 0;
+		ns = (double)ticks * NSEC_PER_SEC / sysconf(_SC_CLK_TCK) /
+		    count / MEASURE_SECONDS;
+
+		T_LOG("%6d connections: %.0f ns of system time per connection "
+		    "per second", count, ns);
+		snprintf(name, sizeof(name), "tcp_timer_ns_per_conn_%d", count);
+		T_PERF(name, ns, "ns",
+		    "system time per connection per second with 1s keepalives");
+	}
+
+	for (int i = 0; i < 2 * n; i++) {
+		close(fds[i]);
+	}
+	close(listen_fd);
+	T_PASS("measured up to %d connections", n);
+}
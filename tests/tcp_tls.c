@@ -0,0 +1,421 @@
+#include <darwintest.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_private.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * TCP_TLS_TX seals the data sent into TLS records and TCP_TLS_RX opens
+ * them, so that one end of a loopback connection with the keys of the
+ * other reads back what was written.
+ */
+
+#define PAYLOAD_SIZE            (5 * TCP_TLS_MAX_PLAINTEXT + 1000)
+
+static char sndbuf[PAYLOAD_SIZE];
+static char rcvbuf[PAYLOAD_SIZE];
+
+static void
+tcp_pair(int *client, int *server)
+{
+	struct sockaddr_in sin = {
+		.sin_len = sizeof(sin),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	struct timeval tv = { .tv_sec = 5 };
+	socklen_t len = sizeof(sin);
+	int listener, rc;
+
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(listener, "socket");
+	rc = bind(listener, (struct sockaddr *)&sin, sizeof(sin));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "bind");
+	rc = getsockname(listener, (struct sockaddr *)&sin, &len);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "getsockname");
+	rc = listen(listener, 1);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "listen");
+
+	*client = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(*client, "socket");
+	rc = connect(*client, (struct sockaddr *)&sin, sizeof(sin));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "connect");
+	*server = accept(listener, NULL, NULL);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(*server, "accept");
+	close(listener);
+
+	rc = setsockopt(*server, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "SO_RCVTIMEO");
+}
+
+static void
+crypto_info(struct tcp_tls_crypto_info *ci, uint16_t version,
+    uint16_t cipher, uint8_t key)
+{
+	memset(ci, 0, sizeof(*ci));
+	ci->tci_version = version;
+	ci->tci_cipher = cipher;
+	memset(ci->tci_key, key, sizeof(ci->tci_key));
+	for (size_t i = 0; i < sizeof(ci->tci_iv); i++) {
+		ci->tci_iv[i] = (uint8_t)(0xa0 + i);
+	}
+	ci->tci_seq[7] = 1;
+}
+
+static void
+install_keys(int fd, int opt, struct tcp_tls_crypto_info *ci)
+{
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(setsockopt(fd, IPPROTO_TCP, opt, ci,
+	    sizeof(*ci)), "%s", opt == TCP_TLS_TX ? "TCP_TLS_TX" : "TCP_TLS_RX");
+}
+
+static void
+recv_all(int fd, char *buf, size_t size)
+{
+	size_t received = 0;
+	ssize_t len;
+
+	while (received < size) {
+		len = recv(fd, buf + received, size - received, 0);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(len, "recv at %zu", received);
+		T_QUIET; T_ASSERT_GT(len, 0L, "no EOF at %zu", received);
+		received += (size_t)len;
+	}
+}
+
+static void
+send_record(int fd, const void *data, size_t size, uint8_t type)
+{
+	char cbuf[CMSG_SPACE(sizeof(type))] = { 0 };
+	struct iovec iov = { .iov_base = (void *)(uintptr_t)data, .iov_len = size };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	ssize_t len;
+
+	cm->cmsg_level = IPPROTO_TCP;
+	cm->cmsg_type = TCP_TLS_RECORD_TYPE;
+	cm->cmsg_len = CMSG_LEN(sizeof(type));
+	memcpy(CMSG_DATA(cm), &type, sizeof(type));
+	len = sendmsg(fd, &msg, 0);
+	T_QUIET; T_ASSERT_EQ(len, (ssize_t)size, "sendmsg");
+}
+
+static void
+tls_roundtrip(uint16_t version, uint16_t cipher)
+{
+	struct tcp_tls_crypto_info ci;
+	int client, server, half = PAYLOAD_SIZE / 2;
+	ssize_t len;
+
+	for (size_t i = 0; i < sizeof(sndbuf); i++) {
+		sndbuf[i] = (char)(i * 7);
+	}
+	tcp_pair(&client, &server);
+
+	crypto_info(&ci, version, cipher, 0x42);
+	install_keys(client, TCP_TLS_TX, &ci);
+
+	/* records received before the keys are installed are decrypted too */
+	len = send(client, sndbuf, half, 0);
+	T_QUIET; T_ASSERT_EQ(len, (ssize_t)half, "send");
+	usleep(100000);
+	install_keys(server, TCP_TLS_RX, &ci);
+
+	len = send(client, sndbuf + half, sizeof(sndbuf) - half, 0);
+	T_QUIET; T_ASSERT_EQ(len, (ssize_t)(sizeof(sndbuf) - half), "send");
+
+	memset(rcvbuf, 0, sizeof(rcvbuf));
+	recv_all(server, rcvbuf, sizeof(rcvbuf));
+	T_EXPECT_EQ(memcmp(rcvbuf, sndbuf, sizeof(sndbuf)), 0,
+	    "version 0x%x cipher %u: %d bytes read back", version, cipher,
+	    PAYLOAD_SIZE);
+
+	close(client);
+	close(server);
+}
+
+T_DECL(tcp_tls_aes_gcm_128_tls13, "TLS 1.3 records with AES-GCM-128")
+{
+	tls_roundtrip(TCP_TLS_VERSION_1_3, TCP_TLS_CIPHER_AES_GCM_128);
+}
+
+T_DECL(tcp_tls_chacha20_poly1305_tls13, "TLS 1.3 records with ChaCha20-Poly1305")
+{
+	tls_roundtrip(TCP_TLS_VERSION_1_3, TCP_TLS_CIPHER_CHACHA20_POLY1305);
+}
+
+T_DECL(tcp_tls_aes_gcm_256_tls12, "TLS 1.2 records with AES-GCM-256")
+{
+	tls_roundtrip(TCP_TLS_VERSION_1_2, TCP_TLS_CIPHER_AES_GCM_256);
+}
+
+T_DECL(tcp_tls_chacha20_poly1305_tls12, "TLS 1.2 records with ChaCha20-Poly1305")
+{
+	tls_roundtrip(TCP_TLS_VERSION_1_2, TCP_TLS_CIPHER_CHACHA20_POLY1305);
+}
+
+/*
+ * Records carrying KAT_PLAINTEXT as application data with the keys set by
+ * crypto_info(ci, version, cipher, 0x42), computed outside of the kernel
+ * as described by RFC 8446 section 5.2 for TLS 1.3, and RFC 5288 and
+ * RFC 7905 for TLS 1.2.
+ */
+#define KAT_PLAINTEXT           "kernel TLS known answer test"
+
+static const uint8_t kat_aes_gcm_128_tls13[] = {
+	0x17, 0x03, 0x03, 0x00, 0x2d, 0xc9, 0x26, 0x37, 0x24, 0xf6, 0x5a, 0x6e,
+	0x64, 0x49, 0x9b, 0xef, 0x35, 0xa6, 0xe0, 0xda, 0x2d, 0x13, 0x12, 0xa8,
+	0xb8, 0x8f, 0x3b, 0xa9, 0xa4, 0xb8, 0x24, 0x80, 0x53, 0xa9, 0x3c, 0x04,
+	0x3c, 0x22, 0x7d, 0xc6, 0x2a, 0x24, 0xb8, 0x73, 0x7a, 0x27, 0x05, 0xf5,
+	0x7b, 0xdd,
+};
+
+static const uint8_t kat_chacha20_poly1305_tls13[] = {
+	0x17, 0x03, 0x03, 0x00, 0x2d, 0x0d, 0xbb, 0xf4, 0xa9, 0x02, 0x8e, 0x51,
+	0xbe, 0xd0, 0x12, 0x5b, 0xea, 0xc9, 0xdd, 0x83, 0xb0, 0xff, 0x0b, 0x95,
+	0x70, 0xa2, 0x3d, 0xb9, 0xe2, 0x5a, 0x57, 0x15, 0xc5, 0x72, 0xcd, 0x4b,
+	0xa3, 0x1e, 0xe3, 0xa8, 0x8b, 0xc0, 0x41, 0x85, 0xcf, 0xf9, 0xeb, 0x6e,
+	0x15, 0x08,
+};
+
+static const uint8_t kat_aes_gcm_256_tls12[] = {
+	0x17, 0x03, 0x03, 0x00, 0x34, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x01, 0xad, 0xe0, 0xd3, 0xc4, 0x30, 0x43, 0xab, 0x37, 0x51, 0x30, 0x05,
+	0x28, 0xda, 0xaa, 0x14, 0x3f, 0x35, 0x18, 0x57, 0x0a, 0x4e, 0xa6, 0xfe,
+	0xf1, 0x5e, 0xa4, 0x3d, 0x1b, 0x71, 0x80, 0xc6, 0x61, 0x60, 0x4e, 0xb4,
+	0x4d, 0xe4, 0x1f, 0x39, 0x80, 0x62, 0x1e, 0x9c, 0x6c,
+};
+
+static const uint8_t kat_chacha20_poly1305_tls12[] = {
+	0x17, 0x03, 0x03, 0x00, 0x2c, 0x0d, 0xbb, 0xf4, 0xa9, 0x02, 0x8e, 0x51,
+	0xbe, 0xd0, 0x12, 0x5b, 0xea, 0xc9, 0xdd, 0x83, 0xb0, 0xff, 0x0b, 0x95,
+	0x70, 0xa2, 0x3d, 0xb9, 0xe2, 0x5a, 0x57, 0x15, 0xc5, 0x55, 0xaf, 0x4e,
+	0x7c, 0xd0, 0x42, 0xb7, 0x30, 0x38, 0x25, 0x62, 0x85, 0x65, 0x9e, 0x68,
+	0xf9,
+};
+
+static const struct {
+	uint16_t        version;
+	uint16_t        cipher;
+	const uint8_t   *record;
+	size_t          len;
+} tls_kats[] = {
+#define KAT(v, c, r)    { TCP_TLS_VERSION_##v, TCP_TLS_CIPHER_##c, r, sizeof(r) }
+	KAT(1_3, AES_GCM_128, kat_aes_gcm_128_tls13),
+	KAT(1_3, CHACHA20_POLY1305, kat_chacha20_poly1305_tls13),
+	KAT(1_2, AES_GCM_256, kat_aes_gcm_256_tls12),
+	KAT(1_2, CHACHA20_POLY1305, kat_chacha20_poly1305_tls12),
+#undef KAT
+};
+
+T_DECL(tcp_tls_known_answer, "Records match known answer vectors")
+{
+	struct tcp_tls_crypto_info ci;
+	size_t plen = strlen(KAT_PLAINTEXT);
+	int client, server;
+	ssize_t len;
+
+	for (size_t i = 0; i < sizeof(tls_kats) / sizeof(tls_kats[0]); i++) {
+		crypto_info(&ci, tls_kats[i].version, tls_kats[i].cipher, 0x42);
+
+		/* sealed by the kernel, read back raw */
+		tcp_pair(&client, &server);
+		install_keys(client, TCP_TLS_TX, &ci);
+		len = send(client, KAT_PLAINTEXT, plen, 0);
+		T_QUIET; T_ASSERT_EQ(len, (ssize_t)plen, "send");
+		recv_all(server, rcvbuf, tls_kats[i].len);
+		T_EXPECT_EQ(memcmp(rcvbuf, tls_kats[i].record, tls_kats[i].len), 0,
+		    "version 0x%x cipher %u: sealed record", tls_kats[i].version,
+		    tls_kats[i].cipher);
+		close(client);
+		close(server);
+
+		/* written raw, opened by the kernel */
+		tcp_pair(&client, &server);
+		install_keys(server, TCP_TLS_RX, &ci);
+		len = send(client, tls_kats[i].record, tls_kats[i].len, 0);
+		T_QUIET; T_ASSERT_EQ(len, (ssize_t)tls_kats[i].len, "send");
+		recv_all(server, rcvbuf, plen);
+		T_EXPECT_EQ(memcmp(rcvbuf, KAT_PLAINTEXT, plen), 0,
+		    "version 0x%x cipher %u: opened record", tls_kats[i].version,
+		    tls_kats[i].cipher);
+		close(client);
+		close(server);
+	}
+}
+
+T_DECL(tcp_tls_control_record,
+    "A record that isn't application data is returned by TCP_TLS_RX_RECORD")
+{
+	static struct tcp_tls_record record;
+	struct tcp_tls_crypto_info ci;
+	uint8_t alert[2] = { 1, 0 };    /* warning, close_notify */
+	socklen_t optlen = sizeof(record);
+	int client, server;
+	char c;
+	ssize_t len;
+
+	tcp_pair(&client, &server);
+	crypto_info(&ci, TCP_TLS_VERSION_1_3, TCP_TLS_CIPHER_AES_GCM_128, 0x17);
+	install_keys(client, TCP_TLS_TX, &ci);
+	install_keys(server, TCP_TLS_RX, &ci);
+
+	len = send(client, sndbuf, 1000, 0);
+	T_QUIET; T_ASSERT_EQ(len, 1000L, "send");
+	send_record(client, alert, sizeof(alert), TCP_TLS_CONTENT_ALERT);
+	len = send(client, sndbuf + 1000, 1000, 0);
+	T_QUIET; T_ASSERT_EQ(len, 1000L, "send");
+	usleep(100000);
+
+	recv_all(server, rcvbuf, 1000);
+	T_EXPECT_EQ(memcmp(rcvbuf, sndbuf, 1000), 0, "data before the record");
+	len = recv(server, &c, 1, 0);
+	T_EXPECT_POSIX_FAILURE(len, ENOMSG, "reading stops at the record");
+
+	T_ASSERT_POSIX_SUCCESS(getsockopt(server, IPPROTO_TCP,
+	    TCP_TLS_RX_RECORD, &record, &optlen), "TCP_TLS_RX_RECORD");
+	T_EXPECT_EQ(record.ttr_type, TCP_TLS_CONTENT_ALERT, "content type");
+	T_EXPECT_EQ(record.ttr_len, (uint16_t)sizeof(alert), "record length");
+	T_EXPECT_EQ(memcmp(record.ttr_data, alert, sizeof(alert)), 0,
+	    "record payload");
+
+	recv_all(server, rcvbuf, 1000);
+	T_EXPECT_EQ(memcmp(rcvbuf, sndbuf + 1000, 1000), 0,
+	    "data after the record");
+	T_EXPECT_POSIX_FAILURE(getsockopt(server, IPPROTO_TCP,
+	    TCP_TLS_RX_RECORD, &record, &optlen), ENOENT,
+	    "no other record is held");
+
+	close(client);
+	close(server);
+}
+
+T_DECL(tcp_tls_key_update, "TLS 1.3 keys are replaced after a KeyUpdate")
+{
+	static struct tcp_tls_record record;
+	struct tcp_tls_crypto_info ci;
+	uint8_t key_update[5] = { 24, 0, 0, 1, 0 };    /* update_not_requested */
+	socklen_t optlen = sizeof(record);
+	int client, server;
+	char c;
+	ssize_t len;
+
+	for (size_t i = 0; i < sizeof(sndbuf); i++) {
+		sndbuf[i] = (char)(i * 7);
+	}
+	tcp_pair(&client, &server);
+	crypto_info(&ci, TCP_TLS_VERSION_1_3, TCP_TLS_CIPHER_AES_GCM_128, 0x42);
+	install_keys(client, TCP_TLS_TX, &ci);
+	install_keys(server, TCP_TLS_RX, &ci);
+
+	len = send(client, sndbuf, 1000, 0);
+	T_QUIET; T_ASSERT_EQ(len, 1000L, "send");
+	send_record(client, key_update, sizeof(key_update),
+	    TCP_TLS_CONTENT_HANDSHAKE);
+
+	crypto_info(&ci, TCP_TLS_VERSION_1_3, TCP_TLS_CIPHER_CHACHA20_POLY1305, 0x43);
+	T_EXPECT_POSIX_FAILURE(setsockopt(client, IPPROTO_TCP, TCP_TLS_TX, &ci,
+	    sizeof(ci)), EINVAL, "the cipher can't change");
+	ci.tci_cipher = TCP_TLS_CIPHER_AES_GCM_128;
+	memset(ci.tci_seq, 0, sizeof(ci.tci_seq));
+	install_keys(client, TCP_TLS_TX, &ci);
+	len = send(client, sndbuf + 1000, 1000, 0);
+	T_QUIET; T_ASSERT_EQ(len, 1000L, "send");
+	usleep(100000);
+
+	recv_all(server, rcvbuf, 1000);
+	T_EXPECT_EQ(memcmp(rcvbuf, sndbuf, 1000), 0, "data before the KeyUpdate");
+	len = recv(server, &c, 1, 0);
+	T_EXPECT_POSIX_FAILURE(len, ENOMSG, "reading stops at the KeyUpdate");
+	T_EXPECT_POSIX_FAILURE(setsockopt(server, IPPROTO_TCP, TCP_TLS_RX, &ci,
+	    sizeof(ci)), EBUSY, "the KeyUpdate must be taken first");
+	T_ASSERT_POSIX_SUCCESS(getsockopt(server, IPPROTO_TCP,
+	    TCP_TLS_RX_RECORD, &record, &optlen), "TCP_TLS_RX_RECORD");
+	T_EXPECT_EQ(record.ttr_type, TCP_TLS_CONTENT_HANDSHAKE, "content type");
+	T_EXPECT_EQ(memcmp(record.ttr_data, key_update, sizeof(key_update)), 0,
+	    "record payload");
+
+	len = recv(server, &c, 1, MSG_DONTWAIT);
+	T_EXPECT_POSIX_FAILURE(len, EWOULDBLOCK, "nothing is decrypted with the old keys");
+	install_keys(server, TCP_TLS_RX, &ci);
+	recv_all(server, rcvbuf, 1000);
+	T_EXPECT_EQ(memcmp(rcvbuf, sndbuf + 1000, 1000), 0,
+	    "data after the KeyUpdate");
+
+	close(client);
+	close(server);
+}
+
+T_DECL(tcp_tls_bad_record, "A record that fails authentication ends the stream")
+{
+	struct tcp_tls_crypto_info ci;
+	int client, server;
+	ssize_t len;
+
+	tcp_pair(&client, &server);
+	crypto_info(&ci, TCP_TLS_VERSION_1_3, TCP_TLS_CIPHER_AES_GCM_128, 0x42);
+	install_keys(client, TCP_TLS_TX, &ci);
+	ci.tci_key[0] ^= 1;
+	install_keys(server, TCP_TLS_RX, &ci);
+
+	len = send(client, sndbuf, 1000, 0);
+	T_QUIET; T_ASSERT_EQ(len, 1000L, "send");
+
+	len = recv(server, rcvbuf, sizeof(rcvbuf), 0);
+	T_EXPECT_POSIX_FAILURE(len, EBADMSG, "the record is rejected");
+	len = recv(server, rcvbuf, sizeof(rcvbuf), 0);
+	T_EXPECT_EQ(len, 0L, "the stream ends after a bad record");
+
+	close(client);
+	close(server);
+}
+
+T_DECL(tcp_tls_setsockopt, "TLS keys need a connection and are set once")
+{
+	struct tcp_tls_crypto_info ci;
+	int client, server, fd;
+
+	crypto_info(&ci, TCP_TLS_VERSION_1_3, TCP_TLS_CIPHER_AES_GCM_128, 0x42);
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "socket");
+	T_EXPECT_POSIX_FAILURE(setsockopt(fd, IPPROTO_TCP, TCP_TLS_TX, &ci,
+	    sizeof(ci)), ENOTCONN, "keys can't be set before connecting");
+	close(fd);
+
+	tcp_pair(&client, &server);
+	ci.tci_cipher = 0;
+	T_EXPECT_POSIX_FAILURE(setsockopt(client, IPPROTO_TCP, TCP_TLS_TX, &ci,
+	    sizeof(ci)), EINVAL, "an unknown cipher is refused");
+	ci.tci_cipher = TCP_TLS_CIPHER_AES_GCM_128;
+	install_keys(client, TCP_TLS_RX, &ci);
+	T_EXPECT_POSIX_FAILURE(setsockopt(client, IPPROTO_TCP, TCP_TLS_RX, &ci,
+	    sizeof(ci)), EBUSY, "receive keys can't be replaced without a KeyUpdate");
+	ci.tci_version = TCP_TLS_VERSION_1_2;
+	install_keys(client, TCP_TLS_TX, &ci);
+	T_EXPECT_POSIX_FAILURE(setsockopt(client, IPPROTO_TCP, TCP_TLS_TX, &ci,
+	    sizeof(ci)), EBUSY, "TLS 1.2 keys can't be replaced");
+	T_EXPECT_POSIX_FAILURE(send(client, sndbuf, 1, MSG_OOB), EOPNOTSUPP,
+	    "urgent data can't be sent");
+
+	close(client);
+	close(server);
+}
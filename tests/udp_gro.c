@@ -0,0 +1,229 @@
+#include <darwintest.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+T_GLOBAL_META(
+	T_META_NAMESPACE("xnu.net"),
+	T_META_RADAR_COMPONENT_NAME("xnu"),
+	T_META_RADAR_COMPONENT_VERSION("networking"),
+	T_META_CHECK_LEAKS(false));
+
+/*
+ * UDP_GRO coalesces the datagrams of a flow into one receive buffer
+ * and returns their size, and UDP_SEGMENT sends a buffer as a train of
+ * datagrams of a given size.
+ */
+
+#define SEGMENT_SIZE            1000
+#define NUM_SEGMENTS            10
+#define LAST_SEGMENT_SIZE       300
+#define TOTAL_SIZE              (SEGMENT_SIZE * NUM_SEGMENTS + LAST_SEGMENT_SIZE)
+
+static char sndbuf[TOTAL_SIZE];
+static char rcvbuf[2 * TOTAL_SIZE];
+
+static int
+udp_bound_socket(struct sockaddr_in *sin)
+{
+	socklen_t len = sizeof(*sin);
+	int fd, rc, size = 2 * TOTAL_SIZE;
+
+	fd = socket(AF_INET, SOCK_DGRAM, 0);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(fd, "socket");
+
+	*sin = (struct sockaddr_in){
+		.sin_len = sizeof(*sin),
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	rc = bind(fd, (struct sockaddr *)sin, sizeof(*sin));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "bind");
+	rc = getsockname(fd, (struct sockaddr *)sin, &len);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "getsockname");
+
+	rc = setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "SO_SNDBUF");
+	rc = setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "SO_RCVBUF");
+	rc = fcntl(fd, F_SETFL, O_NONBLOCK);
+	T_QUIET; T_ASSERT_POSIX_SUCCESS(rc, "O_NONBLOCK");
+
+	return fd;
+}
+
+/* receives a buffer and its UDP_GRO segment size, 0 without one */
+static ssize_t
+udp_recv(int fd, int *segsize)
+{
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = rcvbuf, .iov_len = sizeof(rcvbuf) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cm;
+	ssize_t len;
+
+	*segsize = 0;
+	len = recvmsg(fd, &msg, 0);
+	if (len < 0) {
+		return len;
+	}
+	for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+		if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO) {
+			memcpy(segsize, CMSG_DATA(cm), sizeof(*segsize));
+		}
+	}
+	return len;
+}
+
+static void
+check_payload(size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		T_QUIET; T_ASSERT_EQ(rcvbuf[i], sndbuf[i % sizeof(sndbuf)],
+		    "byte %zu is received in order", i);
+	}
+}
+
+T_DECL(udp_gro_recv,
+    "Datagrams of a flow are coalesced with UDP_GRO")
+{
+	struct sockaddr_in tx_addr, other_addr, rx_addr;
+	int tx, other, rx, one = 1, segsize;
+	ssize_t len;
+
+	for (size_t i = 0; i < sizeof(sndbuf); i++) {
+		sndbuf[i] = (char)i;
+	}
+
+	tx = udp_bound_socket(&tx_addr);
+	other = udp_bound_socket(&other_addr);
+	rx = udp_bound_socket(&rx_addr);
+	T_ASSERT_POSIX_SUCCESS(setsockopt(rx, IPPROTO_UDP, UDP_GRO, &one,
+	    sizeof(one)), "UDP_GRO");
+
+	for (int i = 0; i < NUM_SEGMENTS; i++) {
+		len = sendto(tx, sndbuf + i * SEGMENT_SIZE, SEGMENT_SIZE, 0,
+		    (struct sockaddr *)&rx_addr, sizeof(rx_addr));
+		T_QUIET; T_ASSERT_EQ(len, (ssize_t)SEGMENT_SIZE, "sendto");
+	}
+	len = sendto(tx, sndbuf + NUM_SEGMENTS * SEGMENT_SIZE,
+	    LAST_SEGMENT_SIZE, 0, (struct sockaddr *)&rx_addr, sizeof(rx_addr));
+	T_QUIET; T_ASSERT_EQ(len, (ssize_t)LAST_SEGMENT_SIZE, "sendto");
+
+	/* neither a datagram after a short one nor another source coalesce */
+	len = sendto(tx, sndbuf, SEGMENT_SIZE, 0,
+	    (struct sockaddr *)&rx_addr, sizeof(rx_addr));
+	T_QUIET; T_ASSERT_EQ(len, (ssize_t)SEGMENT_SIZE, "sendto");
+	for (int i = 0; i < 2; i++) {
+		len = sendto(other, sndbuf, SEGMENT_SIZE, 0,
+		    (struct sockaddr *)&rx_addr, sizeof(rx_addr));
+		T_QUIET; T_ASSERT_EQ(len, (ssize_t)SEGMENT_SIZE, "sendto");
+	}
+	usleep(100000);
+
+	len = udp_recv(rx, &segsize);
+	T_EXPECT_EQ(len, (ssize_t)TOTAL_SIZE, "datagrams are coalesced");
+	T_EXPECT_EQ(segsize, SEGMENT_SIZE, "the segment size is returned");
+	check_payload((size_t)len);
+
+	len = udp_recv(rx, &segsize);
+	T_EXPECT_EQ(len, (ssize_t)SEGMENT_SIZE,
+	    "a datagram following a short one starts a new buffer");
+
+	len = udp_recv(rx, &segsize);
+	T_EXPECT_EQ(len, (ssize_t)(2 * SEGMENT_SIZE),
+	    "datagrams of another source are received apart");
+	T_EXPECT_EQ(segsize, SEGMENT_SIZE, "the segment size is returned");
+
+	len = udp_recv(rx, &segsize);
+	T_EXPECT_POSIX_FAILURE(len, EWOULDBLOCK, "nothing else is received");
+
+	close(tx);
+	close(other);
+	close(rx);
+}
+
+static void
+check_segments(int rx, int size, int total)
+{
+	int segsize, received = 0;
+	ssize_t len;
+
+	while (received < total) {
+		len = udp_recv(rx, &segsize);
+		T_QUIET; T_ASSERT_POSIX_SUCCESS(len, "recv");
+		T_QUIET; T_ASSERT_EQ(len, (ssize_t)MIN(size, total - received),
+		    "datagram at %d has the segment size", received);
+		T_QUIET; T_ASSERT_EQ(memcmp(rcvbuf, sndbuf + received,
+		    (size_t)len), 0, "datagram at %d has its payload", received);
+		received += (int)len;
+	}
+	len = udp_recv(rx, &segsize);
+	T_EXPECT_POSIX_FAILURE(len, EWOULDBLOCK, "nothing else is received");
+	T_PASS("%d bytes received in datagrams of %d bytes", total, size);
+}
+
+T_DECL(udp_segment_send,
+    "A buffer is sent as datagrams of the UDP_SEGMENT size")
+{
+	char cbuf[CMSG_SPACE(sizeof(uint16_t))] = { 0 };
+	struct sockaddr_in tx_addr, rx_addr;
+	struct iovec iov = { .iov_base = sndbuf, .iov_len = sizeof(sndbuf) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+	struct cmsghdr *cm;
+	uint16_t cmsg_segsize = 500;
+	int tx, rx, segsize = SEGMENT_SIZE, too_small = 100;
+	ssize_t len;
+
+	for (size_t i = 0; i < sizeof(sndbuf); i++) {
+		sndbuf[i] = (char)i;
+	}
+
+	tx = udp_bound_socket(&tx_addr);
+	rx = udp_bound_socket(&rx_addr);
+	T_ASSERT_POSIX_SUCCESS(connect(tx, (struct sockaddr *)&rx_addr,
+	    sizeof(rx_addr)), "connect");
+
+	T_ASSERT_POSIX_SUCCESS(setsockopt(tx, IPPROTO_UDP, UDP_SEGMENT,
+	    &segsize, sizeof(segsize)), "UDP_SEGMENT");
+	len = send(tx, sndbuf, sizeof(sndbuf), 0);
+	T_ASSERT_EQ(len, (ssize_t)sizeof(sndbuf), "send");
+	check_segments(rx, SEGMENT_SIZE, TOTAL_SIZE);
+
+	/* the size given for a send overrides the one of the socket */
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = IPPROTO_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof(cmsg_segsize));
+	memcpy(CMSG_DATA(cm), &cmsg_segsize, sizeof(cmsg_segsize));
+	len = sendmsg(tx, &msg, 0);
+	T_ASSERT_EQ(len, (ssize_t)sizeof(sndbuf), "sendmsg");
+	check_segments(rx, cmsg_segsize, TOTAL_SIZE);
+
+	/* a buffer needing too many segments is refused */
+	T_ASSERT_POSIX_SUCCESS(setsockopt(tx, IPPROTO_UDP, UDP_SEGMENT,
+	    &too_small, sizeof(too_small)), "UDP_SEGMENT");
+	len = send(tx, sndbuf, sizeof(sndbuf), 0);
+	T_EXPECT_POSIX_FAILURE(len, EINVAL, "more than %d segments",
+	    UDP_SEGMENT_MAX_SEGMENTS);
+
+	close(tx);
+	close(rx);
+}
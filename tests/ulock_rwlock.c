@@ -0,0 +1,251 @@
+#include <darwintest.h>
+
+#include <stdatomic.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ulock.h>
+
+#include <os/tsd.h>
+
+#ifndef __TSD_MACH_THREAD_SELF
+#define __TSD_MACH_THREAD_SELF 3
+#endif
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wbad-function-cast"
+__inline static mach_port_name_t
+_os_get_self(void)
+{
+	mach_port_name_t self = (mach_port_name_t)_os_tsd_get_direct(__TSD_MACH_THREAD_SELF);
+	return self;
+}
+#pragma clang diagnostic pop
+
+T_GLOBAL_META(T_META_RUN_CONCURRENTLY(true));
+
+#pragma mark a rwlock following the UL_RW_LOCK protocol
+
+static _Atomic uint64_t test_rwlock;
+
+static uint32_t
+rw_readers(uint64_t value)
+{
+	return (uint32_t)((value & ULRW_READERS_MASK) >> ULRW_READERS_SHIFT);
+}
+
+static uint64_t
+rw_wait(uint64_t value, uint32_t flags)
+{
+	for (;;) {
+		int rc = __ulock_wait2(UL_RW_LOCK | ULF_NO_ERRNO | flags, &test_rwlock,
+		    value, 0, 0);
+		if (rc == -EINTR) {
+			continue;
+		}
+		if (rc == -EFAULT) {
+			return 0;
+		}
+		T_QUIET; T_ASSERT_GE(rc, 0, "__ulock_wait2(UL_RW_LOCK)");
+		/* waiters the kernel still has, that we must advertise again */
+		return (uint64_t)rc << ULRW_WAITERS_SHIFT;
+	}
+}
+
+static void
+rw_wake(void)
+{
+	int rc = __ulock_wake(UL_RW_LOCK | ULF_NO_ERRNO, &test_rwlock, 0);
+	if (rc != -ENOENT) {
+		T_QUIET; T_ASSERT_EQ(rc, 0, "__ulock_wake(UL_RW_LOCK)");
+	}
+}
+
+static void
+rw_rdlock(void)
+{
+	uint64_t self = _os_get_self() & ~0x3u;
+	uint64_t pending = 0;
+	uint64_t value, nvalue;
+
+	value = atomic_load_explicit(&test_rwlock, memory_order_relaxed);
+	for (;;) {
+		if (!(value & (ULRW_WRITE_LOCKED | ULRW_WRITERS_WAITING))) {
+			nvalue = value + (1ull << ULRW_READERS_SHIFT);
+			nvalue = (nvalue & ~ULRW_OWNER_MASK) | self | pending;
+			if (atomic_compare_exchange_weak_explicit(&test_rwlock, &value,
+			    nvalue, memory_order_acquire, memory_order_relaxed)) {
+				return;
+			}
+			continue;
+		}
+
+		nvalue = value | ULRW_READERS_WAITING | pending;
+		if (nvalue != value && !atomic_compare_exchange_weak_explicit(&test_rwlock,
+		    &value, nvalue, memory_order_relaxed, memory_order_relaxed)) {
+			continue;
+		}
+		pending = rw_wait(nvalue, 0);
+		value = atomic_load_explicit(&test_rwlock, memory_order_relaxed);
+	}
+}
+
+static void
+rw_rdunlock(void)
+{
+	uint64_t self = _os_get_self() & ~0x3u;
+	uint64_t value, nvalue;
+
+	value = atomic_load_explicit(&test_rwlock, memory_order_relaxed);
+	do {
+		nvalue = value - (1ull << ULRW_READERS_SHIFT);
+		if ((nvalue & ULRW_OWNER_MASK) == self) {
+			nvalue &= ~ULRW_OWNER_MASK;
+		}
+		if (rw_readers(nvalue) == 0) {
+			nvalue = 0;
+		}
+	} while (!atomic_compare_exchange_weak_explicit(&test_rwlock, &value,
+	    nvalue, memory_order_release, memory_order_relaxed));
+
+	if (value & ULRW_WAITERS_MASK) {
+		rw_wake();
+	}
+}
+
+static void
+rw_wrlock(void)
+{
+	uint64_t self = _os_get_self() & ~0x3u;
+	uint64_t pending = 0;
+	uint64_t value, nvalue;
+
+	value = atomic_load_explicit(&test_rwlock, memory_order_relaxed);
+	for (;;) {
+		if (!(value & ULRW_WRITE_LOCKED) && rw_readers(value) == 0) {
+			nvalue = ULRW_WRITE_LOCKED | self | pending |
+			    (value & ULRW_WAITERS_MASK);
+			if (atomic_compare_exchange_weak_explicit(&test_rwlock, &value,
+			    nvalue, memory_order_acquire, memory_order_relaxed)) {
+				return;
+			}
+			continue;
+		}
+
+		nvalue = value | ULRW_WRITERS_WAITING | pending;
+		if (nvalue != value && !atomic_compare_exchange_weak_explicit(&test_rwlock,
+		    &value, nvalue, memory_order_relaxed, memory_order_relaxed)) {
+			continue;
+		}
+		pending = rw_wait(nvalue, ULF_WAIT_RW_WRITER);
+		value = atomic_load_explicit(&test_rwlock, memory_order_relaxed);
+	}
+}
+
+static void
+rw_wrunlock(void)
+{
+	uint64_t value;
+
+	value = atomic_exchange_explicit(&test_rwlock, 0, memory_order_release);
+	if (value & ULRW_WAITERS_MASK) {
+		rw_wake();
+	}
+}
+
+#pragma mark ulock_rwlock_stress
+
+#define STRESS_READERS          8
+#define STRESS_WRITERS          4
+#define STRESS_DURATION_SECS    3
+
+static _Atomic bool stress_done;
+static _Atomic uint32_t stress_writers_inside;
+static uint64_t stress_a, stress_b;
+static _Atomic uint64_t stress_reads, stress_writes;
+
+static void *
+stress_reader(void *arg __unused)
+{
+	while (!atomic_load_explicit(&stress_done, memory_order_relaxed)) {
+		rw_rdlock();
+		T_QUIET; T_ASSERT_EQ(atomic_load(&stress_writers_inside), 0,
+		    "no writer while read locked");
+		T_QUIET; T_ASSERT_EQ(stress_a, stress_b, "consistent data");
+		rw_rdunlock();
+		atomic_fetch_add_explicit(&stress_reads, 1, memory_order_relaxed);
+	}
+	return NULL;
+}
+
+static void *
+stress_writer(void *arg __unused)
+{
+	while (!atomic_load_explicit(&stress_done, memory_order_relaxed)) {
+		rw_wrlock();
+		T_QUIET; T_ASSERT_EQ(atomic_fetch_add(&stress_writers_inside, 1), 0,
+		    "exclusive writer");
+		stress_a++;
+		usleep(10);
+		stress_b++;
+		atomic_fetch_sub(&stress_writers_inside, 1);
+		rw_wrunlock();
+		atomic_fetch_add_explicit(&stress_writes, 1, memory_order_relaxed);
+	}
+	return NULL;
+}
+
+T_DECL(ulock_rwlock_stress, "UL_RW_LOCK readers and writers exclusion",
+    T_META_CHECK_LEAKS(false), T_META_TAG_VM_PREFERRED)
+{
+	pthread_t readers[STRESS_READERS], writers[STRESS_WRITERS];
+
+	for (int i = 0; i < STRESS_READERS; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&readers[i], NULL,
+		    stress_reader, NULL), "create reader");
+	}
+	for (int i = 0; i < STRESS_WRITERS; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_create(&writers[i], NULL,
+		    stress_writer, NULL), "create writer");
+	}
+
+	sleep(STRESS_DURATION_SECS);
+	atomic_store(&stress_done, true);
+
+	for (int i = 0; i < STRESS_READERS; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(readers[i], NULL), NULL);
+	}
+	for (int i = 0; i < STRESS_WRITERS; i++) {
+		T_QUIET; T_ASSERT_POSIX_ZERO(pthread_join(writers[i], NULL), NULL);
+	}
+
+	T_ASSERT_EQ(atomic_load(&test_rwlock), 0ull, "lock is free");
+	T_ASSERT_EQ(stress_a, atomic_load(&stress_writes), "every write happened");
+	T_ASSERT_GT(atomic_load(&stress_writes), 0ull, "writers made progress");
+	T_ASSERT_GT(atomic_load(&stress_reads), 0ull, "readers made progress");
+}
+
+#pragma mark ulock_rwlock_args
+
+T_DECL(ulock_rwlock_args, "UL_RW_LOCK argument checking",
+    T_META_CHECK_LEAKS(false), T_META_TAG_VM_PREFERRED)
+{
+	static _Atomic uint64_t word;
+	uint32_t u32 = 0;
+	int rc;
+
+	rc = __ulock_wait2(UL_COMPARE_AND_WAIT | ULF_WAIT_RW_WRITER | ULF_NO_ERRNO,
+	    &u32, 0, 0, 0);
+	T_EXPECT_EQ(rc, -EINVAL, "ULF_WAIT_RW_WRITER requires UL_RW_LOCK");
+
+	rc = __ulock_wait2(UL_RW_LOCK | ULF_NO_ERRNO, (char *)&word + 4, 0, 0, 0);
+	T_EXPECT_EQ(rc, -EINVAL, "UL_RW_LOCK requires a 64bit aligned address");
+
+	atomic_store(&word, ULRW_WRITERS_WAITING);
+	rc = __ulock_wait2(UL_RW_LOCK | ULF_NO_ERRNO, &word, ULRW_WRITERS_WAITING, 0, 0);
+	T_EXPECT_GE(rc, 0, "waiting on a lock nobody holds returns right away");
+
+	rc = __ulock_wake(UL_RW_LOCK | ULF_WAKE_THREAD | ULF_NO_ERRNO, &word, 0);
+	T_EXPECT_EQ(rc, -EINVAL, "ULF_WAKE_THREAD is not supported with UL_RW_LOCK");
+}